@@ -3,8 +3,8 @@
 #extension GL_ARB_shading_language_420pack : enable
 layout(std140, binding = 0) uniform buf
 {
-  mat4 obj_to_world;
-  mat4 world_to_view;
+  vec4 obj_to_world[3]; // Affine3x4 rows.
+  vec4 world_to_view[3];
   mat4 view_to_clip;
 } ubuf;
 
@@ -0,0 +1,18 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+layout(push_constant, row_major) uniform Camera
+{
+  mat4 clip_from_world;
+} camera;
+
+// Positions only, from their own stream, so the prepass never fetches colors.
+layout(location = 0) in vec3 in_position;
+
+// Must match meshlet.vert bit for bit for the main pass's EQUAL depth test.
+invariant gl_Position;
+
+void main()
+{
+  gl_Position = camera.clip_from_world * vec4(in_position, 1.0f);
+}
@@ -3,6 +3,7 @@
 #include <cstdlib>
 #include <cmath>
 #include <malloc.h>
+#include <emmintrin.h>
 
 #define VK_USE_PLATFORM_WIN32_KHR
 #include <vulkan/vulkan.h>
@@ -56,6 +57,14 @@ const char* const g_EnabledInstanceExtensions[] =
   VK_KHR_WIN32_SURFACE_EXTENSION_NAME,
 };
 
+#ifdef VK_EXT_headless_surface
+const char* const g_HeadlessInstanceExtensions[] =
+{
+  VK_KHR_SURFACE_EXTENSION_NAME,
+  VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME,
+};
+#endif
+
 const char* const g_EnabledDeviceExtensions[] =
 {
   VK_KHR_SWAPCHAIN_EXTENSION_NAME,
@@ -361,6 +370,19 @@ struct Mat4
     m[11] = position.z;
   }
 
+  // Looking down +z into Vulkan clip space, so depth is 0 at near_z and 1 at
+  // far_z.
+  void SetPerspective(float vertical_fov, float aspect, float near_z, float far_z)
+  {
+    float focal = 1.0f / std::tan(vertical_fov * 0.5f);
+    SetZero();
+    m[0] = focal / aspect;
+    m[5] = focal;
+    m[10] = far_z / (far_z - near_z);
+    m[11] = -(far_z * near_z) / (far_z - near_z);
+    m[14] = 1.0f;
+  }
+
   Mat4 operator*(const Mat4& a) const
   {
     Mat4 result;
@@ -473,6 +495,17 @@ struct Mat4
     FailIfNotExpected(Vec4(1.0f, 2.0f, 3.0f, 1.0f), v, __FUNCTION__);
   }
 
+  static void TestSetPerspective()
+  {
+    Mat4 a;
+    a.SetPerspective(1.5707964f, 1.0f, 1.0f, 3.0f);
+    Vec4 near_point = a * Vec4(0.0f, 0.0f, 1.0f, 1.0f);
+    Vec4 far_point = a * Vec4(0.0f, 0.0f, 3.0f, 1.0f);
+
+    FailIfNotExpected(Vec4(0.0f, 0.0f, 0.0f, 1.0f), near_point, __FUNCTION__);
+    FailIfNotExpected(Vec4(0.0f, 0.0f, 3.0f, 3.0f), far_point, __FUNCTION__);
+  }
+
   static void RunAllTests()
   {
     TestMultiply();
@@ -480,6 +513,204 @@ struct Mat4
     TestSetIdentity();
     TestSetPosition();
     TestMultiplyVec4();
+    TestSetPerspective();
+  }
+};
+
+// An affine transform as the top three rows of a row major Mat4, the bottom
+// row being implicitly 0 0 0 1.  12 floats, so a per-object transform uploads
+// as 48 bytes instead of 64 and composing two is 36 multiplies instead of 64.
+struct Affine3x4
+{
+  float m[12];
+
+  void SetIdentity()
+  {
+    m[0] = 1.0f;
+    m[1] = 0.0f;
+    m[2] = 0.0f;
+    m[3] = 0.0f;
+
+    m[4] = 0.0f;
+    m[5] = 1.0f;
+    m[6] = 0.0f;
+    m[7] = 0.0f;
+
+    m[8] = 0.0f;
+    m[9] = 0.0f;
+    m[10] = 1.0f;
+    m[11] = 0.0f;
+  }
+
+  void SetPosition(const Vec3& position)
+  {
+    m[3] = position.x;
+    m[7] = position.y;
+    m[11] = position.z;
+  }
+
+  // Drops the bottom row, which must be 0 0 0 1.
+  static Affine3x4 FromMat4(const Mat4& a)
+  {
+    Affine3x4 result;
+    memcpy(result.m, a.m, sizeof(result.m));
+    return result;
+  }
+
+  Mat4 ToMat4() const
+  {
+    Mat4 result;
+    memcpy(result.m, m, sizeof(m));
+    result.m[12] = 0.0f;
+    result.m[13] = 0.0f;
+    result.m[14] = 0.0f;
+    result.m[15] = 1.0f;
+    return result;
+  }
+
+  Affine3x4 operator*(const Affine3x4& a) const
+  {
+    Affine3x4 result;
+
+    result.m[0] = (m[0] * a.m[0]) + (m[1] * a.m[4]) + (m[2] * a.m[8]);
+    result.m[1] = (m[0] * a.m[1]) + (m[1] * a.m[5]) + (m[2] * a.m[9]);
+    result.m[2] = (m[0] * a.m[2]) + (m[1] * a.m[6]) + (m[2] * a.m[10]);
+    result.m[3] = (m[0] * a.m[3]) + (m[1] * a.m[7]) + (m[2] * a.m[11]) + m[3];
+
+    result.m[4] = (m[4] * a.m[0]) + (m[5] * a.m[4]) + (m[6] * a.m[8]);
+    result.m[5] = (m[4] * a.m[1]) + (m[5] * a.m[5]) + (m[6] * a.m[9]);
+    result.m[6] = (m[4] * a.m[2]) + (m[5] * a.m[6]) + (m[6] * a.m[10]);
+    result.m[7] = (m[4] * a.m[3]) + (m[5] * a.m[7]) + (m[6] * a.m[11]) + m[7];
+
+    result.m[8] = (m[8] * a.m[0]) + (m[9] * a.m[4]) + (m[10] * a.m[8]);
+    result.m[9] = (m[8] * a.m[1]) + (m[9] * a.m[5]) + (m[10] * a.m[9]);
+    result.m[10] = (m[8] * a.m[2]) + (m[9] * a.m[6]) + (m[10] * a.m[10]);
+    result.m[11] = (m[8] * a.m[3]) + (m[9] * a.m[7]) + (m[10] * a.m[11]) + m[11];
+
+    return result;
+  }
+
+  Affine3x4& operator*=(const Affine3x4& a)
+  {
+    *this = (*this) * a;
+    return *this;
+  }
+
+  Vec3 TransformPoint(const Vec3& v) const
+  {
+    return Vec3((m[0] * v.x) + (m[1] * v.y) + (m[2] * v.z) + m[3],
+                (m[4] * v.x) + (m[5] * v.y) + (m[6] * v.z) + m[7],
+                (m[8] * v.x) + (m[9] * v.y) + (m[10] * v.z) + m[11]);
+  }
+
+  // The 3x3 part inverted through its adjugate, then the translation taken
+  // back out.  The transform must not be singular.
+  Affine3x4 Inverse() const
+  {
+    Affine3x4 result;
+
+    result.m[0] = (m[5] * m[10]) - (m[6] * m[9]);
+    result.m[1] = (m[2] * m[9]) - (m[1] * m[10]);
+    result.m[2] = (m[1] * m[6]) - (m[2] * m[5]);
+    result.m[4] = (m[6] * m[8]) - (m[4] * m[10]);
+    result.m[5] = (m[0] * m[10]) - (m[2] * m[8]);
+    result.m[6] = (m[2] * m[4]) - (m[0] * m[6]);
+    result.m[8] = (m[4] * m[9]) - (m[5] * m[8]);
+    result.m[9] = (m[1] * m[8]) - (m[0] * m[9]);
+    result.m[10] = (m[0] * m[5]) - (m[1] * m[4]);
+
+    float inv_det = 1.0f / ((m[0] * result.m[0]) + (m[1] * result.m[4]) + (m[2] * result.m[8]));
+
+    for (uint32_t i = 0; i < 12; i += 4)
+    {
+      result.m[i] *= inv_det;
+      result.m[i + 1] *= inv_det;
+      result.m[i + 2] *= inv_det;
+      result.m[i + 3] = -((result.m[i] * m[3]) + (result.m[i + 1] * m[7]) + (result.m[i + 2] * m[11]));
+    }
+
+    return result;
+  }
+
+  // Element by element within tolerance, so -0.0f and 0.0f are equal too.
+  bool IsNear(const Affine3x4& a, float tolerance) const
+  {
+    for (uint32_t i = 0; i < 12; ++i)
+    {
+      if (std::fabs(m[i] - a.m[i]) > tolerance)
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Tests.
+  static void TestMultiply()
+  {
+    Affine3x4 a = { 1.0f, 2.0f, 3.0f, 4.0f,
+                    5.0f, 6.0f, 7.0f, 8.0f,
+                    9.0f, 10.0f, 11.0f, 12.0f };
+    Affine3x4 c = a * a;
+    const Affine3x4 expected = { 38.0f, 44.0f, 50.0f, 60.0f,
+                                 98.0f, 116.0f, 134.0f, 160.0f,
+                                 158.0f, 188.0f, 218.0f, 260.0f };
+
+    FailIfNotExpected(expected, c, __FUNCTION__);
+    FailIfNotExpected(a.ToMat4() * a.ToMat4(), c.ToMat4(), __FUNCTION__);
+  }
+
+  static void TestMat4RoundTrip()
+  {
+    Mat4 a;
+    a.SetIdentity();
+    a.SetPosition(Vec3(1.0f, 2.0f, 3.0f));
+    Affine3x4 b = Affine3x4::FromMat4(a);
+    Affine3x4 expected;
+    expected.SetIdentity();
+    expected.SetPosition(Vec3(1.0f, 2.0f, 3.0f));
+
+    FailIfNotExpected(expected, b, __FUNCTION__);
+    FailIfNotExpected(a, b.ToMat4(), __FUNCTION__);
+  }
+
+  static void TestTransformPoint()
+  {
+    Affine3x4 a;
+    a.SetIdentity();
+    a.SetPosition(Vec3(1.0f, 2.0f, 3.0f));
+    Vec3 v = a.TransformPoint(Vec3(1.0f, 1.0f, 1.0f));
+
+    FailIfNotExpected(Vec3(2.0f, 3.0f, 4.0f), v, __FUNCTION__);
+    FailIfNotExpected(a.ToMat4() * Vec4(1.0f, 1.0f, 1.0f, 1.0f), Vec4(v), __FUNCTION__);
+  }
+
+  static void TestInverse()
+  {
+    // A quarter turn about z, scaled by 2, then moved.
+    const Affine3x4 a = { 0.0f, -2.0f, 0.0f, 1.0f,
+                          2.0f, 0.0f, 0.0f, 2.0f,
+                          0.0f, 0.0f, 2.0f, 3.0f };
+    const Affine3x4 expected = { 0.0f, 0.5f, 0.0f, -1.0f,
+                                 -0.5f, 0.0f, 0.0f, 0.5f,
+                                 0.0f, 0.0f, 0.5f, -1.5f };
+    Affine3x4 identity;
+    identity.SetIdentity();
+    Affine3x4 inverse = a.Inverse();
+
+    // The adjugate leaves -0.0f where expected has 0.0f.
+    FailIfNotExpected(true, expected.IsNear(inverse, 1e-6f), __FUNCTION__);
+    FailIfNotExpected(true, identity.IsNear(a * inverse, 1e-6f), __FUNCTION__);
+    FailIfNotExpected(true, identity.IsNear(inverse * a, 1e-6f), __FUNCTION__);
+  }
+
+  static void RunAllTests()
+  {
+    TestMultiply();
+    TestMat4RoundTrip();
+    TestTransformPoint();
+    TestInverse();
   }
 };
 
@@ -533,406 +764,18062 @@ bool ReadBinaryFile(Buffer* file_contents, const char* path)
   return false;
 }
 
-struct Vertex
+double GetTimeMs()
 {
-  Vec3 position;
-  float color[4];
-};
+  static LARGE_INTEGER s_TicksPerSecond = {};
 
-static const Vertex s_ClipSpaceTriangleVertices[] =
-{
-  {{0.0f, 1.0f, 0.0f},  {1.0f, 0.0f, 0.0f, 1.0f}},
-  {{1.0f, -1.0f, 0.0f},  {0.0f, 1.0f, 0.0f, 1.0f}},
-  {{-1.0f, -1.0f, 0.0f},  {0.0f, 0.0f, 1.0f, 1.0f}},
-};
+  if (!s_TicksPerSecond.QuadPart)
+  {
+    QueryPerformanceFrequency(&s_TicksPerSecond);
+  }
 
-struct CubeUniforms
+  LARGE_INTEGER ticks = {};
+  QueryPerformanceCounter(&ticks);
+  return ((double)ticks.QuadPart * 1000.0) / (double)s_TicksPerSecond.QuadPart;
+}
+
+enum PresentGoal
 {
-  Mat4 world_from_obj;
-  Mat4 view_from_world;
-  Mat4 clip_from_view;
+  PRESENT_GOAL_LOW_LATENCY,
+  PRESENT_GOAL_LOW_POWER,
+  PRESENT_GOAL_MAX_THROUGHPUT,
 };
 
-struct VulkanState
+struct Options
 {
-  VkAllocationCallbacks callbacks;
-  VkInstance instance;
-  uint32_t num_physical_devices = 8;
-  VkPhysicalDevice physical_devices[8];
-  VkPhysicalDeviceMemoryProperties memory_properties[8];
-  VkPhysicalDevice physical_device;
-  uint32_t num_queue_properties = 16;
-  VkQueueFamilyProperties queue_properties[16];
-  float queue_priorities[32];
-  uint32_t queue_family_index = 0;
-  VkDevice device;
-  VkQueue queue;
-  VkSurfaceKHR surface;
-  VkSurfaceCapabilitiesKHR surface_capabilities;
-  uint32_t surface_formats_count;
-  VkSurfaceFormatKHR surface_formats[32];
-  VkSurfaceFormatKHR surface_format;
-  uint32_t present_modes_count;
-  VkPresentModeKHR present_modes[32];
-  VkSwapchainKHR swapchain;
-  uint32_t swapchain_image_count;
-  VkImage swapchain_images[8];
-  VkImageView swapchain_image_views[8];
+  int width = 1280;
+  int height = 720;
+  PresentGoal present_goal = PRESENT_GOAL_LOW_LATENCY;
+  float frame_limit_hz = 0.0f; // 0 disables the CPU-side frame limiter.
+  bool headless = false;       // Present to a VK_EXT_headless_surface instead of a window.
+  int max_frames = 0;          // 0 runs until the window is closed.
+  float frame_budget_ms = 0.0f; // GPU time to hold with dynamic resolution, 0 renders at full resolution.
+  const char* bench = nullptr;  // Runs the named test workload instead of the interactive loop.
+  int device = -1;              // Physical device to use, -1 picks the highest scoring one.
+  int device_count = 0;         // Logical devices for the multi-device benchmark, 0 is one per suitable physical device.
+  int particles = 0;            // GPU particles drawn over the scene, 0 disables them.
+  const char* dump = nullptr;   // Writes every presented frame here, as Y4M if it ends in .y4m and raw texels otherwise.
+  const char* serve = nullptr;  // Renders jobs dropped into this directory instead of opening a window, --frames caps the job count.
+  bool cpu = false;             // Renders with CpuRasterizer and no Vulkan, to --dump if set.
+  const char* capture = nullptr; // Writes the commands and resources of the first --frames frames, or 60, to this file.
+  const char* replay = nullptr;  // Replays a --capture file instead of opening a window, --frames of it or every frame once.
 
-  void Init();
-  void CreateSwapchain(HINSTANCE hInstance);
+  void Parse(int argc, char* argv[]);
 };
 
-void VulkanState::Init()
+void Options::Parse(int argc, char* argv[])
 {
-  VkInstanceCreateInfo info = {};
-  info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-  info.enabledExtensionCount = ARRAY_COUNT(g_EnabledInstanceExtensions);
-  info.ppEnabledExtensionNames = g_EnabledInstanceExtensions;
-  info.enabledLayerCount = ARRAY_COUNT(g_EnabledValidationLayers);
-  info.ppEnabledLayerNames = g_EnabledValidationLayers;
+  for (int i = 1; i < argc; ++i)
+  {
+    const char* arg = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
 
-  callbacks.pfnAllocation = VulkanAlignedAlloc;
-  callbacks.pfnReallocation = VulkanRealloc;
-  callbacks.pfnFree = VulkanFree;
-  callbacks.pfnInternalAllocation = VulkanInternalAllocNotify;
-  callbacks.pfnInternalFree = VulkanInternalFreeNotify;
+    if (!strcmp(arg, "--headless"))
+    {
+      headless = true;
+    }
+    else if (!strcmp(arg, "--cpu"))
+    {
+      cpu = true;
+    }
+    else if (!value)
+    {
+      printf("Ignoring argument '%s'\n", arg);
+    }
+    else if (!strcmp(arg, "--width"))
+    {
+      int parsed = atoi(value);
 
-  VK_CHECK(vkCreateInstance(&info, &callbacks, &instance));
-  VK_CHECK(vkEnumeratePhysicalDevices(instance, &num_physical_devices, physical_devices));
-  printf("%u physical device(s) found!\n", num_physical_devices);
+      if (parsed > 0)
+      {
+        width = parsed;
+      }
+      else
+      {
+        printf("Ignoring --width '%s', expected a positive size\n", value);
+      }
+      ++i;
+    }
+    else if (!strcmp(arg, "--height"))
+    {
+      int parsed = atoi(value);
 
-  for (uint32_t i = 0; i < num_physical_devices; ++i)
-  {
-    VkPhysicalDeviceProperties properties = {};
-    vkGetPhysicalDeviceProperties(physical_devices[i], &properties);
-    printf("physical_devices[%u]:\n", i);
-    printf("  Vulkan API %u.%u.%u\n", VK_VERSION_MAJOR(properties.apiVersion), VK_VERSION_MINOR(properties.apiVersion), VK_VERSION_PATCH(properties.apiVersion));
-    printf("  Vulkan driver version: %u.%u.%u\n", VK_VERSION_MAJOR(properties.driverVersion), VK_VERSION_MINOR(properties.driverVersion), VK_VERSION_PATCH(properties.driverVersion));
-    printf("  Vendor: %u\n", properties.vendorID);
-    printf("  Device: %u\n", properties.deviceID);
-    printf("  Device type: %u\n", properties.deviceType);
-    printf("  Device name: %s\n", properties.deviceName);
-    printf("\n");
-    vkGetPhysicalDeviceMemoryProperties(physical_devices[i], memory_properties + i);
+      if (parsed > 0)
+      {
+        height = parsed;
+      }
+      else
+      {
+        printf("Ignoring --height '%s', expected a positive size\n", value);
+      }
+      ++i;
+    }
+    else if (!strcmp(arg, "--present"))
+    {
+      if (!strcmp(value, "latency"))
+      {
+        present_goal = PRESENT_GOAL_LOW_LATENCY;
+      }
+      else if (!strcmp(value, "power"))
+      {
+        present_goal = PRESENT_GOAL_LOW_POWER;
+      }
+      else if (!strcmp(value, "throughput"))
+      {
+        present_goal = PRESENT_GOAL_MAX_THROUGHPUT;
+      }
+      else
+      {
+        printf("Unknown present goal '%s', expected latency, power or throughput\n", value);
+      }
+      ++i;
+    }
+    else if (!strcmp(arg, "--fps-limit"))
+    {
+      frame_limit_hz = (float)atof(value);
+      ++i;
+    }
+    else if (!strcmp(arg, "--frames"))
+    {
+      max_frames = atoi(value);
+      ++i;
+    }
+    else if (!strcmp(arg, "--frame-budget"))
+    {
+      frame_budget_ms = (float)atof(value);
+      ++i;
+    }
+    else if (!strcmp(arg, "--bench"))
+    {
+      bench = value;
+      ++i;
+    }
+    else if (!strcmp(arg, "--device"))
+    {
+      device = atoi(value);
+      ++i;
+    }
+    else if (!strcmp(arg, "--devices"))
+    {
+      device_count = atoi(value);
+      ++i;
+    }
+    else if (!strcmp(arg, "--particles"))
+    {
+      particles = atoi(value);
+      ++i;
+    }
+    else if (!strcmp(arg, "--dump"))
+    {
+      dump = value;
+      ++i;
+    }
+    else if (!strcmp(arg, "--serve"))
+    {
+      serve = value;
+      ++i;
+    }
+    else if (!strcmp(arg, "--capture"))
+    {
+      capture = value;
+      ++i;
+    }
+    else if (!strcmp(arg, "--replay"))
+    {
+      replay = value;
+      ++i;
+    }
+    else
+    {
+      printf("Ignoring argument '%s'\n", arg);
+    }
   }
+}
 
-  physical_device = physical_devices[0];
-  num_queue_properties = ARRAY_COUNT(queue_properties);
-  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &num_queue_properties, queue_properties);
+// CPU-side frame limiter.  Sleeps for the bulk of the wait and spins the last
+// couple of milliseconds since Sleep() is only accurate to the scheduler tick.
+struct FramePacer
+{
+  double frame_ms = 0.0;
+  double next_frame_ms = 0.0;
 
-  for (uint32_t i = 0; i < num_queue_properties; ++i)
+  void Init(float hz)
   {
-    printf("queue_properties[%u]:\n", i);
-    printf("  Flags: %u\n", queue_properties[i].queueFlags);
-    printf("  Queue count: %u\n", queue_properties[i].queueCount);
-    printf("  Min image transfer granularity: (%u, %u, %u)\n", queue_properties[i].minImageTransferGranularity.width, queue_properties[i].minImageTransferGranularity.height, queue_properties[i].minImageTransferGranularity.depth);
+    frame_ms = (hz > 0.0f) ? (1000.0 / hz) : 0.0;
+    next_frame_ms = 0.0;
   }
 
-  float queue_priorities[32] = {};
-  VkDeviceQueueCreateInfo queue_create_info = {};
-  queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queue_create_info.queueFamilyIndex = queue_family_index;
-  queue_create_info.queueCount = queue_properties[0].queueCount;
-  queue_create_info.pQueuePriorities = queue_priorities;
+  void Wait()
+  {
+    if (frame_ms <= 0.0)
+    {
+      return;
+    }
 
-  VkDeviceCreateInfo device_create_info = {};
-  device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  device_create_info.queueCreateInfoCount = 1;
-  device_create_info.pQueueCreateInfos = &queue_create_info;
-  device_create_info.enabledExtensionCount = ARRAY_COUNT(g_EnabledDeviceExtensions);
-  device_create_info.ppEnabledExtensionNames = g_EnabledDeviceExtensions;
+    double now = GetTimeMs();
 
-  VK_CHECK(vkCreateDevice(physical_device, &device_create_info, &callbacks, &device));
-  vkGetDeviceQueue(device, queue_family_index, 0, &queue);
-}
+    if (next_frame_ms == 0.0)
+    {
+      next_frame_ms = now;
+    }
 
-void VulkanState::CreateSwapchain(HINSTANCE hInstance)
-{
-  VkWin32SurfaceCreateInfoKHR surface_create_info = {};
-  surface_create_info.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
-  surface_create_info.hinstance = hInstance;
-  surface_create_info.hwnd = GetActiveWindow();
+    double remaining = next_frame_ms - now;
 
-  VK_CHECK(vkCreateWin32SurfaceKHR(instance, &surface_create_info, &callbacks, &surface));
-  VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &surface_capabilities));
+    if (remaining > 2.0)
+    {
+      Sleep((DWORD)(remaining - 2.0));
+    }
 
-  VkBool32 surface_supported = VK_FALSE;
+    while (GetTimeMs() < next_frame_ms)
+    {
+      YieldProcessor();
+    }
+
+    next_frame_ms += frame_ms;
+
+    // Don't try to catch up with a burst of frames after a long stall.
+    now = GetTimeMs();
+    if (next_frame_ms < now)
+    {
+      next_frame_ms = now;
+    }
+  }
+};
+
+// Tracks the time from vkQueueSubmit() until the frame is presented, when
+// Create() is given a swapchain with VK_KHR_present_wait, or otherwise until
+// the frame's fence signals, which is when the GPU has finished the frame's
+// commands.  A waiter thread blocks on the fence from the moment the frame is
+// submitted, then on the present, so the main loop's limiter sleep and
+// message pump don't end up in the number.  It watches one frame at a time,
+// so with several frames in flight only the frames submitted while it's
+// Idle() are measured.
+struct FrameLatency
+{
+  VkDevice device = VK_NULL_HANDLE;
+  VkSwapchainKHR swapchain = VK_NULL_HANDLE; // Null without present waits.
+  CRITICAL_SECTION* swapchain_lock = nullptr;
+#ifdef VK_KHR_present_wait
+  PFN_vkWaitForPresentKHR wait_for_present = nullptr;
+#endif
+  HANDLE thread = nullptr;
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE changed;
+  VkFence fence = VK_NULL_HANDLE; // Being waited on while watching.
+  uint64_t present_id = 0;        // Presented after the fence's submission.
+  bool watching = false;
+  bool quit = false;
+  double submit_ms = 0.0;
+  double last_ms = 0.0;
+  double min_ms = 0.0;
+  double max_ms = 0.0;
+  double total_ms = 0.0;
+  uint32_t count = 0;
+
+  // Present waits need the swapchain, the lock the swapchain's other users
+  // hold, and VK_KHR_present_wait enabled on the device.
+  void Create(VkDevice vulkan_device, VkSwapchainKHR present_swapchain = VK_NULL_HANDLE, CRITICAL_SECTION* present_lock = nullptr)
+  {
+    device = vulkan_device;
+    swapchain = present_swapchain;
+    swapchain_lock = present_lock;
+#ifdef VK_KHR_present_wait
+    wait_for_present = swapchain ? (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(device, "vkWaitForPresentKHR") : nullptr;
+    swapchain = wait_for_present ? swapchain : VK_NULL_HANDLE;
+#else
+    swapchain = VK_NULL_HANDLE;
+#endif
+    InitializeCriticalSection(&lock);
+    InitializeConditionVariable(&changed);
+    thread = CreateThread(nullptr, 0, WaiterThread, this, 0, nullptr);
+  }
+
+  void Destroy()
+  {
+    Sync();
+    EnterCriticalSection(&lock);
+    quit = true;
+    WakeAllConditionVariable(&changed);
+    LeaveCriticalSection(&lock);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    DeleteCriticalSection(&lock);
+  }
+
+  // False while the waiter has an earlier frame's fence.  Only Watch() makes
+  // it false, so it stays true for the thread that submits.
+  bool Idle()
+  {
+    EnterCriticalSection(&lock);
+    bool idle = !watching;
+    LeaveCriticalSection(&lock);
+    return idle;
+  }
+
+  // Right before vkQueueSubmit(), once Idle() has returned true, so the waiter
+  // isn't reading this.
+  void Submitted()
+  {
+    submit_ms = GetTimeMs();
+  }
+
+  // Right after vkQueueSubmit(), with the fence it signals and, with present
+  // waits, the id the frame's present will carry.
+  void Watch(VkFence submit_fence, uint64_t submit_present_id = 0)
+  {
+    EnterCriticalSection(&lock);
+    fence = submit_fence;
+    present_id = submit_present_id;
+    watching = true;
+    WakeAllConditionVariable(&changed);
+    LeaveCriticalSection(&lock);
+  }
+
+  // Waits for the waiter to be done with submit_fence, or with whatever it's
+  // watching when that's null.  Call before resetting the fence.
+  void Sync(VkFence submit_fence = VK_NULL_HANDLE)
+  {
+    EnterCriticalSection(&lock);
+
+    while (watching && (!submit_fence || (fence == submit_fence)))
+    {
+      SleepConditionVariableCS(&changed, &lock, INFINITE);
+    }
+
+    LeaveCriticalSection(&lock);
+  }
+
+  void PrintAndReset()
+  {
+    Sync();
+
+    if (count)
+    {
+      printf("Submit-to-%s latency over %u frames: avg %.3f ms, min %.3f ms, max %.3f ms\n", swapchain ? "present" : "GPU-complete", count, total_ms / count, min_ms, max_ms);
+    }
+
+    total_ms = 0.0;
+    count = 0;
+  }
+
+  // Returns false if the present failed, so the frame isn't counted.  The
+  // swapchain is externally synchronized, so each poll holds its lock only
+  // briefly rather than blocking acquires and presents until this one is done.
+  bool WaitForPresent(uint64_t id)
+  {
+    VkResult result = (swapchain && id) ? VK_TIMEOUT : VK_SUCCESS;
+
+#ifdef VK_KHR_present_wait
+    while (result == VK_TIMEOUT)
+    {
+      EnterCriticalSection(swapchain_lock);
+      result = wait_for_present(device, swapchain, id, 100000);
+      LeaveCriticalSection(swapchain_lock);
+    }
+#endif
+
+    return (result == VK_SUCCESS) || (result == VK_SUBOPTIMAL_KHR);
+  }
+
+  static DWORD WINAPI WaiterThread(void* userdata)
+  {
+    FrameLatency& latency = *(FrameLatency*)userdata;
+    EnterCriticalSection(&latency.lock);
+
+    while (true)
+    {
+      while (!latency.watching && !latency.quit)
+      {
+        SleepConditionVariableCS(&latency.changed, &latency.lock, INFINITE);
+      }
+
+      if (latency.quit)
+      {
+        break;
+      }
+
+      VkFence submit_fence = latency.fence;
+      uint64_t present_id = latency.present_id;
+      LeaveCriticalSection(&latency.lock);
+      VK_CHECK(vkWaitForFences(latency.device, 1, &submit_fence, VK_TRUE, UINT64_MAX));
+      bool presented = latency.WaitForPresent(present_id);
+      double done_ms = GetTimeMs();
+      EnterCriticalSection(&latency.lock);
+
+      if (!presented)
+      {
+        latency.watching = false;
+        WakeAllConditionVariable(&latency.changed);
+        continue;
+      }
+
+      latency.last_ms = done_ms - latency.submit_ms;
+      latency.min_ms = (!latency.count || (latency.last_ms < latency.min_ms)) ? latency.last_ms : latency.min_ms;
+      latency.max_ms = (!latency.count || (latency.last_ms > latency.max_ms)) ? latency.last_ms : latency.max_ms;
+      latency.total_ms += latency.last_ms;
+      ++latency.count;
+      latency.watching = false;
+      WakeAllConditionVariable(&latency.changed);
+    }
+
+    LeaveCriticalSection(&latency.lock);
+    return 0;
+  }
+};
+
+struct Vertex
+{
+  Vec3 position;
+  float color[4];
+};
+
+static const Vertex s_ClipSpaceTriangleVertices[] =
+{
+  {{0.0f, 1.0f, 0.0f},  {1.0f, 0.0f, 0.0f, 1.0f}},
+  {{1.0f, -1.0f, 0.0f},  {0.0f, 1.0f, 0.0f, 1.0f}},
+  {{-1.0f, -1.0f, 0.0f},  {0.0f, 0.0f, 1.0f, 1.0f}},
+};
+
+struct CubeUniforms
+{
+  Affine3x4 world_from_obj;
+  Affine3x4 view_from_world;
+  Mat4 clip_from_view;
+};
+
+// Ranks physical devices.  The device type dominates so a discrete GPU always
+// beats an integrated one, then device-local memory and queue families that
+// can run compute or transfers asynchronously break ties.
+struct DeviceScoring
+{
+  // 0 means the device can't run the renderer at all.
+  static uint32_t Score(const VkPhysicalDeviceProperties& properties, const VkPhysicalDeviceMemoryProperties& memory, const VkQueueFamilyProperties* families, uint32_t family_count)
+  {
+    bool graphics = false;
+    bool async_compute = false;
+    bool async_transfer = false;
+
+    for (uint32_t i = 0; i < family_count; ++i)
+    {
+      VkQueueFlags flags = families[i].queueFlags;
+      graphics = graphics || (flags & VK_QUEUE_GRAPHICS_BIT);
+      async_compute = async_compute || ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT));
+      async_transfer = async_transfer || ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)));
+    }
+
+    if (!graphics)
+    {
+      return 0;
+    }
+
+    uint32_t score = 0;
+
+    switch (properties.deviceType)
+    {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: score = 4000; break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score = 2000; break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: score = 1000; break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU: score = 500; break;
+    default: score = 100; break;
+    }
+
+    // A point per 64MB of the biggest device-local heap, capped at 16GB.
+    VkDeviceSize local_bytes = 0;
+
+    for (uint32_t i = 0; i < memory.memoryHeapCount; ++i)
+    {
+      if ((memory.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && (memory.memoryHeaps[i].size > local_bytes))
+      {
+        local_bytes = memory.memoryHeaps[i].size;
+      }
+    }
+
+    const VkDeviceSize max_bytes = 16ull * 1024 * 1024 * 1024;
+    local_bytes = (local_bytes > max_bytes) ? max_bytes : local_bytes;
+    score += (uint32_t)(local_bytes >> 26);
+    score += async_compute ? 200 : 0;
+    score += async_transfer ? 100 : 0;
+    return score;
+  }
+
+  // Tests.
+  static void TestDiscreteBeatsIntegrated()
+  {
+    VkQueueFamilyProperties family = {};
+    family.queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+    family.queueCount = 1;
+
+    VkPhysicalDeviceProperties discrete = {};
+    discrete.deviceType = VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
+    VkPhysicalDeviceMemoryProperties small_memory = {};
+    small_memory.memoryHeapCount = 1;
+    small_memory.memoryHeaps[0].size = 256ull * 1024 * 1024;
+    small_memory.memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+
+    VkPhysicalDeviceProperties integrated = {};
+    integrated.deviceType = VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU;
+    VkPhysicalDeviceMemoryProperties big_memory = small_memory;
+    big_memory.memoryHeaps[0].size = 64ull * 1024 * 1024 * 1024;
+
+    if (Score(discrete, small_memory, &family, 1) <= Score(integrated, big_memory, &family, 1))
+    {
+      Fail(__FUNCTION__);
+    }
+  }
+
+  static void TestTieBreakers()
+  {
+    VkPhysicalDeviceProperties properties = {};
+    properties.deviceType = VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
+    VkPhysicalDeviceMemoryProperties memory = {};
+    memory.memoryHeapCount = 1;
+    memory.memoryHeaps[0].size = 1024ull * 1024 * 1024;
+    memory.memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+    VkPhysicalDeviceMemoryProperties more_memory = memory;
+    more_memory.memoryHeaps[0].size *= 2;
+
+    VkQueueFamilyProperties families[2] = {};
+    families[0].queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+    families[1].queueFlags = VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+
+    uint32_t base = Score(properties, memory, families, 1);
+    FailIfNotExpected(base + 16, Score(properties, more_memory, families, 1), __FUNCTION__);
+    FailIfNotExpected(base + 200, Score(properties, memory, families, 2), __FUNCTION__);
+  }
+
+  static void TestNoGraphicsIsUnsuitable()
+  {
+    VkPhysicalDeviceProperties properties = {};
+    properties.deviceType = VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
+    VkPhysicalDeviceMemoryProperties memory = {};
+    VkQueueFamilyProperties family = {};
+    family.queueFlags = VK_QUEUE_COMPUTE_BIT;
+    FailIfNotExpected(0u, Score(properties, memory, &family, 1), __FUNCTION__);
+  }
+
+  static void RunAllTests()
+  {
+    TestDiscreteBeatsIntegrated();
+    TestTieBreakers();
+    TestNoGraphicsIsUnsuitable();
+  }
+};
+
+// Chooses the present mode and swapchain length for a PresentGoal.  Modes are
+// tried in order of preference; FIFO is the only one the spec guarantees so it
+// ends every list.
+struct PresentPolicy
+{
+  static VkPresentModeKHR ChooseMode(PresentGoal goal, const VkPresentModeKHR* modes, uint32_t mode_count)
+  {
+    // MAILBOX never tears and always shows the newest image, IMMEDIATE is
+    // lower still but tears.
+    static const VkPresentModeKHR s_LowLatency[] = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_FIFO_KHR };
+    // FIFO blocks on vblank so neither the CPU nor the GPU render frames that are never shown.
+    static const VkPresentModeKHR s_LowPower[] = { VK_PRESENT_MODE_FIFO_KHR };
+    // IMMEDIATE never waits on the display, MAILBOX renders uncapped too but drops frames.
+    static const VkPresentModeKHR s_MaxThroughput[] = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_FIFO_KHR };
+
+    const VkPresentModeKHR* preferred = s_LowLatency;
+    uint32_t preferred_count = ARRAY_COUNT(s_LowLatency);
+
+    if (goal == PRESENT_GOAL_LOW_POWER)
+    {
+      preferred = s_LowPower;
+      preferred_count = ARRAY_COUNT(s_LowPower);
+    }
+    else if (goal == PRESENT_GOAL_MAX_THROUGHPUT)
+    {
+      preferred = s_MaxThroughput;
+      preferred_count = ARRAY_COUNT(s_MaxThroughput);
+    }
+
+    for (uint32_t i = 0; i < preferred_count; ++i)
+    {
+      for (uint32_t j = 0; j < mode_count; ++j)
+      {
+        if (modes[j] == preferred[i])
+        {
+          return preferred[i];
+        }
+      }
+    }
+
+    return VK_PRESENT_MODE_FIFO_KHR;
+  }
+
+  static uint32_t ChooseImageCount(PresentGoal goal, VkPresentModeKHR mode, const VkSurfaceCapabilitiesKHR& capabilities, uint32_t max_images)
+  {
+    // Every extra image is another frame of queueing latency, so only go past
+    // double buffering when MAILBOX needs a spare image to replace or when we
+    // want the GPU to never wait on the display.
+    uint32_t count = 2;
+
+    if ((mode == VK_PRESENT_MODE_MAILBOX_KHR) || (goal == PRESENT_GOAL_MAX_THROUGHPUT))
+    {
+      count = 3;
+    }
+
+    if (count < capabilities.minImageCount)
+    {
+      count = capabilities.minImageCount;
+    }
+
+    if (capabilities.maxImageCount && (count > capabilities.maxImageCount))
+    {
+      count = capabilities.maxImageCount;
+    }
+
+    if (count > max_images)
+    {
+      count = max_images;
+    }
+
+    return count;
+  }
+
+  static const char* ModeName(VkPresentModeKHR mode)
+  {
+    switch (mode)
+    {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+    case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+    case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+    default: return "unknown";
+    }
+  }
+
+  // Tests.
+  static void TestChooseMode()
+  {
+    const VkPresentModeKHR all[] = { VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR };
+    const VkPresentModeKHR fifo_only[] = { VK_PRESENT_MODE_FIFO_KHR };
+    const VkPresentModeKHR no_mailbox[] = { VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR };
+
+    FailIfNotExpected(VK_PRESENT_MODE_MAILBOX_KHR, ChooseMode(PRESENT_GOAL_LOW_LATENCY, all, ARRAY_COUNT(all)), __FUNCTION__);
+    FailIfNotExpected(VK_PRESENT_MODE_FIFO_KHR, ChooseMode(PRESENT_GOAL_LOW_POWER, all, ARRAY_COUNT(all)), __FUNCTION__);
+    FailIfNotExpected(VK_PRESENT_MODE_IMMEDIATE_KHR, ChooseMode(PRESENT_GOAL_MAX_THROUGHPUT, all, ARRAY_COUNT(all)), __FUNCTION__);
+    FailIfNotExpected(VK_PRESENT_MODE_IMMEDIATE_KHR, ChooseMode(PRESENT_GOAL_LOW_LATENCY, no_mailbox, ARRAY_COUNT(no_mailbox)), __FUNCTION__);
+    FailIfNotExpected(VK_PRESENT_MODE_FIFO_KHR, ChooseMode(PRESENT_GOAL_MAX_THROUGHPUT, fifo_only, ARRAY_COUNT(fifo_only)), __FUNCTION__);
+  }
+
+  static void TestChooseImageCount()
+  {
+    VkSurfaceCapabilitiesKHR capabilities = {};
+    capabilities.minImageCount = 2;
+    capabilities.maxImageCount = 0;
+
+    FailIfNotExpected(3u, ChooseImageCount(PRESENT_GOAL_LOW_LATENCY, VK_PRESENT_MODE_MAILBOX_KHR, capabilities, 8), __FUNCTION__);
+    FailIfNotExpected(2u, ChooseImageCount(PRESENT_GOAL_LOW_LATENCY, VK_PRESENT_MODE_IMMEDIATE_KHR, capabilities, 8), __FUNCTION__);
+    FailIfNotExpected(2u, ChooseImageCount(PRESENT_GOAL_LOW_POWER, VK_PRESENT_MODE_FIFO_KHR, capabilities, 8), __FUNCTION__);
+    FailIfNotExpected(3u, ChooseImageCount(PRESENT_GOAL_MAX_THROUGHPUT, VK_PRESENT_MODE_FIFO_KHR, capabilities, 8), __FUNCTION__);
+
+    capabilities.minImageCount = 4;
+    FailIfNotExpected(4u, ChooseImageCount(PRESENT_GOAL_LOW_POWER, VK_PRESENT_MODE_FIFO_KHR, capabilities, 8), __FUNCTION__);
+
+    capabilities.minImageCount = 1;
+    capabilities.maxImageCount = 2;
+    FailIfNotExpected(2u, ChooseImageCount(PRESENT_GOAL_MAX_THROUGHPUT, VK_PRESENT_MODE_MAILBOX_KHR, capabilities, 8), __FUNCTION__);
+  }
+
+  static void RunAllTests()
+  {
+    TestChooseMode();
+    TestChooseImageCount();
+  }
+};
+
+struct VulkanState
+{
+  VkAllocationCallbacks callbacks;
+  VkInstance instance;
+  uint32_t num_physical_devices = 8;
+  VkPhysicalDevice physical_devices[8];
+  VkPhysicalDeviceMemoryProperties memory_properties[8];
+  uint32_t physical_device_scores[8];
+  uint32_t physical_device_index = 0;
+  VkPhysicalDevice physical_device;
+  VkPhysicalDeviceProperties physical_device_properties;
+  uint32_t num_queue_properties = 16;
+  VkQueueFamilyProperties queue_properties[16];
+  float queue_priorities[32];
+  uint32_t queue_family_index = 0; // Graphics.
+  uint32_t compute_family_index = 0;
+  uint32_t transfer_family_index = 0;
+  VkDevice device;
+  VkQueue queue; // Graphics.
+  VkQueue compute_queue;
+  VkQueue transfer_queue;
+  VkSurfaceKHR surface;
+  VkSurfaceCapabilitiesKHR surface_capabilities;
+  uint32_t surface_formats_count;
+  VkSurfaceFormatKHR surface_formats[32];
+  VkSurfaceFormatKHR surface_format;
+  uint32_t present_modes_count;
+  VkPresentModeKHR present_modes[32];
+  VkPresentModeKHR present_mode;
+  VkExtent2D swapchain_extent;
+  VkSwapchainKHR swapchain;
+  uint32_t swapchain_image_count;
+  VkImage swapchain_images[8];
+  VkImageView swapchain_image_views[8];
+  bool swapchain_readable = false; // Swapchain images can be copied from, for --dump.
+  uint32_t instance_extension_count = 0;
+  const char* instance_extensions[8];
+  uint32_t device_extension_count = 0;
+  const char* device_extensions[16];
+  bool has_properties2 = false;
+  bool descriptor_indexing = false;
+  bool multi_draw_indirect = false;
+  bool pipeline_statistics = false; // Pipeline statistics queries, for counting fragment shader invocations.
+  bool multiview = false;
+  uint32_t max_multiview_views = 0; // Views one multiview render pass can draw.
+  bool memory_budget = false; // VK_EXT_memory_budget reports per-heap budgets.
+  bool timeline_semaphores = false; // VK_KHR_timeline_semaphore, for DeferredDeleter.
+  bool present_wait = false; // VK_KHR_present_id and VK_KHR_present_wait, for FrameLatency.
+#ifdef VK_EXT_descriptor_indexing
+  VkPhysicalDeviceDescriptorIndexingPropertiesEXT descriptor_indexing_properties;
+#endif
+
+  void Init(const Options& options);
+  void ShareInstance(const VulkanState& other);
+  void CreateDevice(uint32_t index);
+  void CreateSwapchain(HINSTANCE hInstance, const Options& options);
+  uint32_t FindMemoryType(uint32_t memory_type_bits, VkMemoryPropertyFlags required_flags);
+  void AllocateMemory(const VkMemoryRequirements& memory_requirements, VkMemoryPropertyFlags memory_flags, VkDeviceMemory* memory);
+  void CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_flags, VkBuffer* buffer, VkDeviceMemory* memory);
+  void CreateImage(const VkImageCreateInfo& image_create_info, VkMemoryPropertyFlags memory_flags, VkImage* image, VkDeviceMemory* memory);
+  void UploadBuffer(VkBuffer buffer, const void* data, VkDeviceSize bytes);
+  bool LoadShaderModule(const char* path, VkShaderModule* module);
+};
+
+static bool HasExtension(const VkExtensionProperties* extensions, uint32_t count, const char* name)
+{
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (!strcmp(extensions[i].extensionName, name))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void VulkanState::Init(const Options& options)
+{
+  const char* const* required_extensions = g_EnabledInstanceExtensions;
+  uint32_t required_extension_count = ARRAY_COUNT(g_EnabledInstanceExtensions);
+
+  if (options.headless)
+  {
+#ifdef VK_EXT_headless_surface
+    required_extensions = g_HeadlessInstanceExtensions;
+    required_extension_count = ARRAY_COUNT(g_HeadlessInstanceExtensions);
+#else
+    printf("This Vulkan SDK has no VK_EXT_headless_surface!\n");
+    Fail(__FUNCTION__);
+#endif
+  }
+
+  for (uint32_t i = 0; i < required_extension_count; ++i)
+  {
+    instance_extensions[instance_extension_count++] = required_extensions[i];
+  }
+
+  // Optional extensions are only enabled when the loader reports them.
+  uint32_t available_count = 0;
+  VK_CHECK(vkEnumerateInstanceExtensionProperties(nullptr, &available_count, nullptr));
+  VkExtensionProperties* available = (VkExtensionProperties*)Alloc(sizeof(VkExtensionProperties) * (available_count + 1));
+  VK_CHECK(vkEnumerateInstanceExtensionProperties(nullptr, &available_count, available));
+
+  if (HasExtension(available, available_count, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME))
+  {
+    instance_extensions[instance_extension_count++] = VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
+    has_properties2 = true;
+  }
+
+  Free(available);
+
+  VkInstanceCreateInfo info = {};
+  info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  info.enabledExtensionCount = instance_extension_count;
+  info.ppEnabledExtensionNames = instance_extensions;
+  info.enabledLayerCount = ARRAY_COUNT(g_EnabledValidationLayers);
+  info.ppEnabledLayerNames = g_EnabledValidationLayers;
+
+  callbacks.pfnAllocation = VulkanAlignedAlloc;
+  callbacks.pfnReallocation = VulkanRealloc;
+  callbacks.pfnFree = VulkanFree;
+  callbacks.pfnInternalAllocation = VulkanInternalAllocNotify;
+  callbacks.pfnInternalFree = VulkanInternalFreeNotify;
+
+  VK_CHECK(vkCreateInstance(&info, &callbacks, &instance));
+  VK_CHECK(vkEnumeratePhysicalDevices(instance, &num_physical_devices, physical_devices));
+  printf("%u physical device(s) found!\n", num_physical_devices);
+
+  for (uint32_t i = 0; i < num_physical_devices; ++i)
+  {
+    VkPhysicalDeviceProperties properties = {};
+    vkGetPhysicalDeviceProperties(physical_devices[i], &properties);
+    printf("physical_devices[%u]:\n", i);
+    printf("  Vulkan API %u.%u.%u\n", VK_VERSION_MAJOR(properties.apiVersion), VK_VERSION_MINOR(properties.apiVersion), VK_VERSION_PATCH(properties.apiVersion));
+    printf("  Vulkan driver version: %u.%u.%u\n", VK_VERSION_MAJOR(properties.driverVersion), VK_VERSION_MINOR(properties.driverVersion), VK_VERSION_PATCH(properties.driverVersion));
+    printf("  Vendor: %u\n", properties.vendorID);
+    printf("  Device: %u\n", properties.deviceID);
+    printf("  Device type: %u\n", properties.deviceType);
+    printf("  Device name: %s\n", properties.deviceName);
+    vkGetPhysicalDeviceMemoryProperties(physical_devices[i], memory_properties + i);
+
+    uint32_t family_count = ARRAY_COUNT(queue_properties);
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_devices[i], &family_count, queue_properties);
+    physical_device_scores[i] = DeviceScoring::Score(properties, memory_properties[i], queue_properties, family_count);
+    printf("  Score: %u\n", physical_device_scores[i]);
+    printf("\n");
+
+    if (physical_device_scores[i] > physical_device_scores[physical_device_index])
+    {
+      physical_device_index = i;
+    }
+  }
+
+  if ((options.device >= 0) && ((uint32_t)options.device < num_physical_devices))
+  {
+    physical_device_index = (uint32_t)options.device;
+  }
+
+  if (!physical_device_scores[physical_device_index])
+  {
+    Fail("Finding a physical device with a graphics queue");
+  }
+
+  printf("Using physical_devices[%u]\n", physical_device_index);
+  CreateDevice(physical_device_index);
+}
+
+// Takes the instance and what Init() found out about the physical devices
+// from an initialized VulkanState, and nothing per device, so CreateDevice()
+// can make another device on the same instance.
+void VulkanState::ShareInstance(const VulkanState& other)
+{
+  callbacks = other.callbacks;
+  instance = other.instance;
+  num_physical_devices = other.num_physical_devices;
+  memcpy(physical_devices, other.physical_devices, sizeof(physical_devices));
+  memcpy(memory_properties, other.memory_properties, sizeof(memory_properties));
+  memcpy(physical_device_scores, other.physical_device_scores, sizeof(physical_device_scores));
+  instance_extension_count = other.instance_extension_count;
+  memcpy(instance_extensions, other.instance_extensions, sizeof(instance_extensions));
+  has_properties2 = other.has_properties2;
+}
+
+// Everything from here on is per physical device.
+void VulkanState::CreateDevice(uint32_t index)
+{
+  physical_device_index = index;
+  physical_device = physical_devices[index];
+  vkGetPhysicalDeviceProperties(physical_device, &physical_device_properties);
+  num_queue_properties = ARRAY_COUNT(queue_properties);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &num_queue_properties, queue_properties);
+
+  for (uint32_t i = 0; i < num_queue_properties; ++i)
+  {
+    printf("queue_properties[%u]:\n", i);
+    printf("  Flags: %u\n", queue_properties[i].queueFlags);
+    printf("  Queue count: %u\n", queue_properties[i].queueCount);
+    printf("  Min image transfer granularity: (%u, %u, %u)\n", queue_properties[i].minImageTransferGranularity.width, queue_properties[i].minImageTransferGranularity.height, queue_properties[i].minImageTransferGranularity.depth);
+  }
+
+  // Pick a family for each kind of work by capability.  Families without the
+  // graphics bit run asynchronously to graphics, so they're preferred for
+  // compute and transfer, falling back to a family that has the bit anyway
+  // (every graphics or compute family can also do transfers).
+  const uint32_t none = UINT32_MAX;
+  queue_family_index = none;
+  compute_family_index = none;
+  transfer_family_index = none;
+
+  for (uint32_t i = 0; i < num_queue_properties; ++i)
+  {
+    VkQueueFlags flags = queue_properties[i].queueFlags;
+
+    if ((flags & VK_QUEUE_GRAPHICS_BIT) && (queue_family_index == none))
+    {
+      queue_family_index = i;
+    }
+
+    if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT) && (compute_family_index == none))
+    {
+      compute_family_index = i;
+    }
+
+    if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) && (transfer_family_index == none))
+    {
+      transfer_family_index = i;
+    }
+  }
+
+  if (queue_family_index == none)
+  {
+    Fail("Finding a graphics queue family");
+  }
+
+  compute_family_index = (compute_family_index == none) ? queue_family_index : compute_family_index;
+  transfer_family_index = (transfer_family_index == none) ? compute_family_index : transfer_family_index;
+
+  // Take a separate queue for each role while the family has spare queues,
+  // otherwise share the last one handed out.
+  uint32_t queues_used[ARRAY_COUNT(queue_properties)] = {};
+  uint32_t queue_indices[3] = {};
+  const uint32_t role_families[3] = { queue_family_index, compute_family_index, transfer_family_index };
+
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    uint32_t family = role_families[i];
+
+    if (queues_used[family] < queue_properties[family].queueCount)
+    {
+      queue_indices[i] = queues_used[family]++;
+    }
+    else
+    {
+      queue_indices[i] = queues_used[family] - 1;
+    }
+  }
+
+  printf("Queue families: graphics %u, compute %u, transfer %u\n", queue_family_index, compute_family_index, transfer_family_index);
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(queue_priorities); ++i)
+  {
+    queue_priorities[i] = 1.0f;
+  }
+
+  VkDeviceQueueCreateInfo queue_create_infos[3] = {};
+  uint32_t queue_create_info_count = 0;
+
+  for (uint32_t i = 0; i < num_queue_properties; ++i)
+  {
+    if (queues_used[i])
+    {
+      VkDeviceQueueCreateInfo& queue_create_info = queue_create_infos[queue_create_info_count++];
+      queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+      queue_create_info.queueFamilyIndex = i;
+      queue_create_info.queueCount = queues_used[i];
+      queue_create_info.pQueuePriorities = queue_priorities;
+    }
+  }
+
+  device_extension_count = 0;
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(g_EnabledDeviceExtensions); ++i)
+  {
+    device_extensions[device_extension_count++] = g_EnabledDeviceExtensions[i];
+  }
+
+  uint32_t available_count = 0;
+  VK_CHECK(vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &available_count, nullptr));
+  VkExtensionProperties* available = (VkExtensionProperties*)Alloc(sizeof(VkExtensionProperties) * (available_count + 1));
+  VK_CHECK(vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &available_count, available));
+
+  VkDeviceCreateInfo device_create_info = {};
+  device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  device_create_info.queueCreateInfoCount = queue_create_info_count;
+  device_create_info.pQueueCreateInfos = queue_create_infos;
+
+  // Bindless descriptors need runtime-sized, partially bound arrays of
+  // storage buffers that can be updated after they're bound, indexed with
+  // non-uniform indices.  Anything less and the bindless paths stay off.
+  descriptor_indexing = false;
+#ifdef VK_EXT_descriptor_indexing
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features = {};
+  indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+  descriptor_indexing_properties = {};
+  descriptor_indexing_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+
+  if (has_properties2 && HasExtension(available, available_count, VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) && HasExtension(available, available_count, VK_KHR_MAINTENANCE3_EXTENSION_NAME))
+  {
+    PFN_vkGetPhysicalDeviceFeatures2KHR get_features2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
+    PFN_vkGetPhysicalDeviceProperties2KHR get_properties2 = (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties2KHR");
+
+    if (get_features2 && get_properties2)
+    {
+      VkPhysicalDeviceFeatures2KHR features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+      features2.pNext = &indexing_features;
+      get_features2(physical_device, &features2);
+
+      VkPhysicalDeviceProperties2KHR properties2 = {};
+      properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+      properties2.pNext = &descriptor_indexing_properties;
+      get_properties2(physical_device, &properties2);
+
+      descriptor_indexing = indexing_features.runtimeDescriptorArray && indexing_features.descriptorBindingPartiallyBound &&
+        indexing_features.descriptorBindingStorageBufferUpdateAfterBind && indexing_features.shaderStorageBufferArrayNonUniformIndexing;
+    }
+  }
+
+  if (descriptor_indexing)
+  {
+    // Only switch on what the bindless table uses.
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT enabled_features = {};
+    enabled_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    enabled_features.runtimeDescriptorArray = VK_TRUE;
+    enabled_features.descriptorBindingPartiallyBound = VK_TRUE;
+    enabled_features.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+    enabled_features.shaderStorageBufferArrayNonUniformIndexing = VK_TRUE;
+    indexing_features = enabled_features;
+    device_extensions[device_extension_count++] = VK_KHR_MAINTENANCE3_EXTENSION_NAME;
+    device_extensions[device_extension_count++] = VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME;
+    device_create_info.pNext = &indexing_features;
+  }
+#endif
+
+  printf("Descriptor indexing: %s\n", descriptor_indexing ? "yes" : "no");
+
+  // Multiview draws several layers of a layered framebuffer from one render
+  // pass, which only the multiview benchmark uses so far.
+  multiview = false;
+  max_multiview_views = 0;
+#ifdef VK_KHR_multiview
+  VkPhysicalDeviceMultiviewFeaturesKHR multiview_features = {};
+  multiview_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES_KHR;
+
+  if (has_properties2 && HasExtension(available, available_count, VK_KHR_MULTIVIEW_EXTENSION_NAME))
+  {
+    PFN_vkGetPhysicalDeviceFeatures2KHR get_features2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
+    PFN_vkGetPhysicalDeviceProperties2KHR get_properties2 = (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties2KHR");
+
+    if (get_features2 && get_properties2)
+    {
+      VkPhysicalDeviceFeatures2KHR features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+      features2.pNext = &multiview_features;
+      get_features2(physical_device, &features2);
+
+      VkPhysicalDeviceMultiviewPropertiesKHR multiview_properties = {};
+      multiview_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_PROPERTIES_KHR;
+      VkPhysicalDeviceProperties2KHR properties2 = {};
+      properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+      properties2.pNext = &multiview_properties;
+      get_properties2(physical_device, &properties2);
+
+      multiview = (multiview_features.multiview == VK_TRUE);
+      max_multiview_views = multiview ? multiview_properties.maxMultiviewViewCount : 0;
+    }
+  }
+
+  if (multiview)
+  {
+    VkPhysicalDeviceMultiviewFeaturesKHR enabled_features = {};
+    enabled_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES_KHR;
+    enabled_features.pNext = (void*)device_create_info.pNext;
+    enabled_features.multiview = VK_TRUE;
+    multiview_features = enabled_features;
+    device_extensions[device_extension_count++] = VK_KHR_MULTIVIEW_EXTENSION_NAME;
+    device_create_info.pNext = &multiview_features;
+  }
+#endif
+
+  printf("Multiview: %u views\n", max_multiview_views);
+
+  // Budgets let the residency manager keep the device heap from being
+  // oversubscribed, rather than finding out when an allocation fails.
+  memory_budget = false;
+#ifdef VK_EXT_memory_budget
+  if (has_properties2 && HasExtension(available, available_count, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) &&
+    vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceMemoryProperties2KHR"))
+  {
+    memory_budget = true;
+    device_extensions[device_extension_count++] = VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+  }
+#endif
+
+  printf("Memory budget: %s\n", memory_budget ? "yes" : "no");
+
+  // One timeline semaphore tells DeferredDeleter how far the queue has got,
+  // rather than a fence per submission.
+  timeline_semaphores = false;
+#ifdef VK_KHR_timeline_semaphore
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features = {};
+  timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+
+  if (has_properties2 && HasExtension(available, available_count, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+  {
+    PFN_vkGetPhysicalDeviceFeatures2KHR get_features2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
+
+    if (get_features2)
+    {
+      VkPhysicalDeviceFeatures2KHR features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+      features2.pNext = &timeline_features;
+      get_features2(physical_device, &features2);
+      timeline_semaphores = (timeline_features.timelineSemaphore == VK_TRUE);
+    }
+  }
+
+  if (timeline_semaphores)
+  {
+    timeline_features.pNext = (void*)device_create_info.pNext;
+    device_extensions[device_extension_count++] = VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+    device_create_info.pNext = &timeline_features;
+  }
+#endif
+
+  printf("Timeline semaphores: %s\n", timeline_semaphores ? "yes" : "no");
+
+  // Waiting on a present id tells FrameLatency when a frame was presented,
+  // rather than when the GPU finished it.
+  present_wait = false;
+#if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+  VkPhysicalDevicePresentIdFeaturesKHR present_id_features = {};
+  present_id_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+  VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features = {};
+  present_wait_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+
+  if (has_properties2 && HasExtension(available, available_count, VK_KHR_PRESENT_ID_EXTENSION_NAME) && HasExtension(available, available_count, VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+  {
+    PFN_vkGetPhysicalDeviceFeatures2KHR get_features2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
+
+    if (get_features2)
+    {
+      present_wait_features.pNext = &present_id_features;
+      VkPhysicalDeviceFeatures2KHR features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+      features2.pNext = &present_wait_features;
+      get_features2(physical_device, &features2);
+      present_wait = (present_id_features.presentId == VK_TRUE) && (present_wait_features.presentWait == VK_TRUE);
+    }
+  }
+
+  if (present_wait)
+  {
+    present_id_features.pNext = (void*)device_create_info.pNext;
+    present_wait_features.pNext = &present_id_features;
+    device_extensions[device_extension_count++] = VK_KHR_PRESENT_ID_EXTENSION_NAME;
+    device_extensions[device_extension_count++] = VK_KHR_PRESENT_WAIT_EXTENSION_NAME;
+    device_create_info.pNext = &present_wait_features;
+  }
+#endif
+
+  printf("Present wait: %s\n", present_wait ? "yes" : "no");
+  Free(available);
+
+  // Cluster culling draws every meshlet from one indirect call when it can,
+  // and falls back to one indirect call per meshlet when it can't.
+  VkPhysicalDeviceFeatures supported_features = {};
+  vkGetPhysicalDeviceFeatures(physical_device, &supported_features);
+  VkPhysicalDeviceFeatures core_features = {};
+  core_features.multiDrawIndirect = supported_features.multiDrawIndirect;
+  multi_draw_indirect = (supported_features.multiDrawIndirect == VK_TRUE);
+  core_features.pipelineStatisticsQuery = supported_features.pipelineStatisticsQuery;
+  pipeline_statistics = (supported_features.pipelineStatisticsQuery == VK_TRUE);
+  device_create_info.pEnabledFeatures = &core_features;
+
+  device_create_info.enabledExtensionCount = device_extension_count;
+  device_create_info.ppEnabledExtensionNames = device_extensions;
+
+  VK_CHECK(vkCreateDevice(physical_device, &device_create_info, &callbacks, &device));
+  vkGetDeviceQueue(device, queue_family_index, queue_indices[0], &queue);
+  vkGetDeviceQueue(device, compute_family_index, queue_indices[1], &compute_queue);
+  vkGetDeviceQueue(device, transfer_family_index, queue_indices[2], &transfer_queue);
+}
+
+void VulkanState::CreateSwapchain(HINSTANCE hInstance, const Options& options)
+{
+  if (options.headless)
+  {
+#ifdef VK_EXT_headless_surface
+    // Extension entry points aren't exported by the loader library.
+    PFN_vkCreateHeadlessSurfaceEXT create_headless_surface = (PFN_vkCreateHeadlessSurfaceEXT)vkGetInstanceProcAddr(instance, "vkCreateHeadlessSurfaceEXT");
+
+    if (!create_headless_surface)
+    {
+      Fail("vkGetInstanceProcAddr(vkCreateHeadlessSurfaceEXT)");
+    }
+
+    VkHeadlessSurfaceCreateInfoEXT headless_surface_create_info = {};
+    headless_surface_create_info.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT;
+    VK_CHECK(create_headless_surface(instance, &headless_surface_create_info, &callbacks, &surface));
+#endif
+  }
+  else
+  {
+    VkWin32SurfaceCreateInfoKHR surface_create_info = {};
+    surface_create_info.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
+    surface_create_info.hinstance = hInstance;
+    surface_create_info.hwnd = GetActiveWindow();
+
+    VK_CHECK(vkCreateWin32SurfaceKHR(instance, &surface_create_info, &callbacks, &surface));
+  }
+
+  VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &surface_capabilities));
+  swapchain_extent = surface_capabilities.currentExtent;
+
+  // Surfaces without a window (headless) let the swapchain pick the size.
+  if (swapchain_extent.width == 0xFFFFFFFF)
+  {
+    swapchain_extent.width = options.width;
+    swapchain_extent.height = options.height;
+  }
+
+  VkBool32 surface_supported = VK_FALSE;
   VK_CHECK(vkGetPhysicalDeviceSurfaceSupportKHR(physical_device, queue_family_index, surface, &surface_supported));
   printf("\n");
-  printf("Surface %#p supported: %s\n", surface, surface_supported == VK_TRUE ? "true" : "false");
+  printf("Surface %#p supported: %s\n", surface, surface_supported == VK_TRUE ? "true" : "false");
+  printf("\n");
+
+  VK_CHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface, &surface_formats_count, nullptr)); // WTF, Intel needs this function call to get the count first... is this a bug?
+  if (surface_formats_count > ARRAY_COUNT(surface_formats))
+  {
+    surface_formats_count = ARRAY_COUNT(surface_formats);
+  }
+
+  VK_CHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface, &surface_formats_count, surface_formats));
+
+  for (uint32_t i = 0; i < surface_formats_count; ++i)
+  {
+    printf("surface_formats[%u]:\n", i);
+    printf("  format = %d\n", surface_formats[i].format);
+    printf("  colorspace = %d\n", surface_formats[i].colorSpace);
+  }
+
+  surface_format = surface_formats[0];
+  VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &present_modes_count, nullptr)); // WTF, Intel needs this function call to get the count first... is this a bug?
+  if (present_modes_count > ARRAY_COUNT(present_modes))
+  {
+    present_modes_count = ARRAY_COUNT(present_modes);
+  }
+
+  VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &present_modes_count, present_modes));
+
+  printf("\n");
+  for (uint32_t i = 0; i < present_modes_count; ++i)
+  {
+    printf("present_modes[%u] = %d\n", i, present_modes[i]);
+  }
+
+  present_mode = PresentPolicy::ChooseMode(options.present_goal, present_modes, present_modes_count);
+  uint32_t min_image_count = PresentPolicy::ChooseImageCount(options.present_goal, present_mode, surface_capabilities, ARRAY_COUNT(swapchain_images));
+  printf("Present mode %s with %u swapchain image(s)\n", PresentPolicy::ModeName(present_mode), min_image_count);
+
+  VkSwapchainCreateInfoKHR swapchain_create_info = {};
+  swapchain_create_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+  swapchain_create_info.surface = surface;
+  swapchain_create_info.minImageCount = min_image_count;
+  swapchain_create_info.imageFormat = surface_format.format;
+  swapchain_create_info.imageColorSpace = surface_format.colorSpace;
+  swapchain_create_info.imageExtent = swapchain_extent;
+  swapchain_create_info.imageArrayLayers = 1;
+  swapchain_create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  swapchain_readable = (surface_capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) != 0;
+
+  if (swapchain_readable)
+  {
+    swapchain_create_info.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+  }
+
+  swapchain_create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  swapchain_create_info.queueFamilyIndexCount = 1;
+  swapchain_create_info.pQueueFamilyIndices = &queue_family_index;
+  swapchain_create_info.preTransform = surface_capabilities.currentTransform;
+  swapchain_create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+  swapchain_create_info.presentMode = present_mode;
+
+  VK_CHECK(vkCreateSwapchainKHR(device, &swapchain_create_info, &callbacks, &swapchain));
+  swapchain_image_count = 0;
+  VK_CHECK(vkGetSwapchainImagesKHR(device, swapchain, &swapchain_image_count, nullptr));
+
+  if (swapchain_image_count > ARRAY_COUNT(swapchain_images))
+  {
+    swapchain_image_count = ARRAY_COUNT(swapchain_images);
+  }
+
+  VK_CHECK(vkGetSwapchainImagesKHR(device, swapchain, &swapchain_image_count, swapchain_images));
+
+  for (uint32_t i = 0; i < swapchain_image_count; ++i)
+  {
+    VkImageViewCreateInfo color_image_view = {};
+    color_image_view.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    color_image_view.pNext = nullptr;
+    color_image_view.flags = 0;
+    color_image_view.image = swapchain_images[i];
+    color_image_view.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    color_image_view.format = surface_format.format;
+    color_image_view.components.r = VK_COMPONENT_SWIZZLE_R;
+    color_image_view.components.g = VK_COMPONENT_SWIZZLE_G;
+    color_image_view.components.b = VK_COMPONENT_SWIZZLE_B;
+    color_image_view.components.a = VK_COMPONENT_SWIZZLE_A;
+    color_image_view.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    color_image_view.subresourceRange.baseMipLevel = 0;
+    color_image_view.subresourceRange.levelCount = 1;
+    color_image_view.subresourceRange.baseArrayLayer = 0;
+    color_image_view.subresourceRange.layerCount = 1;
+    VK_CHECK(vkCreateImageView(device, &color_image_view, &callbacks, swapchain_image_views + i));
+  }
+}
+
+uint32_t VulkanState::FindMemoryType(uint32_t memory_type_bits, VkMemoryPropertyFlags required_flags)
+{
+  // Bit i of memoryTypeBits is set when memoryTypes[i] can back the resource.
+  for (uint32_t i = 0; i < memory_properties[physical_device_index].memoryTypeCount; ++i)
+  {
+    if ((memory_type_bits & (1 << i)) && ((memory_properties[physical_device_index].memoryTypes[i].propertyFlags & required_flags) == required_flags))
+    {
+      return i;
+    }
+  }
+
+  Fail(__FUNCTION__);
+  return 0;
+}
+
+// When the device heap is full, device-local requests fall back to any other
+// type the resource allows, which is slower to use but keeps running.
+void VulkanState::AllocateMemory(const VkMemoryRequirements& memory_requirements, VkMemoryPropertyFlags memory_flags, VkDeviceMemory* memory)
+{
+  VkMemoryAllocateInfo alloc_info = {};
+  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  alloc_info.allocationSize = memory_requirements.size;
+  alloc_info.memoryTypeIndex = FindMemoryType(memory_requirements.memoryTypeBits, memory_flags);
+  VkResult result = vkAllocateMemory(device, &alloc_info, &callbacks, memory);
+
+  if ((result == VK_ERROR_OUT_OF_DEVICE_MEMORY) && (memory_flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+  {
+    const VkPhysicalDeviceMemoryProperties& properties = memory_properties[physical_device_index];
+    VkMemoryPropertyFlags fallback_flags = memory_flags & ~VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+    for (uint32_t i = 0; (result != VK_SUCCESS) && (i < properties.memoryTypeCount); ++i)
+    {
+      VkMemoryPropertyFlags flags = properties.memoryTypes[i].propertyFlags;
+
+      if ((memory_requirements.memoryTypeBits & (1 << i)) && !(flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) && ((flags & fallback_flags) == fallback_flags))
+      {
+        alloc_info.memoryTypeIndex = i;
+        result = vkAllocateMemory(device, &alloc_info, &callbacks, memory);
+      }
+    }
+
+    if (result == VK_SUCCESS)
+    {
+      printf("Device memory full, %.1f MB fell back to memory type %u\n", memory_requirements.size / (1024.0 * 1024.0), alloc_info.memoryTypeIndex);
+    }
+  }
+
+  VK_CHECK(result);
+}
+
+void VulkanState::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_flags, VkBuffer* buffer, VkDeviceMemory* memory)
+{
+  VkBufferCreateInfo buffer_create_info = {};
+  buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_create_info.usage = usage;
+  buffer_create_info.size = size;
+  buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VK_CHECK(vkCreateBuffer(device, &buffer_create_info, &callbacks, buffer));
+
+  VkMemoryRequirements memory_requirements = {};
+  vkGetBufferMemoryRequirements(device, *buffer, &memory_requirements);
+  AllocateMemory(memory_requirements, memory_flags, memory);
+  VK_CHECK(vkBindBufferMemory(device, *buffer, *memory, 0));
+}
+
+void VulkanState::CreateImage(const VkImageCreateInfo& image_create_info, VkMemoryPropertyFlags memory_flags, VkImage* image, VkDeviceMemory* memory)
+{
+  VK_CHECK(vkCreateImage(device, &image_create_info, &callbacks, image));
+
+  VkMemoryRequirements memory_requirements = {};
+  vkGetImageMemoryRequirements(device, *image, &memory_requirements);
+  AllocateMemory(memory_requirements, memory_flags, memory);
+  VK_CHECK(vkBindImageMemory(device, *image, *memory, 0));
+}
+
+// Fills a device-local buffer through a staging copy and waits for it, for
+// data written once at load time.
+void VulkanState::UploadBuffer(VkBuffer buffer, const void* data, VkDeviceSize bytes)
+{
+  VkBuffer staging_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory staging_memory = VK_NULL_HANDLE;
+  void* staging = nullptr;
+  CreateBuffer(bytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_buffer, &staging_memory);
+  VK_CHECK(vkMapMemory(device, staging_memory, 0, VK_WHOLE_SIZE, 0, &staging));
+  memcpy(staging, data, (size_t)bytes);
+  vkUnmapMemory(device, staging_memory);
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(device, &cmd_pool_info, &callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(device, &cmd_buffer_alloc_info, &cmd));
+
+  VkCommandBufferBeginInfo cmd_buf_info = {};
+  cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+  VkBufferCopy copy_region = {};
+  copy_region.size = bytes;
+  vkCmdCopyBuffer(cmd, staging_buffer, buffer, 1, &copy_region);
+  VK_CHECK(vkEndCommandBuffer(cmd));
+
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &cmd;
+  VK_CHECK(vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE));
+  VK_CHECK(vkQueueWaitIdle(queue));
+  vkDestroyCommandPool(device, cmd_pool, &callbacks);
+  vkDestroyBuffer(device, staging_buffer, &callbacks);
+  vkFreeMemory(device, staging_memory, &callbacks);
+}
+
+// Picks a render scale that holds the GPU frame time under a budget.  Pixel
+// cost goes with the square of the scale, so corrections are sqrt() of the
+// time ratio.  A dead band below the budget plus a cooldown between changes
+// keeps the scale from oscillating frame to frame.
+struct ResolutionScaler
+{
+  float budget_ms = 0.0f;
+  float min_scale = 0.5f;
+  float max_scale = 1.0f;
+  float scale = 1.0f;
+  double smoothed_ms = 0.0;
+  uint32_t frames_since_change = 0;
+
+  static const uint32_t s_CooldownFrames = 16;
+
+  void Init(float budget)
+  {
+    budget_ms = budget;
+    scale = max_scale;
+    smoothed_ms = 0.0;
+    frames_since_change = 0;
+  }
+
+  // Returns true when the scale changed.
+  bool Update(double gpu_ms)
+  {
+    smoothed_ms = (smoothed_ms == 0.0) ? gpu_ms : ((smoothed_ms * 0.9) + (gpu_ms * 0.1));
+    ++frames_since_change;
+
+    // Going over budget drops a frame, so react to single spikes immediately
+    // and only wait for the cooldown before scaling back up.
+    bool over = (gpu_ms > budget_ms * 1.25) || (smoothed_ms > budget_ms);
+    bool under = smoothed_ms < (budget_ms * 0.8);
+
+    if ((!over && !under) || (!over && (frames_since_change < s_CooldownFrames)))
+    {
+      return false;
+    }
+
+    double target_ms = budget_ms * 0.9;
+    double measured_ms = over ? ((gpu_ms > smoothed_ms) ? gpu_ms : smoothed_ms) : smoothed_ms;
+    float new_scale = scale * (float)std::sqrt(target_ms / measured_ms);
+
+    // Step at most 10% at a time and snap to 1/64 so the render extent
+    // doesn't jitter by a pixel every change.
+    if (new_scale > scale + 0.1f)
+    {
+      new_scale = scale + 0.1f;
+    }
+
+    if (new_scale < scale - 0.1f)
+    {
+      new_scale = scale - 0.1f;
+    }
+
+    new_scale = std::floor(new_scale * 64.0f + 0.5f) / 64.0f;
+    new_scale = (new_scale < min_scale) ? min_scale : ((new_scale > max_scale) ? max_scale : new_scale);
+
+    if (new_scale == scale)
+    {
+      return false;
+    }
+
+    scale = new_scale;
+    frames_since_change = 0;
+    return true;
+  }
+
+  // Tests.
+  static void TestScalesDownOverBudget()
+  {
+    ResolutionScaler scaler;
+    scaler.Init(10.0f);
+
+    if (!scaler.Update(20.0) || !(scaler.scale < 1.0f) || !(scaler.scale >= 0.9f))
+    {
+      Fail(__FUNCTION__);
+    }
+  }
+
+  static void TestHoldsInsideBand()
+  {
+    ResolutionScaler scaler;
+    scaler.Init(10.0f);
+
+    for (int i = 0; i < 100; ++i)
+    {
+      if (scaler.Update(9.0))
+      {
+        Fail(__FUNCTION__);
+      }
+    }
+
+    FailIfNotExpected(1.0f, scaler.scale, __FUNCTION__);
+  }
+
+  static void TestScalesUpAfterCooldown()
+  {
+    ResolutionScaler scaler;
+    scaler.Init(10.0f);
+    scaler.scale = 0.5f;
+
+    for (uint32_t i = 0; i < s_CooldownFrames - 1; ++i)
+    {
+      if (scaler.Update(2.0))
+      {
+        Fail(__FUNCTION__);
+      }
+    }
+
+    if (!scaler.Update(2.0) || !(scaler.scale > 0.5f))
+    {
+      Fail(__FUNCTION__);
+    }
+  }
+
+  static void TestClampsToMinimum()
+  {
+    ResolutionScaler scaler;
+    scaler.Init(1.0f);
+
+    for (int i = 0; i < 100; ++i)
+    {
+      scaler.Update(100.0);
+    }
+
+    FailIfNotExpected(scaler.min_scale, scaler.scale, __FUNCTION__);
+  }
+
+  static void RunAllTests()
+  {
+    TestScalesDownOverBudget();
+    TestHoldsInsideBand();
+    TestScalesUpAfterCooldown();
+    TestClampsToMinimum();
+  }
+};
+
+// Renders the scene into an offscreen color target and blits the rendered
+// region up to the swapchain image.  The render graph allocates the target
+// once at the swapchain size and lower resolutions only shrink the viewport,
+// so changing the scale never reallocates anything mid-run.  Each frame in
+// flight has its own pair of timestamps, read once its fence has signalled.
+struct DynamicResolution
+{
+  bool enabled = false;
+  VkExtent2D max_extent = {};
+  VkQueryPool timestamp_pool = VK_NULL_HANDLE;
+  uint32_t timestamps_pending = 0; // A bit per frame slot.
+  uint64_t timestamp_mask = 0;
+  double gpu_ms = 0.0;
+  ResolutionScaler scaler;
+
+  void Create(VulkanState& state, float budget_ms, uint32_t frame_slots);
+  void Destroy(VulkanState& state);
+  VkExtent2D RenderExtent() const;
+  void ReadGpuTime(VulkanState& state, uint32_t slot);
+  void BeginFrame(VkCommandBuffer cmd, uint32_t slot);
+  void EndFrame(VkCommandBuffer cmd, uint32_t slot);
+  void Upscale(VkCommandBuffer cmd, VkImage src, VkImage dst);
+};
+
+void DynamicResolution::Create(VulkanState& state, float budget_ms, uint32_t frame_slots)
+{
+  uint32_t timestamp_bits = state.queue_properties[state.queue_family_index].timestampValidBits;
+
+  if (!timestamp_bits)
+  {
+    printf("Queue family %u has no timestamps, dynamic resolution disabled\n", state.queue_family_index);
+    return;
+  }
+
+  VkFormatProperties format_properties = {};
+  vkGetPhysicalDeviceFormatProperties(state.physical_device, state.surface_format.format, &format_properties);
+  VkFormatFeatureFlags required_features = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+
+  if ((format_properties.optimalTilingFeatures & required_features) != required_features)
+  {
+    printf("Format %d can't be blitted with a linear filter, dynamic resolution disabled\n", state.surface_format.format);
+    return;
+  }
+
+  enabled = true;
+  max_extent = state.swapchain_extent;
+  timestamp_mask = (timestamp_bits >= 64) ? ~0ull : ((1ull << timestamp_bits) - 1);
+  scaler.Init(budget_ms);
+
+  VkQueryPoolCreateInfo query_pool_info = {};
+  query_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  query_pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  query_pool_info.queryCount = 2 * frame_slots;
+  VK_CHECK(vkCreateQueryPool(state.device, &query_pool_info, &state.callbacks, &timestamp_pool));
+}
+
+void DynamicResolution::Destroy(VulkanState& state)
+{
+  if (!enabled)
+  {
+    return;
+  }
+
+  vkDestroyQueryPool(state.device, timestamp_pool, &state.callbacks);
+}
+
+VkExtent2D DynamicResolution::RenderExtent() const
+{
+  VkExtent2D extent = {};
+  extent.width = (uint32_t)(max_extent.width * scaler.scale);
+  extent.height = (uint32_t)(max_extent.height * scaler.scale);
+  extent.width = extent.width ? extent.width : 1;
+  extent.height = extent.height ? extent.height : 1;
+  return extent;
+}
+
+// Call once the fence of the slot's last frame has signalled.
+void DynamicResolution::ReadGpuTime(VulkanState& state, uint32_t slot)
+{
+  if (!(timestamps_pending & (1u << slot)))
+  {
+    return;
+  }
+
+  uint64_t timestamps[2] = {};
+  if (vkGetQueryPoolResults(state.device, timestamp_pool, 2 * slot, 2, sizeof(timestamps), timestamps, sizeof(timestamps[0]), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+  {
+    return;
+  }
+
+  timestamps_pending &= ~(1u << slot);
+  uint64_t ticks = (timestamps[1] - timestamps[0]) & timestamp_mask;
+  gpu_ms = (double)ticks * state.physical_device_properties.limits.timestampPeriod / 1000000.0;
+
+  if (scaler.Update(gpu_ms))
+  {
+    VkExtent2D extent = RenderExtent();
+    printf("Resolution scale %.3f (%ux%u), GPU frame %.3f ms\n", scaler.scale, extent.width, extent.height, gpu_ms);
+  }
+}
+
+void DynamicResolution::BeginFrame(VkCommandBuffer cmd, uint32_t slot)
+{
+  vkCmdResetQueryPool(cmd, timestamp_pool, 2 * slot, 2);
+  vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_pool, 2 * slot);
+}
+
+void DynamicResolution::EndFrame(VkCommandBuffer cmd, uint32_t slot)
+{
+  vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_pool, (2 * slot) + 1);
+  timestamps_pending |= 1u << slot;
+}
+
+// Stretches the rendered region of src over all of dst.  The render graph
+// has src in TRANSFER_SRC_OPTIMAL and dst in TRANSFER_DST_OPTIMAL.
+void DynamicResolution::Upscale(VkCommandBuffer cmd, VkImage src, VkImage dst)
+{
+  VkExtent2D extent = RenderExtent();
+  VkImageBlit blit = {};
+  blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  blit.srcSubresource.layerCount = 1;
+  blit.srcOffsets[1].x = (int32_t)extent.width;
+  blit.srcOffsets[1].y = (int32_t)extent.height;
+  blit.srcOffsets[1].z = 1;
+  blit.dstSubresource = blit.srcSubresource;
+  blit.dstOffsets[1].x = (int32_t)max_extent.width;
+  blit.dstOffsets[1].y = (int32_t)max_extent.height;
+  blit.dstOffsets[1].z = 1;
+  vkCmdBlitImage(cmd, src, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+}
+
+bool VulkanState::LoadShaderModule(const char* path, VkShaderModule* module)
+{
+  Buffer code = {};
+
+  if (!ReadBinaryFile(&code, path))
+  {
+    printf("Could not read SPIR-V code from %s!\n", path);
+    return false;
+  }
+
+  VkShaderModuleCreateInfo shader_module_create_info = {};
+  shader_module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  shader_module_create_info.codeSize = code.bytes;
+  shader_module_create_info.pCode = (uint32_t*)code.data;
+  VK_CHECK(vkCreateShaderModule(device, &shader_module_create_info, &callbacks, module));
+  BufferDestroy(&code);
+  return true;
+}
+
+enum QueueType
+{
+  QUEUE_TYPE_GRAPHICS,
+  QUEUE_TYPE_COMPUTE,
+  QUEUE_TYPE_TRANSFER,
+  QUEUE_TYPE_COUNT,
+};
+
+// Submits jobs (one command buffer each) to the graphics, compute and transfer
+// queues in the order they were begun.  Dependencies between jobs turn into a
+// binary semaphore per edge, so a job can feed any number of later jobs on
+// any queue.  Everything is recycled in Wait() once the work has retired.
+struct QueueScheduler
+{
+  struct Job
+  {
+    QueueType queue;
+    VkCommandBuffer cmd;
+    uint32_t wait_count;
+    VkSemaphore wait_semaphores[8];
+    VkPipelineStageFlags wait_stages[8];
+    uint32_t signal_count;
+    VkSemaphore signal_semaphores[8];
+  };
+
+  VulkanState* state = nullptr;
+  VkQueue queues[QUEUE_TYPE_COUNT] = {};
+  uint32_t families[QUEUE_TYPE_COUNT] = {};
+  VkCommandPool pools[QUEUE_TYPE_COUNT] = {};
+  VkCommandBuffer cmds[QUEUE_TYPE_COUNT][16] = {};
+  uint32_t cmds_used[QUEUE_TYPE_COUNT] = {};
+  VkFence fences[QUEUE_TYPE_COUNT] = {};
+  bool fences_pending[QUEUE_TYPE_COUNT] = {};
+  Job jobs[32] = {};
+  uint32_t job_count = 0;
+  VkSemaphore semaphores[64] = {};
+  uint32_t semaphores_created = 0;
+  uint32_t semaphores_used = 0;
+
+  void Create(VulkanState& vulkan_state);
+  void Destroy();
+  uint32_t BeginJob(QueueType queue);
+  VkCommandBuffer Commands(uint32_t job) const { return jobs[job].cmd; }
+  void EndJob(uint32_t job);
+  void AddDependency(uint32_t job, uint32_t dependency, VkPipelineStageFlags wait_stage);
+  void AddWait(uint32_t job, VkSemaphore semaphore, VkPipelineStageFlags wait_stage);
+  void AddSignal(uint32_t job, VkSemaphore semaphore);
+  void Submit();
+  void Wait();
+
+  // Queue family ownership transfers.  The release is recorded in the job on
+  // the source queue and the acquire in the dependent job on the destination
+  // queue.  Both are no-ops when the two queues share a family.
+  void ReleaseBuffer(VkCommandBuffer cmd, VkBuffer buffer, QueueType from, QueueType to, VkPipelineStageFlags src_stage, VkAccessFlags src_access) const;
+  void AcquireBuffer(VkCommandBuffer cmd, VkBuffer buffer, QueueType from, QueueType to, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) const;
+  void ReleaseImage(VkCommandBuffer cmd, VkImage image, const VkImageSubresourceRange& range, VkImageLayout old_layout, VkImageLayout new_layout, QueueType from, QueueType to, VkPipelineStageFlags src_stage, VkAccessFlags src_access) const;
+  void AcquireImage(VkCommandBuffer cmd, VkImage image, const VkImageSubresourceRange& range, VkImageLayout old_layout, VkImageLayout new_layout, QueueType from, QueueType to, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) const;
+};
+
+void QueueScheduler::Create(VulkanState& vulkan_state)
+{
+  state = &vulkan_state;
+  queues[QUEUE_TYPE_GRAPHICS] = state->queue;
+  queues[QUEUE_TYPE_COMPUTE] = state->compute_queue;
+  queues[QUEUE_TYPE_TRANSFER] = state->transfer_queue;
+  families[QUEUE_TYPE_GRAPHICS] = state->queue_family_index;
+  families[QUEUE_TYPE_COMPUTE] = state->compute_family_index;
+  families[QUEUE_TYPE_TRANSFER] = state->transfer_family_index;
+
+  for (uint32_t i = 0; i < QUEUE_TYPE_COUNT; ++i)
+  {
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    cmd_pool_info.queueFamilyIndex = families[i];
+    VK_CHECK(vkCreateCommandPool(state->device, &cmd_pool_info, &state->callbacks, pools + i));
+
+    VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+    cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buffer_alloc_info.commandPool = pools[i];
+    cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buffer_alloc_info.commandBufferCount = ARRAY_COUNT(cmds[i]);
+    VK_CHECK(vkAllocateCommandBuffers(state->device, &cmd_buffer_alloc_info, cmds[i]));
+
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK(vkCreateFence(state->device, &fence_create_info, &state->callbacks, fences + i));
+  }
+}
+
+void QueueScheduler::Destroy()
+{
+  Wait();
+
+  for (uint32_t i = 0; i < semaphores_created; ++i)
+  {
+    vkDestroySemaphore(state->device, semaphores[i], &state->callbacks);
+  }
+
+  for (uint32_t i = 0; i < QUEUE_TYPE_COUNT; ++i)
+  {
+    vkDestroyFence(state->device, fences[i], &state->callbacks);
+    vkDestroyCommandPool(state->device, pools[i], &state->callbacks);
+  }
+}
+
+uint32_t QueueScheduler::BeginJob(QueueType queue)
+{
+  if ((job_count == ARRAY_COUNT(jobs)) || (cmds_used[queue] == ARRAY_COUNT(cmds[queue])))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  uint32_t index = job_count++;
+  Job& job = jobs[index];
+  job = {};
+  job.queue = queue;
+  job.cmd = cmds[queue][cmds_used[queue]++];
+
+  VkCommandBufferBeginInfo cmd_buf_info = {};
+  cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK(vkBeginCommandBuffer(job.cmd, &cmd_buf_info));
+  return index;
+}
+
+void QueueScheduler::EndJob(uint32_t job)
+{
+  VK_CHECK(vkEndCommandBuffer(jobs[job].cmd));
+}
+
+// Binary semaphores have to be signalled before anything waits on them, so a
+// job can only depend on jobs begun before it.
+void QueueScheduler::AddDependency(uint32_t job, uint32_t dependency, VkPipelineStageFlags wait_stage)
+{
+  if ((dependency >= job) || (jobs[dependency].signal_count == ARRAY_COUNT(jobs[dependency].signal_semaphores)))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  if (semaphores_used == semaphores_created)
+  {
+    if (semaphores_created == ARRAY_COUNT(semaphores))
+    {
+      Fail(__FUNCTION__);
+    }
+
+    VkSemaphoreCreateInfo sem_create_info = {};
+    sem_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    VK_CHECK(vkCreateSemaphore(state->device, &sem_create_info, &state->callbacks, semaphores + semaphores_created++));
+  }
+
+  VkSemaphore semaphore = semaphores[semaphores_used++];
+  AddSignal(dependency, semaphore);
+  AddWait(job, semaphore, wait_stage);
+}
+
+void QueueScheduler::AddWait(uint32_t job, VkSemaphore semaphore, VkPipelineStageFlags wait_stage)
+{
+  Job& j = jobs[job];
+
+  if (j.wait_count == ARRAY_COUNT(j.wait_semaphores))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  j.wait_semaphores[j.wait_count] = semaphore;
+  j.wait_stages[j.wait_count] = wait_stage;
+  ++j.wait_count;
+}
+
+void QueueScheduler::AddSignal(uint32_t job, VkSemaphore semaphore)
+{
+  Job& j = jobs[job];
+
+  if (j.signal_count == ARRAY_COUNT(j.signal_semaphores))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  j.signal_semaphores[j.signal_count++] = semaphore;
+}
+
+void QueueScheduler::Submit()
+{
+  // The last job on each queue carries that queue's fence.
+  uint32_t last_job[QUEUE_TYPE_COUNT];
+
+  for (uint32_t i = 0; i < QUEUE_TYPE_COUNT; ++i)
+  {
+    last_job[i] = UINT32_MAX;
+  }
+
+  for (uint32_t i = 0; i < job_count; ++i)
+  {
+    last_job[jobs[i].queue] = i;
+  }
+
+  for (uint32_t i = 0; i < job_count; ++i)
+  {
+    const Job& job = jobs[i];
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.waitSemaphoreCount = job.wait_count;
+    submit_info.pWaitSemaphores = job.wait_semaphores;
+    submit_info.pWaitDstStageMask = job.wait_stages;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &job.cmd;
+    submit_info.signalSemaphoreCount = job.signal_count;
+    submit_info.pSignalSemaphores = job.signal_semaphores;
+
+    VkFence fence = VK_NULL_HANDLE;
+
+    if (last_job[job.queue] == i)
+    {
+      fence = fences[job.queue];
+      fences_pending[job.queue] = true;
+    }
+
+    VK_CHECK(vkQueueSubmit(queues[job.queue], 1, &submit_info, fence));
+  }
+
+  job_count = 0;
+}
+
+void QueueScheduler::Wait()
+{
+  for (uint32_t i = 0; i < QUEUE_TYPE_COUNT; ++i)
+  {
+    if (fences_pending[i])
+    {
+      VK_CHECK(vkWaitForFences(state->device, 1, fences + i, VK_TRUE, UINT64_MAX));
+      VK_CHECK(vkResetFences(state->device, 1, fences + i));
+      fences_pending[i] = false;
+    }
+
+    if (cmds_used[i])
+    {
+      VK_CHECK(vkResetCommandPool(state->device, pools[i], 0));
+      cmds_used[i] = 0;
+    }
+  }
+
+  // Every wait has executed, so the semaphores are unsignalled again.
+  semaphores_used = 0;
+}
+
+void QueueScheduler::ReleaseBuffer(VkCommandBuffer cmd, VkBuffer buffer, QueueType from, QueueType to, VkPipelineStageFlags src_stage, VkAccessFlags src_access) const
+{
+  if (families[from] == families[to])
+  {
+    return;
+  }
+
+  VkBufferMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = src_access;
+  barrier.dstAccessMask = 0;
+  barrier.srcQueueFamilyIndex = families[from];
+  barrier.dstQueueFamilyIndex = families[to];
+  barrier.buffer = buffer;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(cmd, src_stage, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void QueueScheduler::AcquireBuffer(VkCommandBuffer cmd, VkBuffer buffer, QueueType from, QueueType to, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) const
+{
+  if (families[from] == families[to])
+  {
+    return;
+  }
+
+  VkBufferMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = dst_access;
+  barrier.srcQueueFamilyIndex = families[from];
+  barrier.dstQueueFamilyIndex = families[to];
+  barrier.buffer = buffer;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dst_stage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+// A layout change can ride along with the transfer, in which case both halves
+// must name the same old and new layouts.
+void QueueScheduler::ReleaseImage(VkCommandBuffer cmd, VkImage image, const VkImageSubresourceRange& range, VkImageLayout old_layout, VkImageLayout new_layout, QueueType from, QueueType to, VkPipelineStageFlags src_stage, VkAccessFlags src_access) const
+{
+  if (families[from] == families[to])
+  {
+    return;
+  }
+
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = src_access;
+  barrier.dstAccessMask = 0;
+  barrier.oldLayout = old_layout;
+  barrier.newLayout = new_layout;
+  barrier.srcQueueFamilyIndex = families[from];
+  barrier.dstQueueFamilyIndex = families[to];
+  barrier.image = image;
+  barrier.subresourceRange = range;
+  vkCmdPipelineBarrier(cmd, src_stage, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void QueueScheduler::AcquireImage(VkCommandBuffer cmd, VkImage image, const VkImageSubresourceRange& range, VkImageLayout old_layout, VkImageLayout new_layout, QueueType from, QueueType to, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) const
+{
+  if (families[from] == families[to])
+  {
+    return;
+  }
+
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = dst_access;
+  barrier.oldLayout = old_layout;
+  barrier.newLayout = new_layout;
+  barrier.srcQueueFamilyIndex = families[from];
+  barrier.dstQueueFamilyIndex = families[to];
+  barrier.image = image;
+  barrier.subresourceRange = range;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dst_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+// Runs a transfer-, compute- and graphics-heavy job first one at a time and
+// then all at once through the scheduler.  If the queues really run
+// asynchronously the concurrent run takes less than the sum of the three.
+void RunQueueOverlapBench(VulkanState& state)
+{
+  const VkDeviceSize copy_bytes = 64 * 1024 * 1024;
+  const uint32_t compute_count = 1024 * 1024;
+  const uint32_t compute_iterations = 256;
+  const uint32_t clear_size = 4096;
+  const uint32_t clear_count = 32;
+  const int repeats = 8;
+
+  QueueScheduler scheduler;
+  scheduler.Create(state);
+
+  VkBuffer staging_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory staging_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(copy_bytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &staging_buffer, &staging_memory);
+
+  VkBuffer upload_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory upload_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(copy_bytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &upload_buffer, &upload_memory);
+
+  VkBuffer compute_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory compute_memory = VK_NULL_HANDLE;
+  VkDeviceSize compute_bytes = compute_count * sizeof(float) * 4;
+  state.CreateBuffer(compute_bytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &compute_buffer, &compute_memory);
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = clear_size;
+  image_create_info.extent.height = clear_size;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage clear_image = VK_NULL_HANDLE;
+  VkDeviceMemory clear_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &clear_image, &clear_memory);
+
+  VkImageSubresourceRange clear_range = {};
+  clear_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  clear_range.levelCount = 1;
+  clear_range.layerCount = 1;
+
+  // The compute job runs busy.comp when its SPIR-V is available and falls back
+  // to buffer fills, which still occupy the compute queue.
+  VkShaderModule busy_module = VK_NULL_HANDLE;
+  VkDescriptorSetLayout busy_set_layout = VK_NULL_HANDLE;
+  VkPipelineLayout busy_pipeline_layout = VK_NULL_HANDLE;
+  VkPipeline busy_pipeline = VK_NULL_HANDLE;
+  VkDescriptorPool busy_pool = VK_NULL_HANDLE;
+  VkDescriptorSet busy_sets[2] = {};
+
+  if (state.LoadShaderModule("busy.comp.spv", &busy_module))
+  {
+    VkDescriptorSetLayoutBinding binding = {};
+    binding.binding = 0;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    binding.descriptorCount = 1;
+    binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutCreateInfo set_layout_info = {};
+    set_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    set_layout_info.bindingCount = 1;
+    set_layout_info.pBindings = &binding;
+    VK_CHECK(vkCreateDescriptorSetLayout(state.device, &set_layout_info, &state.callbacks, &busy_set_layout));
+
+    VkPushConstantRange push_range = {};
+    push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_range.size = sizeof(uint32_t) * 2;
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &busy_set_layout;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_range;
+    VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_info, &state.callbacks, &busy_pipeline_layout));
+
+    VkComputePipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = busy_module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = busy_pipeline_layout;
+    VK_CHECK(vkCreateComputePipelines(state.device, VK_NULL_HANDLE, 1, &pipeline_info, &state.callbacks, &busy_pipeline));
+
+    VkDescriptorPoolSize pool_size = {};
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = 2;
+
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = 2;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    VK_CHECK(vkCreateDescriptorPool(state.device, &pool_info, &state.callbacks, &busy_pool));
+
+    VkDescriptorSetLayout set_layouts[2] = { busy_set_layout, busy_set_layout };
+    VkDescriptorSetAllocateInfo set_alloc_info = {};
+    set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_alloc_info.descriptorPool = busy_pool;
+    set_alloc_info.descriptorSetCount = 2;
+    set_alloc_info.pSetLayouts = set_layouts;
+    VK_CHECK(vkAllocateDescriptorSets(state.device, &set_alloc_info, busy_sets));
+
+    // Set 0 works on the compute buffer, set 1 on the start of the upload
+    // buffer for the dependent chain.
+    VkDescriptorBufferInfo buffer_infos[2] = {};
+    buffer_infos[0].buffer = compute_buffer;
+    buffer_infos[0].range = compute_bytes;
+    buffer_infos[1].buffer = upload_buffer;
+    buffer_infos[1].range = compute_bytes;
+
+    VkWriteDescriptorSet writes[2] = {};
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+      writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writes[i].dstSet = busy_sets[i];
+      writes[i].descriptorCount = 1;
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes[i].pBufferInfo = buffer_infos + i;
+    }
+    vkUpdateDescriptorSets(state.device, 2, writes, 0, nullptr);
+  }
+
+  VkBufferCopy copy_region = {};
+  copy_region.size = copy_bytes;
+  VkClearColorValue clear_color = {};
+  clear_color.float32[3] = 1.0f;
+  uint32_t push_constants[2] = { compute_count, compute_iterations };
+
+  // Each of these records one job's worth of work.
+  auto record_transfer = [&](VkCommandBuffer cmd)
+  {
+    vkCmdCopyBuffer(cmd, staging_buffer, upload_buffer, 1, &copy_region);
+  };
+
+  auto record_compute = [&](VkCommandBuffer cmd, uint32_t set)
+  {
+    if (busy_pipeline)
+    {
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, busy_pipeline);
+      vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, busy_pipeline_layout, 0, 1, busy_sets + set, 0, nullptr);
+      vkCmdPushConstants(cmd, busy_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants), push_constants);
+      vkCmdDispatch(cmd, (compute_count + 63) / 64, 1, 1);
+    }
+    else
+    {
+      for (uint32_t i = 0; i < 16; ++i)
+      {
+        vkCmdFillBuffer(cmd, set ? upload_buffer : compute_buffer, 0, compute_bytes, i);
+      }
+    }
+  };
+
+  auto record_graphics = [&](VkCommandBuffer cmd)
+  {
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = clear_image;
+    barrier.subresourceRange = clear_range;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    for (uint32_t i = 0; i < clear_count; ++i)
+    {
+      clear_color.float32[0] = (float)i / clear_count;
+      vkCmdClearColorImage(cmd, clear_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clear_color, 1, &clear_range);
+    }
+  };
+
+  double alone_ms[QUEUE_TYPE_COUNT] = {};
+
+  for (uint32_t queue = 0; queue < QUEUE_TYPE_COUNT; ++queue)
+  {
+    double start_ms = GetTimeMs();
+
+    for (int r = 0; r < repeats; ++r)
+    {
+      uint32_t job = scheduler.BeginJob((QueueType)queue);
+      VkCommandBuffer cmd = scheduler.Commands(job);
+
+      if (queue == QUEUE_TYPE_TRANSFER)
+      {
+        record_transfer(cmd);
+      }
+      else if (queue == QUEUE_TYPE_COMPUTE)
+      {
+        record_compute(cmd, 0);
+      }
+      else
+      {
+        record_graphics(cmd);
+      }
+
+      scheduler.EndJob(job);
+      scheduler.Submit();
+      scheduler.Wait();
+    }
+
+    alone_ms[queue] = (GetTimeMs() - start_ms) / repeats;
+  }
+
+  double start_ms = GetTimeMs();
+
+  for (int r = 0; r < repeats; ++r)
+  {
+    uint32_t transfer_job = scheduler.BeginJob(QUEUE_TYPE_TRANSFER);
+    record_transfer(scheduler.Commands(transfer_job));
+    scheduler.EndJob(transfer_job);
+
+    uint32_t compute_job = scheduler.BeginJob(QUEUE_TYPE_COMPUTE);
+    record_compute(scheduler.Commands(compute_job), 0);
+    scheduler.EndJob(compute_job);
+
+    uint32_t graphics_job = scheduler.BeginJob(QUEUE_TYPE_GRAPHICS);
+    record_graphics(scheduler.Commands(graphics_job));
+    scheduler.EndJob(graphics_job);
+
+    scheduler.Submit();
+    scheduler.Wait();
+  }
+
+  double concurrent_ms = (GetTimeMs() - start_ms) / repeats;
+
+  // A dependent chain: upload on the transfer queue, process on the compute
+  // queue, then hand the buffer to graphics.  Exercises the semaphores and
+  // ownership transfers rather than overlap.
+  start_ms = GetTimeMs();
+
+  for (int r = 0; r < repeats; ++r)
+  {
+    uint32_t upload_job = scheduler.BeginJob(QUEUE_TYPE_TRANSFER);
+    VkCommandBuffer cmd = scheduler.Commands(upload_job);
+
+    if (r > 0)
+    {
+      scheduler.AcquireBuffer(cmd, upload_buffer, QUEUE_TYPE_GRAPHICS, QUEUE_TYPE_TRANSFER, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    }
+
+    record_transfer(cmd);
+    scheduler.ReleaseBuffer(cmd, upload_buffer, QUEUE_TYPE_TRANSFER, QUEUE_TYPE_COMPUTE, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    scheduler.EndJob(upload_job);
+
+    uint32_t process_job = scheduler.BeginJob(QUEUE_TYPE_COMPUTE);
+    cmd = scheduler.Commands(process_job);
+    scheduler.AcquireBuffer(cmd, upload_buffer, QUEUE_TYPE_TRANSFER, QUEUE_TYPE_COMPUTE, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+    record_compute(cmd, 1);
+    scheduler.ReleaseBuffer(cmd, upload_buffer, QUEUE_TYPE_COMPUTE, QUEUE_TYPE_GRAPHICS, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+    scheduler.EndJob(process_job);
+    scheduler.AddDependency(process_job, upload_job, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+    uint32_t consume_job = scheduler.BeginJob(QUEUE_TYPE_GRAPHICS);
+    cmd = scheduler.Commands(consume_job);
+    scheduler.AcquireBuffer(cmd, upload_buffer, QUEUE_TYPE_COMPUTE, QUEUE_TYPE_GRAPHICS, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+
+    // Hand it back so the next iteration's upload starts from the transfer
+    // queue.  The last iteration keeps it, as there's no upload to acquire it.
+    if (r + 1 < repeats)
+    {
+      scheduler.ReleaseBuffer(cmd, upload_buffer, QUEUE_TYPE_GRAPHICS, QUEUE_TYPE_TRANSFER, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0);
+    }
+
+    scheduler.EndJob(consume_job);
+    scheduler.AddDependency(consume_job, process_job, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+
+    scheduler.Submit();
+    scheduler.Wait();
+  }
+
+  double chain_ms = (GetTimeMs() - start_ms) / repeats;
+  double serial_ms = alone_ms[QUEUE_TYPE_GRAPHICS] + alone_ms[QUEUE_TYPE_COMPUTE] + alone_ms[QUEUE_TYPE_TRANSFER];
+
+  printf("Queue overlap (%s compute shader):\n", busy_pipeline ? "busy.comp" : "no");
+  printf("  graphics alone: %.3f ms (family %u)\n", alone_ms[QUEUE_TYPE_GRAPHICS], state.queue_family_index);
+  printf("  compute alone:  %.3f ms (family %u)\n", alone_ms[QUEUE_TYPE_COMPUTE], state.compute_family_index);
+  printf("  transfer alone: %.3f ms (family %u)\n", alone_ms[QUEUE_TYPE_TRANSFER], state.transfer_family_index);
+  printf("  sum:            %.3f ms\n", serial_ms);
+  printf("  concurrent:     %.3f ms (%.1f%% of the sum overlapped)\n", concurrent_ms, 100.0 * (serial_ms - concurrent_ms) / serial_ms);
+  printf("  dependent chain transfer->compute->graphics: %.3f ms\n", chain_ms);
+
+  scheduler.Destroy();
+
+  if (busy_pipeline)
+  {
+    vkDestroyDescriptorPool(state.device, busy_pool, &state.callbacks);
+    vkDestroyPipeline(state.device, busy_pipeline, &state.callbacks);
+    vkDestroyPipelineLayout(state.device, busy_pipeline_layout, &state.callbacks);
+    vkDestroyDescriptorSetLayout(state.device, busy_set_layout, &state.callbacks);
+  }
+
+  if (busy_module)
+  {
+    vkDestroyShaderModule(state.device, busy_module, &state.callbacks);
+  }
+
+  vkDestroyImage(state.device, clear_image, &state.callbacks);
+  vkFreeMemory(state.device, clear_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, compute_buffer, &state.callbacks);
+  vkFreeMemory(state.device, compute_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, upload_buffer, &state.callbacks);
+  vkFreeMemory(state.device, upload_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, staging_buffer, &state.callbacks);
+  vkFreeMemory(state.device, staging_memory, &state.callbacks);
+}
+
+enum RenderGraphAccess
+{
+  RENDER_GRAPH_ACCESS_COLOR_WRITE,
+  RENDER_GRAPH_ACCESS_DEPTH_WRITE,
+  RENDER_GRAPH_ACCESS_DEPTH_READ,
+  RENDER_GRAPH_ACCESS_SAMPLED,
+  RENDER_GRAPH_ACCESS_STORAGE_READ,
+  RENDER_GRAPH_ACCESS_STORAGE_WRITE,
+  RENDER_GRAPH_ACCESS_TRANSFER_SRC,
+  RENDER_GRAPH_ACCESS_TRANSFER_DST,
+  RENDER_GRAPH_ACCESS_COUNT,
+};
+
+struct RenderGraphAccessInfo
+{
+  VkPipelineStageFlags stages;
+  VkAccessFlags access;
+  VkImageLayout layout;
+  VkImageUsageFlags usage;
+  bool write;
+  bool attachment;
+};
+
+static const RenderGraphAccessInfo s_RenderGraphAccessInfo[RENDER_GRAPH_ACCESS_COUNT] =
+{
+  // RENDER_GRAPH_ACCESS_COLOR_WRITE
+  { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, true, true },
+  // RENDER_GRAPH_ACCESS_DEPTH_WRITE
+  { VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, true, true },
+  // RENDER_GRAPH_ACCESS_DEPTH_READ
+  { VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, false, true },
+  // RENDER_GRAPH_ACCESS_SAMPLED
+  { VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT, false, false },
+  // RENDER_GRAPH_ACCESS_STORAGE_READ
+  { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT, false, false },
+  // RENDER_GRAPH_ACCESS_STORAGE_WRITE
+  { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT, true, false },
+  // RENDER_GRAPH_ACCESS_TRANSFER_SRC
+  { VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, false, false },
+  // RENDER_GRAPH_ACCESS_TRANSFER_DST
+  { VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT, true, false },
+};
+
+typedef void (*RenderGraphRecordFn)(VkCommandBuffer cmd, void* userdata);
+
+// Passes declare which images they read and write and the graph works out
+// the rest: passes whose output nobody reads are culled, every layout
+// transition and hazard gets the narrowest barrier that covers it (batched
+// into one vkCmdPipelineBarrier per pass), raster passes get their render
+// pass and framebuffers, and transient images whose lifetimes don't overlap
+// share memory.
+//
+// Transient contents never survive from one frame to the next, and imported
+// images are assumed to be overwritten every frame and are left in their
+// final layout after the last pass.
+struct RenderGraph
+{
+  struct Resource
+  {
+    const char* name;
+    VkFormat format;
+    VkExtent2D extent;
+    VkImageAspectFlags aspect;
+    uint32_t layer_count; // Array layers, every one of them used by every access.
+    VkClearValue clear_value;
+    bool imported;
+    VkImageLayout final_layout;
+    uint32_t image_count;
+    VkImage images[8];
+    VkImageView views[8];
+    bool owns_views; // Views of an imported image, made by Compile() because none were given.
+
+    // Filled in by Compile().
+    VkImageUsageFlags usage;
+    uint32_t first_pass;
+    uint32_t last_pass;
+    uint32_t block;
+    VkMemoryRequirements memory_requirements;
+  };
+
+  struct Use
+  {
+    uint32_t resource;
+    RenderGraphAccess access;
+  };
+
+  struct BarrierBatch
+  {
+    uint32_t first;
+    uint32_t count;
+    VkPipelineStageFlags src_stages;
+    VkPipelineStageFlags dst_stages;
+  };
+
+  struct Pass
+  {
+    const char* name;
+    RenderGraphRecordFn record;
+    void* userdata;
+    uint32_t use_count;
+    Use uses[8];
+    VkExtent2D render_area;
+    uint32_t view_mask; // Layers drawn at once with multiview, 0 for a plain render pass.
+
+    // Filled in by Compile().  Attachments are the color attachments in
+    // declaration order followed by the depth attachment.
+    bool live;
+    BarrierBatch barriers;
+    uint32_t attachment_count;
+    uint32_t attachments[8];
+    VkAttachmentLoadOp load_ops[8];
+    VkAttachmentStoreOp store_ops[8];
+    bool has_depth;
+    VkRenderPass render_pass;
+    uint32_t framebuffer_count;
+    VkFramebuffer framebuffers[8];
+  };
+
+  // Memory shared by transient images whose lifetimes don't overlap.
+  struct Block
+  {
+    VkDeviceSize size;
+    uint32_t memory_type_bits;
+    VkDeviceMemory memory;
+    uint32_t last_resource; // Most recent occupant, for the aliasing barrier.
+  };
+
+  // Where each image was left by the accesses tracked so far.
+  struct ResourceState
+  {
+    bool used;
+    VkImageLayout layout;
+    VkPipelineStageFlags write_stages;
+    VkAccessFlags write_access;
+    VkPipelineStageFlags read_stages;
+    VkAccessFlags read_access;
+  };
+
+  struct Stats
+  {
+    uint32_t live_passes;
+    uint32_t culled_passes;
+    uint32_t image_barriers;
+    uint32_t execution_barriers; // Write-after-read hazards that only need an execution dependency.
+    uint32_t barrier_calls;
+    uint32_t naive_barriers;     // One barrier per declared access, no culling.
+    VkDeviceSize transient_bytes;
+    VkDeviceSize aliased_bytes;
+  };
+
+  VulkanState* state = nullptr;
+  uint32_t resource_count = 0;
+  Resource resources[32] = {};
+  uint32_t pass_count = 0;
+  Pass passes[32] = {};
+  uint32_t block_count = 0;
+  Block blocks[32] = {};
+  uint32_t barrier_count = 0;
+  VkImageMemoryBarrier barriers[128] = {};
+  uint32_t barrier_resources[128] = {};
+  BarrierBatch final_barriers = {};
+  ResourceState states[32] = {};
+  Stats stats = {};
+  uint32_t current_frame = 0;
+
+  uint32_t CreateImage(const char* name, VkFormat format, VkExtent2D extent, VkImageAspectFlags aspect, uint32_t layer_count = 1);
+  uint32_t ImportImage(const char* name, VkFormat format, VkExtent2D extent, VkImageAspectFlags aspect, uint32_t image_count, const VkImage* images, const VkImageView* views, VkImageLayout final_layout, uint32_t layer_count = 1);
+  uint32_t AddPass(const char* name, RenderGraphRecordFn record, void* userdata);
+  void AddUse(uint32_t pass, uint32_t resource, RenderGraphAccess access);
+  void SetViewMask(uint32_t pass, uint32_t view_mask);
+
+  void Compile(VulkanState& vulkan_state);
+  void Destroy();
+  void Execute(VkCommandBuffer cmd, uint32_t frame);
+  void PrintStats() const;
+
+  // Only valid while a pass is being recorded, since imported images change
+  // with the frame.
+  VkImage Image(uint32_t resource) const { return resources[resource].images[current_frame % resources[resource].image_count]; }
+  VkImageView View(uint32_t resource) const { return resources[resource].views[current_frame % resources[resource].image_count]; }
+  VkRenderPass RenderPass(uint32_t pass) const { return passes[pass].render_pass; }
+  VkPipelineStageFlags FirstStages(uint32_t resource) const;
+
+  // The steps of Compile() that don't touch the device, split out for the tests.
+  void Cull();
+  void PlanMemory();
+  void PlanBarriers();
+  void RecordBarriers(VkCommandBuffer cmd, const BarrierBatch& batch) const;
+  static uint32_t PlanAliasing(uint32_t count, const VkMemoryRequirements* requirements, const uint32_t* first_pass, const uint32_t* last_pass, uint32_t* assigned_blocks, VkDeviceSize* block_sizes, uint32_t* block_memory_type_bits);
+
+  static void TestCullsUnreadPasses();
+  static void TestBarriers();
+  static void TestAliasing();
+  static void TestLayers();
+  static void RunAllTests();
+};
+
+uint32_t RenderGraph::CreateImage(const char* name, VkFormat format, VkExtent2D extent, VkImageAspectFlags aspect, uint32_t layer_count)
+{
+  if (resource_count == ARRAY_COUNT(resources))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  Resource& resource = resources[resource_count];
+  resource = {};
+  resource.name = name;
+  resource.format = format;
+  resource.extent = extent;
+  resource.aspect = aspect;
+  resource.layer_count = layer_count;
+  resource.image_count = 1;
+  resource.block = UINT32_MAX;
+
+  if (aspect & VK_IMAGE_ASPECT_DEPTH_BIT)
+  {
+    resource.clear_value.depthStencil.depth = 1.0f;
+  }
+
+  return resource_count++;
+}
+
+uint32_t RenderGraph::ImportImage(const char* name, VkFormat format, VkExtent2D extent, VkImageAspectFlags aspect, uint32_t image_count, const VkImage* images, const VkImageView* views, VkImageLayout final_layout, uint32_t layer_count)
+{
+  if (!image_count || (image_count > ARRAY_COUNT(resources[0].images)))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  uint32_t index = CreateImage(name, format, extent, aspect, layer_count);
+  Resource& resource = resources[index];
+  resource.imported = true;
+  resource.final_layout = final_layout;
+  resource.image_count = image_count;
+
+  for (uint32_t i = 0; i < image_count; ++i)
+  {
+    resource.images[i] = images[i];
+    resource.views[i] = views ? views[i] : VK_NULL_HANDLE;
+  }
+
+  return index;
+}
+
+uint32_t RenderGraph::AddPass(const char* name, RenderGraphRecordFn record, void* userdata)
+{
+  if (pass_count == ARRAY_COUNT(passes))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  Pass& pass = passes[pass_count];
+  pass = {};
+  pass.name = name;
+  pass.record = record;
+  pass.userdata = userdata;
+  return pass_count++;
+}
+
+// A pass may use each resource once.
+void RenderGraph::AddUse(uint32_t pass, uint32_t resource, RenderGraphAccess access)
+{
+  Pass& p = passes[pass];
+
+  if (p.use_count == ARRAY_COUNT(p.uses))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  for (uint32_t i = 0; i < p.use_count; ++i)
+  {
+    if (p.uses[i].resource == resource)
+    {
+      Fail(__FUNCTION__);
+    }
+  }
+
+  p.uses[p.use_count].resource = resource;
+  p.uses[p.use_count].access = access;
+  ++p.use_count;
+}
+
+// Makes a raster pass draw every layer in view_mask in one go with
+// VK_KHR_multiview, gl_ViewIndex telling the shaders which.  Its attachments
+// need at least as many layers as the highest view, and pipelines drawing
+// in it must be made for its render pass.
+void RenderGraph::SetViewMask(uint32_t pass, uint32_t view_mask)
+{
+#ifdef VK_KHR_multiview
+  passes[pass].view_mask = view_mask;
+#else
+  (void)pass;
+  (void)view_mask;
+  Fail(__FUNCTION__);
+#endif
+}
+
+void RenderGraph::Cull()
+{
+  // Walk backwards from the imported images: a pass is live if it writes
+  // something a live pass reads or that leaves the graph.
+  bool needed[ARRAY_COUNT(resources)] = {};
+
+  for (uint32_t i = 0; i < resource_count; ++i)
+  {
+    needed[i] = resources[i].imported;
+    resources[i].usage = 0;
+    resources[i].first_pass = UINT32_MAX;
+    resources[i].last_pass = 0;
+  }
+
+  for (uint32_t p = pass_count; p-- > 0;)
+  {
+    Pass& pass = passes[p];
+    pass.live = false;
+
+    for (uint32_t i = 0; i < pass.use_count; ++i)
+    {
+      if (s_RenderGraphAccessInfo[pass.uses[i].access].write && needed[pass.uses[i].resource])
+      {
+        pass.live = true;
+      }
+    }
+
+    if (!pass.live)
+    {
+      continue;
+    }
+
+    // Writes don't clear needed[] since a later pass may load what an
+    // earlier one rendered.
+    for (uint32_t i = 0; i < pass.use_count; ++i)
+    {
+      needed[pass.uses[i].resource] = true;
+    }
+  }
+
+  stats = {};
+
+  for (uint32_t p = 0; p < pass_count; ++p)
+  {
+    Pass& pass = passes[p];
+    stats.naive_barriers += pass.use_count;
+
+    if (!pass.live)
+    {
+      ++stats.culled_passes;
+      continue;
+    }
+
+    ++stats.live_passes;
+
+    for (uint32_t i = 0; i < pass.use_count; ++i)
+    {
+      Resource& resource = resources[pass.uses[i].resource];
+      resource.usage |= s_RenderGraphAccessInfo[pass.uses[i].access].usage;
+      resource.first_pass = (p < resource.first_pass) ? p : resource.first_pass;
+      resource.last_pass = p;
+    }
+  }
+
+  for (uint32_t i = 0; i < resource_count; ++i)
+  {
+    stats.naive_barriers += resources[i].imported ? 1 : 0;
+  }
+
+  // Attachments: clear on first use in the frame, store only if something
+  // after this pass (or outside the graph) looks at the result.
+  for (uint32_t p = 0; p < pass_count; ++p)
+  {
+    Pass& pass = passes[p];
+    pass.attachment_count = 0;
+    pass.has_depth = false;
+
+    if (!pass.live)
+    {
+      continue;
+    }
+
+    uint32_t depth_use = UINT32_MAX;
+
+    for (uint32_t i = 0; i < pass.use_count; ++i)
+    {
+      RenderGraphAccess access = pass.uses[i].access;
+
+      if (access == RENDER_GRAPH_ACCESS_COLOR_WRITE)
+      {
+        pass.attachments[pass.attachment_count++] = i;
+      }
+      else if (s_RenderGraphAccessInfo[access].attachment)
+      {
+        depth_use = i;
+      }
+    }
+
+    if (depth_use != UINT32_MAX)
+    {
+      pass.attachments[pass.attachment_count++] = depth_use;
+      pass.has_depth = true;
+    }
+
+    for (uint32_t a = 0; a < pass.attachment_count; ++a)
+    {
+      const Use& use = pass.uses[pass.attachments[a]];
+      const Resource& resource = resources[use.resource];
+      bool first = (resource.first_pass == p);
+      bool read_only = !s_RenderGraphAccessInfo[use.access].write;
+      pass.attachments[a] = use.resource;
+      pass.load_ops[a] = (first && !read_only) ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD;
+      pass.store_ops[a] = (resource.imported || (resource.last_pass > p)) ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    }
+
+    if (pass.attachment_count && !pass.render_area.width)
+    {
+      pass.render_area = resources[pass.attachments[0]].extent;
+    }
+  }
+}
+
+// Greedy first fit, largest first: each image goes into the first block with
+// a compatible memory type whose occupants are all dead before it's first
+// used or born after it's last used.  Everything is bound at offset 0, so the
+// block is as big as its biggest occupant.
+uint32_t RenderGraph::PlanAliasing(uint32_t count, const VkMemoryRequirements* requirements, const uint32_t* first_pass, const uint32_t* last_pass, uint32_t* assigned_blocks, VkDeviceSize* block_sizes, uint32_t* block_memory_type_bits)
+{
+  uint32_t order[ARRAY_COUNT(resources)] = {};
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    uint32_t j = i;
+
+    for (; (j > 0) && (requirements[order[j - 1]].size < requirements[i].size); --j)
+    {
+      order[j] = order[j - 1];
+    }
+
+    order[j] = i;
+    assigned_blocks[i] = UINT32_MAX;
+  }
+
+  uint32_t block_count = 0;
+
+  for (uint32_t o = 0; o < count; ++o)
+  {
+    uint32_t i = order[o];
+    uint32_t block = 0;
+
+    for (; block < block_count; ++block)
+    {
+      if (!(block_memory_type_bits[block] & requirements[i].memoryTypeBits))
+      {
+        continue;
+      }
+
+      bool overlaps = false;
+
+      for (uint32_t j = 0; j < count; ++j)
+      {
+        if ((assigned_blocks[j] == block) && (first_pass[i] <= last_pass[j]) && (first_pass[j] <= last_pass[i]))
+        {
+          overlaps = true;
+          break;
+        }
+      }
+
+      if (!overlaps)
+      {
+        break;
+      }
+    }
+
+    if (block == block_count)
+    {
+      block_sizes[block] = 0;
+      block_memory_type_bits[block] = ~0u;
+      ++block_count;
+    }
+
+    assigned_blocks[i] = block;
+    block_memory_type_bits[block] &= requirements[i].memoryTypeBits;
+    block_sizes[block] = (requirements[i].size > block_sizes[block]) ? requirements[i].size : block_sizes[block];
+  }
+
+  return block_count;
+}
+
+// Expects memory_requirements to be filled in for the live transient images.
+void RenderGraph::PlanMemory()
+{
+  VkMemoryRequirements requirements[ARRAY_COUNT(resources)] = {};
+  uint32_t first_pass[ARRAY_COUNT(resources)] = {};
+  uint32_t last_pass[ARRAY_COUNT(resources)] = {};
+  uint32_t assigned_blocks[ARRAY_COUNT(resources)] = {};
+  uint32_t transients[ARRAY_COUNT(resources)] = {};
+  VkDeviceSize block_sizes[ARRAY_COUNT(blocks)] = {};
+  uint32_t block_memory_type_bits[ARRAY_COUNT(blocks)] = {};
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < resource_count; ++i)
+  {
+    resources[i].block = UINT32_MAX;
+
+    if (resources[i].imported || (resources[i].first_pass == UINT32_MAX))
+    {
+      continue;
+    }
+
+    requirements[count] = resources[i].memory_requirements;
+    first_pass[count] = resources[i].first_pass;
+    last_pass[count] = resources[i].last_pass;
+    transients[count] = i;
+    stats.transient_bytes += requirements[count].size;
+    ++count;
+  }
+
+  block_count = PlanAliasing(count, requirements, first_pass, last_pass, assigned_blocks, block_sizes, block_memory_type_bits);
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    resources[transients[i]].block = assigned_blocks[i];
+  }
+
+  for (uint32_t b = 0; b < block_count; ++b)
+  {
+    blocks[b] = {};
+    blocks[b].size = block_sizes[b];
+    blocks[b].memory_type_bits = block_memory_type_bits[b];
+    blocks[b].last_resource = UINT32_MAX;
+    stats.aliased_bytes += block_sizes[b];
+  }
+}
+
+// Replays the frame twice.  The first run only establishes the state the
+// images are left in at the end of a frame, which is what the first barrier
+// of the next frame has to wait on.
+void RenderGraph::PlanBarriers()
+{
+  for (uint32_t i = 0; i < resource_count; ++i)
+  {
+    states[i] = {};
+  }
+
+  for (uint32_t round = 0; round < 2; ++round)
+  {
+    bool emit = (round == 1);
+    barrier_count = 0;
+
+    for (uint32_t i = 0; i < resource_count; ++i)
+    {
+      states[i].used = false;
+    }
+
+    for (uint32_t p = 0; p < pass_count; ++p)
+    {
+      Pass& pass = passes[p];
+
+      if (!pass.live)
+      {
+        continue;
+      }
+
+      BarrierBatch batch = {};
+      batch.first = barrier_count;
+
+      for (uint32_t u = 0; u < pass.use_count; ++u)
+      {
+        uint32_t r = pass.uses[u].resource;
+        const RenderGraphAccessInfo& info = s_RenderGraphAccessInfo[pass.uses[u].access];
+        Resource& resource = resources[r];
+        ResourceState& s = states[r];
+        bool image_barrier = false;
+        VkImageLayout old_layout = s.layout;
+        VkPipelineStageFlags src_stages = 0;
+        VkAccessFlags src_access = 0;
+
+        if (!s.used)
+        {
+          // First use this frame: the old contents are garbage.
+          old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+          image_barrier = true;
+
+          if (resource.imported)
+          {
+            // Chains with a semaphore wait at the same stage.
+            src_stages = info.stages;
+          }
+          else
+          {
+            // Wait for whoever used the memory last, this image in the
+            // previous frame or another image aliased onto it.
+            Block& block = blocks[resource.block];
+
+            if (block.last_resource != UINT32_MAX)
+            {
+              const ResourceState& previous = states[block.last_resource];
+              src_stages = previous.write_stages | previous.read_stages;
+              src_access = previous.write_access;
+            }
+
+            block.last_resource = r;
+          }
+
+          s.used = true;
+        }
+        else if (s.layout != info.layout)
+        {
+          image_barrier = true;
+          src_stages = s.write_stages | s.read_stages;
+          src_access = s.write_access;
+        }
+        else if (s.write_access && (info.write || ((s.read_stages & info.stages) != info.stages) || ((s.read_access & info.access) != info.access)))
+        {
+          // Read or write after write that isn't visible yet.
+          image_barrier = true;
+          src_stages = s.write_stages | s.read_stages;
+          src_access = s.write_access;
+        }
+        else if (info.write && s.read_stages)
+        {
+          // Write after read only has to wait for the reads to finish.
+          src_stages = s.read_stages;
+
+          if (emit)
+          {
+            ++stats.execution_barriers;
+          }
+        }
+
+        if (image_barrier || src_stages)
+        {
+          batch.src_stages |= src_stages ? src_stages : (VkPipelineStageFlags)VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+          batch.dst_stages |= info.stages;
+        }
+
+        if (image_barrier && emit)
+        {
+          if (barrier_count == ARRAY_COUNT(barriers))
+          {
+            Fail(__FUNCTION__);
+          }
+
+          VkImageMemoryBarrier& barrier = barriers[barrier_count];
+          barrier = {};
+          barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+          barrier.srcAccessMask = src_access;
+          barrier.dstAccessMask = info.access;
+          barrier.oldLayout = old_layout;
+          barrier.newLayout = info.layout;
+          barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+          barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+          barrier.subresourceRange.aspectMask = resource.aspect;
+          barrier.subresourceRange.levelCount = 1;
+          barrier.subresourceRange.layerCount = resource.layer_count;
+          barrier_resources[barrier_count] = r;
+          ++barrier_count;
+          ++stats.image_barriers;
+        }
+
+        s.layout = info.layout;
+
+        if (info.write)
+        {
+          s.write_stages = info.stages;
+          s.write_access = info.access;
+          s.read_stages = 0;
+          s.read_access = 0;
+        }
+        else
+        {
+          s.read_stages |= info.stages;
+          s.read_access |= info.access;
+        }
+      }
+
+      batch.count = barrier_count - batch.first;
+      pass.barriers = batch;
+
+      if (emit && batch.src_stages)
+      {
+        ++stats.barrier_calls;
+      }
+    }
+
+    // Hand the imported images over in the layout the caller asked for.
+    BarrierBatch batch = {};
+    batch.first = barrier_count;
+
+    for (uint32_t r = 0; r < resource_count; ++r)
+    {
+      Resource& resource = resources[r];
+      ResourceState& s = states[r];
+
+      if (!resource.imported || !s.used || (s.layout == resource.final_layout))
+      {
+        continue;
+      }
+
+      batch.src_stages |= s.write_stages | s.read_stages;
+      batch.dst_stages |= VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+      if (emit)
+      {
+        VkImageMemoryBarrier& barrier = barriers[barrier_count];
+        barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = s.write_access;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = s.layout;
+        barrier.newLayout = resource.final_layout;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.subresourceRange.aspectMask = resource.aspect;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.layerCount = resource.layer_count;
+        barrier_resources[barrier_count] = r;
+        ++barrier_count;
+        ++stats.image_barriers;
+      }
+
+      s.layout = resource.final_layout;
+    }
+
+    batch.count = barrier_count - batch.first;
+    final_barriers = batch;
+
+    if (emit && batch.src_stages)
+    {
+      ++stats.barrier_calls;
+    }
+  }
+}
+
+// The stages an imported image is first touched at, which is where a
+// semaphore guarding it (e.g. swapchain acquire) should wait.
+VkPipelineStageFlags RenderGraph::FirstStages(uint32_t resource) const
+{
+  const Resource& r = resources[resource];
+
+  if (r.first_pass == UINT32_MAX)
+  {
+    return VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+  }
+
+  const Pass& pass = passes[r.first_pass];
+
+  for (uint32_t i = 0; i < pass.use_count; ++i)
+  {
+    if (pass.uses[i].resource == resource)
+    {
+      return s_RenderGraphAccessInfo[pass.uses[i].access].stages;
+    }
+  }
+
+  return VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+}
+
+void RenderGraph::Compile(VulkanState& vulkan_state)
+{
+  state = &vulkan_state;
+  Cull();
+
+  for (uint32_t i = 0; i < resource_count; ++i)
+  {
+    Resource& resource = resources[i];
+
+    if (resource.imported || (resource.first_pass == UINT32_MAX))
+    {
+      continue;
+    }
+
+    VkImageCreateInfo image_create_info = {};
+    image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_create_info.imageType = VK_IMAGE_TYPE_2D;
+    image_create_info.format = resource.format;
+    image_create_info.extent.width = resource.extent.width;
+    image_create_info.extent.height = resource.extent.height;
+    image_create_info.extent.depth = 1;
+    image_create_info.mipLevels = 1;
+    image_create_info.arrayLayers = resource.layer_count;
+    image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_create_info.usage = resource.usage;
+    image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VK_CHECK(vkCreateImage(state->device, &image_create_info, &state->callbacks, resource.images));
+    vkGetImageMemoryRequirements(state->device, resource.images[0], &resource.memory_requirements);
+  }
+
+  PlanMemory();
+  PlanBarriers();
+
+  for (uint32_t b = 0; b < block_count; ++b)
+  {
+    VkMemoryAllocateInfo mem_alloc_info = {};
+    mem_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    mem_alloc_info.allocationSize = blocks[b].size;
+    mem_alloc_info.memoryTypeIndex = state->FindMemoryType(blocks[b].memory_type_bits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VK_CHECK(vkAllocateMemory(state->device, &mem_alloc_info, &state->callbacks, &blocks[b].memory));
+  }
+
+  const VkImageUsageFlags attachment_usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+
+  for (uint32_t i = 0; i < resource_count; ++i)
+  {
+    Resource& resource = resources[i];
+    uint32_t view_count = 1;
+
+    if (resource.imported && !resource.views[0] && (resource.usage & attachment_usage))
+    {
+      resource.owns_views = true;
+      view_count = resource.image_count;
+    }
+    else if (resource.block == UINT32_MAX)
+    {
+      continue;
+    }
+    else
+    {
+      VK_CHECK(vkBindImageMemory(state->device, resource.images[0], blocks[resource.block].memory, 0));
+    }
+
+    for (uint32_t v = 0; v < view_count; ++v)
+    {
+      VkImageViewCreateInfo view_info = {};
+      view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+      view_info.image = resource.images[v];
+      view_info.viewType = (resource.layer_count > 1) ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
+      view_info.format = resource.format;
+      view_info.components.r = VK_COMPONENT_SWIZZLE_R;
+      view_info.components.g = VK_COMPONENT_SWIZZLE_G;
+      view_info.components.b = VK_COMPONENT_SWIZZLE_B;
+      view_info.components.a = VK_COMPONENT_SWIZZLE_A;
+      view_info.subresourceRange.aspectMask = resource.aspect;
+      view_info.subresourceRange.levelCount = 1;
+      view_info.subresourceRange.layerCount = resource.layer_count;
+      VK_CHECK(vkCreateImageView(state->device, &view_info, &state->callbacks, resource.views + v));
+    }
+  }
+
+  // The graph does every layout transition with barriers, so attachments
+  // start and end a render pass in the layout they're used in and no
+  // subpass dependencies are needed.
+  for (uint32_t p = 0; p < pass_count; ++p)
+  {
+    Pass& pass = passes[p];
+
+    if (!pass.live || !pass.attachment_count)
+    {
+      continue;
+    }
+
+    VkAttachmentDescription attachments[8] = {};
+    VkAttachmentReference references[8] = {};
+    pass.framebuffer_count = 1;
+
+    for (uint32_t a = 0; a < pass.attachment_count; ++a)
+    {
+      const Resource& resource = resources[pass.attachments[a]];
+      VkImageLayout layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+      for (uint32_t i = 0; i < pass.use_count; ++i)
+      {
+        if (pass.uses[i].resource == pass.attachments[a])
+        {
+          layout = s_RenderGraphAccessInfo[pass.uses[i].access].layout;
+        }
+      }
+
+      attachments[a].format = resource.format;
+      attachments[a].samples = VK_SAMPLE_COUNT_1_BIT;
+      attachments[a].loadOp = pass.load_ops[a];
+      attachments[a].storeOp = pass.store_ops[a];
+      attachments[a].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+      attachments[a].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+      attachments[a].initialLayout = layout;
+      attachments[a].finalLayout = layout;
+      references[a].attachment = a;
+      references[a].layout = layout;
+
+      if ((resource.image_count > 1) && (pass.framebuffer_count > 1) && (resource.image_count != pass.framebuffer_count))
+      {
+        Fail(__FUNCTION__);
+      }
+
+      pass.framebuffer_count = (resource.image_count > pass.framebuffer_count) ? resource.image_count : pass.framebuffer_count;
+    }
+
+    uint32_t color_count = pass.has_depth ? (pass.attachment_count - 1) : pass.attachment_count;
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = color_count;
+    subpass.pColorAttachments = color_count ? references : nullptr;
+    subpass.pDepthStencilAttachment = pass.has_depth ? (references + color_count) : nullptr;
+
+    VkRenderPassCreateInfo rp_info = {};
+    rp_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    rp_info.attachmentCount = pass.attachment_count;
+    rp_info.pAttachments = attachments;
+    rp_info.subpassCount = 1;
+    rp_info.pSubpasses = &subpass;
+
+#ifdef VK_KHR_multiview
+    VkRenderPassMultiviewCreateInfoKHR multiview_info = {};
+    multiview_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_MULTIVIEW_CREATE_INFO_KHR;
+    multiview_info.subpassCount = 1;
+    multiview_info.pViewMasks = &pass.view_mask;
+
+    if (pass.view_mask)
+    {
+      rp_info.pNext = &multiview_info;
+    }
+#endif
+
+    VK_CHECK(vkCreateRenderPass(state->device, &rp_info, &state->callbacks, &pass.render_pass));
+
+    VkImageView framebuffer_attachments[8] = {};
+    VkFramebufferCreateInfo fb_info = {};
+    fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    fb_info.renderPass = pass.render_pass;
+    fb_info.attachmentCount = pass.attachment_count;
+    fb_info.pAttachments = framebuffer_attachments;
+    fb_info.width = resources[pass.attachments[0]].extent.width;
+    fb_info.height = resources[pass.attachments[0]].extent.height;
+    fb_info.layers = 1; // Multiview takes its layers from the view mask.
+
+    for (uint32_t f = 0; f < pass.framebuffer_count; ++f)
+    {
+      for (uint32_t a = 0; a < pass.attachment_count; ++a)
+      {
+        const Resource& resource = resources[pass.attachments[a]];
+        framebuffer_attachments[a] = resource.views[f % resource.image_count];
+      }
+
+      VK_CHECK(vkCreateFramebuffer(state->device, &fb_info, &state->callbacks, pass.framebuffers + f));
+    }
+  }
+}
+
+void RenderGraph::Destroy()
+{
+  for (uint32_t p = 0; p < pass_count; ++p)
+  {
+    Pass& pass = passes[p];
+
+    for (uint32_t f = 0; f < pass.framebuffer_count; ++f)
+    {
+      vkDestroyFramebuffer(state->device, pass.framebuffers[f], &state->callbacks);
+    }
+
+    if (pass.render_pass)
+    {
+      vkDestroyRenderPass(state->device, pass.render_pass, &state->callbacks);
+    }
+  }
+
+  for (uint32_t i = 0; i < resource_count; ++i)
+  {
+    Resource& resource = resources[i];
+
+    if (resource.owns_views)
+    {
+      for (uint32_t v = 0; v < resource.image_count; ++v)
+      {
+        vkDestroyImageView(state->device, resource.views[v], &state->callbacks);
+      }
+    }
+
+    if (resource.imported || !resource.images[0])
+    {
+      continue;
+    }
+
+    if (resource.views[0])
+    {
+      vkDestroyImageView(state->device, resource.views[0], &state->callbacks);
+    }
+
+    vkDestroyImage(state->device, resource.images[0], &state->callbacks);
+  }
+
+  for (uint32_t b = 0; b < block_count; ++b)
+  {
+    vkFreeMemory(state->device, blocks[b].memory, &state->callbacks);
+  }
+}
+
+void RenderGraph::RecordBarriers(VkCommandBuffer cmd, const BarrierBatch& batch) const
+{
+  if (!batch.src_stages)
+  {
+    return;
+  }
+
+  VkImageMemoryBarrier image_barriers[ARRAY_COUNT(barriers)];
+
+  for (uint32_t i = 0; i < batch.count; ++i)
+  {
+    image_barriers[i] = barriers[batch.first + i];
+    image_barriers[i].image = Image(barrier_resources[batch.first + i]);
+  }
+
+  vkCmdPipelineBarrier(cmd, batch.src_stages, batch.dst_stages, 0, 0, nullptr, 0, nullptr, batch.count, image_barriers);
+}
+
+// frame picks which of the imported images (e.g. the swapchain image index)
+// this recording renders to.
+void RenderGraph::Execute(VkCommandBuffer cmd, uint32_t frame)
+{
+  current_frame = frame;
+
+  for (uint32_t p = 0; p < pass_count; ++p)
+  {
+    const Pass& pass = passes[p];
+
+    if (!pass.live)
+    {
+      continue;
+    }
+
+    RecordBarriers(cmd, pass.barriers);
+
+    if (pass.render_pass)
+    {
+      VkClearValue clear_values[8] = {};
+
+      for (uint32_t a = 0; a < pass.attachment_count; ++a)
+      {
+        clear_values[a] = resources[pass.attachments[a]].clear_value;
+      }
+
+      VkRenderPassBeginInfo rp_begin = {};
+      rp_begin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+      rp_begin.renderPass = pass.render_pass;
+      rp_begin.framebuffer = pass.framebuffers[frame % pass.framebuffer_count];
+      rp_begin.renderArea.extent = pass.render_area;
+      rp_begin.clearValueCount = pass.attachment_count;
+      rp_begin.pClearValues = clear_values;
+      vkCmdBeginRenderPass(cmd, &rp_begin, VK_SUBPASS_CONTENTS_INLINE);
+    }
+
+    if (pass.record)
+    {
+      pass.record(cmd, pass.userdata);
+    }
+
+    if (pass.render_pass)
+    {
+      vkCmdEndRenderPass(cmd);
+    }
+  }
+
+  RecordBarriers(cmd, final_barriers);
+}
+
+void RenderGraph::PrintStats() const
+{
+  printf("Render graph: %u passes, %u culled\n", stats.live_passes, stats.culled_passes);
+
+  for (uint32_t p = 0; p < pass_count; ++p)
+  {
+    const Pass& pass = passes[p];
+    printf("  %-16s %s, %u image barriers\n", pass.name, pass.live ? "live" : "culled", pass.live ? pass.barriers.count : 0);
+  }
+
+  printf("  barriers: %u image barriers + %u execution-only dependencies in %u vkCmdPipelineBarrier calls (naive: %u)\n", stats.image_barriers, stats.execution_barriers, stats.barrier_calls, stats.naive_barriers);
+  printf("  transient memory: %.2f MB aliased into %u blocks, %.2f MB without aliasing (%.1f%% saved)\n",
+    stats.aliased_bytes / (1024.0 * 1024.0), block_count, stats.transient_bytes / (1024.0 * 1024.0),
+    stats.transient_bytes ? (100.0 * (stats.transient_bytes - stats.aliased_bytes) / stats.transient_bytes) : 0.0);
+}
+
+// Tests.
+void RenderGraph::TestCullsUnreadPasses()
+{
+  RenderGraph graph;
+  VkExtent2D extent = { 64, 64 };
+  VkImage image = (VkImage)1;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &image, nullptr, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  uint32_t scene = graph.CreateImage("scene", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT);
+  uint32_t debug = graph.CreateImage("debug", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT);
+
+  uint32_t draw = graph.AddPass("draw", nullptr, nullptr);
+  graph.AddUse(draw, scene, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  uint32_t overlay = graph.AddPass("overlay", nullptr, nullptr);
+  graph.AddUse(overlay, scene, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(overlay, debug, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  uint32_t copy = graph.AddPass("copy", nullptr, nullptr);
+  graph.AddUse(copy, scene, RENDER_GRAPH_ACCESS_TRANSFER_SRC);
+  graph.AddUse(copy, output, RENDER_GRAPH_ACCESS_TRANSFER_DST);
+  graph.Cull();
+
+  if (!graph.passes[draw].live || graph.passes[overlay].live || !graph.passes[copy].live)
+  {
+    Fail(__FUNCTION__);
+  }
+
+  FailIfNotExpected(UINT32_MAX, graph.resources[debug].first_pass, __FUNCTION__);
+  FailIfNotExpected(VK_ATTACHMENT_LOAD_OP_CLEAR, graph.passes[draw].load_ops[0], __FUNCTION__);
+  FailIfNotExpected(VK_ATTACHMENT_STORE_OP_STORE, graph.passes[draw].store_ops[0], __FUNCTION__);
+}
+
+void RenderGraph::TestBarriers()
+{
+  RenderGraph graph;
+  VkExtent2D extent = { 64, 64 };
+  VkImage image = (VkImage)1;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &image, nullptr, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+  uint32_t scene = graph.CreateImage("scene", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT);
+  uint32_t depth = graph.CreateImage("depth", VK_FORMAT_D16_UNORM, extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+  uint32_t draw = graph.AddPass("draw", nullptr, nullptr);
+  graph.AddUse(draw, scene, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.AddUse(draw, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+  uint32_t blur = graph.AddPass("blur", nullptr, nullptr);
+  graph.AddUse(blur, scene, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(blur, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  uint32_t sharpen = graph.AddPass("sharpen", nullptr, nullptr);
+  graph.AddUse(sharpen, scene, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(sharpen, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+
+  for (uint32_t i = 0; i < graph.resource_count; ++i)
+  {
+    graph.resources[i].memory_requirements.size = 1024;
+    graph.resources[i].memory_requirements.memoryTypeBits = 1;
+  }
+
+  graph.Cull();
+  graph.PlanMemory();
+  graph.PlanBarriers();
+
+  // Depth is attachment-only and dies with the pass, so it's never stored.
+  FailIfNotExpected(VK_ATTACHMENT_STORE_OP_DONT_CARE, graph.passes[draw].store_ops[1], __FUNCTION__);
+
+  // draw: scene and depth from UNDEFINED.
+  FailIfNotExpected(2u, graph.passes[draw].barriers.count, __FUNCTION__);
+
+  // blur: scene to SHADER_READ_ONLY, output from UNDEFINED, batched together.
+  FailIfNotExpected(2u, graph.passes[blur].barriers.count, __FUNCTION__);
+  FailIfNotExpected(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, graph.barriers[graph.passes[blur].barriers.first].newLayout, __FUNCTION__);
+  FailIfNotExpected((VkAccessFlags)(VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT), graph.barriers[graph.passes[blur].barriers.first].srcAccessMask, __FUNCTION__);
+
+  // sharpen: reading scene again needs nothing, but output is written again.
+  FailIfNotExpected(1u, graph.passes[sharpen].barriers.count, __FUNCTION__);
+  FailIfNotExpected(output, graph.barrier_resources[graph.passes[sharpen].barriers.first], __FUNCTION__);
+
+  // And the output ends up presentable.
+  FailIfNotExpected(1u, graph.final_barriers.count, __FUNCTION__);
+  FailIfNotExpected(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, graph.barriers[graph.final_barriers.first].newLayout, __FUNCTION__);
+  FailIfNotExpected(6u, graph.stats.image_barriers, __FUNCTION__);
+  FailIfNotExpected(4u, graph.stats.barrier_calls, __FUNCTION__);
+}
+
+void RenderGraph::TestAliasing()
+{
+  VkMemoryRequirements requirements[4] = {};
+  requirements[0].size = 100;
+  requirements[0].memoryTypeBits = 3;
+  requirements[1].size = 200;
+  requirements[1].memoryTypeBits = 3;
+  requirements[2].size = 50;
+  requirements[2].memoryTypeBits = 1;
+  requirements[3].size = 300;
+  requirements[3].memoryTypeBits = 2;
+  uint32_t first_pass[4] = { 0, 2, 1, 3 };
+  uint32_t last_pass[4] = { 1, 3, 2, 4 };
+  uint32_t assigned_blocks[4] = {};
+  VkDeviceSize block_sizes[4] = {};
+  uint32_t block_memory_type_bits[4] = {};
+
+  // Largest first: 3 takes a block, 1 overlaps it and needs its own, 0 is
+  // dead before 3 is born so it shares with 3, and 2 overlaps 1 and can't use
+  // 3's memory type.
+  uint32_t block_count = PlanAliasing(4, requirements, first_pass, last_pass, assigned_blocks, block_sizes, block_memory_type_bits);
+  FailIfNotExpected(3u, block_count, __FUNCTION__);
+  FailIfNotExpected(assigned_blocks[3], assigned_blocks[0], __FUNCTION__);
+
+  if ((assigned_blocks[1] == assigned_blocks[3]) || (assigned_blocks[2] == assigned_blocks[1]) || (assigned_blocks[2] == assigned_blocks[3]))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  FailIfNotExpected((VkDeviceSize)300, block_sizes[assigned_blocks[3]], __FUNCTION__);
+  FailIfNotExpected(2u, block_memory_type_bits[assigned_blocks[3]], __FUNCTION__);
+}
+
+// Barriers on layered images cover every layer, and a multiview pass still
+// gets ordinary attachments.
+void RenderGraph::TestLayers()
+{
+  RenderGraph graph;
+  VkExtent2D extent = { 64, 64 };
+  VkImage image = (VkImage)1;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, 6);
+  uint32_t depth = graph.CreateImage("depth", VK_FORMAT_D16_UNORM, extent, VK_IMAGE_ASPECT_DEPTH_BIT, 6);
+  uint32_t draw = graph.AddPass("draw", nullptr, nullptr);
+  graph.AddUse(draw, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.AddUse(draw, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+  graph.SetViewMask(draw, 0x3f);
+  graph.resources[depth].memory_requirements.size = 1024;
+  graph.resources[depth].memory_requirements.memoryTypeBits = 1;
+
+  graph.Cull();
+  graph.PlanMemory();
+  graph.PlanBarriers();
+
+  FailIfNotExpected(2u, graph.passes[draw].barriers.count, __FUNCTION__);
+  FailIfNotExpected(6u, graph.barriers[graph.passes[draw].barriers.first].subresourceRange.layerCount, __FUNCTION__);
+  FailIfNotExpected(6u, graph.barriers[graph.passes[draw].barriers.first + 1].subresourceRange.layerCount, __FUNCTION__);
+  FailIfNotExpected(2u, graph.passes[draw].attachment_count, __FUNCTION__);
+  FailIfNotExpected(0x3fu, graph.passes[draw].view_mask, __FUNCTION__);
+}
+
+void RenderGraph::RunAllTests()
+{
+  TestCullsUnreadPasses();
+  TestBarriers();
+  TestAliasing();
+  TestLayers();
+}
+
+struct CopyPass
+{
+  RenderGraph* graph;
+  uint32_t src;
+  uint32_t dst;
+  VkExtent2D extent;
+};
+
+static void RecordCopyPass(VkCommandBuffer cmd, void* userdata)
+{
+  const CopyPass& pass = *(const CopyPass*)userdata;
+  VkImageCopy region = {};
+  region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.srcSubresource.layerCount = 1;
+  region.dstSubresource = region.srcSubresource;
+  region.extent.width = pass.extent.width;
+  region.extent.height = pass.extent.height;
+  region.extent.depth = 1;
+  vkCmdCopyImage(cmd, pass.graph->Image(pass.src), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, pass.graph->Image(pass.dst), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+}
+
+// A deferred-style frame: shadows, G-buffer, lighting, a bloom chain,
+// composite and a copy out, plus a debug view nobody reads.  The raster
+// passes only clear, which is enough to exercise the barriers and aliasing.
+void RunRenderGraphBench(VulkanState& state, const Options& options)
+{
+  const int frames = 200;
+  VkExtent2D extent = { (uint32_t)options.width, (uint32_t)options.height };
+  VkExtent2D half_extent = { extent.width / 2, extent.height / 2 };
+  VkExtent2D quarter_extent = { extent.width / 4, extent.height / 4 };
+  VkExtent2D shadow_extent = { 2048, 2048 };
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage output_image = VK_NULL_HANDLE;
+  VkDeviceMemory output_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &output_image, &output_memory);
+
+  RenderGraph graph;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &output_image, nullptr, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  uint32_t shadow_map = graph.CreateImage("shadow_map", VK_FORMAT_D16_UNORM, shadow_extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+  uint32_t depth = graph.CreateImage("depth", VK_FORMAT_D16_UNORM, extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+  uint32_t albedo = graph.CreateImage("albedo", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT);
+  uint32_t normals = graph.CreateImage("normals", VK_FORMAT_R16G16B16A16_SFLOAT, extent, VK_IMAGE_ASPECT_COLOR_BIT);
+  uint32_t hdr = graph.CreateImage("hdr", VK_FORMAT_R16G16B16A16_SFLOAT, extent, VK_IMAGE_ASPECT_COLOR_BIT);
+  uint32_t bloom_half = graph.CreateImage("bloom_half", VK_FORMAT_R16G16B16A16_SFLOAT, half_extent, VK_IMAGE_ASPECT_COLOR_BIT);
+  uint32_t bloom_quarter = graph.CreateImage("bloom_quarter", VK_FORMAT_R16G16B16A16_SFLOAT, quarter_extent, VK_IMAGE_ASPECT_COLOR_BIT);
+  uint32_t ldr = graph.CreateImage("ldr", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT);
+  uint32_t debug = graph.CreateImage("debug", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT);
+
+  uint32_t pass = graph.AddPass("shadows", nullptr, nullptr);
+  graph.AddUse(pass, shadow_map, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+
+  pass = graph.AddPass("gbuffer", nullptr, nullptr);
+  graph.AddUse(pass, albedo, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.AddUse(pass, normals, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.AddUse(pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+
+  pass = graph.AddPass("lighting", nullptr, nullptr);
+  graph.AddUse(pass, albedo, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(pass, normals, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(pass, depth, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(pass, shadow_map, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(pass, hdr, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+
+  pass = graph.AddPass("debug_view", nullptr, nullptr);
+  graph.AddUse(pass, depth, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(pass, debug, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+
+  pass = graph.AddPass("bloom_down", nullptr, nullptr);
+  graph.AddUse(pass, hdr, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(pass, bloom_half, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+
+  pass = graph.AddPass("bloom_blur", nullptr, nullptr);
+  graph.AddUse(pass, bloom_half, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(pass, bloom_quarter, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+
+  pass = graph.AddPass("composite", nullptr, nullptr);
+  graph.AddUse(pass, hdr, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(pass, bloom_quarter, RENDER_GRAPH_ACCESS_SAMPLED);
+  graph.AddUse(pass, ldr, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+
+  CopyPass copy_pass = { &graph, ldr, output, extent };
+  pass = graph.AddPass("copy_out", RecordCopyPass, &copy_pass);
+  graph.AddUse(pass, ldr, RENDER_GRAPH_ACCESS_TRANSFER_SRC);
+  graph.AddUse(pass, output, RENDER_GRAPH_ACCESS_TRANSFER_DST);
+
+  graph.Compile(state);
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+  // Recorded once and resubmitted, like the swapchain command buffers.
+  VkCommandBufferBeginInfo cmd_buf_info = {};
+  cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+  graph.Execute(cmd, 0);
+  VK_CHECK(vkEndCommandBuffer(cmd));
+
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &cmd;
+
+  double start_ms = GetTimeMs();
+
+  for (int i = 0; i < frames; ++i)
+  {
+    VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+    VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+    VK_CHECK(vkResetFences(state.device, 1, &fence));
+  }
+
+  double frame_ms = (GetTimeMs() - start_ms) / frames;
+
+  graph.PrintStats();
+  printf("  %ux%u, %.3f ms per frame over %d frames\n", extent.width, extent.height, frame_ms, frames);
+
+  vkDestroyFence(state.device, fence, &state.callbacks);
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+  graph.Destroy();
+  vkDestroyImage(state.device, output_image, &state.callbacks);
+  vkFreeMemory(state.device, output_memory, &state.callbacks);
+}
+
+// Hands independent frames to whichever device should finish one soonest,
+// going by a running average of how long each device takes per frame.
+struct LoadBalancer
+{
+  uint32_t device_count = 0;
+  uint32_t max_in_flight = 2;
+  double average_ms[8] = {};
+  uint32_t in_flight[8] = {};
+  uint32_t completed[8] = {};
+
+  void Init(uint32_t count, uint32_t in_flight_limit)
+  {
+    *this = LoadBalancer();
+    device_count = count;
+    max_in_flight = in_flight_limit;
+  }
+
+  // Returns UINT32_MAX when every device is at its in-flight limit.
+  uint32_t Pick() const
+  {
+    uint32_t best = UINT32_MAX;
+    double best_finish_ms = 0.0;
+
+    for (uint32_t i = 0; i < device_count; ++i)
+    {
+      if (in_flight[i] >= max_in_flight)
+      {
+        continue;
+      }
+
+      // Devices that haven't finished a frame yet look free, so each one
+      // gets timed before the averages are trusted.
+      double finish_ms = (in_flight[i] + 1) * (completed[i] ? average_ms[i] : 0.0);
+
+      if ((best == UINT32_MAX) || (finish_ms < best_finish_ms) || ((finish_ms == best_finish_ms) && (in_flight[i] < in_flight[best])))
+      {
+        best = i;
+        best_finish_ms = finish_ms;
+      }
+    }
+
+    return best;
+  }
+
+  void Submitted(uint32_t device)
+  {
+    ++in_flight[device];
+  }
+
+  void Completed(uint32_t device, double frame_ms)
+  {
+    --in_flight[device];
+    average_ms[device] = completed[device] ? ((average_ms[device] * 0.8) + (frame_ms * 0.2)) : frame_ms;
+    ++completed[device];
+  }
+
+  // Tests.
+  static void TestPrefersFasterDevice()
+  {
+    LoadBalancer balancer;
+    balancer.Init(2, 4);
+    balancer.Submitted(0);
+    balancer.Submitted(1);
+    balancer.Completed(0, 10.0);
+    balancer.Completed(1, 30.0);
+
+    // Device 0 can finish two frames by the time device 1 finishes one.
+    const uint32_t expected[3] = { 0, 0, 1 };
+
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+      uint32_t device = balancer.Pick();
+      FailIfNotExpected(expected[i], device, __FUNCTION__);
+      balancer.Submitted(device);
+    }
+  }
+
+  static void TestRespectsInFlightLimit()
+  {
+    LoadBalancer balancer;
+    balancer.Init(2, 1);
+    FailIfNotExpected(0u, balancer.Pick(), __FUNCTION__);
+    balancer.Submitted(0);
+    FailIfNotExpected(1u, balancer.Pick(), __FUNCTION__);
+    balancer.Submitted(1);
+    FailIfNotExpected(UINT32_MAX, balancer.Pick(), __FUNCTION__);
+  }
+
+  static void RunAllTests()
+  {
+    TestPrefersFasterDevice();
+    TestRespectsInFlightLimit();
+  }
+};
+
+// One device's share of the multi-device benchmark: a render target and a
+// command buffer per frame slot, each of which clears the target a number of
+// times as a stand-in for rendering an independent frame.
+struct DeviceWorker
+{
+  VulkanState* state = nullptr;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VkCommandBuffer cmds[2] = {};
+  VkFence fences[2] = {};
+  bool busy[2] = {};
+  double submit_ms[2] = {};
+  double last_complete_ms = 0.0;
+  VkImage image = VK_NULL_HANDLE;
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+
+  void Create(VulkanState& vulkan_state, VkExtent2D extent, uint32_t clear_count);
+  void Destroy();
+};
+
+void DeviceWorker::Create(VulkanState& vulkan_state, VkExtent2D extent, uint32_t clear_count)
+{
+  state = &vulkan_state;
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  state->CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &image, &memory);
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state->queue_family_index;
+  VK_CHECK(vkCreateCommandPool(state->device, &cmd_pool_info, &state->callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = ARRAY_COUNT(cmds);
+  VK_CHECK(vkAllocateCommandBuffers(state->device, &cmd_buffer_alloc_info, cmds));
+
+  VkImageSubresourceRange range = {};
+  range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  range.levelCount = 1;
+  range.layerCount = 1;
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(cmds); ++i)
+  {
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK(vkCreateFence(state->device, &fence_create_info, &state->callbacks, fences + i));
+
+    VkCommandBufferBeginInfo cmd_buf_info = {};
+    cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    VK_CHECK(vkBeginCommandBuffer(cmds[i], &cmd_buf_info));
+
+    // Both slots write the same image, so order them against each other.
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange = range;
+    vkCmdPipelineBarrier(cmds[i], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    VkClearColorValue clear_color = {};
+    clear_color.float32[3] = 1.0f;
+
+    for (uint32_t c = 0; c < clear_count; ++c)
+    {
+      clear_color.float32[0] = (float)c / clear_count;
+      vkCmdClearColorImage(cmds[i], image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clear_color, 1, &range);
+    }
+
+    VK_CHECK(vkEndCommandBuffer(cmds[i]));
+  }
+}
+
+void DeviceWorker::Destroy()
+{
+  for (uint32_t i = 0; i < ARRAY_COUNT(cmds); ++i)
+  {
+    if (busy[i])
+    {
+      VK_CHECK(vkWaitForFences(state->device, 1, fences + i, VK_TRUE, UINT64_MAX));
+    }
+
+    vkDestroyFence(state->device, fences[i], &state->callbacks);
+  }
+
+  vkDestroyCommandPool(state->device, cmd_pool, &state->callbacks);
+  vkDestroyImage(state->device, image, &state->callbacks);
+  vkFreeMemory(state->device, memory, &state->callbacks);
+}
+
+// Renders frames on whichever worker the balancer picks until frame_count
+// have finished, returning the wall time.
+double RunDeviceFrames(DeviceWorker* workers, uint32_t worker_count, uint32_t frame_count, LoadBalancer& balancer)
+{
+  balancer.Init(worker_count, ARRAY_COUNT(workers[0].cmds));
+  uint32_t submitted = 0;
+  uint32_t completed = 0;
+  double start_ms = GetTimeMs();
+
+  while (completed < frame_count)
+  {
+    for (uint32_t d = 0; d < worker_count; ++d)
+    {
+      DeviceWorker& worker = workers[d];
+
+      for (uint32_t slot = 0; slot < ARRAY_COUNT(worker.cmds); ++slot)
+      {
+        if (!worker.busy[slot] || (vkGetFenceStatus(worker.state->device, worker.fences[slot]) != VK_SUCCESS))
+        {
+          continue;
+        }
+
+        // Time the device spent on this frame, not the time it sat queued
+        // behind the other slot.
+        double now_ms = GetTimeMs();
+        double began_ms = (worker.submit_ms[slot] > worker.last_complete_ms) ? worker.submit_ms[slot] : worker.last_complete_ms;
+        balancer.Completed(d, now_ms - began_ms);
+        worker.last_complete_ms = now_ms;
+        worker.busy[slot] = false;
+        VK_CHECK(vkResetFences(worker.state->device, 1, worker.fences + slot));
+        ++completed;
+      }
+    }
+
+    uint32_t d = (submitted < frame_count) ? balancer.Pick() : UINT32_MAX;
+
+    if (d == UINT32_MAX)
+    {
+      YieldProcessor();
+      continue;
+    }
+
+    DeviceWorker& worker = workers[d];
+    uint32_t slot = worker.busy[0] ? 1 : 0;
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = worker.cmds + slot;
+    worker.submit_ms[slot] = GetTimeMs();
+    VK_CHECK(vkQueueSubmit(worker.state->queue, 1, &submit_info, worker.fences[slot]));
+    worker.busy[slot] = true;
+    balancer.Submitted(d);
+    ++submitted;
+  }
+
+  return GetTimeMs() - start_ms;
+}
+
+// Creates a logical device on every suitable physical device, or --devices of
+// them spread round-robin across the suitable ones so two logical devices on
+// a single (e.g. software) ICD also work, and compares the throughput of all
+// of them against the primary device alone.
+void RunMultiDeviceBench(VulkanState& state, const Options& options)
+{
+  const uint32_t frame_count = 240;
+  const uint32_t clear_count = 16;
+  VkExtent2D extent = { (uint32_t)options.width, (uint32_t)options.height };
+
+  uint32_t suitable[ARRAY_COUNT(state.physical_devices)] = {};
+  uint32_t suitable_count = 0;
+  uint32_t primary = 0;
+
+  for (uint32_t i = 0; i < state.num_physical_devices; ++i)
+  {
+    if (state.physical_device_scores[i])
+    {
+      primary = (i == state.physical_device_index) ? suitable_count : primary;
+      suitable[suitable_count++] = i;
+    }
+  }
+
+  uint32_t device_count = options.device_count ? (uint32_t)options.device_count : suitable_count;
+  device_count = (device_count > 8) ? 8 : ((device_count < 1) ? 1 : device_count);
+
+  // The primary device is the one everything else runs on; the others share
+  // its instance but own their devices.
+  VulkanState secondaries[8] = {};
+  VulkanState* devices[8] = { &state };
+  DeviceWorker workers[8];
+
+  for (uint32_t d = 1; d < device_count; ++d)
+  {
+    devices[d] = secondaries + d;
+    devices[d]->ShareInstance(state);
+    devices[d]->CreateDevice(suitable[(primary + d) % suitable_count]);
+  }
+
+  for (uint32_t d = 0; d < device_count; ++d)
+  {
+    workers[d].Create(*devices[d], extent, clear_count);
+  }
+
+  LoadBalancer balancer;
+  double single_ms = RunDeviceFrames(workers, 1, frame_count, balancer);
+  double multi_ms = RunDeviceFrames(workers, device_count, frame_count, balancer);
+
+  printf("Multi-device: %u frames of %u %ux%u clears\n", frame_count, clear_count, extent.width, extent.height);
+  printf("  primary alone: %.1f ms (%.1f frames/s)\n", single_ms, frame_count * 1000.0 / single_ms);
+  printf("  %u devices:     %.1f ms (%.1f frames/s, %.2fx)\n", device_count, multi_ms, frame_count * 1000.0 / multi_ms, single_ms / multi_ms);
+
+  for (uint32_t d = 0; d < device_count; ++d)
+  {
+    printf("  device %u (physical %u, %s): %u frames, %.3f ms average\n", d, devices[d]->physical_device_index, devices[d]->physical_device_properties.deviceName, balancer.completed[d], balancer.average_ms[d]);
+  }
+
+  for (uint32_t d = 0; d < device_count; ++d)
+  {
+    workers[d].Destroy();
+  }
+
+  for (uint32_t d = 1; d < device_count; ++d)
+  {
+    vkDestroyDevice(devices[d]->device, &devices[d]->callbacks);
+  }
+}
+
+// One resource bound to a descriptor set.  Buffer types use buffer, image and
+// sampler types use image.
+struct DescriptorBinding
+{
+  uint32_t binding;
+  VkDescriptorType type;
+  VkDescriptorBufferInfo buffer;
+  VkDescriptorImageInfo image;
+};
+
+static bool IsBufferDescriptor(VkDescriptorType type)
+{
+  return (type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) || (type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER) ||
+    (type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC) || (type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC);
+}
+
+// Everything that decides a descriptor set's contents.  It's hashed and
+// compared as raw bytes, so Set() clears the padding first.
+struct DescriptorSetKey
+{
+  VkDescriptorSetLayout layout;
+  uint32_t binding_count;
+  DescriptorBinding bindings[4];
+
+  void Set(VkDescriptorSetLayout set_layout, const DescriptorBinding* set_bindings, uint32_t count)
+  {
+    if (count > ARRAY_COUNT(bindings))
+    {
+      Fail(__FUNCTION__);
+    }
+
+    memset(this, 0, sizeof(*this));
+    layout = set_layout;
+    binding_count = count;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      bindings[i].binding = set_bindings[i].binding;
+      bindings[i].type = set_bindings[i].type;
+
+      if (IsBufferDescriptor(set_bindings[i].type))
+      {
+        bindings[i].buffer = set_bindings[i].buffer;
+      }
+      else
+      {
+        bindings[i].image.sampler = set_bindings[i].image.sampler;
+        bindings[i].image.imageView = set_bindings[i].image.imageView;
+        bindings[i].image.imageLayout = set_bindings[i].image.imageLayout;
+      }
+    }
+  }
+};
+
+// Maps descriptor set contents to an already written set, open addressed
+// with linear probing.  A hash of 0 marks an empty slot.
+struct DescriptorCache
+{
+  struct Entry
+  {
+    uint64_t hash;
+    DescriptorSetKey key;
+    VkDescriptorSet set;
+  };
+
+  Entry* entries = nullptr;
+  uint32_t capacity = 0; // Power of two.
+  uint32_t count = 0;
+
+  void Create(uint32_t entry_capacity)
+  {
+    capacity = entry_capacity;
+    entries = (Entry*)Alloc(sizeof(Entry) * capacity, 16);
+    Clear();
+  }
+
+  void Destroy()
+  {
+    Free(entries);
+    entries = nullptr;
+    capacity = 0;
+    count = 0;
+  }
+
+  void Clear()
+  {
+    memset(entries, 0, sizeof(Entry) * capacity);
+    count = 0;
+  }
+
+  // FNV-1a.
+  static uint64_t Hash(const DescriptorSetKey& key)
+  {
+    const uint8_t* bytes = (const uint8_t*)&key;
+    size_t size = offsetof(DescriptorSetKey, bindings) + (sizeof(DescriptorBinding) * key.binding_count);
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+
+    return hash ? hash : 1;
+  }
+
+  bool Find(const DescriptorSetKey& key, uint64_t hash, VkDescriptorSet* set) const
+  {
+    uint32_t mask = capacity - 1;
+
+    for (uint32_t i = (uint32_t)hash & mask; entries[i].hash; i = (i + 1) & mask)
+    {
+      if ((entries[i].hash == hash) && !memcmp(&entries[i].key, &key, sizeof(key)))
+      {
+        *set = entries[i].set;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Doubles the table once it's three quarters full, so every set is cached.
+  void Insert(const DescriptorSetKey& key, uint64_t hash, VkDescriptorSet set)
+  {
+    if ((count + 1) * 4 > capacity * 3)
+    {
+      Grow();
+    }
+
+    uint32_t mask = capacity - 1;
+    uint32_t i = (uint32_t)hash & mask;
+
+    while (entries[i].hash)
+    {
+      i = (i + 1) & mask;
+    }
+
+    entries[i].hash = hash;
+    entries[i].key = key;
+    entries[i].set = set;
+    ++count;
+  }
+
+  void Grow()
+  {
+    Entry* old_entries = entries;
+    uint32_t old_capacity = capacity;
+    Create(capacity * 2);
+
+    for (uint32_t i = 0; i < old_capacity; ++i)
+    {
+      if (old_entries[i].hash)
+      {
+        Insert(old_entries[i].key, old_entries[i].hash, old_entries[i].set);
+      }
+    }
+
+    Free(old_entries);
+  }
+
+  // Tests.
+  static DescriptorSetKey TestKey(VkBuffer buffer, VkDeviceSize offset)
+  {
+    DescriptorBinding binding = {};
+    binding.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    binding.buffer.buffer = buffer;
+    binding.buffer.offset = offset;
+    binding.buffer.range = 256;
+    binding.image.imageLayout = VK_IMAGE_LAYOUT_GENERAL; // Ignored for buffers.
+
+    DescriptorSetKey key;
+    key.Set(VK_NULL_HANDLE, &binding, 1);
+    return key;
+  }
+
+  static void TestFindsInsertedSets()
+  {
+    DescriptorCache cache;
+    cache.Create(16);
+    VkBuffer buffer = (VkBuffer)(uintptr_t)0x100;
+    VkDescriptorSet set = VK_NULL_HANDLE;
+
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+      DescriptorSetKey key = TestKey(buffer, i * 256);
+      FailIfNotExpected(false, cache.Find(key, Hash(key), &set), __FUNCTION__);
+      cache.Insert(key, Hash(key), (VkDescriptorSet)(uintptr_t)(i + 1));
+    }
+
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+      DescriptorSetKey key = TestKey(buffer, i * 256);
+      FailIfNotExpected(true, cache.Find(key, Hash(key), &set), __FUNCTION__);
+      FailIfNotExpected((VkDescriptorSet)(uintptr_t)(i + 1), set, __FUNCTION__);
+    }
+
+    DescriptorSetKey other = TestKey((VkBuffer)(uintptr_t)0x200, 0);
+    FailIfNotExpected(false, cache.Find(other, Hash(other), &set), __FUNCTION__);
+    cache.Destroy();
+  }
+
+  static void TestGrowsWhenFull()
+  {
+    DescriptorCache cache;
+    cache.Create(8);
+    VkDescriptorSet set = VK_NULL_HANDLE;
+
+    for (uint32_t i = 0; i < 32; ++i)
+    {
+      DescriptorSetKey key = TestKey((VkBuffer)(uintptr_t)0x100, i * 256);
+      cache.Insert(key, Hash(key), (VkDescriptorSet)(uintptr_t)(i + 1));
+    }
+
+    FailIfNotExpected(64u, cache.capacity, __FUNCTION__);
+    FailIfNotExpected(32u, cache.count, __FUNCTION__);
+
+    for (uint32_t i = 0; i < 32; ++i)
+    {
+      DescriptorSetKey key = TestKey((VkBuffer)(uintptr_t)0x100, i * 256);
+      FailIfNotExpected(true, cache.Find(key, Hash(key), &set), __FUNCTION__);
+      FailIfNotExpected((VkDescriptorSet)(uintptr_t)(i + 1), set, __FUNCTION__);
+    }
+
+    // Clearing keeps the grown table.
+    cache.Clear();
+    DescriptorSetKey key = TestKey((VkBuffer)(uintptr_t)0x100, 0);
+    FailIfNotExpected(false, cache.Find(key, Hash(key), &set), __FUNCTION__);
+    FailIfNotExpected(64u, cache.capacity, __FUNCTION__);
+    cache.Destroy();
+  }
+
+  static void RunAllTests()
+  {
+    TestFindsInsertedSets();
+    TestGrowsWhenFull();
+  }
+};
+
+// Relative number of descriptors of each type per set in a pool.
+struct DescriptorPoolRatio
+{
+  VkDescriptorType type;
+  float per_set;
+};
+
+static const DescriptorPoolRatio s_DescriptorPoolRatios[] =
+{
+  { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2.0f },
+  { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2.0f },
+  { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1.0f },
+  { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4.0f },
+  { VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 1.0f },
+  { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1.0f },
+  { VK_DESCRIPTOR_TYPE_SAMPLER, 0.5f },
+};
+
+// Hands out descriptor sets from a growing list of pools per frame in flight.
+// BeginFrame() resets a frame's pools in one call instead of freeing sets one
+// by one, and Get() returns the same set for the same contents within a
+// frame so identical draws skip vkUpdateDescriptorSets.
+struct DescriptorAllocator
+{
+  struct Frame
+  {
+    VkDescriptorPool pools[16];
+    uint32_t pool_count;
+    uint32_t current;
+    DescriptorCache cache;
+  };
+
+  struct Stats
+  {
+    uint32_t allocations;
+    uint32_t writes;
+    uint32_t cache_hits;
+    uint32_t pools_created;
+  };
+
+  VulkanState* state = nullptr;
+  Frame frames[4] = {};
+  uint32_t frame_count = 0;
+  uint32_t frame = 0;
+  uint32_t next_pool_sets = 256;
+  Stats stats = {};
+
+  void Create(VulkanState& vulkan_state, uint32_t frames_in_flight);
+  void Destroy();
+  void BeginFrame(uint32_t frame_index);
+  VkDescriptorPool CreatePool(uint32_t max_sets);
+  VkDescriptorSet Allocate(VkDescriptorSetLayout layout);
+  void Write(VkDescriptorSet set, const DescriptorSetKey& key);
+  VkDescriptorSet Get(VkDescriptorSetLayout layout, const DescriptorBinding* bindings, uint32_t count);
+  void PrintStats() const;
+};
+
+void DescriptorAllocator::Create(VulkanState& vulkan_state, uint32_t frames_in_flight)
+{
+  state = &vulkan_state;
+  frame_count = (frames_in_flight > ARRAY_COUNT(frames)) ? ARRAY_COUNT(frames) : frames_in_flight;
+
+  for (uint32_t i = 0; i < frame_count; ++i)
+  {
+    frames[i].cache.Create(512);
+  }
+}
+
+void DescriptorAllocator::Destroy()
+{
+  for (uint32_t i = 0; i < frame_count; ++i)
+  {
+    for (uint32_t p = 0; p < frames[i].pool_count; ++p)
+    {
+      vkDestroyDescriptorPool(state->device, frames[i].pools[p], &state->callbacks);
+    }
+
+    frames[i].cache.Destroy();
+    frames[i].pool_count = 0;
+  }
+}
+
+// The frame's previous submission must have completed.
+void DescriptorAllocator::BeginFrame(uint32_t frame_index)
+{
+  frame = frame_index % frame_count;
+  Frame& f = frames[frame];
+
+  for (uint32_t p = 0; p < f.pool_count; ++p)
+  {
+    VK_CHECK(vkResetDescriptorPool(state->device, f.pools[p], 0));
+  }
+
+  f.current = 0;
+  f.cache.Clear();
+}
+
+VkDescriptorPool DescriptorAllocator::CreatePool(uint32_t max_sets)
+{
+  VkDescriptorPoolSize pool_sizes[ARRAY_COUNT(s_DescriptorPoolRatios)] = {};
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(s_DescriptorPoolRatios); ++i)
+  {
+    pool_sizes[i].type = s_DescriptorPoolRatios[i].type;
+    pool_sizes[i].descriptorCount = (uint32_t)(s_DescriptorPoolRatios[i].per_set * max_sets);
+  }
+
+  VkDescriptorPoolCreateInfo descriptor_pool = {};
+  descriptor_pool.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  descriptor_pool.maxSets = max_sets;
+  descriptor_pool.poolSizeCount = ARRAY_COUNT(pool_sizes);
+  descriptor_pool.pPoolSizes = pool_sizes;
+  VkDescriptorPool pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateDescriptorPool(state->device, &descriptor_pool, &state->callbacks, &pool));
+  ++stats.pools_created;
+  return pool;
+}
+
+VkDescriptorSet DescriptorAllocator::Allocate(VkDescriptorSetLayout layout)
+{
+  Frame& f = frames[frame];
+
+  if (!f.pool_count)
+  {
+    f.pools[f.pool_count++] = CreatePool(next_pool_sets);
+  }
+
+  VkDescriptorSetAllocateInfo desc_alloc_info = {};
+  desc_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  desc_alloc_info.descriptorPool = f.pools[f.current];
+  desc_alloc_info.descriptorSetCount = 1;
+  desc_alloc_info.pSetLayouts = &layout;
+  VkDescriptorSet set = VK_NULL_HANDLE;
+
+  // Any failure here means the pool is full (out of pool memory, or
+  // fragmented on older drivers), so move on to the next one, growing the
+  // list with bigger pools as needed.
+  if (vkAllocateDescriptorSets(state->device, &desc_alloc_info, &set) != VK_SUCCESS)
+  {
+    if (++f.current == f.pool_count)
+    {
+      if (f.pool_count == ARRAY_COUNT(f.pools))
+      {
+        Fail(__FUNCTION__);
+      }
+
+      next_pool_sets = (next_pool_sets < 4096) ? (next_pool_sets * 2) : next_pool_sets;
+      f.pools[f.pool_count++] = CreatePool(next_pool_sets);
+    }
+
+    desc_alloc_info.descriptorPool = f.pools[f.current];
+    VK_CHECK(vkAllocateDescriptorSets(state->device, &desc_alloc_info, &set));
+  }
+
+  ++stats.allocations;
+  return set;
+}
+
+void DescriptorAllocator::Write(VkDescriptorSet set, const DescriptorSetKey& key)
+{
+  VkWriteDescriptorSet writes[ARRAY_COUNT(key.bindings)] = {};
+
+  for (uint32_t i = 0; i < key.binding_count; ++i)
+  {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = set;
+    writes[i].dstBinding = key.bindings[i].binding;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = key.bindings[i].type;
+
+    if (IsBufferDescriptor(key.bindings[i].type))
+    {
+      writes[i].pBufferInfo = &key.bindings[i].buffer;
+    }
+    else
+    {
+      writes[i].pImageInfo = &key.bindings[i].image;
+    }
+  }
+
+  vkUpdateDescriptorSets(state->device, key.binding_count, writes, 0, nullptr);
+  ++stats.writes;
+}
+
+VkDescriptorSet DescriptorAllocator::Get(VkDescriptorSetLayout layout, const DescriptorBinding* bindings, uint32_t count)
+{
+  DescriptorSetKey key;
+  key.Set(layout, bindings, count);
+  uint64_t hash = DescriptorCache::Hash(key);
+  VkDescriptorSet set = VK_NULL_HANDLE;
+
+  if (frames[frame].cache.Find(key, hash, &set))
+  {
+    ++stats.cache_hits;
+    return set;
+  }
+
+  set = Allocate(layout);
+  Write(set, key);
+  frames[frame].cache.Insert(key, hash, set);
+  return set;
+}
+
+void DescriptorAllocator::PrintStats() const
+{
+  printf("  descriptor sets allocated: %u, written: %u, cache hits: %u, pools created: %u\n", stats.allocations, stats.writes, stats.cache_hits, stats.pools_created);
+}
+
+// A single descriptor set holding a large update-after-bind array of storage
+// buffers.  It's bound once and draws pick their element by index (a push
+// constant), so binding cost no longer scales with the number of draws.
+// Needs VK_EXT_descriptor_indexing; Create() returns false without it.
+struct BindlessTable
+{
+  VulkanState* state = nullptr;
+  VkDescriptorSetLayout layout = VK_NULL_HANDLE;
+  VkDescriptorPool pool = VK_NULL_HANDLE;
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  uint32_t capacity = 0;
+  uint32_t count = 0;
+
+  bool Create(VulkanState& vulkan_state, uint32_t max_buffers, VkShaderStageFlags stages);
+  void Destroy();
+  uint32_t Add(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range);
+};
+
+bool BindlessTable::Create(VulkanState& vulkan_state, uint32_t max_buffers, VkShaderStageFlags stages)
+{
+  state = &vulkan_state;
+
+  if (!state->descriptor_indexing)
+  {
+    return false;
+  }
+
+#ifdef VK_EXT_descriptor_indexing
+  const VkPhysicalDeviceDescriptorIndexingPropertiesEXT& limits = state->descriptor_indexing_properties;
+  capacity = max_buffers;
+  capacity = (capacity > limits.maxDescriptorSetUpdateAfterBindStorageBuffers) ? limits.maxDescriptorSetUpdateAfterBindStorageBuffers : capacity;
+  capacity = (capacity > limits.maxPerStageDescriptorUpdateAfterBindStorageBuffers) ? limits.maxPerStageDescriptorUpdateAfterBindStorageBuffers : capacity;
+  count = 0;
+
+  VkDescriptorSetLayoutBinding layout_binding = {};
+  layout_binding.binding = 0;
+  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  layout_binding.descriptorCount = capacity;
+  layout_binding.stageFlags = stages;
+
+  // Elements can be written while the set is bound, and elements no draw
+  // reads don't need to be valid.
+  VkDescriptorBindingFlagsEXT binding_flags = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+  VkDescriptorSetLayoutBindingFlagsCreateInfoEXT binding_flags_info = {};
+  binding_flags_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+  binding_flags_info.bindingCount = 1;
+  binding_flags_info.pBindingFlags = &binding_flags;
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.pNext = &binding_flags_info;
+  descriptor_layout.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+  descriptor_layout.bindingCount = 1;
+  descriptor_layout.pBindings = &layout_binding;
+  VK_CHECK(vkCreateDescriptorSetLayout(state->device, &descriptor_layout, &state->callbacks, &layout));
+
+  VkDescriptorPoolSize type_count = {};
+  type_count.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  type_count.descriptorCount = capacity;
+
+  VkDescriptorPoolCreateInfo descriptor_pool = {};
+  descriptor_pool.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  descriptor_pool.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+  descriptor_pool.maxSets = 1;
+  descriptor_pool.poolSizeCount = 1;
+  descriptor_pool.pPoolSizes = &type_count;
+  VK_CHECK(vkCreateDescriptorPool(state->device, &descriptor_pool, &state->callbacks, &pool));
+
+  VkDescriptorSetAllocateInfo desc_alloc_info = {};
+  desc_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  desc_alloc_info.descriptorPool = pool;
+  desc_alloc_info.descriptorSetCount = 1;
+  desc_alloc_info.pSetLayouts = &layout;
+  VK_CHECK(vkAllocateDescriptorSets(state->device, &desc_alloc_info, &set));
+  return true;
+#else
+  return false;
+#endif
+}
+
+void BindlessTable::Destroy()
+{
+  if (layout)
+  {
+    vkDestroyDescriptorPool(state->device, pool, &state->callbacks);
+    vkDestroyDescriptorSetLayout(state->device, layout, &state->callbacks);
+    layout = VK_NULL_HANDLE;
+  }
+}
+
+// Returns the index shaders use to reach the buffer range.
+uint32_t BindlessTable::Add(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+{
+  if (count == capacity)
+  {
+    Fail(__FUNCTION__);
+  }
+
+  VkDescriptorBufferInfo buffer_info = {};
+  buffer_info.buffer = buffer;
+  buffer_info.offset = offset;
+  buffer_info.range = range;
+
+  VkWriteDescriptorSet writes = {};
+  writes.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes.dstSet = set;
+  writes.dstBinding = 0;
+  writes.dstArrayElement = count;
+  writes.descriptorCount = 1;
+  writes.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  writes.pBufferInfo = &buffer_info;
+  vkUpdateDescriptorSets(state->device, 1, &writes, 0, nullptr);
+  return count++;
+}
+
+enum DescriptorBenchMode
+{
+  DESCRIPTOR_BENCH_MODE_UPDATE, // Allocate, write and bind a set per draw.
+  DESCRIPTOR_BENCH_MODE_CACHED, // Bind a cached set per draw.
+  DESCRIPTOR_BENCH_MODE_BINDLESS, // Bind one table, push an index per draw.
+  DESCRIPTOR_BENCH_MODE_COUNT,
+};
+
+// Measures the CPU cost of giving each of 10000 draws its own material (one
+// of 256 slices of a storage buffer) with each binding model.  Only the
+// binding commands are recorded, the draws themselves would cost the same in
+// every mode.
+void RunDescriptorBench(VulkanState& state)
+{
+  const uint32_t frame_count = 16;
+  const uint32_t draw_count = 10000;
+  const uint32_t material_count = 256;
+  const VkDeviceSize material_bytes = 256;
+
+  VkBuffer material_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory material_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(material_count * material_bytes, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &material_buffer, &material_memory);
+
+  VkDescriptorSetLayoutBinding layout_binding = {};
+  layout_binding.binding = 0;
+  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  layout_binding.descriptorCount = 1;
+  layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.bindingCount = 1;
+  descriptor_layout.pBindings = &layout_binding;
+  VkDescriptorSetLayout material_layout = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateDescriptorSetLayout(state.device, &descriptor_layout, &state.callbacks, &material_layout));
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.setLayoutCount = 1;
+  pipeline_layout_create_info.pSetLayouts = &material_layout;
+  VkPipelineLayout material_pipeline_layout = VK_NULL_HANDLE;
+  VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_create_info, &state.callbacks, &material_pipeline_layout));
+
+  BindlessTable bindless;
+  VkPipelineLayout bindless_pipeline_layout = VK_NULL_HANDLE;
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+  push_constant_range.size = sizeof(uint32_t);
+
+  if (bindless.Create(state, 65536, layout_binding.stageFlags))
+  {
+    for (uint32_t m = 0; m < material_count; ++m)
+    {
+      bindless.Add(material_buffer, m * material_bytes, material_bytes);
+    }
+
+    pipeline_layout_create_info.pSetLayouts = &bindless.layout;
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+    VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_create_info, &state.callbacks, &bindless_pipeline_layout));
+  }
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+  const char* const mode_names[DESCRIPTOR_BENCH_MODE_COUNT] = { "allocate + update + bind", "cached set + bind", "bindless index" };
+  DescriptorAllocator allocators[DESCRIPTOR_BENCH_MODE_COUNT];
+  double record_ms[DESCRIPTOR_BENCH_MODE_COUNT] = {};
+
+  for (uint32_t mode = 0; mode < DESCRIPTOR_BENCH_MODE_COUNT; ++mode)
+  {
+    if ((mode == DESCRIPTOR_BENCH_MODE_BINDLESS) && !bindless_pipeline_layout)
+    {
+      continue;
+    }
+
+    DescriptorAllocator& allocator = allocators[mode];
+    allocator.Create(state, 1);
+
+    for (uint32_t frame = 0; frame < frame_count; ++frame)
+    {
+      allocator.BeginFrame(frame);
+
+      VkCommandBufferBeginInfo cmd_buf_info = {};
+      cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+
+      double start_ms = GetTimeMs();
+
+      if (mode == DESCRIPTOR_BENCH_MODE_BINDLESS)
+      {
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, bindless_pipeline_layout, 0, 1, &bindless.set, 0, nullptr);
+      }
+
+      for (uint32_t draw = 0; draw < draw_count; ++draw)
+      {
+        // Scatter materials across draws the way an unsorted scene would.
+        uint32_t material = (draw * 97) % material_count;
+
+        if (mode == DESCRIPTOR_BENCH_MODE_BINDLESS)
+        {
+          vkCmdPushConstants(cmd, bindless_pipeline_layout, push_constant_range.stageFlags, 0, sizeof(material), &material);
+          continue;
+        }
+
+        DescriptorBinding binding = {};
+        binding.binding = 0;
+        binding.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        binding.buffer.buffer = material_buffer;
+        binding.buffer.offset = material * material_bytes;
+        binding.buffer.range = material_bytes;
+        VkDescriptorSet set = VK_NULL_HANDLE;
+
+        if (mode == DESCRIPTOR_BENCH_MODE_UPDATE)
+        {
+          DescriptorSetKey key;
+          key.Set(material_layout, &binding, 1);
+          set = allocator.Allocate(material_layout);
+          allocator.Write(set, key);
+        }
+        else
+        {
+          set = allocator.Get(material_layout, &binding, 1);
+        }
+
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, material_pipeline_layout, 0, 1, &set, 0, nullptr);
+      }
+
+      record_ms[mode] += GetTimeMs() - start_ms;
+      VK_CHECK(vkEndCommandBuffer(cmd));
+
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.commandBufferCount = 1;
+      submit_info.pCommandBuffers = &cmd;
+      VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+      VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+      VK_CHECK(vkResetFences(state.device, 1, &fence));
+    }
+  }
+
+  printf("Descriptors: %u frames of %u draws over %u materials\n", frame_count, draw_count, material_count);
+
+  for (uint32_t mode = 0; mode < DESCRIPTOR_BENCH_MODE_COUNT; ++mode)
+  {
+    if ((mode == DESCRIPTOR_BENCH_MODE_BINDLESS) && !bindless_pipeline_layout)
+    {
+      printf("  %s: unsupported, no VK_EXT_descriptor_indexing\n", mode_names[mode]);
+      continue;
+    }
+
+    printf("  %s: %.1f ns per draw (%.3f ms per frame)\n", mode_names[mode], record_ms[mode] * 1000000.0 / (frame_count * draw_count), record_ms[mode] / frame_count);
+
+    if (mode != DESCRIPTOR_BENCH_MODE_BINDLESS)
+    {
+      allocators[mode].PrintStats();
+    }
+  }
+
+  for (uint32_t mode = 0; mode < DESCRIPTOR_BENCH_MODE_COUNT; ++mode)
+  {
+    allocators[mode].Destroy();
+  }
+
+  vkDestroyFence(state.device, fence, &state.callbacks);
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+
+  if (bindless_pipeline_layout)
+  {
+    vkDestroyPipelineLayout(state.device, bindless_pipeline_layout, &state.callbacks);
+  }
+
+  bindless.Destroy();
+  vkDestroyPipelineLayout(state.device, material_pipeline_layout, &state.callbacks);
+  vkDestroyDescriptorSetLayout(state.device, material_layout, &state.callbacks);
+  vkDestroyBuffer(state.device, material_buffer, &state.callbacks);
+  vkFreeMemory(state.device, material_memory, &state.callbacks);
+}
+
+// A pipeline drawing Vertex triangles into a single color attachment with
+// dynamic viewport and scissor, for test workloads that only vary the vertex
+// shader and layout.  depth_equal only shades fragments whose depth matches
+// what a depth prepass left behind, without writing depth.  Nothing is culled
+// unless cull_mode says so.
+VkPipeline CreateVertexColorPipeline(VulkanState& state, VkRenderPass render_pass, VkPipelineLayout layout, VkShaderModule vertex_module, VkShaderModule frag_module, bool depth_test = false, bool depth_equal = false,
+  VkCullModeFlags cull_mode = VK_CULL_MODE_NONE)
+{
+  VkDynamicState dynamic_state_enables[2] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+  VkPipelineDynamicStateCreateInfo dynamic_create_info = {};
+  dynamic_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamic_create_info.dynamicStateCount = ARRAY_COUNT(dynamic_state_enables);
+  dynamic_create_info.pDynamicStates = dynamic_state_enables;
+
+  VkVertexInputBindingDescription vi_binding = {};
+  vi_binding.binding = 1;
+  vi_binding.stride = sizeof(Vertex);
+  vi_binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+  VkVertexInputAttributeDescription vi_attribs[2] = {};
+  vi_attribs[0].location = 0;
+  vi_attribs[0].binding = 1;
+  vi_attribs[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+  vi_attribs[0].offset = offsetof(Vertex, position);
+  vi_attribs[1].location = 1;
+  vi_attribs[1].binding = 1;
+  vi_attribs[1].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+  vi_attribs[1].offset = offsetof(Vertex, color);
+
+  VkPipelineVertexInputStateCreateInfo vi = {};
+  vi.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vi.vertexBindingDescriptionCount = 1;
+  vi.pVertexBindingDescriptions = &vi_binding;
+  vi.vertexAttributeDescriptionCount = ARRAY_COUNT(vi_attribs);
+  vi.pVertexAttributeDescriptions = vi_attribs;
+
+  VkPipelineInputAssemblyStateCreateInfo ia = {};
+  ia.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+  VkPipelineRasterizationStateCreateInfo rs = {};
+  rs.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rs.polygonMode = VK_POLYGON_MODE_FILL;
+  rs.cullMode = cull_mode;
+  rs.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  rs.lineWidth = 1.0f;
+
+  VkPipelineColorBlendAttachmentState att_state = {};
+  att_state.colorWriteMask = 0xf;
+
+  VkPipelineColorBlendStateCreateInfo cb = {};
+  cb.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  cb.attachmentCount = 1;
+  cb.pAttachments = &att_state;
+
+  VkPipelineViewportStateCreateInfo vp = {};
+  vp.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  vp.viewportCount = 1;
+  vp.scissorCount = 1;
+
+  VkPipelineMultisampleStateCreateInfo ms = {};
+  ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+  // Depth testing is off unless asked for, for render passes that have a
+  // depth attachment.
+  VkPipelineDepthStencilStateCreateInfo ds = {};
+  ds.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  ds.depthTestEnable = depth_test ? VK_TRUE : VK_FALSE;
+  ds.depthWriteEnable = (depth_test && !depth_equal) ? VK_TRUE : VK_FALSE;
+  ds.depthCompareOp = depth_equal ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS_OR_EQUAL;
+
+  VkPipelineShaderStageCreateInfo shader_stage_create_info[2] = {};
+  shader_stage_create_info[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stage_create_info[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  shader_stage_create_info[0].module = vertex_module;
+  shader_stage_create_info[0].pName = "main";
+  shader_stage_create_info[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stage_create_info[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  shader_stage_create_info[1].module = frag_module;
+  shader_stage_create_info[1].pName = "main";
+
+  VkGraphicsPipelineCreateInfo pipeline_create_info = {};
+  pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipeline_create_info.layout = layout;
+  pipeline_create_info.pVertexInputState = &vi;
+  pipeline_create_info.pInputAssemblyState = &ia;
+  pipeline_create_info.pRasterizationState = &rs;
+  pipeline_create_info.pColorBlendState = &cb;
+  pipeline_create_info.pMultisampleState = &ms;
+  pipeline_create_info.pDynamicState = &dynamic_create_info;
+  pipeline_create_info.pViewportState = &vp;
+  pipeline_create_info.pDepthStencilState = &ds;
+  pipeline_create_info.pStages = shader_stage_create_info;
+  pipeline_create_info.stageCount = ARRAY_COUNT(shader_stage_create_info);
+  pipeline_create_info.renderPass = render_pass;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateGraphicsPipelines(state.device, VK_NULL_HANDLE, 1, &pipeline_create_info, &state.callbacks, &pipeline));
+  return pipeline;
+}
+
+// Data that changes from one draw to the next.
+struct PerDrawData
+{
+  Affine3x4 obj_to_world; // Three row major rows, the shaders' vec4 obj_to_world[3].
+};
+
+// How a pipeline receives PerDrawData.
+enum PerDrawStrategy
+{
+  PER_DRAW_STRATEGY_PUSH_CONSTANTS, // vkCmdPushConstants before every draw.
+  PER_DRAW_STRATEGY_DYNAMIC_UNIFORM, // One uniform buffer, rebound at a new dynamic offset per draw.
+  PER_DRAW_STRATEGY_STORAGE_BUFFER, // One storage buffer per frame, indexed by firstInstance.
+  PER_DRAW_STRATEGY_COUNT,
+};
+
+struct PerDrawStrategyInfo
+{
+  const char* name;
+  const char* vertex_shader;
+  VkDescriptorType descriptor_type;
+};
+
+static const PerDrawStrategyInfo s_PerDrawStrategyInfo[PER_DRAW_STRATEGY_COUNT] =
+{
+  { "push constants", "per_draw_push.vert.spv", VK_DESCRIPTOR_TYPE_MAX_ENUM },
+  { "dynamic uniform offsets", "per_draw_dynamic.vert.spv", VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC },
+  { "storage buffer + instance index", "per_draw_storage.vert.spv", VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC },
+};
+
+// The per-draw half of a pipeline: its layout and, for the buffer strategies,
+// a persistently mapped buffer with a region per frame in flight that draws
+// append their data to.
+struct PerDrawPath
+{
+  VulkanState* state = nullptr;
+  PerDrawStrategy strategy = PER_DRAW_STRATEGY_PUSH_CONSTANTS;
+  VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  VkBuffer buffer = VK_NULL_HANDLE;
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  uint8_t* mapped = nullptr;
+  uint32_t max_draws = 0;
+  uint32_t frame_count = 0;
+  VkDeviceSize stride = 0;
+  VkDeviceSize frame_bytes = 0;
+
+  // Recording state.
+  uint32_t frame = 0;
+  uint32_t draw_count = 0;
+
+  static void Layout(PerDrawStrategy strategy, const VkPhysicalDeviceLimits& limits, uint32_t max_draws, VkDeviceSize* stride, VkDeviceSize* frame_bytes);
+  void Create(VulkanState& vulkan_state, DescriptorAllocator& descriptors, PerDrawStrategy draw_strategy, uint32_t draws_per_frame, uint32_t frames_in_flight);
+  void Destroy();
+  void Begin(VkCommandBuffer cmd, uint32_t frame_index);
+  void Draw(VkCommandBuffer cmd, const PerDrawData& data, uint32_t vertex_count);
+
+  // Tests.
+  static void TestLayout();
+  static void RunAllTests();
+};
+
+static VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+  return (alignment > 1) ? (((value + alignment - 1) / alignment) * alignment) : value;
+}
+
+// Dynamic uniform offsets must be multiples of minUniformBufferOffsetAlignment,
+// so every draw gets a padded slot.  The storage buffer is packed and only
+// each frame's region has to be aligned.
+void PerDrawPath::Layout(PerDrawStrategy strategy, const VkPhysicalDeviceLimits& limits, uint32_t max_draws, VkDeviceSize* stride, VkDeviceSize* frame_bytes)
+{
+  switch (strategy)
+  {
+  case PER_DRAW_STRATEGY_DYNAMIC_UNIFORM:
+  {
+    *stride = AlignUp(sizeof(PerDrawData), limits.minUniformBufferOffsetAlignment);
+    *frame_bytes = *stride * max_draws;
+    break;
+  }
+  case PER_DRAW_STRATEGY_STORAGE_BUFFER:
+  {
+    *stride = sizeof(PerDrawData);
+    *frame_bytes = AlignUp(*stride * max_draws, limits.minStorageBufferOffsetAlignment);
+    break;
+  }
+  default:
+  {
+    *stride = 0;
+    *frame_bytes = 0;
+    break;
+  }
+  }
+}
+
+void PerDrawPath::Create(VulkanState& vulkan_state, DescriptorAllocator& descriptors, PerDrawStrategy draw_strategy, uint32_t draws_per_frame, uint32_t frames_in_flight)
+{
+  state = &vulkan_state;
+  strategy = draw_strategy;
+  max_draws = draws_per_frame;
+  frame_count = frames_in_flight;
+
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.size = sizeof(PerDrawData);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+
+  if (strategy == PER_DRAW_STRATEGY_PUSH_CONSTANTS)
+  {
+    if (state->physical_device_properties.limits.maxPushConstantsSize < sizeof(PerDrawData))
+    {
+      Fail(__FUNCTION__);
+    }
+
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+    VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &pipeline_layout));
+    return;
+  }
+
+  Layout(strategy, state->physical_device_properties.limits, max_draws, &stride, &frame_bytes);
+  VkDescriptorType descriptor_type = s_PerDrawStrategyInfo[strategy].descriptor_type;
+  VkBufferUsageFlags usage = (strategy == PER_DRAW_STRATEGY_DYNAMIC_UNIFORM) ? VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT : VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  state->CreateBuffer(frame_bytes * frame_count, usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &buffer, &memory);
+  VK_CHECK(vkMapMemory(state->device, memory, 0, VK_WHOLE_SIZE, 0, (void**)&mapped));
+
+  VkDescriptorSetLayoutBinding layout_binding = {};
+  layout_binding.binding = 0;
+  layout_binding.descriptorType = descriptor_type;
+  layout_binding.descriptorCount = 1;
+  layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.bindingCount = 1;
+  descriptor_layout.pBindings = &layout_binding;
+  VK_CHECK(vkCreateDescriptorSetLayout(state->device, &descriptor_layout, &state->callbacks, &set_layout));
+
+  pipeline_layout_create_info.setLayoutCount = 1;
+  pipeline_layout_create_info.pSetLayouts = &set_layout;
+  VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &pipeline_layout));
+
+  // The set covers one draw's data for uniforms and a whole frame's array for
+  // storage, and the dynamic offset moves it.
+  DescriptorBinding binding = {};
+  binding.binding = 0;
+  binding.type = descriptor_type;
+  binding.buffer.buffer = buffer;
+  binding.buffer.offset = 0;
+  binding.buffer.range = (strategy == PER_DRAW_STRATEGY_DYNAMIC_UNIFORM) ? sizeof(PerDrawData) : (stride * max_draws);
+  set = descriptors.Get(set_layout, &binding, 1);
+}
+
+void PerDrawPath::Destroy()
+{
+  if (buffer)
+  {
+    vkUnmapMemory(state->device, memory);
+    vkDestroyBuffer(state->device, buffer, &state->callbacks);
+    vkFreeMemory(state->device, memory, &state->callbacks);
+    vkDestroyDescriptorSetLayout(state->device, set_layout, &state->callbacks);
+    buffer = VK_NULL_HANDLE;
+  }
+
+  vkDestroyPipelineLayout(state->device, pipeline_layout, &state->callbacks);
+}
+
+// Call after binding the pipeline.  The frame's previous use of its region
+// must have completed.
+void PerDrawPath::Begin(VkCommandBuffer cmd, uint32_t frame_index)
+{
+  frame = frame_count ? (frame_index % frame_count) : 0;
+  draw_count = 0;
+
+  if (strategy == PER_DRAW_STRATEGY_STORAGE_BUFFER)
+  {
+    uint32_t dynamic_offset = (uint32_t)(frame * frame_bytes);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &set, 1, &dynamic_offset);
+  }
+}
+
+void PerDrawPath::Draw(VkCommandBuffer cmd, const PerDrawData& data, uint32_t vertex_count)
+{
+  if (draw_count == max_draws)
+  {
+    Fail(__FUNCTION__);
+  }
+
+  switch (strategy)
+  {
+  case PER_DRAW_STRATEGY_PUSH_CONSTANTS:
+  {
+    vkCmdPushConstants(cmd, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(data), &data);
+    vkCmdDraw(cmd, vertex_count, 1, 0, 0);
+    break;
+  }
+  case PER_DRAW_STRATEGY_DYNAMIC_UNIFORM:
+  {
+    VkDeviceSize offset = (frame * frame_bytes) + (draw_count * stride);
+    memcpy(mapped + offset, &data, sizeof(data));
+    uint32_t dynamic_offset = (uint32_t)offset;
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &set, 1, &dynamic_offset);
+    vkCmdDraw(cmd, vertex_count, 1, 0, 0);
+    break;
+  }
+  case PER_DRAW_STRATEGY_STORAGE_BUFFER:
+  {
+    memcpy(mapped + (frame * frame_bytes) + (draw_count * stride), &data, sizeof(data));
+    vkCmdDraw(cmd, vertex_count, 1, 0, draw_count);
+    break;
+  }
+  default:
+  {
+    Fail(__FUNCTION__);
+  }
+  }
+
+  ++draw_count;
+}
+
+void PerDrawPath::TestLayout()
+{
+  VkPhysicalDeviceLimits limits = {};
+  limits.minUniformBufferOffsetAlignment = 256;
+  limits.minStorageBufferOffsetAlignment = 256;
+  VkDeviceSize stride = 0;
+  VkDeviceSize frame_bytes = 0;
+
+  Layout(PER_DRAW_STRATEGY_DYNAMIC_UNIFORM, limits, 10, &stride, &frame_bytes);
+  FailIfNotExpected((VkDeviceSize)256, stride, __FUNCTION__);
+  FailIfNotExpected((VkDeviceSize)2560, frame_bytes, __FUNCTION__);
+
+  Layout(PER_DRAW_STRATEGY_STORAGE_BUFFER, limits, 10, &stride, &frame_bytes);
+  FailIfNotExpected((VkDeviceSize)sizeof(PerDrawData), stride, __FUNCTION__);
+  FailIfNotExpected((VkDeviceSize)512, frame_bytes, __FUNCTION__);
+
+  Layout(PER_DRAW_STRATEGY_PUSH_CONSTANTS, limits, 10, &stride, &frame_bytes);
+  FailIfNotExpected((VkDeviceSize)0, frame_bytes, __FUNCTION__);
+}
+
+void PerDrawPath::RunAllTests()
+{
+  TestLayout();
+}
+
+struct PerDrawBenchPass
+{
+  PerDrawPath* path;
+  VkPipeline pipeline;
+  VkBuffer vertex_buffer;
+  const PerDrawData* draws;
+  uint32_t draw_count;
+  uint32_t frame;
+  VkExtent2D extent;
+  double record_ms;
+};
+
+static void RecordPerDrawBenchPass(VkCommandBuffer cmd, void* userdata)
+{
+  PerDrawBenchPass& pass = *(PerDrawBenchPass*)userdata;
+  double start_ms = GetTimeMs();
+
+  VkViewport viewport = {};
+  viewport.width = (float)pass.extent.width;
+  viewport.height = (float)pass.extent.height;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = {};
+  scissor.extent = pass.extent;
+  const VkDeviceSize offsets = 0;
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pass.pipeline);
+  vkCmdBindVertexBuffers(cmd, 1, 1, &pass.vertex_buffer, &offsets);
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+  pass.path->Begin(cmd, pass.frame);
+
+  for (uint32_t i = 0; i < pass.draw_count; ++i)
+  {
+    pass.path->Draw(cmd, pass.draws[i], ARRAY_COUNT(s_ClipSpaceTriangleVertices));
+  }
+
+  pass.record_ms += GetTimeMs() - start_ms;
+}
+
+// Draws a grid of small triangles, each with its own transform, through each
+// per-draw strategy and reports CPU recording time per draw and the time per
+// frame including the GPU.
+void RunPerDrawBench(VulkanState& state, const Options& options)
+{
+  const uint32_t frame_count = 64;
+  const uint32_t frames_in_flight = 2;
+  const uint32_t draw_count = 20000;
+  const uint32_t grid = 142; // ~sqrt(draw_count)
+  VkExtent2D extent = { (uint32_t)options.width, (uint32_t)options.height };
+
+  PerDrawData* draws = (PerDrawData*)Alloc(sizeof(PerDrawData) * draw_count, 16);
+
+  for (uint32_t i = 0; i < draw_count; ++i)
+  {
+    float scale = 1.0f / grid;
+    Affine3x4& m = draws[i].obj_to_world;
+    m.SetIdentity();
+    m.m[0] = scale;
+    m.m[5] = scale;
+    m.SetPosition(Vec3(-1.0f + ((i % grid) + 0.5f) * 2.0f * scale, -1.0f + ((i / grid) + 0.5f) * 2.0f * scale, 0.5f));
+  }
+
+  VkBuffer vertex_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory vertex_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(sizeof(s_ClipSpaceTriangleVertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &vertex_buffer, &vertex_memory);
+  void* vertex_data = nullptr;
+  VK_CHECK(vkMapMemory(state.device, vertex_memory, 0, VK_WHOLE_SIZE, 0, &vertex_data));
+  memcpy(vertex_data, s_ClipSpaceTriangleVertices, sizeof(s_ClipSpaceTriangleVertices));
+  vkUnmapMemory(state.device, vertex_memory);
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage output_image = VK_NULL_HANDLE;
+  VkDeviceMemory output_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &output_image, &output_memory);
+
+  PerDrawBenchPass bench_pass = {};
+  bench_pass.vertex_buffer = vertex_buffer;
+  bench_pass.draws = draws;
+  bench_pass.draw_count = draw_count;
+  bench_pass.extent = extent;
+
+  RenderGraph graph;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &output_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  uint32_t pass = graph.AddPass("draws", RecordPerDrawBenchPass, &bench_pass);
+  graph.AddUse(pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.Compile(state);
+
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+  bool have_frag = state.LoadShaderModule("basic.frag.spv", &frag_module);
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = frames_in_flight;
+  VkCommandBuffer cmds[frames_in_flight] = {};
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, cmds));
+
+  VkFence fences[frames_in_flight] = {};
+
+  for (uint32_t i = 0; i < frames_in_flight; ++i)
+  {
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, fences + i));
+  }
+
+  DescriptorAllocator descriptors;
+  descriptors.Create(state, 1);
+
+  printf("Per-draw data: %u frames of %u draws, %ux%u\n", frame_count, draw_count, extent.width, extent.height);
+
+  for (uint32_t s = 0; s < PER_DRAW_STRATEGY_COUNT; ++s)
+  {
+    const PerDrawStrategyInfo& info = s_PerDrawStrategyInfo[s];
+    VkShaderModule vertex_module = VK_NULL_HANDLE;
+
+    if (!have_frag || !state.LoadShaderModule(info.vertex_shader, &vertex_module))
+    {
+      printf("  %s: skipped, no shader\n", info.name);
+      continue;
+    }
+
+    PerDrawPath path;
+    path.Create(state, descriptors, (PerDrawStrategy)s, draw_count, frames_in_flight);
+    VkPipeline pipeline = CreateVertexColorPipeline(state, graph.RenderPass(pass), path.pipeline_layout, vertex_module, frag_module);
+    vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+
+    bench_pass.path = &path;
+    bench_pass.pipeline = pipeline;
+    bench_pass.record_ms = 0.0;
+    double start_ms = GetTimeMs();
+
+    for (uint32_t frame = 0; frame < frame_count; ++frame)
+    {
+      uint32_t slot = frame % frames_in_flight;
+      VK_CHECK(vkWaitForFences(state.device, 1, fences + slot, VK_TRUE, UINT64_MAX));
+      VK_CHECK(vkResetFences(state.device, 1, fences + slot));
+
+      VkCommandBufferBeginInfo cmd_buf_info = {};
+      cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      VK_CHECK(vkBeginCommandBuffer(cmds[slot], &cmd_buf_info));
+      bench_pass.frame = frame;
+      graph.Execute(cmds[slot], 0);
+      VK_CHECK(vkEndCommandBuffer(cmds[slot]));
+
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.commandBufferCount = 1;
+      submit_info.pCommandBuffers = cmds + slot;
+      VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fences[slot]));
+    }
+
+    VK_CHECK(vkWaitForFences(state.device, frames_in_flight, fences, VK_TRUE, UINT64_MAX));
+    double total_ms = GetTimeMs() - start_ms;
+
+    printf("  %s: %.1f ns per draw recorded, %.3f ms per frame\n", info.name, bench_pass.record_ms * 1000000.0 / (frame_count * draw_count), total_ms / frame_count);
+
+    vkDestroyPipeline(state.device, pipeline, &state.callbacks);
+    path.Destroy();
+  }
+
+  descriptors.Destroy();
+
+  for (uint32_t i = 0; i < frames_in_flight; ++i)
+  {
+    vkDestroyFence(state.device, fences[i], &state.callbacks);
+  }
+
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+
+  if (have_frag)
+  {
+    vkDestroyShaderModule(state.device, frag_module, &state.callbacks);
+  }
+
+  graph.Destroy();
+  vkDestroyImage(state.device, output_image, &state.callbacks);
+  vkFreeMemory(state.device, output_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, vertex_buffer, &state.callbacks);
+  vkFreeMemory(state.device, vertex_memory, &state.callbacks);
+  Free(draws);
+}
+
+// Jobs process the items [begin, end) of whatever data points at.
+typedef void (*JobFn)(void* data, uint32_t begin, uint32_t end);
+
+struct JobCounter;
+
+struct Job
+{
+  JobFn fn;
+  void* data;
+  uint32_t begin;
+  uint32_t end;
+  uint32_t batch; // Non-zero for ParallelFor() ranges, which split down to this size.
+  JobCounter* counter;
+};
+
+// Counts unfinished jobs.  Jobs queued with RunAfter() wait here until the
+// count drops to zero.
+struct JobCounter
+{
+  volatile long count = 0;
+  volatile long lock = 0;
+  uint32_t waiting_count = 0;
+  Job waiting[8];
+};
+
+static void SpinLock(volatile long* lock, uint64_t* spins)
+{
+  while (InterlockedCompareExchange(lock, 1, 0) != 0)
+  {
+    ++*spins;
+    YieldProcessor();
+  }
+}
+
+static void SpinUnlock(volatile long* lock)
+{
+  InterlockedExchange(lock, 0);
+}
+
+// Worker index of the calling thread.  The thread that creates a JobSystem is
+// worker 0 and helps out whenever it waits.
+static thread_local uint32_t s_JobWorkerIndex = 0;
+
+// Work-stealing scheduler.  Each worker pushes and pops jobs at the bottom of
+// its own deque, and idle workers steal the oldest jobs from the top of a
+// random victim's, which for ParallelFor() ranges are the biggest.  The
+// deques are ring buffers behind a spinlock rather than lock-free, since
+// jobs here are coarse enough that the lock is rarely contended, and the
+// contention that does happen shows up in the stats.
+//
+// main() runs its startup on one, and texture streaming, the scene graph,
+// draw sorting and the CPU rasterizer take one.  The interactive frame loop
+// doesn't: it draws one static scene with no culling or transforms, and
+// FramePipeline already keeps its recording off the message thread.
+struct JobSystem
+{
+  struct Deque
+  {
+    volatile long lock;
+    volatile uint32_t top;
+    volatile uint32_t bottom;
+    Job jobs[4096];
+  };
+
+  // Only written by the owning worker.
+  struct WorkerStats
+  {
+    uint64_t jobs;
+    uint64_t steals;
+    uint64_t failed_steals;
+    uint64_t lock_spins;
+    uint64_t sleeps;
+  };
+
+  struct Worker
+  {
+    JobSystem* system;
+    uint32_t index;
+    uint32_t rng;
+    HANDLE thread;
+    WorkerStats stats;
+    Deque deque;
+    char padding[64];
+  };
+
+  Worker* workers = nullptr;
+  uint32_t worker_count = 0;
+  volatile long quit = 0;
+  volatile long queued = 0;
+  volatile long sleeping = 0;
+  CRITICAL_SECTION sleep_lock;
+  CONDITION_VARIABLE wake;
+
+  static uint32_t DefaultWorkerCount();
+  void Create(uint32_t count);
+  void Destroy();
+  void Run(JobFn fn, void* data, JobCounter* counter);
+  void RunAfter(JobCounter* dependency, JobFn fn, void* data, JobCounter* counter);
+  void ParallelFor(uint32_t count, uint32_t batch, JobFn fn, void* data, JobCounter* counter);
+  void Wait(JobCounter* counter);
+  void ResetStats();
+  void PrintStats() const;
+
+  void Push(const Job& job);
+  bool Pop(uint32_t index, Job* job);
+  bool Steal(uint32_t index, Job* job);
+  bool RunOne(uint32_t index);
+  void Execute(uint32_t index, Job job);
+  void Complete(uint32_t index, JobCounter* counter);
+  static DWORD WINAPI WorkerThread(void* userdata);
+
+  // Tests.
+  static void TestParallelForCoversRange();
+  static void TestDependencies();
+  static void RunAllTests();
+};
+
+uint32_t JobSystem::DefaultWorkerCount()
+{
+  SYSTEM_INFO system_info = {};
+  GetSystemInfo(&system_info);
+  return system_info.dwNumberOfProcessors ? system_info.dwNumberOfProcessors : 1;
+}
+
+void JobSystem::Create(uint32_t count)
+{
+  worker_count = count ? count : 1;
+  workers = (Worker*)Alloc(sizeof(Worker) * worker_count, 64);
+  memset(workers, 0, sizeof(Worker) * worker_count);
+  quit = 0;
+  queued = 0;
+  sleeping = 0;
+  InitializeCriticalSection(&sleep_lock);
+  InitializeConditionVariable(&wake);
+  s_JobWorkerIndex = 0;
+
+  for (uint32_t i = 0; i < worker_count; ++i)
+  {
+    workers[i].system = this;
+    workers[i].index = i;
+    workers[i].rng = (i + 1) * 2654435761u;
+  }
+
+  for (uint32_t i = 1; i < worker_count; ++i)
+  {
+    workers[i].thread = CreateThread(nullptr, 0, WorkerThread, workers + i, 0, nullptr);
+  }
+}
+
+// Every job must have finished.
+void JobSystem::Destroy()
+{
+  EnterCriticalSection(&sleep_lock);
+  InterlockedExchange(&quit, 1);
+  WakeAllConditionVariable(&wake);
+  LeaveCriticalSection(&sleep_lock);
+
+  for (uint32_t i = 1; i < worker_count; ++i)
+  {
+    WaitForSingleObject(workers[i].thread, INFINITE);
+    CloseHandle(workers[i].thread);
+  }
+
+  DeleteCriticalSection(&sleep_lock);
+  Free(workers);
+  workers = nullptr;
+  worker_count = 0;
+}
+
+void JobSystem::Push(const Job& job)
+{
+  Worker& worker = workers[s_JobWorkerIndex];
+  Deque& deque = worker.deque;
+  SpinLock(&deque.lock, &worker.stats.lock_spins);
+
+  if ((deque.bottom - deque.top) == ARRAY_COUNT(deque.jobs))
+  {
+    // Full, so do it now instead.
+    SpinUnlock(&deque.lock);
+    Execute(s_JobWorkerIndex, job);
+    return;
+  }
+
+  deque.jobs[deque.bottom % ARRAY_COUNT(deque.jobs)] = job;
+  ++deque.bottom;
+  SpinUnlock(&deque.lock);
+  InterlockedIncrement(&queued);
+
+  if (sleeping)
+  {
+    EnterCriticalSection(&sleep_lock);
+    WakeConditionVariable(&wake);
+    LeaveCriticalSection(&sleep_lock);
+  }
+}
+
+bool JobSystem::Pop(uint32_t index, Job* job)
+{
+  Worker& worker = workers[index];
+  Deque& deque = worker.deque;
+
+  if (deque.bottom == deque.top)
+  {
+    return false;
+  }
+
+  SpinLock(&deque.lock, &worker.stats.lock_spins);
+  bool found = (deque.bottom != deque.top);
+
+  if (found)
+  {
+    --deque.bottom;
+    *job = deque.jobs[deque.bottom % ARRAY_COUNT(deque.jobs)];
+  }
+
+  SpinUnlock(&deque.lock);
+
+  if (found)
+  {
+    InterlockedDecrement(&queued);
+  }
+
+  return found;
+}
+
+bool JobSystem::Steal(uint32_t index, Job* job)
+{
+  Worker& worker = workers[index];
+
+  for (uint32_t attempt = 1; attempt < worker_count; ++attempt)
+  {
+    worker.rng ^= worker.rng << 13;
+    worker.rng ^= worker.rng >> 17;
+    worker.rng ^= worker.rng << 5;
+    uint32_t victim_index = worker.rng % worker_count;
+
+    if (victim_index == index)
+    {
+      continue;
+    }
+
+    Deque& victim = workers[victim_index].deque;
+
+    if (victim.bottom == victim.top)
+    {
+      ++worker.stats.failed_steals;
+      continue;
+    }
+
+    SpinLock(&victim.lock, &worker.stats.lock_spins);
+    bool found = (victim.bottom != victim.top);
+
+    if (found)
+    {
+      *job = victim.jobs[victim.top % ARRAY_COUNT(victim.jobs)];
+      ++victim.top;
+    }
+
+    SpinUnlock(&victim.lock);
+
+    if (found)
+    {
+      InterlockedDecrement(&queued);
+      ++worker.stats.steals;
+      return true;
+    }
+
+    ++worker.stats.failed_steals;
+  }
+
+  return false;
+}
+
+bool JobSystem::RunOne(uint32_t index)
+{
+  Job job;
+
+  if (Pop(index, &job) || Steal(index, &job))
+  {
+    Execute(index, job);
+    return true;
+  }
+
+  return false;
+}
+
+void JobSystem::Execute(uint32_t index, Job job)
+{
+  // Keep halving a range, leaving the far half for thieves, until it's down
+  // to one batch.
+  while (job.batch && ((job.end - job.begin) > job.batch))
+  {
+    uint32_t batches = (job.end - job.begin + job.batch - 1) / job.batch;
+    uint32_t middle = job.begin + ((batches / 2) * job.batch);
+    Job half = job;
+    half.begin = middle;
+    job.end = middle;
+
+    if (half.counter)
+    {
+      InterlockedIncrement(&half.counter->count);
+    }
+
+    Push(half);
+  }
+
+  job.fn(job.data, job.begin, job.end);
+  ++workers[index].stats.jobs;
+  Complete(index, job.counter);
+}
+
+// The counter is locked around the final decrement so a waiter can't see
+// zero, return and free the counter while its continuations are taken.
+void JobSystem::Complete(uint32_t index, JobCounter* counter)
+{
+  if (!counter)
+  {
+    return;
+  }
+
+  Job waiting[ARRAY_COUNT(counter->waiting)];
+  uint32_t waiting_count = 0;
+  SpinLock(&counter->lock, &workers[index].stats.lock_spins);
+
+  if (InterlockedDecrement(&counter->count) == 0)
+  {
+    waiting_count = counter->waiting_count;
+    memcpy(waiting, counter->waiting, sizeof(Job) * waiting_count);
+    counter->waiting_count = 0;
+  }
+
+  SpinUnlock(&counter->lock);
+
+  for (uint32_t i = 0; i < waiting_count; ++i)
+  {
+    Push(waiting[i]);
+  }
+}
+
+void JobSystem::Run(JobFn fn, void* data, JobCounter* counter)
+{
+  Job job = { fn, data, 0, 1, 0, counter };
+
+  if (counter)
+  {
+    InterlockedIncrement(&counter->count);
+  }
+
+  Push(job);
+}
+
+// Runs the job once dependency reaches zero.
+void JobSystem::RunAfter(JobCounter* dependency, JobFn fn, void* data, JobCounter* counter)
+{
+  Job job = { fn, data, 0, 1, 0, counter };
+
+  if (counter)
+  {
+    InterlockedIncrement(&counter->count);
+  }
+
+  SpinLock(&dependency->lock, &workers[s_JobWorkerIndex].stats.lock_spins);
+
+  if (dependency->count)
+  {
+    if (dependency->waiting_count == ARRAY_COUNT(dependency->waiting))
+    {
+      Fail(__FUNCTION__);
+    }
+
+    dependency->waiting[dependency->waiting_count++] = job;
+    SpinUnlock(&dependency->lock);
+    return;
+  }
+
+  SpinUnlock(&dependency->lock);
+  Push(job);
+}
+
+// Calls fn on [0, count) in ranges of about batch items.
+void JobSystem::ParallelFor(uint32_t count, uint32_t batch, JobFn fn, void* data, JobCounter* counter)
+{
+  if (!count)
+  {
+    return;
+  }
+
+  Job job = { fn, data, 0, count, batch ? batch : 1, counter };
+
+  if (counter)
+  {
+    InterlockedIncrement(&counter->count);
+  }
+
+  Push(job);
+}
+
+// Runs other jobs until the counter reaches zero.
+void JobSystem::Wait(JobCounter* counter)
+{
+  uint32_t index = s_JobWorkerIndex;
+
+  while (counter->count || counter->lock)
+  {
+    if (!RunOne(index))
+    {
+      YieldProcessor();
+    }
+  }
+}
+
+DWORD WINAPI JobSystem::WorkerThread(void* userdata)
+{
+  Worker& worker = *(Worker*)userdata;
+  JobSystem& system = *worker.system;
+  s_JobWorkerIndex = worker.index;
+  uint32_t idle = 0;
+
+  while (!system.quit)
+  {
+    if (system.RunOne(worker.index))
+    {
+      idle = 0;
+      continue;
+    }
+
+    // Spin a little before sleeping, new work usually isn't far off.  The
+    // timeout covers a wake that lands between the check and the sleep.
+    if (++idle < 64)
+    {
+      YieldProcessor();
+      continue;
+    }
+
+    EnterCriticalSection(&system.sleep_lock);
+    InterlockedIncrement(&system.sleeping);
+
+    if (!system.queued && !system.quit)
+    {
+      SleepConditionVariableCS(&system.wake, &system.sleep_lock, 1);
+      ++worker.stats.sleeps;
+    }
+
+    InterlockedDecrement(&system.sleeping);
+    LeaveCriticalSection(&system.sleep_lock);
+    idle = 0;
+  }
+
+  return 0;
+}
+
+void JobSystem::ResetStats()
+{
+  for (uint32_t i = 0; i < worker_count; ++i)
+  {
+    memset(&workers[i].stats, 0, sizeof(WorkerStats));
+  }
+}
+
+void JobSystem::PrintStats() const
+{
+  WorkerStats total = {};
+
+  for (uint32_t i = 0; i < worker_count; ++i)
+  {
+    total.jobs += workers[i].stats.jobs;
+    total.steals += workers[i].stats.steals;
+    total.failed_steals += workers[i].stats.failed_steals;
+    total.lock_spins += workers[i].stats.lock_spins;
+    total.sleeps += workers[i].stats.sleeps;
+  }
+
+  printf("    %llu jobs, %llu steals, %llu failed steals, %llu lock spins, %llu sleeps\n", (unsigned long long)total.jobs, (unsigned long long)total.steals, (unsigned long long)total.failed_steals, (unsigned long long)total.lock_spins, (unsigned long long)total.sleeps);
+}
+
+static void TestCountItems(void* data, uint32_t begin, uint32_t end)
+{
+  volatile long* counts = (volatile long*)data;
+
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    InterlockedIncrement(counts + i);
+  }
+}
+
+void JobSystem::TestParallelForCoversRange()
+{
+  JobSystem jobs;
+  jobs.Create(4);
+  volatile long counts[1000] = {};
+  JobCounter counter;
+  jobs.ParallelFor(ARRAY_COUNT(counts), 7, TestCountItems, (void*)counts, &counter);
+  jobs.Wait(&counter);
+  jobs.Destroy();
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(counts); ++i)
+  {
+    FailIfNotExpected(1L, (long)counts[i], __FUNCTION__);
+  }
+}
+
+struct TestStageData
+{
+  volatile long* next;
+  long* order;
+  long stage;
+};
+
+static void TestOrderStage(void* data, uint32_t, uint32_t)
+{
+  const TestStageData& test = *(const TestStageData*)data;
+  long position = InterlockedIncrement(test.next) - 1;
+  test.order[position] = test.stage;
+}
+
+void JobSystem::TestDependencies()
+{
+  JobSystem jobs;
+  jobs.Create(4);
+  volatile long next = 0;
+  long order[3] = {};
+  TestStageData stages[3] = { { &next, order, 1 }, { &next, order, 2 }, { &next, order, 3 } };
+  JobCounter first;
+  JobCounter second;
+  JobCounter third;
+
+  jobs.Run(TestOrderStage, stages + 0, &first);
+  jobs.RunAfter(&first, TestOrderStage, stages + 1, &second);
+  jobs.RunAfter(&second, TestOrderStage, stages + 2, &third);
+  jobs.Wait(&third);
+  jobs.Destroy();
+
+  const long expected[3] = { 1, 2, 3 };
+  FailIfNotExpected(expected, order, __FUNCTION__);
+}
+
+void JobSystem::RunAllTests()
+{
+  TestParallelForCoversRange();
+  TestDependencies();
+}
+
+// Levels this size and smaller stream in as one block, ahead of any larger
+// level, so every texture has something to sample almost immediately.
+static const uint32_t s_MipTailSize = 32;
+
+struct StreamedTexture
+{
+  uint32_t size; // Square, power of two.
+  uint32_t levels;
+  uint32_t tail_mip; // First level of the mip tail.
+  uint32_t resident_mip; // Most detailed resident level, levels when nothing is.
+  uint32_t desired_mip;
+  bool pending; // A decode for this texture is in flight.
+  uint32_t last_visible_frame;
+  float distance;
+  VkImage image;
+  VkDeviceMemory memory;
+  VkImageView view;
+};
+
+// Levels [first_mip, last_mip) of one texture, tightly packed.
+struct TextureDecodeRequest
+{
+  uint32_t texture;
+  uint32_t size;
+  uint32_t first_mip;
+  uint32_t last_mip;
+  uint8_t* data;
+  VkDeviceSize bytes;
+};
+
+// Keeps the most useful mips of a large set of textures in a fixed amount of
+// memory.  Callers report each texture's distance every frame.  Decode
+// threads produce missing levels, tails first and then one level at a time
+// towards the desired one, and Update() uploads as many as fit in the
+// per-frame byte budget.  Without sparse residency a texture's resident
+// levels live in one image, so each change recreates the image and copies
+// the levels it keeps on the GPU; the old image is released once its frame
+// slot comes around again.  Over the memory cap, mips beyond what textures
+// currently want are evicted, least recently visible first.
+struct TextureStreamer
+{
+  struct Retired
+  {
+    VkImage image;
+    VkDeviceMemory memory;
+    VkImageView view;
+  };
+
+  struct Stats
+  {
+    uint64_t bytes_uploaded;
+    uint32_t uploads;
+    uint32_t evictions;
+    uint32_t dropped; // Decoded levels that were stale or didn't fit.
+    uint64_t lookups;
+    uint64_t hits; // Visible textures with their desired level resident.
+  };
+
+  VulkanState* state = nullptr;
+  StreamedTexture* textures = nullptr;
+  uint32_t texture_count = 0;
+  float near_distance = 2.0f; // Closer than this needs mip 0.
+  VkDeviceSize memory_cap = 0;
+  VkDeviceSize resident_bytes = 0;
+  VkDeviceSize upload_budget = 0;
+  uint32_t frames_in_flight = 0;
+  uint32_t frame = 0;
+
+  VkBuffer staging_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory staging_memory = VK_NULL_HANDLE;
+  uint8_t* staging = nullptr;
+  VkDeviceSize staging_slot_bytes = 0;
+  Retired retired[4][256];
+  uint32_t retired_count[4] = {};
+
+  // Shared with the decode jobs, under lock.
+  CRITICAL_SECTION lock;
+  TextureDecodeRequest queue[16];
+  uint32_t queue_head = 0;
+  uint32_t queue_count = 0;
+  TextureDecodeRequest completed[16];
+  uint32_t completed_count = 0;
+
+  // Main thread only.  Outstanding counts requests from Request() until their
+  // level is uploaded or dropped.
+  JobSystem* jobs = nullptr;
+  JobCounter decode_counter;
+  TextureDecodeRequest ready[16];
+  uint32_t ready_count = 0;
+  uint32_t outstanding = 0;
+  Stats stats = {};
+
+  void Create(VulkanState& vulkan_state, uint32_t count, uint32_t size, VkDeviceSize memory_limit, VkDeviceSize frame_upload_budget, uint32_t frame_count, JobSystem& job_system);
+  void Destroy();
+  void SetVisibility(uint32_t texture, bool visible, float distance);
+  void Update(VkCommandBuffer cmd, uint32_t frame_index);
+  void PrintStats(double seconds) const;
+
+  void Request(uint32_t texture, uint32_t first_mip, uint32_t last_mip);
+  void Rebuild(VkCommandBuffer cmd, uint32_t texture, uint32_t new_mip, const TextureDecodeRequest* upload, VkDeviceSize staging_offset);
+  static void DecodeJob(void* data, uint32_t begin, uint32_t end);
+  static void Decode(TextureDecodeRequest& request);
+
+  static uint32_t MipLevels(uint32_t size);
+  static VkDeviceSize LevelBytes(uint32_t size, uint32_t first_mip, uint32_t last_mip);
+  static uint32_t DesiredMip(float distance, float near_distance, uint32_t tail_mip);
+  static uint32_t PickEviction(const StreamedTexture* textures, uint32_t count, uint32_t skip);
+
+  // Tests.
+  static void TestLevels();
+  static void TestDesiredMip();
+  static void TestPickEviction();
+  static void RunAllTests();
+};
+
+uint32_t TextureStreamer::MipLevels(uint32_t size)
+{
+  uint32_t levels = 1;
+
+  while (size > 1)
+  {
+    size >>= 1;
+    ++levels;
+  }
+
+  return levels;
+}
+
+// RGBA8 texels in levels [first_mip, last_mip).
+VkDeviceSize TextureStreamer::LevelBytes(uint32_t size, uint32_t first_mip, uint32_t last_mip)
+{
+  VkDeviceSize bytes = 0;
+
+  for (uint32_t mip = first_mip; mip < last_mip; ++mip)
+  {
+    VkDeviceSize level_size = (size >> mip) ? (size >> mip) : 1;
+    bytes += level_size * level_size * 4;
+  }
+
+  return bytes;
+}
+
+// Each doubling of distance past near_distance halves the texels needed.
+uint32_t TextureStreamer::DesiredMip(float distance, float near_distance, uint32_t tail_mip)
+{
+  if (distance <= near_distance)
+  {
+    return 0;
+  }
+
+  uint32_t mip = (uint32_t)floorf(log2f(distance / near_distance));
+  return (mip > tail_mip) ? tail_mip : mip;
+}
+
+// The texture holding the most detail beyond what it wants, ties going to the
+// one seen least recently.  Tails are never evicted, and neither are levels a
+// texture still wants, so streaming can't thrash.
+uint32_t TextureStreamer::PickEviction(const StreamedTexture* textures, uint32_t count, uint32_t skip)
+{
+  uint32_t best = UINT32_MAX;
+  uint32_t best_excess = 0;
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    const StreamedTexture& texture = textures[i];
+
+    if ((i == skip) || (texture.resident_mip >= texture.tail_mip) || (texture.desired_mip <= texture.resident_mip))
+    {
+      continue;
+    }
+
+    uint32_t excess = texture.desired_mip - texture.resident_mip;
+
+    if ((excess > best_excess) || ((excess == best_excess) && (texture.last_visible_frame < textures[best].last_visible_frame)))
+    {
+      best = i;
+      best_excess = excess;
+    }
+  }
+
+  return best;
+}
+
+void TextureStreamer::Create(VulkanState& vulkan_state, uint32_t count, uint32_t size, VkDeviceSize memory_limit, VkDeviceSize frame_upload_budget, uint32_t frame_count, JobSystem& job_system)
+{
+  state = &vulkan_state;
+  jobs = &job_system;
+  texture_count = count;
+  memory_cap = memory_limit;
+  upload_budget = frame_upload_budget;
+  frames_in_flight = (frame_count > ARRAY_COUNT(retired)) ? ARRAY_COUNT(retired) : frame_count;
+  textures = (StreamedTexture*)Alloc(sizeof(StreamedTexture) * count, 16);
+  memset(textures, 0, sizeof(StreamedTexture) * count);
+
+  uint32_t levels = MipLevels(size);
+  uint32_t tail_mip = 0;
+
+  while ((size >> tail_mip) > s_MipTailSize)
+  {
+    ++tail_mip;
+  }
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    textures[i].size = size;
+    textures[i].levels = levels;
+    textures[i].tail_mip = tail_mip;
+    textures[i].resident_mip = levels;
+    textures[i].desired_mip = tail_mip;
+  }
+
+  // A frame's slot holds its budget, or one whole level 0 if that's bigger
+  // so the largest level can still go up on its own.
+  staging_slot_bytes = LevelBytes(size, 0, 1);
+  staging_slot_bytes = (upload_budget > staging_slot_bytes) ? upload_budget : staging_slot_bytes;
+  state->CreateBuffer(staging_slot_bytes * frames_in_flight, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_buffer, &staging_memory);
+  VK_CHECK(vkMapMemory(state->device, staging_memory, 0, VK_WHOLE_SIZE, 0, (void**)&staging));
+
+  InitializeCriticalSection(&lock);
+}
+
+// The GPU must be done with every frame.
+void TextureStreamer::Destroy()
+{
+  jobs->Wait(&decode_counter);
+  DeleteCriticalSection(&lock);
+
+  for (uint32_t i = 0; i < completed_count; ++i)
+  {
+    Free(completed[i].data);
+  }
+
+  for (uint32_t i = 0; i < ready_count; ++i)
+  {
+    Free(ready[i].data);
+  }
+
+  for (uint32_t slot = 0; slot < frames_in_flight; ++slot)
+  {
+    for (uint32_t i = 0; i < retired_count[slot]; ++i)
+    {
+      vkDestroyImageView(state->device, retired[slot][i].view, &state->callbacks);
+      vkDestroyImage(state->device, retired[slot][i].image, &state->callbacks);
+      vkFreeMemory(state->device, retired[slot][i].memory, &state->callbacks);
+    }
+  }
+
+  for (uint32_t i = 0; i < texture_count; ++i)
+  {
+    if (textures[i].image)
+    {
+      vkDestroyImageView(state->device, textures[i].view, &state->callbacks);
+      vkDestroyImage(state->device, textures[i].image, &state->callbacks);
+      vkFreeMemory(state->device, textures[i].memory, &state->callbacks);
+    }
+  }
+
+  vkUnmapMemory(state->device, staging_memory);
+  vkDestroyBuffer(state->device, staging_buffer, &state->callbacks);
+  vkFreeMemory(state->device, staging_memory, &state->callbacks);
+  Free(textures);
+  textures = nullptr;
+}
+
+// Textures that aren't visible only want their tail.
+void TextureStreamer::SetVisibility(uint32_t texture, bool visible, float distance)
+{
+  StreamedTexture& t = textures[texture];
+  t.distance = distance;
+  t.desired_mip = visible ? DesiredMip(distance, near_distance, t.tail_mip) : t.tail_mip;
+
+  if (visible)
+  {
+    t.last_visible_frame = frame;
+    ++stats.lookups;
+    stats.hits += (t.resident_mip <= t.desired_mip) ? 1 : 0;
+  }
+}
+
+void TextureStreamer::Request(uint32_t texture, uint32_t first_mip, uint32_t last_mip)
+{
+  TextureDecodeRequest request = {};
+  request.texture = texture;
+  request.size = textures[texture].size;
+  request.first_mip = first_mip;
+  request.last_mip = last_mip;
+  textures[texture].pending = true;
+  ++outstanding;
+
+  EnterCriticalSection(&lock);
+  queue[(queue_head + queue_count) % ARRAY_COUNT(queue)] = request;
+  ++queue_count;
+  LeaveCriticalSection(&lock);
+
+  jobs->Run(DecodeJob, this, &decode_counter);
+}
+
+// One job per request, but requests are taken in queue order rather than the
+// job's own, since jobs can run in any order.
+void TextureStreamer::DecodeJob(void* data, uint32_t, uint32_t)
+{
+  TextureStreamer& streamer = *(TextureStreamer*)data;
+
+  EnterCriticalSection(&streamer.lock);
+  TextureDecodeRequest request = streamer.queue[streamer.queue_head];
+  streamer.queue_head = (streamer.queue_head + 1) % ARRAY_COUNT(streamer.queue);
+  --streamer.queue_count;
+  LeaveCriticalSection(&streamer.lock);
+
+  Decode(request);
+
+  EnterCriticalSection(&streamer.lock);
+  streamer.completed[streamer.completed_count++] = request;
+  LeaveCriticalSection(&streamer.lock);
+}
+
+// There are no texture assets, so "decoding" synthesizes a checkerboard in a
+// per-texture color, tinted by level so mip transitions are visible.
+void TextureStreamer::Decode(TextureDecodeRequest& request)
+{
+  request.bytes = LevelBytes(request.size, request.first_mip, request.last_mip);
+  request.data = (uint8_t*)Alloc((size_t)request.bytes, 16);
+  uint32_t hash = (request.texture + 1) * 2654435761u;
+  uint32_t* texel = (uint32_t*)request.data;
+
+  for (uint32_t mip = request.first_mip; mip < request.last_mip; ++mip)
+  {
+    uint32_t level_size = (request.size >> mip) ? (request.size >> mip) : 1;
+    uint32_t cell_shift = (mip < 3) ? (5 - mip) : 2;
+    uint32_t tint = 255 - (mip * 16);
+
+    for (uint32_t y = 0; y < level_size; ++y)
+    {
+      for (uint32_t x = 0; x < level_size; ++x)
+      {
+        uint32_t color = (((x >> cell_shift) ^ (y >> cell_shift)) & 1) ? hash : ~hash;
+        uint32_t r = (((color >> 0) & 0xff) * tint) >> 8;
+        uint32_t g = (((color >> 8) & 0xff) * tint) >> 8;
+        uint32_t b = (((color >> 16) & 0xff) * tint) >> 8;
+        *texel++ = r | (g << 8) | (b << 16) | 0xff000000u;
+      }
+    }
+  }
+}
+
+void TextureStreamer::Rebuild(VkCommandBuffer cmd, uint32_t texture, uint32_t new_mip, const TextureDecodeRequest* upload, VkDeviceSize staging_offset)
+{
+  StreamedTexture& t = textures[texture];
+  uint32_t new_levels = t.levels - new_mip;
+  uint32_t old_mip = t.resident_mip;
+  uint32_t new_size = (t.size >> new_mip) ? (t.size >> new_mip) : 1;
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = new_size;
+  image_create_info.extent.height = new_size;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = new_levels;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage image = VK_NULL_HANDLE;
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  state->CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &image, &memory);
+
+  VkImageMemoryBarrier barriers[2] = {};
+  barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barriers[0].srcAccessMask = 0;
+  barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barriers[0].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barriers[0].image = image;
+  barriers[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barriers[0].subresourceRange.levelCount = new_levels;
+  barriers[0].subresourceRange.layerCount = 1;
+  barriers[1] = barriers[0];
+  barriers[1].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  barriers[1].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barriers[1].image = t.image;
+  barriers[1].subresourceRange.levelCount = t.levels - old_mip;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, t.image ? 2 : 1, barriers);
+
+  // Keep every level both images have.
+  if (t.image)
+  {
+    VkImageCopy copies[16] = {};
+    uint32_t copy_count = 0;
+
+    for (uint32_t mip = (old_mip > new_mip) ? old_mip : new_mip; mip < t.levels; ++mip)
+    {
+      uint32_t level_size = (t.size >> mip) ? (t.size >> mip) : 1;
+      VkImageCopy& copy = copies[copy_count++];
+      copy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      copy.srcSubresource.mipLevel = mip - old_mip;
+      copy.srcSubresource.layerCount = 1;
+      copy.dstSubresource = copy.srcSubresource;
+      copy.dstSubresource.mipLevel = mip - new_mip;
+      copy.extent.width = level_size;
+      copy.extent.height = level_size;
+      copy.extent.depth = 1;
+    }
+
+    vkCmdCopyImage(cmd, t.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, copy_count, copies);
+  }
+
+  if (upload)
+  {
+    VkBufferImageCopy regions[16] = {};
+    VkDeviceSize offset = staging_offset;
+
+    for (uint32_t mip = upload->first_mip; mip < upload->last_mip; ++mip)
+    {
+      uint32_t level_size = (t.size >> mip) ? (t.size >> mip) : 1;
+      VkBufferImageCopy& region = regions[mip - upload->first_mip];
+      region.bufferOffset = offset;
+      region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      region.imageSubresource.mipLevel = mip - new_mip;
+      region.imageSubresource.layerCount = 1;
+      region.imageExtent.width = level_size;
+      region.imageExtent.height = level_size;
+      region.imageExtent.depth = 1;
+      offset += LevelBytes(t.size, mip, mip + 1);
+    }
+
+    vkCmdCopyBufferToImage(cmd, staging_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, upload->last_mip - upload->first_mip, regions);
+  }
+
+  barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barriers[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, barriers);
+
+  VkImageViewCreateInfo view_create_info = {};
+  view_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_create_info.image = image;
+  view_create_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  view_create_info.subresourceRange = barriers[0].subresourceRange;
+  VkImageView view = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateImageView(state->device, &view_create_info, &state->callbacks, &view));
+
+  if (t.image)
+  {
+    uint32_t slot = frame % frames_in_flight;
+
+    if (retired_count[slot] == ARRAY_COUNT(retired[slot]))
+    {
+      Fail(__FUNCTION__);
+    }
+
+    Retired& old = retired[slot][retired_count[slot]++];
+    old.image = t.image;
+    old.memory = t.memory;
+    old.view = t.view;
+  }
+
+  resident_bytes -= LevelBytes(t.size, old_mip, t.levels);
+  resident_bytes += LevelBytes(t.size, new_mip, t.levels);
+  t.image = image;
+  t.memory = memory;
+  t.view = view;
+  t.resident_mip = new_mip;
+}
+
+// Records uploads and evictions into cmd, ahead of any pass sampling the
+// textures.  The previous use of this frame's slot must have completed.
+void TextureStreamer::Update(VkCommandBuffer cmd, uint32_t frame_index)
+{
+  frame = frame_index;
+  uint32_t slot = frame % frames_in_flight;
+
+  for (uint32_t i = 0; i < retired_count[slot]; ++i)
+  {
+    vkDestroyImageView(state->device, retired[slot][i].view, &state->callbacks);
+    vkDestroyImage(state->device, retired[slot][i].image, &state->callbacks);
+    vkFreeMemory(state->device, retired[slot][i].memory, &state->callbacks);
+  }
+
+  retired_count[slot] = 0;
+
+  EnterCriticalSection(&lock);
+
+  for (uint32_t i = 0; i < completed_count; ++i)
+  {
+    ready[ready_count++] = completed[i];
+  }
+
+  completed_count = 0;
+  LeaveCriticalSection(&lock);
+
+  // Upload decoded levels, tails first, until the budget runs out.  Anything
+  // that doesn't fit waits for the next frame.
+  VkDeviceSize staging_used = 0;
+
+  for (uint32_t pass = 0; pass < 2; ++pass)
+  {
+    for (uint32_t i = 0; i < ready_count;)
+    {
+      TextureDecodeRequest& request = ready[i];
+      StreamedTexture& t = textures[request.texture];
+      bool tail = (request.first_mip == t.tail_mip);
+
+      if ((pass == 0) && !tail)
+      {
+        ++i;
+        continue;
+      }
+
+      // Skip levels the camera has moved away from, or that no longer sit
+      // right above what's resident.
+      bool keep = (request.last_mip == t.resident_mip) && (tail || (request.first_mip >= t.desired_mip));
+
+      if (keep)
+      {
+        if (staging_used && ((staging_used + request.bytes) > upload_budget))
+        {
+          ++i;
+          continue;
+        }
+
+        VkDeviceSize growth = LevelBytes(t.size, request.first_mip, request.last_mip);
+
+        while ((resident_bytes + growth) > memory_cap)
+        {
+          uint32_t victim = PickEviction(textures, texture_count, request.texture);
+
+          if (victim == UINT32_MAX)
+          {
+            break;
+          }
+
+          Rebuild(cmd, victim, textures[victim].resident_mip + 1, nullptr, 0);
+          ++stats.evictions;
+        }
+
+        keep = tail || ((resident_bytes + growth) <= memory_cap);
+      }
+
+      if (keep)
+      {
+        VkDeviceSize offset = (slot * staging_slot_bytes) + staging_used;
+        memcpy(staging + offset, request.data, (size_t)request.bytes);
+        Rebuild(cmd, request.texture, request.first_mip, &request, offset);
+        staging_used += (request.bytes + 15) & ~(VkDeviceSize)15;
+        stats.bytes_uploaded += request.bytes;
+        ++stats.uploads;
+      }
+      else
+      {
+        ++stats.dropped;
+      }
+
+      t.pending = false;
+      --outstanding;
+      Free(request.data);
+      ready[i] = ready[--ready_count];
+    }
+  }
+
+  // Queue the next decodes.  Any texture without a tail goes first, then the
+  // ones furthest from their desired level, nearest first.
+  while (outstanding < ARRAY_COUNT(queue))
+  {
+    uint32_t best = UINT32_MAX;
+    uint32_t best_deficit = 0;
+    bool best_tail = false;
+
+    for (uint32_t i = 0; i < texture_count; ++i)
+    {
+      const StreamedTexture& t = textures[i];
+
+      if (t.pending)
+      {
+        continue;
+      }
+
+      bool tail = (t.resident_mip == t.levels);
+      uint32_t deficit = (t.resident_mip > t.desired_mip) ? (t.resident_mip - t.desired_mip) : 0;
+
+      if (!tail && (!deficit || best_tail))
+      {
+        continue;
+      }
+
+      if ((best == UINT32_MAX) || (tail && !best_tail) || (deficit > best_deficit) || ((deficit == best_deficit) && (t.distance < textures[best].distance)))
+      {
+        best = i;
+        best_deficit = deficit;
+        best_tail = tail;
+      }
+    }
+
+    if (best == UINT32_MAX)
+    {
+      break;
+    }
+
+    const StreamedTexture& t = textures[best];
+    Request(best, best_tail ? t.tail_mip : (t.resident_mip - 1), best_tail ? t.levels : t.resident_mip);
+  }
+}
+
+void TextureStreamer::PrintStats(double seconds) const
+{
+  printf("  uploads: %u, %.1f MB (%.1f MB/s)\n", stats.uploads, stats.bytes_uploaded / (1024.0 * 1024.0), stats.bytes_uploaded / (1024.0 * 1024.0 * seconds));
+  printf("  evictions: %u, dropped: %u\n", stats.evictions, stats.dropped);
+  printf("  residency hit rate: %.1f%% of %llu visible lookups\n", stats.lookups ? (100.0 * stats.hits / stats.lookups) : 0.0, (unsigned long long)stats.lookups);
+  printf("  resident: %.1f of %.1f MB\n", resident_bytes / (1024.0 * 1024.0), memory_cap / (1024.0 * 1024.0));
+}
+
+void TextureStreamer::TestLevels()
+{
+  FailIfNotExpected(11u, MipLevels(1024), __FUNCTION__);
+  FailIfNotExpected(1u, MipLevels(1), __FUNCTION__);
+  FailIfNotExpected((VkDeviceSize)(64 * 4 + 16 * 4 + 4 * 4), LevelBytes(8, 0, 3), __FUNCTION__);
+  FailIfNotExpected((VkDeviceSize)4, LevelBytes(8, 3, 4), __FUNCTION__);
+}
+
+void TextureStreamer::TestDesiredMip()
+{
+  FailIfNotExpected(0u, DesiredMip(1.0f, 2.0f, 5), __FUNCTION__);
+  FailIfNotExpected(0u, DesiredMip(3.9f, 2.0f, 5), __FUNCTION__);
+  FailIfNotExpected(1u, DesiredMip(4.0f, 2.0f, 5), __FUNCTION__);
+  FailIfNotExpected(2u, DesiredMip(9.0f, 2.0f, 5), __FUNCTION__);
+  FailIfNotExpected(5u, DesiredMip(1000.0f, 2.0f, 5), __FUNCTION__);
+}
+
+void TextureStreamer::TestPickEviction()
+{
+  StreamedTexture textures[4] = {};
+
+  for (uint32_t i = 0; i < 4; ++i)
+  {
+    textures[i].levels = 11;
+    textures[i].tail_mip = 5;
+  }
+
+  // Wants what it has.
+  textures[0].resident_mip = 1;
+  textures[0].desired_mip = 1;
+  // Only its tail.
+  textures[1].resident_mip = 5;
+  textures[1].desired_mip = 5;
+  // One level more than it wants, seen recently.
+  textures[2].resident_mip = 2;
+  textures[2].desired_mip = 3;
+  textures[2].last_visible_frame = 10;
+  // One level more than it wants, seen long ago.
+  textures[3].resident_mip = 3;
+  textures[3].desired_mip = 4;
+  textures[3].last_visible_frame = 2;
+
+  FailIfNotExpected(3u, PickEviction(textures, 4, UINT32_MAX), __FUNCTION__);
+  FailIfNotExpected(2u, PickEviction(textures, 4, 3), __FUNCTION__);
+
+  textures[2].desired_mip = 5;
+  FailIfNotExpected(2u, PickEviction(textures, 4, UINT32_MAX), __FUNCTION__);
+
+  textures[2].desired_mip = 2;
+  textures[3].desired_mip = 3;
+  FailIfNotExpected(UINT32_MAX, PickEviction(textures, 4, UINT32_MAX), __FUNCTION__);
+}
+
+void TextureStreamer::RunAllTests()
+{
+  TestLevels();
+  TestDesiredMip();
+  TestPickEviction();
+}
+
+struct TexturedBenchPass
+{
+  TextureStreamer* streamer;
+  DescriptorAllocator* descriptors;
+  VkPipeline pipeline;
+  VkPipelineLayout pipeline_layout;
+  VkDescriptorSetLayout set_layout;
+  VkSampler sampler;
+  VkBuffer vertex_buffer;
+  VkExtent2D extent;
+  uint32_t grid;
+  const bool* visible;
+};
+
+// Draws every visible texture that has something resident into its cell of a
+// screen grid.
+static void RecordTexturedBenchPass(VkCommandBuffer cmd, void* userdata)
+{
+  const TexturedBenchPass& pass = *(const TexturedBenchPass*)userdata;
+
+  if (!pass.pipeline)
+  {
+    return;
+  }
+
+  VkViewport viewport = {};
+  viewport.width = (float)pass.extent.width;
+  viewport.height = (float)pass.extent.height;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = {};
+  scissor.extent = pass.extent;
+  const VkDeviceSize offsets = 0;
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pass.pipeline);
+  vkCmdBindVertexBuffers(cmd, 1, 1, &pass.vertex_buffer, &offsets);
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+  float scale = 1.0f / pass.grid;
+
+  for (uint32_t i = 0; i < pass.streamer->texture_count; ++i)
+  {
+    const StreamedTexture& texture = pass.streamer->textures[i];
+
+    if (!pass.visible[i] || !texture.view)
+    {
+      continue;
+    }
+
+    DescriptorBinding binding = {};
+    binding.binding = 0;
+    binding.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    binding.image.sampler = pass.sampler;
+    binding.image.imageView = texture.view;
+    binding.image.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    VkDescriptorSet set = pass.descriptors->Get(pass.set_layout, &binding, 1);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pass.pipeline_layout, 0, 1, &set, 0, nullptr);
+
+    PerDrawData draw = {};
+    draw.obj_to_world.SetIdentity();
+    draw.obj_to_world.m[0] = scale;
+    draw.obj_to_world.m[5] = scale;
+    draw.obj_to_world.SetPosition(Vec3(-1.0f + ((i % pass.grid) + 0.5f) * 2.0f * scale, -1.0f + ((i / pass.grid) + 0.5f) * 2.0f * scale, 0.5f));
+    vkCmdPushConstants(cmd, pass.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(draw), &draw);
+    vkCmdDraw(cmd, ARRAY_COUNT(s_ClipSpaceTriangleVertices), 1, 0, 0);
+  }
+}
+
+static int CompareDoubles(const void* a, const void* b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+// Flies a camera over a 16x16 grid of 1024x1024 textures (1.4 GB with full
+// mip chains) with 192 MB of texture memory and 8 MB of uploads per frame.
+void RunTextureStreamingBench(VulkanState& state, const Options& options)
+{
+  const uint32_t frame_count = 1200;
+  const uint32_t frames_in_flight = 2;
+  const uint32_t grid = 16;
+  const uint32_t texture_count = grid * grid;
+  const float spacing = 4.0f;
+  const float view_distance = 24.0f;
+  VkExtent2D extent = { (uint32_t)options.width, (uint32_t)options.height };
+
+  // The frame loop never waits on the decode jobs, so they need at least one
+  // worker besides this thread.
+  uint32_t worker_count = JobSystem::DefaultWorkerCount();
+  JobSystem jobs;
+  jobs.Create((worker_count < 2) ? 2 : worker_count);
+  TextureStreamer streamer;
+  streamer.Create(state, texture_count, 1024, 192ull << 20, 8ull << 20, frames_in_flight, jobs);
+
+  VkBuffer vertex_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory vertex_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(sizeof(s_ClipSpaceTriangleVertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &vertex_buffer, &vertex_memory);
+  void* vertex_data = nullptr;
+  VK_CHECK(vkMapMemory(state.device, vertex_memory, 0, VK_WHOLE_SIZE, 0, &vertex_data));
+  memcpy(vertex_data, s_ClipSpaceTriangleVertices, sizeof(s_ClipSpaceTriangleVertices));
+  vkUnmapMemory(state.device, vertex_memory);
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage output_image = VK_NULL_HANDLE;
+  VkDeviceMemory output_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &output_image, &output_memory);
+
+  bool visible[texture_count] = {};
+  TexturedBenchPass bench_pass = {};
+  bench_pass.streamer = &streamer;
+  bench_pass.vertex_buffer = vertex_buffer;
+  bench_pass.extent = extent;
+  bench_pass.grid = grid;
+  bench_pass.visible = visible;
+
+  RenderGraph graph;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &output_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  uint32_t pass = graph.AddPass("textured", RecordTexturedBenchPass, &bench_pass);
+  graph.AddUse(pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.Compile(state);
+
+  VkSamplerCreateInfo sampler_create_info = {};
+  sampler_create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_create_info.magFilter = VK_FILTER_LINEAR;
+  sampler_create_info.minFilter = VK_FILTER_LINEAR;
+  sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  sampler_create_info.maxLod = 16.0f;
+  VK_CHECK(vkCreateSampler(state.device, &sampler_create_info, &state.callbacks, &bench_pass.sampler));
+
+  VkDescriptorSetLayoutBinding layout_binding = {};
+  layout_binding.binding = 0;
+  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  layout_binding.descriptorCount = 1;
+  layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.bindingCount = 1;
+  descriptor_layout.pBindings = &layout_binding;
+  VK_CHECK(vkCreateDescriptorSetLayout(state.device, &descriptor_layout, &state.callbacks, &bench_pass.set_layout));
+
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.size = sizeof(PerDrawData);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.setLayoutCount = 1;
+  pipeline_layout_create_info.pSetLayouts = &bench_pass.set_layout;
+  pipeline_layout_create_info.pushConstantRangeCount = 1;
+  pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+  VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_create_info, &state.callbacks, &bench_pass.pipeline_layout));
+
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+
+  if (state.LoadShaderModule("textured.vert.spv", &vertex_module) && state.LoadShaderModule("textured.frag.spv", &frag_module))
+  {
+    bench_pass.pipeline = CreateVertexColorPipeline(state, graph.RenderPass(pass), bench_pass.pipeline_layout, vertex_module, frag_module);
+  }
+  else
+  {
+    printf("Streaming without drawing, no textured shaders\n");
+  }
+
+  if (vertex_module)
+  {
+    vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+  }
+
+  if (frag_module)
+  {
+    vkDestroyShaderModule(state.device, frag_module, &state.callbacks);
+  }
+
+  DescriptorAllocator descriptors;
+  descriptors.Create(state, frames_in_flight);
+  bench_pass.descriptors = &descriptors;
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = frames_in_flight;
+  VkCommandBuffer cmds[frames_in_flight] = {};
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, cmds));
+
+  VkFence fences[frames_in_flight] = {};
+
+  for (uint32_t i = 0; i < frames_in_flight; ++i)
+  {
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, fences + i));
+  }
+
+  double* frame_ms = (double*)Alloc(sizeof(double) * frame_count, 16);
+  double start_ms = GetTimeMs();
+  double last_ms = start_ms;
+
+  for (uint32_t frame = 0; frame < frame_count; ++frame)
+  {
+    uint32_t slot = frame % frames_in_flight;
+    VK_CHECK(vkWaitForFences(state.device, 1, fences + slot, VK_TRUE, UINT64_MAX));
+    VK_CHECK(vkResetFences(state.device, 1, fences + slot));
+    descriptors.BeginFrame(frame);
+
+    // Two laps of a figure of eight low over the grid.
+    float t = (6.2831853f * 2.0f * frame) / frame_count;
+    float extent_world = (grid - 1) * spacing;
+    Vec3 camera(extent_world * (0.5f + 0.45f * sinf(t)), 1.0f, extent_world * (0.5f + 0.45f * sinf(2.0f * t)));
+
+    for (uint32_t i = 0; i < texture_count; ++i)
+    {
+      float dx = ((i % grid) * spacing) - camera.x;
+      float dz = ((i / grid) * spacing) - camera.z;
+      float distance = sqrtf((dx * dx) + (camera.y * camera.y) + (dz * dz));
+      visible[i] = distance < view_distance;
+      streamer.SetVisibility(i, visible[i], distance);
+    }
+
+    VkCommandBufferBeginInfo cmd_buf_info = {};
+    cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vkBeginCommandBuffer(cmds[slot], &cmd_buf_info));
+    streamer.Update(cmds[slot], frame);
+    graph.Execute(cmds[slot], 0);
+    VK_CHECK(vkEndCommandBuffer(cmds[slot]));
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = cmds + slot;
+    VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fences[slot]));
+
+    double now_ms = GetTimeMs();
+    frame_ms[frame] = now_ms - last_ms;
+    last_ms = now_ms;
+  }
+
+  VK_CHECK(vkWaitForFences(state.device, frames_in_flight, fences, VK_TRUE, UINT64_MAX));
+  double total_ms = GetTimeMs() - start_ms;
+
+  double mean_ms = 0.0;
+  double variance = 0.0;
+
+  for (uint32_t i = 0; i < frame_count; ++i)
+  {
+    mean_ms += frame_ms[i] / frame_count;
+  }
+
+  for (uint32_t i = 0; i < frame_count; ++i)
+  {
+    variance += ((frame_ms[i] - mean_ms) * (frame_ms[i] - mean_ms)) / frame_count;
+  }
+
+  qsort(frame_ms, frame_count, sizeof(double), CompareDoubles);
+
+  printf("Texture streaming: %u frames, %u textures of 1024x1024\n", frame_count, texture_count);
+  streamer.PrintStats(total_ms / 1000.0);
+  printf("  frame time: %.3f ms mean, %.3f ms std dev, %.3f ms 99th percentile, %.3f ms max\n", mean_ms, sqrt(variance), frame_ms[(frame_count * 99) / 100], frame_ms[frame_count - 1]);
+  Free(frame_ms);
+
+  for (uint32_t i = 0; i < frames_in_flight; ++i)
+  {
+    vkDestroyFence(state.device, fences[i], &state.callbacks);
+  }
+
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+  descriptors.Destroy();
+
+  if (bench_pass.pipeline)
+  {
+    vkDestroyPipeline(state.device, bench_pass.pipeline, &state.callbacks);
+  }
+
+  vkDestroyPipelineLayout(state.device, bench_pass.pipeline_layout, &state.callbacks);
+  vkDestroyDescriptorSetLayout(state.device, bench_pass.set_layout, &state.callbacks);
+  vkDestroySampler(state.device, bench_pass.sampler, &state.callbacks);
+  graph.Destroy();
+  streamer.Destroy();
+  jobs.Destroy();
+  vkDestroyImage(state.device, output_image, &state.callbacks);
+  vkFreeMemory(state.device, output_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, vertex_buffer, &state.callbacks);
+  vkFreeMemory(state.device, vertex_memory, &state.callbacks);
+}
+
+struct TransformJobData
+{
+  const Mat4* parents;
+  const Mat4* locals;
+  Mat4* worlds;
+};
+
+static void UpdateTransformsJob(void* data, uint32_t begin, uint32_t end)
+{
+  const TransformJobData& job = *(const TransformJobData*)data;
+
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    job.worlds[i] = job.parents[i] * job.locals[i];
+  }
+}
+
+struct CullJobData
+{
+  const Vec4* spheres; // xyz center, w radius.
+  const Vec4* planes; // xyz normal, w distance, normals point inwards.
+  uint8_t* visible;
+};
+
+static void CullSpheresJob(void* data, uint32_t begin, uint32_t end)
+{
+  const CullJobData& job = *(const CullJobData*)data;
+
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    const Vec4& sphere = job.spheres[i];
+    uint8_t inside = 1;
+
+    for (uint32_t p = 0; p < 6; ++p)
+    {
+      const Vec4& plane = job.planes[p];
+      inside &= ((plane.x * sphere.x) + (plane.y * sphere.y) + (plane.z * sphere.z) + plane.w) > -sphere.w;
+    }
+
+    job.visible[i] = inside;
+  }
+}
+
+static void DecodeTextureJob(void* data, uint32_t begin, uint32_t end)
+{
+  TextureDecodeRequest* requests = (TextureDecodeRequest*)data;
+
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    TextureStreamer::Decode(requests[i]);
+  }
+}
+
+struct RecordJobData
+{
+  VkCommandBuffer* cmds;
+  VkPipelineLayout pipeline_layout;
+  uint32_t draws_per_buffer;
+};
+
+// Each command buffer has its own pool, so they can be recorded in parallel.
+static void RecordCommandsJob(void* data, uint32_t begin, uint32_t end)
+{
+  const RecordJobData& job = *(const RecordJobData*)data;
+
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    VkCommandBufferInheritanceInfo inheritance_info = {};
+    inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    VkCommandBufferBeginInfo cmd_buf_info = {};
+    cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    cmd_buf_info.pInheritanceInfo = &inheritance_info;
+    VK_CHECK(vkBeginCommandBuffer(job.cmds[i], &cmd_buf_info));
+
+    PerDrawData draw = {};
+    draw.obj_to_world.SetIdentity();
+
+    for (uint32_t d = 0; d < job.draws_per_buffer; ++d)
+    {
+      draw.obj_to_world.m[3] = (float)d;
+      vkCmdPushConstants(job.cmds[i], job.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(draw), &draw);
+    }
+
+    VK_CHECK(vkEndCommandBuffer(job.cmds[i]));
+  }
+}
+
+// Runs transform updates, culling, texture decoding and parallel command
+// recording on 1, 2, 4, ... N workers and reports the speedup over one.
+// Recording is push constants only, since commands are what's being timed
+// and there's no pipeline to draw with here.
+void RunJobSystemBench(VulkanState& state)
+{
+  enum { WORKLOAD_TRANSFORMS, WORKLOAD_CULLING, WORKLOAD_DECODING, WORKLOAD_RECORDING, WORKLOAD_COUNT };
+  const char* const workload_names[WORKLOAD_COUNT] = { "transforms", "culling", "decoding", "recording" };
+  const uint32_t transform_count = 1 << 18;
+  const uint32_t sphere_count = 1 << 20;
+  const uint32_t texture_count = 32;
+  const uint32_t cmd_count = 64;
+  const uint32_t repeats = 8;
+
+  Mat4* transforms = (Mat4*)Alloc(sizeof(Mat4) * transform_count * 3, 16);
+  TransformJobData transform_data = { transforms, transforms + transform_count, transforms + (transform_count * 2) };
+
+  for (uint32_t i = 0; i < transform_count * 2; ++i)
+  {
+    transforms[i].SetIdentity();
+    transforms[i].SetPosition(Vec3((float)(i % 100), (float)(i % 37), (float)(i % 11)));
+  }
+
+  Vec4* spheres = (Vec4*)Alloc(sizeof(Vec4) * sphere_count, 16);
+  uint8_t* visible = (uint8_t*)Alloc(sphere_count, 16);
+  const Vec4 planes[6] = { Vec4(1.0f, 0.0f, 0.0f, 50.0f), Vec4(-1.0f, 0.0f, 0.0f, 50.0f), Vec4(0.0f, 1.0f, 0.0f, 50.0f), Vec4(0.0f, -1.0f, 0.0f, 50.0f), Vec4(0.0f, 0.0f, 1.0f, 0.0f), Vec4(0.0f, 0.0f, -1.0f, 100.0f) };
+  CullJobData cull_data = { spheres, planes, visible };
+
+  for (uint32_t i = 0; i < sphere_count; ++i)
+  {
+    spheres[i] = Vec4((float)(i % 200) - 100.0f, (float)((i / 200) % 200) - 100.0f, (float)(i % 150), 1.0f);
+  }
+
+  TextureDecodeRequest requests[texture_count] = {};
+
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.size = sizeof(PerDrawData);
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.pushConstantRangeCount = 1;
+  pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_create_info, &state.callbacks, &pipeline_layout));
+
+  VkCommandPool cmd_pools[cmd_count + 1] = {};
+  VkCommandBuffer cmds[cmd_count] = {};
+  VkCommandBuffer primary = VK_NULL_HANDLE;
+
+  for (uint32_t i = 0; i <= cmd_count; ++i)
+  {
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, cmd_pools + i));
+
+    VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+    cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buffer_alloc_info.commandPool = cmd_pools[i];
+    cmd_buffer_alloc_info.level = (i < cmd_count) ? VK_COMMAND_BUFFER_LEVEL_SECONDARY : VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buffer_alloc_info.commandBufferCount = 1;
+    VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, (i < cmd_count) ? (cmds + i) : &primary));
+  }
+
+  RecordJobData record_data = { cmds, pipeline_layout, 4000 };
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+  uint32_t max_workers = JobSystem::DefaultWorkerCount();
+  double base_ms[WORKLOAD_COUNT] = {};
+  printf("Job system: %u hardware threads\n", max_workers);
+
+  for (uint32_t workers = 1;; workers = ((workers * 2) > max_workers) ? max_workers : (workers * 2))
+  {
+    JobSystem jobs;
+    jobs.Create(workers);
+    printf("  %u worker(s):\n", workers);
+
+    for (uint32_t w = 0; w < WORKLOAD_COUNT; ++w)
+    {
+      jobs.ResetStats();
+      double start_ms = GetTimeMs();
+
+      for (uint32_t r = 0; r < repeats; ++r)
+      {
+        JobCounter counter;
+
+        switch (w)
+        {
+        case WORKLOAD_TRANSFORMS:
+        {
+          jobs.ParallelFor(transform_count, 2048, UpdateTransformsJob, &transform_data, &counter);
+          break;
+        }
+        case WORKLOAD_CULLING:
+        {
+          jobs.ParallelFor(sphere_count, 8192, CullSpheresJob, &cull_data, &counter);
+          break;
+        }
+        case WORKLOAD_DECODING:
+        {
+          for (uint32_t i = 0; i < texture_count; ++i)
+          {
+            Free(requests[i].data);
+            requests[i].texture = i;
+            requests[i].size = 256;
+            requests[i].first_mip = 0;
+            requests[i].last_mip = TextureStreamer::MipLevels(256);
+            requests[i].data = nullptr;
+          }
+
+          jobs.ParallelFor(texture_count, 1, DecodeTextureJob, requests, &counter);
+          break;
+        }
+        case WORKLOAD_RECORDING:
+        {
+          jobs.ParallelFor(cmd_count, 1, RecordCommandsJob, &record_data, &counter);
+          break;
+        }
+        }
+
+        jobs.Wait(&counter);
+
+        if (w == WORKLOAD_RECORDING)
+        {
+          VkCommandBufferBeginInfo cmd_buf_info = {};
+          cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+          cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+          VK_CHECK(vkBeginCommandBuffer(primary, &cmd_buf_info));
+          vkCmdExecuteCommands(primary, cmd_count, cmds);
+          VK_CHECK(vkEndCommandBuffer(primary));
+
+          VkSubmitInfo submit_info = {};
+          submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+          submit_info.commandBufferCount = 1;
+          submit_info.pCommandBuffers = &primary;
+          VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+          VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+          VK_CHECK(vkResetFences(state.device, 1, &fence));
+        }
+      }
+
+      double ms = (GetTimeMs() - start_ms) / repeats;
+      base_ms[w] = (workers == 1) ? ms : base_ms[w];
+      printf("   %-10s %8.3f ms (%.2fx)\n", workload_names[w], ms, base_ms[w] / ms);
+      jobs.PrintStats();
+    }
+
+    jobs.Destroy();
+
+    if (workers == max_workers)
+    {
+      break;
+    }
+  }
+
+  for (uint32_t i = 0; i < texture_count; ++i)
+  {
+    Free(requests[i].data);
+  }
+
+  vkDestroyFence(state.device, fence, &state.callbacks);
+
+  for (uint32_t i = 0; i <= cmd_count; ++i)
+  {
+    vkDestroyCommandPool(state.device, cmd_pools[i], &state.callbacks);
+  }
+
+  vkDestroyPipelineLayout(state.device, pipeline_layout, &state.callbacks);
+  Free(visible);
+  Free(spheres);
+  Free(transforms);
+}
+
+static const uint32_t s_SceneNoParent = 0xffffffffu;
+static const uint32_t s_SceneMaxDepth = 64;
+
+struct SceneRange
+{
+  uint32_t begin;
+  uint32_t end;
+};
+
+// A transform hierarchy stored as flat arrays.  Nodes are added in any order
+// as long as parents come first, then Build() lays them out breadth first, so
+// each level is one contiguous range of slots and each node's children are
+// consecutive.  That makes the descendants of a node one contiguous range per
+// level below it, so Update() can walk just the subtrees under nodes whose
+// local transform changed, and the world transforms it rewrote are a short
+// list of ranges that upload as straight copies.  Node handles stay valid
+// across Build(), the arrays are indexed by slot.
+struct SceneGraph
+{
+  uint32_t capacity = 0;
+  uint32_t node_count = 0;
+  uint32_t level_count = 0;
+  uint32_t level_start[s_SceneMaxDepth + 1];
+
+  // By handle.
+  uint32_t* node_parents = nullptr;
+  uint32_t* slots = nullptr;
+
+  // By slot.
+  uint32_t* parents = nullptr; // Slot of the parent, or s_SceneNoParent.
+  uint32_t* child_start = nullptr; // Children are [child_start[i], child_start[i + 1]).
+  Affine3x4* locals = nullptr;
+  PerDrawData* worlds = nullptr; // Ready to hand to PerDrawPath::Draw() or copy to a per-object buffer.
+  uint8_t* queued = nullptr; // In the dirty list.
+  uint8_t* changed = nullptr; // Rewritten by the last Update().
+
+  // Slots whose local transform changed since the last Update().
+  uint32_t* dirty = nullptr;
+  uint32_t dirty_count = 0;
+
+  // What the last Update() rewrote: subtree i is ranges[subtrees[i]] up to
+  // ranges[subtrees[i + 1]], in level order.
+  SceneRange* ranges = nullptr;
+  uint32_t range_count = 0;
+  uint32_t range_capacity = 0;
+  uint32_t* subtrees = nullptr;
+  uint32_t subtree_count = 0;
+  uint32_t changed_count = 0;
+
+  void Create(uint32_t max_nodes);
+  void Destroy();
+  uint32_t Add(uint32_t parent, const Affine3x4& local);
+  void Build();
+  void SetLocal(uint32_t node, const Affine3x4& local);
+  void MarkAllDirty();
+  void Update(JobSystem* jobs);
+  void CopyChanged(PerDrawData* objects, JobSystem* jobs) const;
+
+  void MarkDirty(uint32_t slot);
+  static void UpdateJob(void* data, uint32_t begin, uint32_t end);
+  static void CopyChangedJob(void* data, uint32_t begin, uint32_t end);
+
+  // Tests.
+  static void TestBuildOrder();
+  static void TestIncrementalUpdate();
+  static void RunAllTests();
+};
+
+void SceneGraph::Create(uint32_t max_nodes)
+{
+  capacity = max_nodes;
+  node_count = 0;
+  level_count = 0;
+  node_parents = (uint32_t*)Alloc(sizeof(uint32_t) * capacity, 16);
+  slots = (uint32_t*)Alloc(sizeof(uint32_t) * capacity, 16);
+  parents = (uint32_t*)Alloc(sizeof(uint32_t) * capacity, 16);
+  child_start = (uint32_t*)Alloc(sizeof(uint32_t) * (capacity + 1), 16);
+  locals = (Affine3x4*)Alloc(sizeof(Affine3x4) * capacity, 16);
+  worlds = (PerDrawData*)Alloc(sizeof(PerDrawData) * capacity, 16);
+  queued = (uint8_t*)Alloc(capacity, 16);
+  changed = (uint8_t*)Alloc(capacity, 16);
+  dirty = (uint32_t*)Alloc(sizeof(uint32_t) * capacity, 16);
+  subtrees = (uint32_t*)Alloc(sizeof(uint32_t) * (capacity + 1), 16);
+  memset(queued, 0, capacity);
+  memset(changed, 0, capacity);
+  dirty_count = 0;
+  range_capacity = 1024;
+  ranges = (SceneRange*)Alloc(sizeof(SceneRange) * range_capacity, 16);
+  range_count = 0;
+  subtree_count = 0;
+  changed_count = 0;
+}
+
+void SceneGraph::Destroy()
+{
+  Free(ranges);
+  Free(subtrees);
+  Free(dirty);
+  Free(changed);
+  Free(queued);
+  Free(worlds);
+  Free(locals);
+  Free(child_start);
+  Free(parents);
+  Free(slots);
+  Free(node_parents);
+  capacity = 0;
+  node_count = 0;
+}
+
+// Until Build(), the by-slot arrays are in handle order.
+uint32_t SceneGraph::Add(uint32_t parent, const Affine3x4& local)
+{
+  if ((node_count == capacity) || ((parent != s_SceneNoParent) && (parent >= node_count)))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  uint32_t node = node_count++;
+  node_parents[node] = parent;
+  locals[node] = local;
+  return node;
+}
+
+void SceneGraph::Build()
+{
+  // Children of each node as ranges of one array, in handle order.  The
+  // by-slot child_start doubles as the by-handle one until the end.
+  uint32_t* children = (uint32_t*)Alloc(sizeof(uint32_t) * node_count, 16);
+  uint32_t* order = (uint32_t*)Alloc(sizeof(uint32_t) * node_count, 16);
+  memset(child_start, 0, sizeof(uint32_t) * (node_count + 1));
+
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    if (node_parents[i] != s_SceneNoParent)
+    {
+      ++child_start[node_parents[i] + 1];
+    }
+  }
+
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    child_start[i + 1] += child_start[i];
+  }
+
+  uint32_t order_count = 0;
+
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    if (node_parents[i] != s_SceneNoParent)
+    {
+      children[child_start[node_parents[i]]++] = i;
+    }
+    else
+    {
+      order[order_count++] = i;
+    }
+  }
+
+  // The fill above advanced every start to the next node's start.
+  for (uint32_t i = node_count; i > 0; --i)
+  {
+    child_start[i] = child_start[i - 1];
+  }
+
+  child_start[0] = 0;
+
+  // Breadth first from the roots.  Each level is the children of the
+  // previous level in order, so by the time the first node of a level comes
+  // up, all of that level has been appended.
+  level_count = 0;
+  uint32_t level_end = 0;
+
+  for (uint32_t i = 0; i < order_count; ++i)
+  {
+    if (i == level_end)
+    {
+      if (level_count == s_SceneMaxDepth)
+      {
+        Fail(__FUNCTION__);
+      }
+
+      level_start[level_count++] = i;
+      level_end = order_count;
+    }
+
+    uint32_t node = order[i];
+
+    for (uint32_t c = child_start[node]; c < child_start[node + 1]; ++c)
+    {
+      order[order_count++] = children[c];
+    }
+  }
+
+  level_start[level_count] = order_count;
+
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    slots[order[i]] = i;
+  }
+
+  // Children were appended in their parents' slot order, starting right
+  // after the roots.
+  uint32_t next_child = level_start[1];
+
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    uint32_t node = order[i];
+    children[i] = child_start[node + 1] - child_start[node];
+  }
+
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    child_start[i] = next_child;
+    next_child += children[i];
+  }
+
+  child_start[node_count] = next_child;
+
+  // Rearrange the locals into slot order through the worlds array, which is
+  // about to be recomputed anyway.
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    worlds[i].obj_to_world = locals[order[i]];
+  }
+
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    uint32_t parent = node_parents[order[i]];
+    parents[i] = (parent != s_SceneNoParent) ? slots[parent] : s_SceneNoParent;
+    locals[i] = worlds[i].obj_to_world;
+  }
+
+  Free(order);
+  Free(children);
+  memset(queued, 0, node_count);
+  memset(changed, 0, node_count);
+  dirty_count = 0;
+  range_count = 0;
+  subtree_count = 0;
+  MarkAllDirty();
+}
+
+void SceneGraph::MarkDirty(uint32_t slot)
+{
+  if (!queued[slot])
+  {
+    queued[slot] = 1;
+    dirty[dirty_count++] = slot;
+  }
+}
+
+void SceneGraph::SetLocal(uint32_t node, const Affine3x4& local)
+{
+  uint32_t slot = slots[node];
+  locals[slot] = local;
+  MarkDirty(slot);
+}
+
+// Every node is under a root.
+void SceneGraph::MarkAllDirty()
+{
+  for (uint32_t i = level_start[0]; i < level_start[1]; ++i)
+  {
+    MarkDirty(i);
+  }
+}
+
+static int CompareUint32s(const void* a, const void* b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+void SceneGraph::UpdateJob(void* data, uint32_t begin, uint32_t end)
+{
+  const SceneGraph& scene = *(const SceneGraph*)data;
+
+  for (uint32_t s = begin; s < end; ++s)
+  {
+    for (uint32_t r = scene.subtrees[s]; r < scene.subtrees[s + 1]; ++r)
+    {
+      for (uint32_t i = scene.ranges[r].begin; i < scene.ranges[r].end; ++i)
+      {
+        uint32_t parent = scene.parents[i];
+        scene.worlds[i].obj_to_world = (parent != s_SceneNoParent) ? (scene.worlds[parent].obj_to_world * scene.locals[i]) : scene.locals[i];
+      }
+    }
+  }
+}
+
+// Dirty slots are visited in order, so an ancestor always comes before its
+// descendants and a dirty node inside an already collected subtree is
+// skipped.  That leaves disjoint subtrees, which update in parallel; within
+// one, the ranges go level by level so parents are done first.
+void SceneGraph::Update(JobSystem* jobs)
+{
+  for (uint32_t r = 0; r < range_count; ++r)
+  {
+    memset(changed + ranges[r].begin, 0, ranges[r].end - ranges[r].begin);
+  }
+
+  range_count = 0;
+  subtree_count = 0;
+  changed_count = 0;
+  qsort(dirty, dirty_count, sizeof(uint32_t), CompareUint32s);
+
+  for (uint32_t d = 0; d < dirty_count; ++d)
+  {
+    uint32_t slot = dirty[d];
+    queued[slot] = 0;
+
+    if (changed[slot])
+    {
+      continue;
+    }
+
+    subtrees[subtree_count++] = range_count;
+    SceneRange range = { slot, slot + 1 };
+
+    while (range.begin < range.end)
+    {
+      if (range_count == range_capacity)
+      {
+        SceneRange* grown = (SceneRange*)Alloc(sizeof(SceneRange) * range_capacity * 2, 16);
+        memcpy(grown, ranges, sizeof(SceneRange) * range_count);
+        Free(ranges);
+        ranges = grown;
+        range_capacity *= 2;
+      }
+
+      ranges[range_count++] = range;
+      memset(changed + range.begin, 1, range.end - range.begin);
+      changed_count += range.end - range.begin;
+      range.begin = child_start[range.begin];
+      range.end = child_start[range.end];
+    }
+  }
+
+  subtrees[subtree_count] = range_count;
+  dirty_count = 0;
+
+  if (jobs)
+  {
+    JobCounter counter;
+    jobs->ParallelFor(subtree_count, 8, UpdateJob, this, &counter);
+    jobs->Wait(&counter);
+  }
+  else
+  {
+    UpdateJob(this, 0, subtree_count);
+  }
+}
+
+struct SceneCopyJobData
+{
+  const SceneGraph* scene;
+  PerDrawData* objects;
+};
+
+void SceneGraph::CopyChangedJob(void* data, uint32_t begin, uint32_t end)
+{
+  const SceneCopyJobData& job = *(const SceneCopyJobData*)data;
+  const SceneGraph& scene = *job.scene;
+
+  for (uint32_t r = begin; r < end; ++r)
+  {
+    const SceneRange& range = scene.ranges[r];
+    memcpy(job.objects + range.begin, scene.worlds + range.begin, sizeof(PerDrawData) * (range.end - range.begin));
+  }
+}
+
+// Copies the world transforms the last Update() rewrote, changed_count of
+// them, into a persistent per-object array indexed by slot, such as a mapped
+// storage buffer.
+void SceneGraph::CopyChanged(PerDrawData* objects, JobSystem* jobs) const
+{
+  SceneCopyJobData job = { this, objects };
+
+  if (jobs)
+  {
+    JobCounter counter;
+    jobs->ParallelFor(range_count, 64, CopyChangedJob, &job, &counter);
+    jobs->Wait(&counter);
+  }
+  else
+  {
+    CopyChangedJob(&job, 0, range_count);
+  }
+}
+
+void SceneGraph::TestBuildOrder()
+{
+  // 0 -> 2 -> 3, 1 -> 4, with 4 added before 2's child.
+  Affine3x4 identity;
+  identity.SetIdentity();
+  SceneGraph scene;
+  scene.Create(5);
+  uint32_t a = scene.Add(s_SceneNoParent, identity);
+  uint32_t b = scene.Add(s_SceneNoParent, identity);
+  uint32_t c = scene.Add(a, identity);
+  uint32_t d = scene.Add(c, identity);
+  uint32_t e = scene.Add(b, identity);
+  scene.Build();
+
+  const uint32_t expected_slots[5] = { 0, 1, 2, 4, 3 };
+  const uint32_t expected_parents[5] = { s_SceneNoParent, s_SceneNoParent, 0, 1, 2 };
+  const uint32_t expected_levels[4] = { 0, 2, 4, 5 };
+  const uint32_t expected_child_start[6] = { 2, 3, 4, 5, 5, 5 };
+  const uint32_t slots[5] = { scene.slots[a], scene.slots[b], scene.slots[c], scene.slots[d], scene.slots[e] };
+  uint32_t parents[5] = {};
+  uint32_t levels[4] = {};
+  uint32_t child_start[6] = {};
+  memcpy(parents, scene.parents, sizeof(parents));
+  memcpy(child_start, scene.child_start, sizeof(child_start));
+  memcpy(levels, scene.level_start, sizeof(levels));
+
+  FailIfNotExpected(expected_slots, slots, __FUNCTION__);
+  FailIfNotExpected(expected_parents, parents, __FUNCTION__);
+  FailIfNotExpected(3u, scene.level_count, __FUNCTION__);
+  FailIfNotExpected(expected_levels, levels, __FUNCTION__);
+  FailIfNotExpected(expected_child_start, child_start, __FUNCTION__);
+  scene.Destroy();
+}
+
+void SceneGraph::TestIncrementalUpdate()
+{
+  Affine3x4 local;
+  local.SetIdentity();
+  local.SetPosition(Vec3(1.0f, 0.0f, 0.0f));
+  SceneGraph scene;
+  scene.Create(4);
+  uint32_t root = scene.Add(s_SceneNoParent, local);
+  uint32_t child = scene.Add(root, local);
+  uint32_t grandchild = scene.Add(child, local);
+  uint32_t other = scene.Add(s_SceneNoParent, local);
+  scene.Build();
+  scene.Update(nullptr);
+  PerDrawData objects[4] = {};
+
+  FailIfNotExpected(3.0f, scene.worlds[scene.slots[grandchild]].obj_to_world.m[3], __FUNCTION__);
+  scene.CopyChanged(objects, nullptr);
+  FailIfNotExpected(4u, scene.changed_count, __FUNCTION__);
+
+  // Moving the child changes it and the grandchild only.
+  local.SetPosition(Vec3(5.0f, 0.0f, 0.0f));
+  scene.SetLocal(child, local);
+  scene.Update(nullptr);
+  memset(objects, 0, sizeof(objects));
+
+  FailIfNotExpected(7.0f, scene.worlds[scene.slots[grandchild]].obj_to_world.m[3], __FUNCTION__);
+  scene.CopyChanged(objects, nullptr);
+  FailIfNotExpected(2u, scene.changed_count, __FUNCTION__);
+  FailIfNotExpected(0.0f, objects[scene.slots[other]].obj_to_world.m[3], __FUNCTION__);
+  FailIfNotExpected(6.0f, objects[scene.slots[child]].obj_to_world.m[3], __FUNCTION__);
+
+  // Nothing changed since.
+  scene.Update(nullptr);
+  FailIfNotExpected(0u, scene.changed_count, __FUNCTION__);
+
+  // A dirty node under a dirty ancestor is only updated once.
+  scene.SetLocal(grandchild, local);
+  scene.SetLocal(root, local);
+  scene.Update(nullptr);
+  FailIfNotExpected(3u, scene.changed_count, __FUNCTION__);
+  FailIfNotExpected(15.0f, scene.worlds[scene.slots[grandchild]].obj_to_world.m[3], __FUNCTION__);
+  scene.Destroy();
+}
+
+void SceneGraph::RunAllTests()
+{
+  TestBuildOrder();
+  TestIncrementalUpdate();
+}
+
+// Builds a random 1M node hierarchy and times updates with 0.1%, 1% and 10%
+// of the local transforms changing per frame against recomputing every world
+// transform, on one thread and on the job system, including copying the
+// changed transforms to a mapped per-object storage buffer.
+void RunSceneGraphBench(VulkanState& state)
+{
+  const uint32_t node_count = 1 << 20;
+  const uint32_t root_count = 1024;
+  const uint32_t frame_count = 32;
+  const float change_percents[] = { 0.1f, 1.0f, 10.0f, 100.0f };
+
+  SceneGraph scene;
+  scene.Create(node_count);
+  uint32_t rng = 0x2545f491u;
+  Affine3x4 local;
+  local.SetIdentity();
+
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    local.SetPosition(Vec3((float)(rng & 15) * 0.25f, (float)((rng >> 4) & 15) * 0.25f, 0.0f));
+    scene.Add((i < root_count) ? s_SceneNoParent : (rng % i), local);
+  }
+
+  double start_ms = GetTimeMs();
+  scene.Build();
+  printf("Scene graph: %u nodes in %u levels, built in %.1f ms\n", node_count, scene.level_count, GetTimeMs() - start_ms);
+
+  VkBuffer object_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory object_memory = VK_NULL_HANDLE;
+  PerDrawData* objects = nullptr;
+  state.CreateBuffer(sizeof(PerDrawData) * node_count, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &object_buffer, &object_memory);
+  VK_CHECK(vkMapMemory(state.device, object_memory, 0, VK_WHOLE_SIZE, 0, (void**)&objects));
+
+  JobSystem jobs;
+  jobs.Create(JobSystem::DefaultWorkerCount());
+
+  for (uint32_t threaded = 0; threaded < 2; ++threaded)
+  {
+    printf("  %s:\n", threaded ? "job system" : "one thread");
+    JobSystem* job_system = threaded ? &jobs : nullptr;
+
+    for (uint32_t p = 0; p < ARRAY_COUNT(change_percents); ++p)
+    {
+      uint32_t changes = (uint32_t)(node_count * change_percents[p] / 100.0f);
+      double update_ms = 0.0;
+      double copy_ms = 0.0;
+      uint64_t changed = 0;
+
+      for (uint32_t frame = 0; frame < frame_count; ++frame)
+      {
+        if (changes == node_count)
+        {
+          scene.MarkAllDirty();
+        }
+        else
+        {
+          for (uint32_t i = 0; i < changes; ++i)
+          {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            local.SetPosition(Vec3((float)(frame & 7), (float)(i & 7), 0.0f));
+            scene.SetLocal(rng % node_count, local);
+          }
+        }
+
+        start_ms = GetTimeMs();
+        scene.Update(job_system);
+        double copy_start_ms = GetTimeMs();
+        scene.CopyChanged(objects, job_system);
+        changed += scene.changed_count;
+        double end_ms = GetTimeMs();
+        update_ms += copy_start_ms - start_ms;
+        copy_ms += end_ms - copy_start_ms;
+      }
+
+      printf("   %5.1f%% locals changed: %8.3f ms update, %7.3f ms upload, %8llu worlds changed per frame\n", change_percents[p], update_ms / frame_count, copy_ms / frame_count, (unsigned long long)(changed / frame_count));
+    }
+  }
+
+  jobs.Destroy();
+  vkUnmapMemory(state.device, object_memory);
+  vkDestroyBuffer(state.device, object_buffer, &state.callbacks);
+  vkFreeMemory(state.device, object_memory, &state.callbacks);
+  scene.Destroy();
+}
+
+// Mirrors the Counters block in the particle shaders (std430).  The CPU only
+// writes it once at creation, everything after that happens on the GPU.
+struct ParticleCounters
+{
+  uint32_t current; // Alive list being simulated, the other one is drawn.
+  uint32_t dead_count;
+  uint32_t emit_count;
+  uint32_t simulate_count;
+  uint32_t frame;
+  uint32_t capacity;
+  uint32_t simulated; // Running total, for the benchmark.
+  uint32_t pad;
+  VkDispatchIndirectCommand emit_dispatch;
+  VkDispatchIndirectCommand simulate_dispatch;
+  VkDrawIndirectCommand draw; // instanceCount is the number of survivors.
+};
+
+struct ParticleParams
+{
+  uint32_t emit_per_frame;
+  float dt;
+  uint32_t group_size;
+};
+
+// GPU-only particles.  Each frame a one-thread prepare dispatch sizes the
+// emit and simulate dispatches from counters the GPU wrote last frame, emit
+// pulls particles off a dead list, simulate integrates them and compacts the
+// survivors into the other of two alive lists, and an indirect draw renders
+// one triangle instance per survivor.  Simulate() and Draw() record the same
+// commands every frame, so they can go in command buffers recorded once.
+struct ParticleSystem
+{
+  enum Pipeline
+  {
+    PIPELINE_PREPARE,
+    PIPELINE_EMIT,
+    PIPELINE_SIMULATE,
+    PIPELINE_DRAW,
+    PIPELINE_COUNT,
+  };
+
+  VulkanState* state = nullptr;
+  uint32_t capacity = 0;
+  ParticleParams params = {};
+  VkBuffer particle_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory particle_memory = VK_NULL_HANDLE;
+  VkBuffer list_buffer = VK_NULL_HANDLE; // Two alive lists then the dead list.
+  VkDeviceMemory list_memory = VK_NULL_HANDLE;
+  VkBuffer counter_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory counter_memory = VK_NULL_HANDLE;
+  ParticleCounters* counters = nullptr; // Mapped, only safe to read once the GPU is idle.
+  VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  VkPipeline pipelines[PIPELINE_COUNT] = {};
+
+  bool Create(VulkanState& vulkan_state, DescriptorAllocator& descriptors, VkRenderPass render_pass, uint32_t max_particles, uint32_t emit_per_frame, uint32_t group_size);
+  void Destroy();
+  void Simulate(VkCommandBuffer cmd);
+  void Draw(VkCommandBuffer cmd, VkBuffer vertex_buffer);
+
+  // Tests.
+  static void TestCountersLayout();
+  static void RunAllTests();
+};
+
+// Returns false, having created nothing, when the shaders haven't been built.
+// group_size is the compute workgroup size, specialized into the shaders.
+bool ParticleSystem::Create(VulkanState& vulkan_state, DescriptorAllocator& descriptors, VkRenderPass render_pass, uint32_t max_particles, uint32_t emit_per_frame, uint32_t group_size)
+{
+  const char* const shader_paths[PIPELINE_COUNT] = { "particle_prepare.comp.spv", "particle_emit.comp.spv", "particle_simulate.comp.spv", "particle.vert.spv" };
+  VkShaderModule modules[PIPELINE_COUNT] = {};
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+  bool have_shaders = vulkan_state.LoadShaderModule("basic.frag.spv", &frag_module);
+
+  for (uint32_t i = 0; have_shaders && (i < PIPELINE_COUNT); ++i)
+  {
+    have_shaders = vulkan_state.LoadShaderModule(shader_paths[i], modules + i);
+  }
+
+  if (!have_shaders)
+  {
+    for (uint32_t i = 0; i < PIPELINE_COUNT; ++i)
+    {
+      vkDestroyShaderModule(vulkan_state.device, modules[i], &vulkan_state.callbacks);
+    }
+
+    vkDestroyShaderModule(vulkan_state.device, frag_module, &vulkan_state.callbacks);
+    return false;
+  }
+
+  state = &vulkan_state;
+  capacity = max_particles;
+  params.emit_per_frame = emit_per_frame;
+  params.dt = 1.0f / 60.0f;
+  params.group_size = group_size;
+
+  const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  state->CreateBuffer(sizeof(float) * 8 * capacity, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &particle_buffer, &particle_memory);
+  state->CreateBuffer(sizeof(uint32_t) * 3 * capacity, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &list_buffer, &list_memory);
+  state->CreateBuffer(sizeof(ParticleCounters), usage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &counter_buffer, &counter_memory);
+  VK_CHECK(vkMapMemory(state->device, counter_memory, 0, VK_WHOLE_SIZE, 0, (void**)&counters));
+
+  // Everything starts dead.  Current starts at 1 so the first prepare flips
+  // it to 0.
+  memset(counters, 0, sizeof(ParticleCounters));
+  counters->current = 1;
+  counters->dead_count = capacity;
+  counters->capacity = capacity;
+  counters->draw.vertexCount = ARRAY_COUNT(s_ClipSpaceTriangleVertices);
+
+  VkBuffer staging_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory staging_memory = VK_NULL_HANDLE;
+  uint32_t* dead_list = nullptr;
+  state->CreateBuffer(sizeof(uint32_t) * capacity, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_buffer, &staging_memory);
+  VK_CHECK(vkMapMemory(state->device, staging_memory, 0, VK_WHOLE_SIZE, 0, (void**)&dead_list));
+
+  for (uint32_t i = 0; i < capacity; ++i)
+  {
+    dead_list[i] = i;
+  }
+
+  vkUnmapMemory(state->device, staging_memory);
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state->queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state->device, &cmd_pool_info, &state->callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(state->device, &cmd_buffer_alloc_info, &cmd));
+
+  VkCommandBufferBeginInfo cmd_buf_info = {};
+  cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+  VkBufferCopy copy_region = {};
+  copy_region.dstOffset = sizeof(uint32_t) * 2 * capacity;
+  copy_region.size = sizeof(uint32_t) * capacity;
+  vkCmdCopyBuffer(cmd, staging_buffer, list_buffer, 1, &copy_region);
+  VK_CHECK(vkEndCommandBuffer(cmd));
+
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &cmd;
+  VK_CHECK(vkQueueSubmit(state->queue, 1, &submit_info, VK_NULL_HANDLE));
+  VK_CHECK(vkQueueWaitIdle(state->queue));
+  vkDestroyCommandPool(state->device, cmd_pool, &state->callbacks);
+  vkDestroyBuffer(state->device, staging_buffer, &state->callbacks);
+  vkFreeMemory(state->device, staging_memory, &state->callbacks);
+
+  // Bindings: particles, alive lists, dead list, counters.
+  VkDescriptorSetLayoutBinding layout_bindings[4] = {};
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(layout_bindings); ++i)
+  {
+    layout_bindings[i].binding = i;
+    layout_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layout_bindings[i].descriptorCount = 1;
+    layout_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_VERTEX_BIT;
+  }
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.bindingCount = ARRAY_COUNT(layout_bindings);
+  descriptor_layout.pBindings = layout_bindings;
+  VK_CHECK(vkCreateDescriptorSetLayout(state->device, &descriptor_layout, &state->callbacks, &set_layout));
+
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constant_range.size = sizeof(ParticleParams);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.setLayoutCount = 1;
+  pipeline_layout_create_info.pSetLayouts = &set_layout;
+  pipeline_layout_create_info.pushConstantRangeCount = 1;
+  pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+  VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &pipeline_layout));
+
+  DescriptorBinding bindings[4] = {};
+  const VkBuffer buffers[4] = { particle_buffer, list_buffer, list_buffer, counter_buffer };
+  const VkDeviceSize offsets[4] = { 0, 0, sizeof(uint32_t) * 2 * capacity, 0 };
+  const VkDeviceSize ranges[4] = { sizeof(float) * 8 * capacity, sizeof(uint32_t) * 2 * capacity, sizeof(uint32_t) * capacity, sizeof(ParticleCounters) };
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(bindings); ++i)
+  {
+    bindings[i].binding = i;
+    bindings[i].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].buffer.buffer = buffers[i];
+    bindings[i].buffer.offset = offsets[i];
+    bindings[i].buffer.range = ranges[i];
+  }
+
+  set = descriptors.Get(set_layout, bindings, ARRAY_COUNT(bindings));
+
+  VkSpecializationMapEntry specialization_entry = {};
+  specialization_entry.constantID = 0;
+  specialization_entry.size = sizeof(uint32_t);
+  VkSpecializationInfo specialization_info = {};
+  specialization_info.mapEntryCount = 1;
+  specialization_info.pMapEntries = &specialization_entry;
+  specialization_info.dataSize = sizeof(uint32_t);
+  specialization_info.pData = &params.group_size;
+
+  for (uint32_t i = PIPELINE_PREPARE; i <= PIPELINE_SIMULATE; ++i)
+  {
+    VkComputePipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = modules[i];
+    pipeline_info.stage.pName = "main";
+    pipeline_info.stage.pSpecializationInfo = (i == PIPELINE_PREPARE) ? nullptr : &specialization_info;
+    pipeline_info.layout = pipeline_layout;
+    VK_CHECK(vkCreateComputePipelines(state->device, VK_NULL_HANDLE, 1, &pipeline_info, &state->callbacks, pipelines + i));
+  }
+
+  pipelines[PIPELINE_DRAW] = CreateVertexColorPipeline(*state, render_pass, pipeline_layout, modules[PIPELINE_DRAW], frag_module);
+
+  for (uint32_t i = 0; i < PIPELINE_COUNT; ++i)
+  {
+    vkDestroyShaderModule(state->device, modules[i], &state->callbacks);
+  }
+
+  vkDestroyShaderModule(state->device, frag_module, &state->callbacks);
+  return true;
+}
+
+void ParticleSystem::Destroy()
+{
+  if (!state)
+  {
+    return;
+  }
+
+  for (uint32_t i = 0; i < PIPELINE_COUNT; ++i)
+  {
+    vkDestroyPipeline(state->device, pipelines[i], &state->callbacks);
+  }
+
+  vkDestroyPipelineLayout(state->device, pipeline_layout, &state->callbacks);
+  vkDestroyDescriptorSetLayout(state->device, set_layout, &state->callbacks);
+  vkUnmapMemory(state->device, counter_memory);
+  vkDestroyBuffer(state->device, counter_buffer, &state->callbacks);
+  vkFreeMemory(state->device, counter_memory, &state->callbacks);
+  vkDestroyBuffer(state->device, list_buffer, &state->callbacks);
+  vkFreeMemory(state->device, list_memory, &state->callbacks);
+  vkDestroyBuffer(state->device, particle_buffer, &state->callbacks);
+  vkFreeMemory(state->device, particle_memory, &state->callbacks);
+  state = nullptr;
+}
+
+// Record outside a render pass, before the pass that calls Draw().
+void ParticleSystem::Simulate(VkCommandBuffer cmd)
+{
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+
+  // Last frame's draw is done reading the lists and counters.
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_layout, 0, 1, &set, 0, nullptr);
+  vkCmdPushConstants(cmd, pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[PIPELINE_PREPARE]);
+  vkCmdDispatch(cmd, 1, 1, 1);
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[PIPELINE_EMIT]);
+  vkCmdDispatchIndirect(cmd, counter_buffer, offsetof(ParticleCounters, emit_dispatch));
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[PIPELINE_SIMULATE]);
+  vkCmdDispatchIndirect(cmd, counter_buffer, offsetof(ParticleCounters, simulate_dispatch));
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+// Record inside the render pass given to Create(), with the viewport and
+// scissor set.  vertex_buffer holds the Vertex triangle each particle is.
+void ParticleSystem::Draw(VkCommandBuffer cmd, VkBuffer vertex_buffer)
+{
+  const VkDeviceSize offsets = 0;
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines[PIPELINE_DRAW]);
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &set, 0, nullptr);
+  vkCmdBindVertexBuffers(cmd, 1, 1, &vertex_buffer, &offsets);
+  vkCmdDrawIndirect(cmd, counter_buffer, offsetof(ParticleCounters, draw), 1, sizeof(VkDrawIndirectCommand));
+}
+
+// The shaders declare the counters as a flat run of uints, so the C++ side
+// must not have padding.
+void ParticleSystem::TestCountersLayout()
+{
+  FailIfNotExpected((size_t)32, offsetof(ParticleCounters, emit_dispatch), __FUNCTION__);
+  FailIfNotExpected((size_t)44, offsetof(ParticleCounters, simulate_dispatch), __FUNCTION__);
+  FailIfNotExpected((size_t)56, offsetof(ParticleCounters, draw), __FUNCTION__);
+  FailIfNotExpected((size_t)72, sizeof(ParticleCounters), __FUNCTION__);
+}
+
+void ParticleSystem::RunAllTests()
+{
+  TestCountersLayout();
+}
+
+// Runs the simulation with 1M live particles at each workgroup size the
+// device allows and reports particles simulated per millisecond.  Drawing
+// isn't included; it's the same indirect draw at any workgroup size.
+void RunParticleBench(VulkanState& state)
+{
+  const uint32_t capacity = 4 << 20;
+  const uint32_t emit_per_frame = 1 << 14;
+  const uint32_t warmup_frames = 192; // Longer than the longest lifetime, a multiple of frames_per_submit.
+  const uint32_t frame_count = 240;
+  const uint32_t frames_per_submit = 16;
+  const uint32_t group_sizes[] = { 32, 64, 128, 256, 512, 1024 };
+
+  // The draw pipeline needs a compatible render pass even though nothing is
+  // drawn.
+  VkExtent2D extent = { 64, 64 };
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage output_image = VK_NULL_HANDLE;
+  VkDeviceMemory output_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &output_image, &output_memory);
+
+  RenderGraph graph;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &output_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  uint32_t pass = graph.AddPass("particles", nullptr, nullptr);
+  graph.AddUse(pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.Compile(state);
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+  DescriptorAllocator descriptors;
+  descriptors.Create(state, 1);
+  const VkPhysicalDeviceLimits& limits = state.physical_device_properties.limits;
+  printf("Particles: %u max, %u emitted per frame, %u frames\n", capacity, emit_per_frame, frame_count);
+
+  for (uint32_t g = 0; g < ARRAY_COUNT(group_sizes); ++g)
+  {
+    uint32_t group_size = group_sizes[g];
+
+    if ((group_size > limits.maxComputeWorkGroupSize[0]) || (group_size > limits.maxComputeWorkGroupInvocations))
+    {
+      break;
+    }
+
+    ParticleSystem particles;
+
+    if (!particles.Create(state, descriptors, graph.RenderPass(pass), capacity, emit_per_frame, group_size))
+    {
+      printf("  skipped, no shaders\n");
+      break;
+    }
+
+    uint32_t simulated = 0;
+    double start_ms = 0.0;
+
+    for (uint32_t frame = 0; frame < warmup_frames + frame_count; frame += frames_per_submit)
+    {
+      if (frame == warmup_frames)
+      {
+        simulated = particles.counters->simulated;
+        start_ms = GetTimeMs();
+      }
+
+      VkCommandBufferBeginInfo cmd_buf_info = {};
+      cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+
+      for (uint32_t i = 0; i < frames_per_submit; ++i)
+      {
+        particles.Simulate(cmd);
+      }
+
+      VK_CHECK(vkEndCommandBuffer(cmd));
+
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.commandBufferCount = 1;
+      submit_info.pCommandBuffers = &cmd;
+      VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+      VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+      VK_CHECK(vkResetFences(state.device, 1, &fence));
+    }
+
+    double total_ms = GetTimeMs() - start_ms;
+    simulated = particles.counters->simulated - simulated;
+    printf("  workgroup %4u: %8.3f ms per frame, %u alive, %.0f particles per ms\n", group_size, total_ms / frame_count, particles.counters->draw.instanceCount, simulated / total_ms);
+    particles.Destroy();
+  }
+
+  descriptors.Destroy();
+  vkDestroyFence(state.device, fence, &state.callbacks);
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+  graph.Destroy();
+  vkDestroyImage(state.device, output_image, &state.callbacks);
+  vkFreeMemory(state.device, output_memory, &state.callbacks);
+}
+
+enum ReadbackFileFormat
+{
+  READBACK_FILE_RAW, // Frames back to back as the image's texels.
+  READBACK_FILE_Y4M, // YUV4MPEG2, 4:2:0 full range.
+};
+
+// Copies rendered frames into a ring of host buffers and writes them to disk
+// from a background thread.  Capture() never waits: when every slot is still
+// being copied or written, the frame is dropped and counted instead.  Slots
+// are used in order, so frames are written in the order they were captured.
+struct FrameReadback
+{
+  enum SlotState
+  {
+    SLOT_FREE,
+    SLOT_COPYING, // Submitted, fence not yet seen signaled.
+    SLOT_WRITING, // Owned by the writer thread.
+  };
+
+  struct Slot
+  {
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    uint8_t* mapped;
+    VkCommandBuffer cmd;
+    VkFence fence;
+    volatile long state;
+  };
+
+  struct Stats
+  {
+    uint64_t captured;
+    uint64_t dropped;
+    volatile long written;
+  };
+
+  VulkanState* state = nullptr;
+  VkExtent2D extent = {};
+  VkFormat format = VK_FORMAT_UNDEFINED;
+  ReadbackFileFormat file_format = READBACK_FILE_RAW;
+  bool swap_red_blue = false; // BGRA texels.
+  bool coherent = false;
+  VkDeviceSize frame_bytes = 0;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  Slot slots[4] = {};
+  uint32_t slot_count = 0;
+  uint32_t next_slot = 0; // Next to capture into.
+  uint32_t poll_slot = 0; // Oldest that may be copying.
+  FILE* file = nullptr;
+  uint8_t* yuv = nullptr; // Writer thread only.
+  Stats stats = {};
+
+  // Shared with the writer thread, under lock.
+  HANDLE thread = nullptr;
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE work_ready;
+  bool quit = false;
+  uint32_t write_queue[4];
+  uint32_t write_head = 0;
+  uint32_t write_count = 0;
+
+  bool Create(VulkanState& vulkan_state, VkExtent2D frame_extent, VkFormat frame_format, uint32_t buffer_count, const char* path);
+  void Destroy();
+  bool Capture(VkImage image, VkImageLayout layout, VkCommandBuffer* cmd, VkFence* fence);
+  void Poll();
+
+  static DWORD WINAPI WriterThread(void* userdata);
+  static void ConvertToI420(const uint8_t* texels, bool swap_red_blue, uint32_t width, uint32_t height, uint8_t* out);
+
+  // Tests.
+  static void TestConvertToI420();
+  static void RunAllTests();
+};
+
+// Paths ending in .y4m get YUV4MPEG2, anything else raw texels.  Returns
+// false if the file can't be opened or the format has no Y4M conversion.
+bool FrameReadback::Create(VulkanState& vulkan_state, VkExtent2D frame_extent, VkFormat frame_format, uint32_t buffer_count, const char* path)
+{
+  size_t path_length = strlen(path);
+  file_format = ((path_length > 4) && !_stricmp(path + path_length - 4, ".y4m")) ? READBACK_FILE_Y4M : READBACK_FILE_RAW;
+  swap_red_blue = (frame_format == VK_FORMAT_B8G8R8A8_UNORM) || (frame_format == VK_FORMAT_B8G8R8A8_SRGB);
+  bool rgba = (frame_format == VK_FORMAT_R8G8B8A8_UNORM) || (frame_format == VK_FORMAT_R8G8B8A8_SRGB);
+
+  if ((file_format == READBACK_FILE_Y4M) && !swap_red_blue && !rgba)
+  {
+    printf("Frame dump: no Y4M conversion for format %d\n", frame_format);
+    return false;
+  }
+
+  file = fopen(path, "wb");
+
+  if (!file)
+  {
+    printf("Frame dump: could not open '%s'\n", path);
+    return false;
+  }
+
+  state = &vulkan_state;
+  extent = frame_extent;
+  format = frame_format;
+  frame_bytes = (VkDeviceSize)extent.width * extent.height * 4;
+  slot_count = (buffer_count > ARRAY_COUNT(slots)) ? ARRAY_COUNT(slots) : buffer_count;
+  next_slot = 0;
+  poll_slot = 0;
+  memset(&stats, 0, sizeof(stats));
+
+  if (file_format == READBACK_FILE_Y4M)
+  {
+    fprintf(file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C420jpeg\n", extent.width, extent.height);
+    yuv = (uint8_t*)Alloc((size_t)extent.width * extent.height + (2 * ((extent.width + 1) / 2) * ((extent.height + 1) / 2)), 16);
+  }
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state->queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VK_CHECK(vkCreateCommandPool(state->device, &cmd_pool_info, &state->callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+
+  // The CPU reads every byte, so cached memory is preferred over the
+  // write-combined kind, at the cost of invalidating before each read when
+  // it isn't coherent too.
+  const VkPhysicalDeviceMemoryProperties& memory_properties = state->memory_properties[state->physical_device_index];
+
+  for (uint32_t i = 0; i < slot_count; ++i)
+  {
+    Slot& slot = slots[i];
+    VkBufferCreateInfo buffer_create_info = {};
+    buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_create_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_create_info.size = frame_bytes;
+    buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK(vkCreateBuffer(state->device, &buffer_create_info, &state->callbacks, &slot.buffer));
+
+    VkMemoryRequirements memory_requirements = {};
+    vkGetBufferMemoryRequirements(state->device, slot.buffer, &memory_requirements);
+    uint32_t memory_type = memory_properties.memoryTypeCount;
+
+    for (uint32_t t = 0; t < memory_properties.memoryTypeCount; ++t)
+    {
+      const VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+
+      if ((memory_requirements.memoryTypeBits & (1 << t)) && ((memory_properties.memoryTypes[t].propertyFlags & cached) == cached))
+      {
+        memory_type = t;
+        break;
+      }
+    }
+
+    if (memory_type == memory_properties.memoryTypeCount)
+    {
+      memory_type = state->FindMemoryType(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+
+    coherent = (memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = memory_requirements.size;
+    alloc_info.memoryTypeIndex = memory_type;
+    VK_CHECK(vkAllocateMemory(state->device, &alloc_info, &state->callbacks, &slot.memory));
+    VK_CHECK(vkBindBufferMemory(state->device, slot.buffer, slot.memory, 0));
+    VK_CHECK(vkMapMemory(state->device, slot.memory, 0, VK_WHOLE_SIZE, 0, (void**)&slot.mapped));
+
+    VK_CHECK(vkAllocateCommandBuffers(state->device, &cmd_buffer_alloc_info, &slot.cmd));
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK(vkCreateFence(state->device, &fence_create_info, &state->callbacks, &slot.fence));
+    slot.state = SLOT_FREE;
+  }
+
+  printf("Frame dump: %ux%u %s to '%s' through %u %s buffers\n", extent.width, extent.height, (file_format == READBACK_FILE_Y4M) ? "Y4M" : (swap_red_blue ? "raw BGRA" : "raw"), path, slot_count, coherent ? "coherent" : "cached");
+
+  InitializeCriticalSection(&lock);
+  InitializeConditionVariable(&work_ready);
+  quit = false;
+  write_head = 0;
+  write_count = 0;
+  thread = CreateThread(nullptr, 0, WriterThread, this, 0, nullptr);
+  return true;
+}
+
+// Finishes writing every captured frame.  The device must be idle.
+void FrameReadback::Destroy()
+{
+  if (!state)
+  {
+    return;
+  }
+
+  Poll();
+  EnterCriticalSection(&lock);
+  quit = true;
+  WakeConditionVariable(&work_ready);
+  LeaveCriticalSection(&lock);
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+  DeleteCriticalSection(&lock);
+
+  for (uint32_t i = 0; i < slot_count; ++i)
+  {
+    vkDestroyFence(state->device, slots[i].fence, &state->callbacks);
+    vkUnmapMemory(state->device, slots[i].memory);
+    vkDestroyBuffer(state->device, slots[i].buffer, &state->callbacks);
+    vkFreeMemory(state->device, slots[i].memory, &state->callbacks);
+  }
+
+  vkDestroyCommandPool(state->device, cmd_pool, &state->callbacks);
+  fclose(file);
+  file = nullptr;
+  Free(yuv);
+  yuv = nullptr;
+  state = nullptr;
+}
+
+// Records a copy of image, which is in layout and is left in it, into the
+// next slot.  Submit cmd after the frame's rendering, with fence.  Returns
+// false and drops the frame if that slot isn't free yet.
+bool FrameReadback::Capture(VkImage image, VkImageLayout layout, VkCommandBuffer* cmd, VkFence* fence)
+{
+  Slot& slot = slots[next_slot];
+
+  if (slot.state != SLOT_FREE)
+  {
+    ++stats.dropped;
+    return false;
+  }
+
+  VkCommandBufferBeginInfo cmd_buf_info = {};
+  cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK(vkBeginCommandBuffer(slot.cmd, &cmd_buf_info));
+
+  VkImageMemoryBarrier image_barrier = {};
+  image_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  image_barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  image_barrier.oldLayout = layout;
+  image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  image_barrier.image = image;
+  image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  image_barrier.subresourceRange.levelCount = 1;
+  image_barrier.subresourceRange.layerCount = 1;
+  vkCmdPipelineBarrier(slot.cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &image_barrier);
+
+  VkBufferImageCopy region = {};
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent.width = extent.width;
+  region.imageExtent.height = extent.height;
+  region.imageExtent.depth = 1;
+  vkCmdCopyImageToBuffer(slot.cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.buffer, 1, &region);
+
+  image_barrier.srcAccessMask = 0;
+  image_barrier.dstAccessMask = 0;
+  image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  image_barrier.newLayout = layout;
+  VkBufferMemoryBarrier buffer_barrier = {};
+  buffer_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  buffer_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  buffer_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  buffer_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  buffer_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  buffer_barrier.buffer = slot.buffer;
+  buffer_barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(slot.cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 1, &buffer_barrier, 1, &image_barrier);
+  VK_CHECK(vkEndCommandBuffer(slot.cmd));
+
+  slot.state = SLOT_COPYING;
+  *cmd = slot.cmd;
+  *fence = slot.fence;
+  next_slot = (next_slot + 1) % slot_count;
+  ++stats.captured;
+  return true;
+}
+
+// Hands finished copies to the writer without waiting on any that aren't.
+// Call once a frame; Destroy() calls it with the device idle to flush.
+void FrameReadback::Poll()
+{
+  while ((slots[poll_slot].state == SLOT_COPYING) && (vkGetFenceStatus(state->device, slots[poll_slot].fence) == VK_SUCCESS))
+  {
+    Slot& slot = slots[poll_slot];
+    VK_CHECK(vkResetFences(state->device, 1, &slot.fence));
+    slot.state = SLOT_WRITING;
+
+    EnterCriticalSection(&lock);
+    write_queue[(write_head + write_count) % ARRAY_COUNT(write_queue)] = poll_slot;
+    ++write_count;
+    WakeConditionVariable(&work_ready);
+    LeaveCriticalSection(&lock);
+
+    poll_slot = (poll_slot + 1) % slot_count;
+  }
+}
+
+DWORD WINAPI FrameReadback::WriterThread(void* userdata)
+{
+  FrameReadback& readback = *(FrameReadback*)userdata;
+
+  for (;;)
+  {
+    EnterCriticalSection(&readback.lock);
+
+    while (!readback.quit && !readback.write_count)
+    {
+      SleepConditionVariableCS(&readback.work_ready, &readback.lock, INFINITE);
+    }
+
+    if (!readback.write_count)
+    {
+      LeaveCriticalSection(&readback.lock);
+      return 0;
+    }
+
+    Slot& slot = readback.slots[readback.write_queue[readback.write_head]];
+    readback.write_head = (readback.write_head + 1) % ARRAY_COUNT(readback.write_queue);
+    --readback.write_count;
+    LeaveCriticalSection(&readback.lock);
+
+    if (!readback.coherent)
+    {
+      VkMappedMemoryRange range = {};
+      range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+      range.memory = slot.memory;
+      range.size = VK_WHOLE_SIZE;
+      VK_CHECK(vkInvalidateMappedMemoryRanges(readback.state->device, 1, &range));
+    }
+
+    if (readback.file_format == READBACK_FILE_Y4M)
+    {
+      uint32_t width = readback.extent.width;
+      uint32_t height = readback.extent.height;
+      size_t yuv_bytes = ((size_t)width * height) + (2 * ((width + 1) / 2) * ((height + 1) / 2));
+      ConvertToI420(slot.mapped, readback.swap_red_blue, width, height, readback.yuv);
+      fputs("FRAME\n", readback.file);
+      fwrite(readback.yuv, 1, yuv_bytes, readback.file);
+    }
+    else
+    {
+      fwrite(slot.mapped, 1, (size_t)readback.frame_bytes, readback.file);
+    }
+
+    InterlockedExchange(&slot.state, SLOT_FREE);
+    InterlockedIncrement(&readback.stats.written);
+  }
+}
+
+// 8-bit RGBA or BGRA to planar Y, U, V with 2x2 subsampled chroma, using
+// full range BT.601 to match the C420jpeg Y4M header.
+void FrameReadback::ConvertToI420(const uint8_t* texels, bool swap_red_blue, uint32_t width, uint32_t height, uint8_t* out)
+{
+  uint32_t chroma_width = (width + 1) / 2;
+  uint32_t chroma_height = (height + 1) / 2;
+  uint8_t* y_plane = out;
+  uint8_t* u_plane = out + ((size_t)width * height);
+  uint8_t* v_plane = u_plane + ((size_t)chroma_width * chroma_height);
+  uint32_t r_offset = swap_red_blue ? 2 : 0;
+  uint32_t b_offset = swap_red_blue ? 0 : 2;
+
+  for (uint32_t cy = 0; cy < chroma_height; ++cy)
+  {
+    for (uint32_t cx = 0; cx < chroma_width; ++cx)
+    {
+      int32_t r_sum = 0;
+      int32_t g_sum = 0;
+      int32_t b_sum = 0;
+      int32_t count = 0;
+
+      for (uint32_t y = cy * 2; (y < (cy * 2) + 2) && (y < height); ++y)
+      {
+        for (uint32_t x = cx * 2; (x < (cx * 2) + 2) && (x < width); ++x)
+        {
+          const uint8_t* texel = texels + ((((size_t)y * width) + x) * 4);
+          int32_t r = texel[r_offset];
+          int32_t g = texel[1];
+          int32_t b = texel[b_offset];
+          y_plane[((size_t)y * width) + x] = (uint8_t)(((77 * r) + (150 * g) + (29 * b) + 128) >> 8);
+          r_sum += r;
+          g_sum += g;
+          b_sum += b;
+          ++count;
+        }
+      }
+
+      r_sum /= count;
+      g_sum /= count;
+      b_sum /= count;
+
+      // The +32768 is the 128 offset, added before the shift so it never
+      // sees a negative value.
+      int32_t u = ((-43 * r_sum) - (85 * g_sum) + (128 * b_sum) + 32768 + 128) >> 8;
+      int32_t v = ((128 * r_sum) - (107 * g_sum) - (21 * b_sum) + 32768 + 128) >> 8;
+      u_plane[((size_t)cy * chroma_width) + cx] = (uint8_t)((u > 255) ? 255 : u);
+      v_plane[((size_t)cy * chroma_width) + cx] = (uint8_t)((v > 255) ? 255 : v);
+    }
+  }
+}
+
+void FrameReadback::TestConvertToI420()
+{
+  // 3x2 BGRA: a red 2x2 block and a white column that gets its own chroma.
+  const uint8_t texels[2][3][4] =
+  {
+    { { 0, 0, 255, 255 }, { 0, 0, 255, 255 }, { 255, 255, 255, 255 } },
+    { { 0, 0, 255, 255 }, { 0, 0, 255, 255 }, { 255, 255, 255, 255 } },
+  };
+  const uint8_t expected[10] = { 77, 77, 255, 77, 77, 255, 85, 128, 255, 128 };
+  uint8_t out[10] = {};
+
+  ConvertToI420(&texels[0][0][0], true, 3, 2, out);
+  FailIfNotExpected(expected, out, __FUNCTION__);
+}
+
+void FrameReadback::RunAllTests()
+{
+  TestConvertToI420();
+}
+
+struct ReadbackBenchPass
+{
+  VkImage image;
+  VkClearColorValue color;
+};
+
+static void RecordReadbackBenchPass(VkCommandBuffer cmd, void* userdata)
+{
+  const ReadbackBenchPass& bench_pass = *(const ReadbackBenchPass*)userdata;
+  VkImageSubresourceRange range = {};
+  range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  range.levelCount = 1;
+  range.layerCount = 1;
+  vkCmdClearColorImage(cmd, bench_pass.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &bench_pass.color, 1, &range);
+}
+
+// Renders frames into an offscreen target as fast as possible while dumping
+// them through FrameReadback, at 1080p and 4K, and reports the rendered and
+// written frame rates.  Frames go to options.dump if it's set, which is
+// rewritten for each size, and to the null device otherwise (Windows maps
+// NUL with any extension to it) so only the copies and the Y4M conversion
+// are measured.
+void RunReadbackBench(VulkanState& state, const Options& options)
+{
+  const VkExtent2D extents[2] = { { 1920, 1080 }, { 3840, 2160 } };
+  const uint32_t frame_count = 240;
+  const uint32_t frames_in_flight = 2;
+  const char* path = options.dump ? options.dump : "NUL.y4m";
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = frames_in_flight;
+  VkCommandBuffer cmds[frames_in_flight] = {};
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, cmds));
+
+  VkFence fences[frames_in_flight] = {};
+
+  for (uint32_t i = 0; i < frames_in_flight; ++i)
+  {
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, fences + i));
+  }
+
+  printf("Frame readback: %u frames per size\n", frame_count);
+
+  for (uint32_t e = 0; e < ARRAY_COUNT(extents); ++e)
+  {
+    VkExtent2D extent = extents[e];
+    VkImageCreateInfo image_create_info = {};
+    image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_create_info.imageType = VK_IMAGE_TYPE_2D;
+    image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+    image_create_info.extent.width = extent.width;
+    image_create_info.extent.height = extent.height;
+    image_create_info.extent.depth = 1;
+    image_create_info.mipLevels = 1;
+    image_create_info.arrayLayers = 1;
+    image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_create_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkImage output_image = VK_NULL_HANDLE;
+    VkDeviceMemory output_memory = VK_NULL_HANDLE;
+    state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &output_image, &output_memory);
+
+    ReadbackBenchPass bench_pass = {};
+    bench_pass.image = output_image;
+    RenderGraph graph;
+    uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &output_image, nullptr, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+    uint32_t pass = graph.AddPass("clear", RecordReadbackBenchPass, &bench_pass);
+    graph.AddUse(pass, output, RENDER_GRAPH_ACCESS_TRANSFER_DST);
+    graph.Compile(state);
+
+    FrameReadback readback;
+
+    if (!readback.Create(state, extent, VK_FORMAT_R8G8B8A8_UNORM, 3, path))
+    {
+      graph.Destroy();
+      vkDestroyImage(state.device, output_image, &state.callbacks);
+      vkFreeMemory(state.device, output_memory, &state.callbacks);
+      break;
+    }
+
+    double start_ms = GetTimeMs();
+
+    for (uint32_t frame = 0; frame < frame_count; ++frame)
+    {
+      uint32_t slot = frame % frames_in_flight;
+      VK_CHECK(vkWaitForFences(state.device, 1, fences + slot, VK_TRUE, UINT64_MAX));
+      VK_CHECK(vkResetFences(state.device, 1, fences + slot));
+      readback.Poll();
+
+      float t = (float)frame / frame_count;
+      bench_pass.color.float32[0] = t;
+      bench_pass.color.float32[1] = 1.0f - t;
+      bench_pass.color.float32[2] = 0.5f;
+      bench_pass.color.float32[3] = 1.0f;
+
+      VkCommandBufferBeginInfo cmd_buf_info = {};
+      cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      VK_CHECK(vkBeginCommandBuffer(cmds[slot], &cmd_buf_info));
+      graph.Execute(cmds[slot], 0);
+      VK_CHECK(vkEndCommandBuffer(cmds[slot]));
+
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.commandBufferCount = 1;
+      submit_info.pCommandBuffers = cmds + slot;
+      VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fences[slot]));
+
+      VkCommandBuffer copy_cmd = VK_NULL_HANDLE;
+      VkFence copy_fence = VK_NULL_HANDLE;
+
+      if (readback.Capture(output_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, &copy_cmd, &copy_fence))
+      {
+        submit_info.pCommandBuffers = &copy_cmd;
+        VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, copy_fence));
+      }
+    }
+
+    VK_CHECK(vkWaitForFences(state.device, frames_in_flight, fences, VK_TRUE, UINT64_MAX));
+    double render_ms = GetTimeMs() - start_ms;
+    VK_CHECK(vkQueueWaitIdle(state.queue));
+    readback.Destroy();
+    double total_ms = GetTimeMs() - start_ms;
+
+    printf("  %ux%u: rendered %.1f fps, wrote %ld of %u frames at %.1f fps sustained, %llu dropped\n", extent.width, extent.height, frame_count * 1000.0 / render_ms, readback.stats.written, frame_count, readback.stats.written * 1000.0 / total_ms, (unsigned long long)readback.stats.dropped);
+
+    graph.Destroy();
+    vkDestroyImage(state.device, output_image, &state.callbacks);
+    vkFreeMemory(state.device, output_memory, &state.callbacks);
+  }
+
+  for (uint32_t i = 0; i < frames_in_flight; ++i)
+  {
+    vkDestroyFence(state.device, fences[i], &state.callbacks);
+  }
+
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+}
+
+// Frustum planes of a row major clip_from_world, xyz pointing inwards and
+// normalized so a sphere is inside a plane when dot(xyz, center) + w is at
+// least -radius.
+static void ExtractFrustumPlanes(const Mat4& clip_from_world, Vec4* planes)
+{
+  const float* m = clip_from_world.m;
+  const float signs[4] = { 1.0f, -1.0f, 1.0f, -1.0f };
+
+  // Left, right, bottom and top are w +/- x and w +/- y, near is z >= 0 and
+  // far is w - z.
+  for (uint32_t i = 0; i < 4; ++i)
+  {
+    const float* row = m + ((i / 2) * 4);
+    planes[i] = Vec4(m[12] + (signs[i] * row[0]), m[13] + (signs[i] * row[1]), m[14] + (signs[i] * row[2]), m[15] + (signs[i] * row[3]));
+  }
+
+  planes[4] = Vec4(m[8], m[9], m[10], m[11]);
+  planes[5] = Vec4(m[12] - m[8], m[13] - m[9], m[14] - m[10], m[15] - m[11]);
+
+  for (uint32_t i = 0; i < 6; ++i)
+  {
+    float length = planes[i].ToVec3().Length();
+    planes[i] = Vec4(planes[i].x / length, planes[i].y / length, planes[i].z / length, planes[i].w / length);
+  }
+}
+
+// A run of a mesh's triangles small enough to cull as one, laid out for
+// meshlet_cull.comp.
+struct Meshlet
+{
+  Vec3 center;
+  float radius;
+  Vec3 cone_axis;    // Average facing, zero when the triangles face too many ways to cull.
+  float cone_cutoff; // Sine of the cone's half angle.
+  uint32_t first_index;
+  uint32_t index_count;
+  uint32_t vertex_count;
+  uint32_t pad;
+};
+
+enum ClusterCullFlags
+{
+  CLUSTER_CULL_FRUSTUM = 1,
+  CLUSTER_CULL_CONE = 2,
+};
+
+// Splits an indexed triangle list into meshlets at load time.  Triangles are
+// reordered so every meshlet is one contiguous run of the index buffer, and
+// each run is grown from triangles that share vertices with it, so meshlets
+// come out compact enough for their bounds to cull well.
+struct MeshletMesh
+{
+  uint32_t* indices = nullptr; // Reordered copy of the source indices.
+  uint32_t index_count = 0;
+  Meshlet* meshlets = nullptr;
+  uint32_t meshlet_count = 0;
+
+  void Build(const Vertex* vertices, uint32_t vertex_count, const uint32_t* source_indices, uint32_t source_index_count, uint32_t max_vertices, uint32_t max_triangles);
+  void Destroy();
+
+  static void ComputeBounds(const Vertex* vertices, const uint32_t* triangle_indices, uint32_t triangle_index_count, Meshlet* meshlet);
+  static bool IsVisible(const Meshlet& meshlet, const Vec4* planes, const Vec3& camera_position, uint32_t flags);
+
+  // Tests.
+  static void MakeGrid(uint32_t size, Vertex* vertices, uint32_t* indices);
+  static void TestMeshletLayout();
+  static void TestBuildLimits();
+  static void TestConeCulling();
+  static void TestFrustumCulling();
+  static void RunAllTests();
+};
+
+// max_vertices and max_triangles of 64 and 124 fit a meshlet's local
+// indices in a byte and its triangles in 128 bytes of them, the sizes mesh
+// shading hardware is built around.
+void MeshletMesh::Build(const Vertex* vertices, uint32_t vertex_count, const uint32_t* source_indices, uint32_t source_index_count, uint32_t max_vertices, uint32_t max_triangles)
+{
+  uint32_t triangle_count = source_index_count / 3;
+
+  // Triangles using each vertex.
+  uint32_t* adjacency_offsets = (uint32_t*)Alloc(sizeof(uint32_t) * (vertex_count + 1), 16);
+  uint32_t* adjacency = (uint32_t*)Alloc(sizeof(uint32_t) * source_index_count, 16);
+  memset(adjacency_offsets, 0, sizeof(uint32_t) * (vertex_count + 1));
+
+  for (uint32_t i = 0; i < source_index_count; ++i)
+  {
+    ++adjacency_offsets[source_indices[i] + 1];
+  }
+
+  for (uint32_t v = 0; v < vertex_count; ++v)
+  {
+    adjacency_offsets[v + 1] += adjacency_offsets[v];
+  }
+
+  uint32_t* adjacency_fill = (uint32_t*)Alloc(sizeof(uint32_t) * vertex_count, 16);
+  memcpy(adjacency_fill, adjacency_offsets, sizeof(uint32_t) * vertex_count);
+
+  for (uint32_t i = 0; i < source_index_count; ++i)
+  {
+    adjacency[adjacency_fill[source_indices[i]]++] = i / 3;
+  }
+
+  Free(adjacency_fill);
+
+  // marks[v] is one more than the meshlet v was last added to.
+  uint32_t* marks = (uint32_t*)Alloc(sizeof(uint32_t) * vertex_count, 16);
+  bool* emitted = (bool*)Alloc(triangle_count, 16);
+  uint32_t* meshlet_vertices = (uint32_t*)Alloc(sizeof(uint32_t) * max_vertices, 16);
+  memset(marks, 0, sizeof(uint32_t) * vertex_count);
+  memset(emitted, 0, triangle_count);
+
+  index_count = triangle_count * 3;
+  indices = (uint32_t*)Alloc(sizeof(uint32_t) * (index_count ? index_count : 1), 16);
+  meshlets = (Meshlet*)Alloc(sizeof(Meshlet) * (triangle_count ? triangle_count : 1), 16);
+  meshlet_count = 0;
+
+  uint32_t next_unemitted = 0;
+  uint32_t emitted_count = 0;
+  Meshlet* meshlet = nullptr;
+  uint32_t meshlet_vertex_count = 0;
+
+  while (emitted_count < triangle_count)
+  {
+    // The triangle adding the fewest new vertices among those touching the
+    // meshlet, or the next unused one to start a new meshlet with.
+    uint32_t best = UINT32_MAX;
+    uint32_t best_new = 4;
+
+    for (uint32_t i = 0; meshlet && (i < meshlet_vertex_count) && best_new; ++i)
+    {
+      uint32_t v = meshlet_vertices[i];
+
+      for (uint32_t a = adjacency_offsets[v]; a < adjacency_offsets[v + 1]; ++a)
+      {
+        uint32_t t = adjacency[a];
+
+        if (emitted[t])
+        {
+          continue;
+        }
+
+        uint32_t new_vertices = 0;
+
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+          new_vertices += (marks[source_indices[(t * 3) + c]] != meshlet_count) ? 1 : 0;
+        }
+
+        if (new_vertices < best_new)
+        {
+          best = t;
+          best_new = new_vertices;
+        }
+      }
+    }
+
+    bool full = meshlet && ((best == UINT32_MAX) || ((meshlet_vertex_count + best_new) > max_vertices) || ((meshlet->index_count / 3) == max_triangles));
+
+    if (!meshlet || full)
+    {
+      if (meshlet)
+      {
+        meshlet->vertex_count = meshlet_vertex_count;
+        ComputeBounds(vertices, indices + meshlet->first_index, meshlet->index_count, meshlet);
+      }
+
+      while (emitted[next_unemitted])
+      {
+        ++next_unemitted;
+      }
+
+      meshlet = meshlets + meshlet_count++;
+      *meshlet = {};
+      meshlet->first_index = emitted_count * 3;
+      meshlet_vertex_count = 0;
+      best = next_unemitted;
+    }
+
+    for (uint32_t c = 0; c < 3; ++c)
+    {
+      uint32_t v = source_indices[(best * 3) + c];
+
+      if (marks[v] != meshlet_count)
+      {
+        marks[v] = meshlet_count;
+        meshlet_vertices[meshlet_vertex_count++] = v;
+      }
+
+      indices[meshlet->first_index + meshlet->index_count++] = v;
+    }
+
+    emitted[best] = true;
+    ++emitted_count;
+  }
+
+  if (meshlet)
+  {
+    meshlet->vertex_count = meshlet_vertex_count;
+    ComputeBounds(vertices, indices + meshlet->first_index, meshlet->index_count, meshlet);
+  }
+
+  Free(meshlet_vertices);
+  Free(emitted);
+  Free(marks);
+  Free(adjacency);
+  Free(adjacency_offsets);
+}
+
+void MeshletMesh::Destroy()
+{
+  Free(indices);
+  Free(meshlets);
+  indices = nullptr;
+  meshlets = nullptr;
+  index_count = 0;
+  meshlet_count = 0;
+}
+
+// The sphere is centered on the bounding box.  The cone's axis is the average
+// of the triangle normals and its cutoff comes from the normal furthest from
+// that, with counter-clockwise triangles facing their normal.
+void MeshletMesh::ComputeBounds(const Vertex* vertices, const uint32_t* triangle_indices, uint32_t triangle_index_count, Meshlet* meshlet)
+{
+  Vec3 min_position = vertices[triangle_indices[0]].position;
+  Vec3 max_position = min_position;
+
+  for (uint32_t i = 1; i < triangle_index_count; ++i)
+  {
+    const Vec3& p = vertices[triangle_indices[i]].position;
+    min_position = Vec3(std::fmin(min_position.x, p.x), std::fmin(min_position.y, p.y), std::fmin(min_position.z, p.z));
+    max_position = Vec3(std::fmax(max_position.x, p.x), std::fmax(max_position.y, p.y), std::fmax(max_position.z, p.z));
+  }
+
+  Vec3 center((min_position.x + max_position.x) * 0.5f, (min_position.y + max_position.y) * 0.5f, (min_position.z + max_position.z) * 0.5f);
+  float radius_squared = 0.0f;
+  Vec3 normal_sum(0.0f, 0.0f, 0.0f);
+
+  for (uint32_t i = 0; i < triangle_index_count; ++i)
+  {
+    const Vec3& p = vertices[triangle_indices[i]].position;
+    Vec3 offset(p.x - center.x, p.y - center.y, p.z - center.z);
+    radius_squared = std::fmax(radius_squared, offset.LengthSquared());
+  }
+
+  for (uint32_t i = 0; i < triangle_index_count; i += 3)
+  {
+    const Vec3& a = vertices[triangle_indices[i]].position;
+    const Vec3& b = vertices[triangle_indices[i + 1]].position;
+    const Vec3& c = vertices[triangle_indices[i + 2]].position;
+    Vec3 normal = Vec3(b.x - a.x, b.y - a.y, b.z - a.z).Cross(Vec3(c.x - a.x, c.y - a.y, c.z - a.z));
+
+    if (normal.LengthSquared() > 0.0f)
+    {
+      normal.Normalize();
+      normal_sum = Vec3(normal_sum.x + normal.x, normal_sum.y + normal.y, normal_sum.z + normal.z);
+    }
+  }
+
+  meshlet->center = center;
+  meshlet->radius = std::sqrt(radius_squared);
+  meshlet->cone_axis = Vec3(0.0f, 0.0f, 0.0f);
+  meshlet->cone_cutoff = 1.0f;
+
+  if (normal_sum.LengthSquared() == 0.0f)
+  {
+    return;
+  }
+
+  Vec3 axis = normal_sum.Normalized();
+  float min_dot = 1.0f;
+
+  for (uint32_t i = 0; i < triangle_index_count; i += 3)
+  {
+    const Vec3& a = vertices[triangle_indices[i]].position;
+    const Vec3& b = vertices[triangle_indices[i + 1]].position;
+    const Vec3& c = vertices[triangle_indices[i + 2]].position;
+    Vec3 normal = Vec3(b.x - a.x, b.y - a.y, b.z - a.z).Cross(Vec3(c.x - a.x, c.y - a.y, c.z - a.z));
+
+    if (normal.LengthSquared() > 0.0f)
+    {
+      min_dot = std::fmin(min_dot, axis.Dot(normal.Normalized()));
+    }
+  }
+
+  // Past about 84 degrees the cone almost never culls, so don't bother.
+  if (min_dot > 0.1f)
+  {
+    meshlet->cone_axis = axis;
+    meshlet->cone_cutoff = std::sqrt(1.0f - (min_dot * min_dot));
+  }
+}
+
+// The same test as meshlet_cull.comp.
+bool MeshletMesh::IsVisible(const Meshlet& meshlet, const Vec4* planes, const Vec3& camera_position, uint32_t flags)
+{
+  if (flags & CLUSTER_CULL_FRUSTUM)
+  {
+    for (uint32_t i = 0; i < 6; ++i)
+    {
+      if ((planes[i].ToVec3().Dot(meshlet.center) + planes[i].w) < -meshlet.radius)
+      {
+        return false;
+      }
+    }
+  }
+
+  Vec3 offset(meshlet.center.x - camera_position.x, meshlet.center.y - camera_position.y, meshlet.center.z - camera_position.z);
+  return !(flags & CLUSTER_CULL_CONE) || (offset.Dot(meshlet.cone_axis) < ((meshlet.cone_cutoff * offset.Length()) + meshlet.radius));
+}
+
+// A size x size quad grid on the z = 0 plane, facing +z, one unit per quad.
+void MeshletMesh::MakeGrid(uint32_t size, Vertex* vertices, uint32_t* indices)
+{
+  for (uint32_t y = 0; y <= size; ++y)
+  {
+    for (uint32_t x = 0; x <= size; ++x)
+    {
+      Vertex& vertex = vertices[(y * (size + 1)) + x];
+      vertex = {};
+      vertex.position = Vec3((float)x, (float)y, 0.0f);
+    }
+  }
+
+  for (uint32_t y = 0; y < size; ++y)
+  {
+    for (uint32_t x = 0; x < size; ++x)
+    {
+      uint32_t a = (y * (size + 1)) + x;
+      uint32_t* quad = indices + (((y * size) + x) * 6);
+      quad[0] = a;
+      quad[1] = a + 1;
+      quad[2] = a + size + 2;
+      quad[3] = a;
+      quad[4] = a + size + 2;
+      quad[5] = a + size + 1;
+    }
+  }
+}
+
+// meshlet_cull.comp reads meshlets as three vec4s.
+void MeshletMesh::TestMeshletLayout()
+{
+  FailIfNotExpected((size_t)16, offsetof(Meshlet, cone_axis), __FUNCTION__);
+  FailIfNotExpected((size_t)32, offsetof(Meshlet, first_index), __FUNCTION__);
+  FailIfNotExpected((size_t)48, sizeof(Meshlet), __FUNCTION__);
+}
+
+// Every source triangle comes out exactly once, in meshlets within the limits
+// that tile the index buffer.
+void MeshletMesh::TestBuildLimits()
+{
+  const uint32_t size = 20;
+  Vertex vertices[(size + 1) * (size + 1)];
+  uint32_t source_indices[size * size * 6];
+  MakeGrid(size, vertices, source_indices);
+
+  MeshletMesh mesh;
+  mesh.Build(vertices, ARRAY_COUNT(vertices), source_indices, ARRAY_COUNT(source_indices), 64, 124);
+  FailIfNotExpected((uint32_t)ARRAY_COUNT(source_indices), mesh.index_count, __FUNCTION__);
+
+  uint32_t next_index = 0;
+
+  for (uint32_t m = 0; m < mesh.meshlet_count; ++m)
+  {
+    const Meshlet& meshlet = mesh.meshlets[m];
+    FailIfNotExpected(next_index, meshlet.first_index, __FUNCTION__);
+    FailIfNotExpected(true, (meshlet.vertex_count <= 64) && ((meshlet.index_count / 3) <= 124), __FUNCTION__);
+    next_index += meshlet.index_count;
+
+    bool used[ARRAY_COUNT(vertices)] = {};
+    uint32_t unique = 0;
+
+    for (uint32_t i = meshlet.first_index; i < meshlet.first_index + meshlet.index_count; ++i)
+    {
+      unique += used[mesh.indices[i]] ? 0 : 1;
+      used[mesh.indices[i]] = true;
+    }
+
+    FailIfNotExpected(meshlet.vertex_count, unique, __FUNCTION__);
+  }
+
+  FailIfNotExpected(mesh.index_count, next_index, __FUNCTION__);
+
+  // Each quad's two triangles are identified by their first vertex and which
+  // half they are.
+  bool seen[size * size * 2] = {};
+
+  for (uint32_t i = 0; i < mesh.index_count; i += 3)
+  {
+    uint32_t a = mesh.indices[i];
+    uint32_t quad = ((a / (size + 1)) * size) + (a % (size + 1));
+    uint32_t half = (mesh.indices[i + 1] == a + 1) ? 0 : 1;
+    FailIfNotExpected(false, seen[(quad * 2) + half], __FUNCTION__);
+    seen[(quad * 2) + half] = true;
+  }
+
+  mesh.Destroy();
+}
+
+void MeshletMesh::TestConeCulling()
+{
+  Vertex vertices[5 * 5];
+  uint32_t source_indices[4 * 4 * 6];
+  MakeGrid(4, vertices, source_indices);
+
+  MeshletMesh mesh;
+  mesh.Build(vertices, ARRAY_COUNT(vertices), source_indices, ARRAY_COUNT(source_indices), 64, 124);
+  FailIfNotExpected(1u, mesh.meshlet_count, __FUNCTION__);
+
+  const Meshlet& meshlet = mesh.meshlets[0];
+  FailIfNotExpected(true, IsVisible(meshlet, nullptr, Vec3(2.0f, 2.0f, 5.0f), CLUSTER_CULL_CONE), __FUNCTION__);
+  FailIfNotExpected(false, IsVisible(meshlet, nullptr, Vec3(2.0f, 2.0f, -5.0f), CLUSTER_CULL_CONE), __FUNCTION__);
+
+  // Edge on, some of the sphere is in front of the plane.
+  FailIfNotExpected(true, IsVisible(meshlet, nullptr, Vec3(20.0f, 2.0f, 0.0f), CLUSTER_CULL_CONE), __FUNCTION__);
+  mesh.Destroy();
+}
+
+void MeshletMesh::TestFrustumCulling()
+{
+  Mat4 clip_from_world;
+  clip_from_world.SetPerspective(1.5707964f, 1.0f, 0.1f, 100.0f);
+  Vec4 planes[6];
+  ExtractFrustumPlanes(clip_from_world, planes);
+
+  Meshlet meshlet = {};
+  meshlet.radius = 1.0f;
+  meshlet.cone_axis = Vec3(0.0f, 0.0f, 0.0f);
+  meshlet.cone_cutoff = 1.0f;
+  const Vec3 camera_position(0.0f, 0.0f, 0.0f);
+  const Vec3 centers[5] = { Vec3(0.0f, 0.0f, 10.0f), Vec3(0.0f, 0.0f, -10.0f), Vec3(12.0f, 0.0f, 10.0f), Vec3(10.5f, 0.0f, 10.0f), Vec3(0.0f, 0.0f, 100.5f) };
+  const bool expected[5] = { true, false, false, true, true };
+  bool visible[5] = {};
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(centers); ++i)
+  {
+    meshlet.center = centers[i];
+    visible[i] = IsVisible(meshlet, planes, camera_position, CLUSTER_CULL_FRUSTUM | CLUSTER_CULL_CONE);
+  }
+
+  FailIfNotExpected(expected, visible, __FUNCTION__);
+}
+
+void MeshletMesh::RunAllTests()
+{
+  TestMeshletLayout();
+  TestBuildLimits();
+  TestConeCulling();
+  TestFrustumCulling();
+}
+
+struct ClusterStats
+{
+  uint32_t visible_meshlets;
+  uint32_t visible_triangles;
+};
+
+struct ClusterCullParams
+{
+  Vec4 planes[6];
+  Vec4 camera_position;
+  uint32_t meshlet_count;
+  uint32_t flags;
+};
+
+// Draws a MeshletMesh with its meshlets culled on the GPU.  Cull() writes one
+// indexed indirect draw per meshlet, with no instances for the culled ones,
+// and Draw() issues them all at once, or one at a time without
+// multiDrawIndirect.  The vertices must already be in world space.
+struct ClusterRenderer
+{
+  VulkanState* state = nullptr;
+  uint32_t meshlet_count = 0;
+  uint32_t index_count = 0;
+  uint32_t group_size = 64;
+  VkBuffer vertex_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory vertex_memory = VK_NULL_HANDLE;
+  VkBuffer index_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory index_memory = VK_NULL_HANDLE;
+  VkBuffer meshlet_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory meshlet_memory = VK_NULL_HANDLE;
+  VkBuffer draw_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory draw_memory = VK_NULL_HANDLE;
+  VkBuffer stats_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory stats_memory = VK_NULL_HANDLE;
+  ClusterStats* stats = nullptr; // Mapped, last Cull()'s counts once the GPU is idle.
+  VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+  VkPipelineLayout cull_layout = VK_NULL_HANDLE;
+  VkPipelineLayout draw_layout = VK_NULL_HANDLE;
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  VkPipeline cull_pipeline = VK_NULL_HANDLE;
+  VkPipeline draw_pipeline = VK_NULL_HANDLE;
+
+  bool Create(VulkanState& vulkan_state, DescriptorAllocator& descriptors, VkRenderPass render_pass, const Vertex* vertices, uint32_t vertex_count, const MeshletMesh& mesh);
+  void Destroy();
+  void Cull(VkCommandBuffer cmd, const Mat4& clip_from_world, const Vec3& camera_position, uint32_t flags);
+  void Draw(VkCommandBuffer cmd, const Mat4& clip_from_world);
+  void DrawWholeMesh(VkCommandBuffer cmd, const Mat4& clip_from_world);
+};
+
+// Returns false, having created nothing, when the shaders haven't been built.
+bool ClusterRenderer::Create(VulkanState& vulkan_state, DescriptorAllocator& descriptors, VkRenderPass render_pass, const Vertex* vertices, uint32_t vertex_count, const MeshletMesh& mesh)
+{
+  VkShaderModule cull_module = VK_NULL_HANDLE;
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+  bool have_shaders = vulkan_state.LoadShaderModule("meshlet_cull.comp.spv", &cull_module) &&
+    vulkan_state.LoadShaderModule("meshlet.vert.spv", &vertex_module) &&
+    vulkan_state.LoadShaderModule("basic.frag.spv", &frag_module);
+
+  if (!have_shaders)
+  {
+    vkDestroyShaderModule(vulkan_state.device, cull_module, &vulkan_state.callbacks);
+    vkDestroyShaderModule(vulkan_state.device, vertex_module, &vulkan_state.callbacks);
+    vkDestroyShaderModule(vulkan_state.device, frag_module, &vulkan_state.callbacks);
+    return false;
+  }
+
+  state = &vulkan_state;
+  meshlet_count = mesh.meshlet_count;
+  index_count = mesh.index_count;
+
+  const VkDeviceSize vertex_bytes = sizeof(Vertex) * vertex_count;
+  const VkDeviceSize index_bytes = sizeof(uint32_t) * index_count;
+  const VkDeviceSize meshlet_bytes = sizeof(Meshlet) * meshlet_count;
+  const VkDeviceSize draw_bytes = sizeof(VkDrawIndexedIndirectCommand) * meshlet_count;
+  state->CreateBuffer(vertex_bytes, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertex_buffer, &vertex_memory);
+  state->CreateBuffer(index_bytes, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer, &index_memory);
+  state->CreateBuffer(meshlet_bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &meshlet_buffer, &meshlet_memory);
+  state->CreateBuffer(draw_bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &draw_buffer, &draw_memory);
+  state->CreateBuffer(sizeof(ClusterStats), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stats_buffer, &stats_memory);
+  VK_CHECK(vkMapMemory(state->device, stats_memory, 0, VK_WHOLE_SIZE, 0, (void**)&stats));
+  memset(stats, 0, sizeof(ClusterStats));
+
+  state->UploadBuffer(vertex_buffer, vertices, vertex_bytes);
+  state->UploadBuffer(index_buffer, mesh.indices, index_bytes);
+  state->UploadBuffer(meshlet_buffer, mesh.meshlets, meshlet_bytes);
+
+  // Bindings: meshlets, draws, stats.
+  VkDescriptorSetLayoutBinding layout_bindings[3] = {};
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(layout_bindings); ++i)
+  {
+    layout_bindings[i].binding = i;
+    layout_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layout_bindings[i].descriptorCount = 1;
+    layout_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.bindingCount = ARRAY_COUNT(layout_bindings);
+  descriptor_layout.pBindings = layout_bindings;
+  VK_CHECK(vkCreateDescriptorSetLayout(state->device, &descriptor_layout, &state->callbacks, &set_layout));
+
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constant_range.size = sizeof(ClusterCullParams);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.setLayoutCount = 1;
+  pipeline_layout_create_info.pSetLayouts = &set_layout;
+  pipeline_layout_create_info.pushConstantRangeCount = 1;
+  pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+  VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &cull_layout));
+
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.size = sizeof(Mat4);
+  pipeline_layout_create_info.setLayoutCount = 0;
+  pipeline_layout_create_info.pSetLayouts = nullptr;
+  VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &draw_layout));
+
+  DescriptorBinding bindings[3] = {};
+  const VkBuffer buffers[3] = { meshlet_buffer, draw_buffer, stats_buffer };
+  const VkDeviceSize ranges[3] = { meshlet_bytes, draw_bytes, sizeof(ClusterStats) };
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(bindings); ++i)
+  {
+    bindings[i].binding = i;
+    bindings[i].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].buffer.buffer = buffers[i];
+    bindings[i].buffer.offset = 0;
+    bindings[i].buffer.range = ranges[i];
+  }
+
+  set = descriptors.Get(set_layout, bindings, ARRAY_COUNT(bindings));
+
+  VkSpecializationMapEntry specialization_entry = {};
+  specialization_entry.constantID = 0;
+  specialization_entry.size = sizeof(uint32_t);
+  VkSpecializationInfo specialization_info = {};
+  specialization_info.mapEntryCount = 1;
+  specialization_info.pMapEntries = &specialization_entry;
+  specialization_info.dataSize = sizeof(uint32_t);
+  specialization_info.pData = &group_size;
+
+  VkComputePipelineCreateInfo pipeline_info = {};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = cull_module;
+  pipeline_info.stage.pName = "main";
+  pipeline_info.stage.pSpecializationInfo = &specialization_info;
+  pipeline_info.layout = cull_layout;
+  VK_CHECK(vkCreateComputePipelines(state->device, VK_NULL_HANDLE, 1, &pipeline_info, &state->callbacks, &cull_pipeline));
+
+  draw_pipeline = CreateVertexColorPipeline(*state, render_pass, draw_layout, vertex_module, frag_module);
+  vkDestroyShaderModule(state->device, cull_module, &state->callbacks);
+  vkDestroyShaderModule(state->device, vertex_module, &state->callbacks);
+  vkDestroyShaderModule(state->device, frag_module, &state->callbacks);
+  return true;
+}
+
+void ClusterRenderer::Destroy()
+{
+  if (!state)
+  {
+    return;
+  }
+
+  vkDestroyPipeline(state->device, draw_pipeline, &state->callbacks);
+  vkDestroyPipeline(state->device, cull_pipeline, &state->callbacks);
+  vkDestroyPipelineLayout(state->device, draw_layout, &state->callbacks);
+  vkDestroyPipelineLayout(state->device, cull_layout, &state->callbacks);
+  vkDestroyDescriptorSetLayout(state->device, set_layout, &state->callbacks);
+  vkUnmapMemory(state->device, stats_memory);
+
+  const VkBuffer buffers[5] = { vertex_buffer, index_buffer, meshlet_buffer, draw_buffer, stats_buffer };
+  const VkDeviceMemory memories[5] = { vertex_memory, index_memory, meshlet_memory, draw_memory, stats_memory };
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(buffers); ++i)
+  {
+    vkDestroyBuffer(state->device, buffers[i], &state->callbacks);
+    vkFreeMemory(state->device, memories[i], &state->callbacks);
+  }
+
+  state = nullptr;
+}
+
+// Record outside a render pass, before the pass that calls Draw().  flags is
+// a combination of ClusterCullFlags, zero draws every meshlet.
+void ClusterRenderer::Cull(VkCommandBuffer cmd, const Mat4& clip_from_world, const Vec3& camera_position, uint32_t flags)
+{
+  ClusterCullParams params = {};
+  ExtractFrustumPlanes(clip_from_world, params.planes);
+  params.camera_position = Vec4(camera_position);
+  params.meshlet_count = meshlet_count;
+  params.flags = flags;
+
+  // Last frame's draws are done reading the commands.
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+  vkCmdFillBuffer(cmd, stats_buffer, 0, sizeof(ClusterStats), 0);
+
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline);
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_layout, 0, 1, &set, 0, nullptr);
+  vkCmdPushConstants(cmd, cull_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+  vkCmdDispatch(cmd, (meshlet_count + group_size - 1) / group_size, 1, 1);
+
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+// Record inside the render pass given to Create(), with the viewport and
+// scissor set.
+void ClusterRenderer::Draw(VkCommandBuffer cmd, const Mat4& clip_from_world)
+{
+  const VkDeviceSize offsets = 0;
+  const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw_pipeline);
+  vkCmdPushConstants(cmd, draw_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(Mat4), &clip_from_world);
+  vkCmdBindVertexBuffers(cmd, 1, 1, &vertex_buffer, &offsets);
+  vkCmdBindIndexBuffer(cmd, index_buffer, 0, VK_INDEX_TYPE_UINT32);
+
+  if (state->multi_draw_indirect)
+  {
+    vkCmdDrawIndexedIndirect(cmd, draw_buffer, 0, meshlet_count, stride);
+    return;
+  }
+
+  for (uint32_t i = 0; i < meshlet_count; ++i)
+  {
+    vkCmdDrawIndexedIndirect(cmd, draw_buffer, (VkDeviceSize)i * stride, 1, stride);
+  }
+}
+
+// The same triangles as a single draw with no culling, for comparison.
+void ClusterRenderer::DrawWholeMesh(VkCommandBuffer cmd, const Mat4& clip_from_world)
+{
+  const VkDeviceSize offsets = 0;
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw_pipeline);
+  vkCmdPushConstants(cmd, draw_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(Mat4), &clip_from_world);
+  vkCmdBindVertexBuffers(cmd, 1, 1, &vertex_buffer, &offsets);
+  vkCmdBindIndexBuffer(cmd, index_buffer, 0, VK_INDEX_TYPE_UINT32);
+  vkCmdDrawIndexed(cmd, index_count, 1, 0, 0, 0);
+}
+
+// Appends a UV sphere facing outwards, in world space.
+static void AppendSphere(const Vec3& center, float radius, uint32_t rings, uint32_t segments, const float* color, Vertex* vertices, uint32_t* vertex_count, uint32_t* indices, uint32_t* index_count)
+{
+  const float pi = 3.14159265f;
+  uint32_t first_vertex = *vertex_count;
+
+  for (uint32_t r = 0; r <= rings; ++r)
+  {
+    float theta = (pi * r) / rings;
+
+    for (uint32_t s = 0; s <= segments; ++s)
+    {
+      float phi = (2.0f * pi * s) / segments;
+      Vertex& vertex = vertices[(*vertex_count)++];
+      vertex.position = Vec3(center.x + (radius * std::sin(theta) * std::cos(phi)), center.y + (radius * std::cos(theta)), center.z + (radius * std::sin(theta) * std::sin(phi)));
+      memcpy(vertex.color, color, sizeof(vertex.color));
+    }
+  }
+
+  for (uint32_t r = 0; r < rings; ++r)
+  {
+    for (uint32_t s = 0; s < segments; ++s)
+    {
+      uint32_t a = first_vertex + (r * (segments + 1)) + s;
+      uint32_t b = a + segments + 1;
+      uint32_t* quad = indices + *index_count;
+      quad[0] = a;
+      quad[1] = a + 1;
+      quad[2] = b;
+      quad[3] = a + 1;
+      quad[4] = b + 1;
+      quad[5] = b;
+      *index_count += 6;
+    }
+  }
+}
+
+enum MeshletBenchMode
+{
+  MESHLET_BENCH_WHOLE_MESH,
+  MESHLET_BENCH_CLUSTERS,
+  MESHLET_BENCH_FRUSTUM,
+  MESHLET_BENCH_FRUSTUM_AND_CONE,
+  MESHLET_BENCH_MODE_COUNT,
+};
+
+struct MeshletBenchPass
+{
+  ClusterRenderer* clusters;
+  Mat4 clip_from_world;
+  MeshletBenchMode mode;
+  VkExtent2D extent;
+};
+
+static void RecordMeshletBenchPass(VkCommandBuffer cmd, void* userdata)
+{
+  MeshletBenchPass& bench_pass = *(MeshletBenchPass*)userdata;
+  VkViewport viewport = {};
+  viewport.width = (float)bench_pass.extent.width;
+  viewport.height = (float)bench_pass.extent.height;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = {};
+  scissor.extent = bench_pass.extent;
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+  if (bench_pass.mode == MESHLET_BENCH_WHOLE_MESH)
+  {
+    bench_pass.clusters->DrawWholeMesh(cmd, bench_pass.clip_from_world);
+  }
+  else
+  {
+    bench_pass.clusters->Draw(cmd, bench_pass.clip_from_world);
+  }
+}
+
+// A 16x16 field of dense spheres, about 2M triangles, seen from inside so the
+// frustum rejects most of it and the cone test the far side of what's left.
+// Reports the triangles submitted and the time per frame drawing the whole
+// mesh in one call against drawing its meshlets with each culling mode.
+void RunMeshletBench(VulkanState& state, const Options& options)
+{
+  const uint32_t grid = 16;
+  const uint32_t rings = 64;
+  const uint32_t segments = 64;
+  const uint32_t frame_count = 64;
+  const uint32_t frames_per_submit = 16;
+  const char* const mode_names[MESHLET_BENCH_MODE_COUNT] = { "whole mesh", "meshlets, no culling", "meshlets, frustum", "meshlets, frustum + cone" };
+  const uint32_t cull_flags[MESHLET_BENCH_MODE_COUNT] = { 0, 0, CLUSTER_CULL_FRUSTUM, CLUSTER_CULL_FRUSTUM | CLUSTER_CULL_CONE };
+  VkExtent2D extent = { (uint32_t)options.width, (uint32_t)options.height };
+
+  uint32_t sphere_vertices = (rings + 1) * (segments + 1);
+  uint32_t sphere_indices = rings * segments * 6;
+  Vertex* vertices = (Vertex*)Alloc(sizeof(Vertex) * sphere_vertices * grid * grid, 16);
+  uint32_t* indices = (uint32_t*)Alloc(sizeof(uint32_t) * sphere_indices * grid * grid, 16);
+  uint32_t vertex_count = 0;
+  uint32_t index_count = 0;
+
+  for (uint32_t i = 0; i < grid * grid; ++i)
+  {
+    const float color[4] = { (float)(i % grid) / grid, (float)(i / grid) / grid, 0.5f, 1.0f };
+    Vec3 center(((i % grid) * 3.0f) - (grid * 1.5f), 0.0f, ((i / grid) * 3.0f) - (grid * 1.5f));
+    AppendSphere(center, 1.0f, rings, segments, color, vertices, &vertex_count, indices, &index_count);
+  }
+
+  double build_start_ms = GetTimeMs();
+  MeshletMesh mesh;
+  mesh.Build(vertices, vertex_count, indices, index_count, 64, 124);
+  printf("Meshlets: %u triangles in %u meshlets (%.1f per meshlet), built in %.1f ms\n", index_count / 3, mesh.meshlet_count, (double)index_count / 3 / mesh.meshlet_count, GetTimeMs() - build_start_ms);
+  Free(indices);
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage output_image = VK_NULL_HANDLE;
+  VkDeviceMemory output_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &output_image, &output_memory);
+
+  MeshletBenchPass bench_pass = {};
+  bench_pass.extent = extent;
+
+  RenderGraph graph;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &output_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  uint32_t pass = graph.AddPass("meshlets", RecordMeshletBenchPass, &bench_pass);
+  graph.AddUse(pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.Compile(state);
+
+  DescriptorAllocator descriptors;
+  descriptors.Create(state, 1);
+  ClusterRenderer clusters;
+
+  if (!clusters.Create(state, descriptors, graph.RenderPass(pass), vertices, vertex_count, mesh))
+  {
+    printf("  skipped, no shaders\n");
+  }
+  else
+  {
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    VkCommandPool cmd_pool = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+    VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+    cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buffer_alloc_info.commandPool = cmd_pool;
+    cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buffer_alloc_info.commandBufferCount = 1;
+    VkCommandBuffer cmd = VK_NULL_HANDLE;
+    VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkFence fence = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+    // Standing near the middle of the field looking along +z.
+    const Vec3 camera_position(0.5f, 1.5f, -4.0f);
+    Mat4 world_to_view;
+    world_to_view.SetIdentity();
+    world_to_view.SetPosition(Vec3(-camera_position.x, -camera_position.y, -camera_position.z));
+    Mat4 view_to_clip;
+    view_to_clip.SetPerspective(1.0471976f, (float)extent.width / extent.height, 0.1f, 200.0f);
+    bench_pass.clip_from_world = view_to_clip * world_to_view;
+
+    printf("  %ux%u, %u frames, %s\n", extent.width, extent.height, frame_count, state.multi_draw_indirect ? "multi-draw indirect" : "one indirect draw per meshlet");
+
+    for (uint32_t m = 0; m < MESHLET_BENCH_MODE_COUNT; ++m)
+    {
+      bench_pass.mode = (MeshletBenchMode)m;
+      double start_ms = 0.0;
+
+      // The first submission warms up and isn't timed.
+      for (uint32_t frame = 0; frame < frame_count + frames_per_submit; frame += frames_per_submit)
+      {
+        if (frame == frames_per_submit)
+        {
+          start_ms = GetTimeMs();
+        }
+
+        VkCommandBufferBeginInfo cmd_buf_info = {};
+        cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+
+        for (uint32_t i = 0; i < frames_per_submit; ++i)
+        {
+          if (m != MESHLET_BENCH_WHOLE_MESH)
+          {
+            clusters.Cull(cmd, bench_pass.clip_from_world, camera_position, cull_flags[m]);
+          }
+
+          graph.Execute(cmd, 0);
+        }
+
+        VK_CHECK(vkEndCommandBuffer(cmd));
+
+        VkSubmitInfo submit_info = {};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &cmd;
+        VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+        VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+        VK_CHECK(vkResetFences(state.device, 1, &fence));
+      }
+
+      double total_ms = GetTimeMs() - start_ms;
+      uint32_t triangles = (m == MESHLET_BENCH_WHOLE_MESH) ? (mesh.index_count / 3) : clusters.stats->visible_triangles;
+      uint32_t meshlets = (m == MESHLET_BENCH_WHOLE_MESH) ? mesh.meshlet_count : clusters.stats->visible_meshlets;
+      printf("  %-26s %9u triangles, %6u meshlets, %8.3f ms per frame\n", mode_names[m], triangles, meshlets, total_ms / frame_count);
+    }
+
+    vkDestroyFence(state.device, fence, &state.callbacks);
+    vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+    clusters.Destroy();
+  }
+
+  descriptors.Destroy();
+  graph.Destroy();
+  vkDestroyImage(state.device, output_image, &state.callbacks);
+  vkFreeMemory(state.device, output_memory, &state.callbacks);
+  mesh.Destroy();
+  Free(vertices);
+}
+
+// One drawable for OcclusionCuller: a bounding sphere and a range of the
+// shared index buffer, laid out for occlusion_cull.comp.
+struct OcclusionObject
+{
+  Vec3 center;
+  float radius;
+  uint32_t index_count;
+  uint32_t first_index;
+  int32_t vertex_offset;
+  uint32_t pad;
+};
+
+// Per-frame camera, written into the command buffer with vkCmdUpdateBuffer so
+// several frames can be recorded back to back.
+struct OcclusionView
+{
+  Mat4 clip_from_world;
+  Mat4 prev_clip_from_world;
+  Vec4 planes[6];
+  float hiz_size[2];
+  uint32_t object_count;
+  uint32_t flags;
+};
+
+struct OcclusionStats
+{
+  uint32_t frustum_culled;
+  uint32_t early_drawn;
+  uint32_t late_drawn;
+  uint32_t occluded;
+};
+
+enum OcclusionFlags
+{
+  OCCLUSION_CULL = 1,    // Test against the pyramid at all.
+  OCCLUSION_HISTORY = 2, // Last frame's pyramid is there to test against.
+};
+
+// GPU occlusion culling against a hierarchical-Z pyramid of the depth buffer.
+// Each frame:
+//
+//   EarlyCull()    frustum test everything and draw what last frame's pyramid
+//                  doesn't hide, with DrawEarly() in the first depth pass.
+//   BuildPyramid() reduce that depth into the pyramid, farthest depth per
+//                  texel, in compute.
+//   LateCull()     test what the early pass skipped against the new pyramid
+//                  and draw what turns out to be visible after all with
+//                  DrawLate(), in a second pass that loads the depth.
+//
+// So objects are only ever skipped when this frame's depth hides them, and
+// the pyramid left at the end of the frame is next frame's history.  The
+// pyramid is managed here rather than by the render graph since it has a mip
+// chain; it's imported into the graph only so the pass that builds it isn't
+// culled.  The vertices must already be in world space.
+struct OcclusionCuller
+{
+  VulkanState* state = nullptr;
+  uint32_t object_count = 0;
+  VkExtent2D extent = {};
+  uint32_t level_count = 0;
+  uint32_t flags = OCCLUSION_CULL;
+  Mat4 clip_from_world;
+  Mat4 prev_clip_from_world;
+  VkBuffer vertex_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory vertex_memory = VK_NULL_HANDLE;
+  VkBuffer index_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory index_memory = VK_NULL_HANDLE;
+  VkBuffer object_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory object_memory = VK_NULL_HANDLE;
+  VkBuffer view_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory view_memory = VK_NULL_HANDLE;
+  VkBuffer early_draw_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory early_draw_memory = VK_NULL_HANDLE;
+  VkBuffer late_draw_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory late_draw_memory = VK_NULL_HANDLE;
+  VkBuffer drawn_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory drawn_memory = VK_NULL_HANDLE;
+  VkBuffer stats_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory stats_memory = VK_NULL_HANDLE;
+  OcclusionStats* stats = nullptr; // Mapped, the last frame's counts once the GPU is idle.
+  VkImage hiz_image = VK_NULL_HANDLE;
+  VkDeviceMemory hiz_memory = VK_NULL_HANDLE;
+  VkImageView hiz_view = VK_NULL_HANDLE; // Every level, for culling.
+  VkImageView level_views[16] = {};
+  VkSampler sampler = VK_NULL_HANDLE;
+  VkDescriptorSetLayout reduce_set_layout = VK_NULL_HANDLE;
+  VkDescriptorSetLayout cull_set_layout = VK_NULL_HANDLE;
+  VkPipelineLayout reduce_layout = VK_NULL_HANDLE;
+  VkPipelineLayout cull_layout = VK_NULL_HANDLE;
+  VkPipelineLayout draw_layout = VK_NULL_HANDLE;
+  VkDescriptorSet reduce_sets[16] = {};
+  VkDescriptorSet cull_set = VK_NULL_HANDLE;
+  VkPipeline reduce_pipeline = VK_NULL_HANDLE;
+  VkPipeline cull_pipeline = VK_NULL_HANDLE;
+  VkPipeline draw_pipeline = VK_NULL_HANDLE;
+  DescriptorAllocator* descriptors = nullptr;
+
+  bool Create(VulkanState& vulkan_state, DescriptorAllocator& descriptor_allocator, VkExtent2D depth_extent, const Vertex* vertices, uint32_t vertex_count, const uint32_t* indices, uint32_t index_count, const OcclusionObject* objects, uint32_t count);
+  void AttachToGraph(RenderGraph& graph, uint32_t draw_pass, uint32_t depth);
+  void Destroy();
+  void EarlyCull(VkCommandBuffer cmd, const Mat4& camera_clip_from_world);
+  void BuildPyramid(VkCommandBuffer cmd);
+  void LateCull(VkCommandBuffer cmd);
+  void DrawEarly(VkCommandBuffer cmd);
+  void DrawLate(VkCommandBuffer cmd);
+  void Draw(VkCommandBuffer cmd, VkBuffer draw_buffer);
+
+  static uint32_t LevelCount(VkExtent2D extent);
+  static void ReduceRange(uint32_t texel, uint32_t source_size, uint32_t destination_size, uint32_t* first, uint32_t* last);
+
+  // Tests.
+  static void TestLayouts();
+  static void TestLevelCount();
+  static void TestReduceRange();
+  static void RunAllTests();
+};
+
+// Levels halve rounding up, down to 1x1.
+uint32_t OcclusionCuller::LevelCount(VkExtent2D extent)
+{
+  uint32_t count = 1;
+
+  while ((extent.width > 1) || (extent.height > 1))
+  {
+    extent.width = (extent.width + 1) / 2;
+    extent.height = (extent.height + 1) / 2;
+    ++count;
+  }
+
+  return count;
+}
+
+// The source texels a destination texel covers along one axis, the same
+// ranges hiz_reduce.comp takes the maximum over.
+void OcclusionCuller::ReduceRange(uint32_t texel, uint32_t source_size, uint32_t destination_size, uint32_t* first, uint32_t* last)
+{
+  *first = (texel * source_size) / destination_size;
+  *last = ((((texel + 1) * source_size) + destination_size - 1) / destination_size) - 1;
+}
+
+// Returns false, having created nothing, when the shaders haven't been built.
+// AttachToGraph() has to be called before anything is recorded.
+bool OcclusionCuller::Create(VulkanState& vulkan_state, DescriptorAllocator& descriptor_allocator, VkExtent2D depth_extent, const Vertex* vertices, uint32_t vertex_count, const uint32_t* indices, uint32_t index_count, const OcclusionObject* objects, uint32_t count)
+{
+  VkShaderModule reduce_module = VK_NULL_HANDLE;
+  VkShaderModule cull_module = VK_NULL_HANDLE;
+  bool have_shaders = vulkan_state.LoadShaderModule("hiz_reduce.comp.spv", &reduce_module) &&
+    vulkan_state.LoadShaderModule("occlusion_cull.comp.spv", &cull_module);
+
+  if (!have_shaders)
+  {
+    vkDestroyShaderModule(vulkan_state.device, reduce_module, &vulkan_state.callbacks);
+    vkDestroyShaderModule(vulkan_state.device, cull_module, &vulkan_state.callbacks);
+    return false;
+  }
+
+  state = &vulkan_state;
+  descriptors = &descriptor_allocator;
+  object_count = count;
+  extent = depth_extent;
+  level_count = LevelCount(extent);
+  clip_from_world.SetIdentity();
+  prev_clip_from_world.SetIdentity();
+
+  if (level_count > ARRAY_COUNT(level_views))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  const VkDeviceSize draw_bytes = sizeof(VkDrawIndexedIndirectCommand) * object_count;
+  const VkBufferUsageFlags draw_usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+  state->CreateBuffer(sizeof(Vertex) * vertex_count, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertex_buffer, &vertex_memory);
+  state->CreateBuffer(sizeof(uint32_t) * index_count, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer, &index_memory);
+  state->CreateBuffer(sizeof(OcclusionObject) * object_count, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &object_buffer, &object_memory);
+  state->CreateBuffer(sizeof(OcclusionView), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &view_buffer, &view_memory);
+  state->CreateBuffer(draw_bytes, draw_usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &early_draw_buffer, &early_draw_memory);
+  state->CreateBuffer(draw_bytes, draw_usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &late_draw_buffer, &late_draw_memory);
+  state->CreateBuffer(sizeof(uint32_t) * object_count, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &drawn_buffer, &drawn_memory);
+  state->CreateBuffer(sizeof(OcclusionStats), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stats_buffer, &stats_memory);
+  VK_CHECK(vkMapMemory(state->device, stats_memory, 0, VK_WHOLE_SIZE, 0, (void**)&stats));
+  memset(stats, 0, sizeof(OcclusionStats));
+
+  state->UploadBuffer(vertex_buffer, vertices, sizeof(Vertex) * vertex_count);
+  state->UploadBuffer(index_buffer, indices, sizeof(uint32_t) * index_count);
+  state->UploadBuffer(object_buffer, objects, sizeof(OcclusionObject) * object_count);
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R32_SFLOAT;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = level_count;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  state->CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &hiz_image, &hiz_memory);
+
+  VkImageViewCreateInfo view_info = {};
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = hiz_image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = VK_FORMAT_R32_SFLOAT;
+  view_info.components.r = VK_COMPONENT_SWIZZLE_R;
+  view_info.components.g = VK_COMPONENT_SWIZZLE_G;
+  view_info.components.b = VK_COMPONENT_SWIZZLE_B;
+  view_info.components.a = VK_COMPONENT_SWIZZLE_A;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.levelCount = level_count;
+  view_info.subresourceRange.layerCount = 1;
+  VK_CHECK(vkCreateImageView(state->device, &view_info, &state->callbacks, &hiz_view));
+
+  for (uint32_t i = 0; i < level_count; ++i)
+  {
+    view_info.subresourceRange.baseMipLevel = i;
+    view_info.subresourceRange.levelCount = 1;
+    VK_CHECK(vkCreateImageView(state->device, &view_info, &state->callbacks, level_views + i));
+  }
+
+  // Only ever read with texelFetch.
+  VkSamplerCreateInfo sampler_create_info = {};
+  sampler_create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_create_info.magFilter = VK_FILTER_NEAREST;
+  sampler_create_info.minFilter = VK_FILTER_NEAREST;
+  sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_create_info.maxLod = (float)level_count;
+  VK_CHECK(vkCreateSampler(state->device, &sampler_create_info, &state->callbacks, &sampler));
+
+  // Reduce bindings: source level, destination level.
+  VkDescriptorSetLayoutBinding reduce_bindings[2] = {};
+  reduce_bindings[0].binding = 0;
+  reduce_bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  reduce_bindings[0].descriptorCount = 1;
+  reduce_bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  reduce_bindings[1].binding = 1;
+  reduce_bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  reduce_bindings[1].descriptorCount = 1;
+  reduce_bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.bindingCount = ARRAY_COUNT(reduce_bindings);
+  descriptor_layout.pBindings = reduce_bindings;
+  VK_CHECK(vkCreateDescriptorSetLayout(state->device, &descriptor_layout, &state->callbacks, &reduce_set_layout));
+
+  // Cull bindings: objects, view, early draws, late draws, drawn early,
+  // stats, pyramid.
+  VkDescriptorSetLayoutBinding cull_bindings[7] = {};
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(cull_bindings); ++i)
+  {
+    cull_bindings[i].binding = i;
+    cull_bindings[i].descriptorType = (i == 6) ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    cull_bindings[i].descriptorCount = 1;
+    cull_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+
+  descriptor_layout.bindingCount = ARRAY_COUNT(cull_bindings);
+  descriptor_layout.pBindings = cull_bindings;
+  VK_CHECK(vkCreateDescriptorSetLayout(state->device, &descriptor_layout, &state->callbacks, &cull_set_layout));
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.setLayoutCount = 1;
+  pipeline_layout_create_info.pSetLayouts = &reduce_set_layout;
+  VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &reduce_layout));
+
+  // Cull: phase and level count.
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constant_range.size = sizeof(uint32_t) * 2;
+  pipeline_layout_create_info.pSetLayouts = &cull_set_layout;
+  pipeline_layout_create_info.pushConstantRangeCount = 1;
+  pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+  VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &cull_layout));
+
+  // Draw: clip_from_world.
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.size = sizeof(Mat4);
+  pipeline_layout_create_info.setLayoutCount = 0;
+  pipeline_layout_create_info.pSetLayouts = nullptr;
+  VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &draw_layout));
+
+  // Level 0 reads the depth buffer, so its set waits for AttachToGraph().
+  for (uint32_t i = 1; i < level_count; ++i)
+  {
+    DescriptorBinding bindings[2] = {};
+    bindings[0].binding = 0;
+    bindings[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[0].image.sampler = sampler;
+    bindings[0].image.imageView = level_views[i - 1];
+    bindings[0].image.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    bindings[1].binding = 1;
+    bindings[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    bindings[1].image.imageView = level_views[i];
+    bindings[1].image.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    reduce_sets[i] = descriptors->Get(reduce_set_layout, bindings, ARRAY_COUNT(bindings));
+  }
+
+  DescriptorBinding bindings[7] = {};
+  const VkBuffer buffers[6] = { object_buffer, view_buffer, early_draw_buffer, late_draw_buffer, drawn_buffer, stats_buffer };
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(buffers); ++i)
+  {
+    bindings[i].binding = i;
+    bindings[i].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].buffer.buffer = buffers[i];
+    bindings[i].buffer.range = VK_WHOLE_SIZE;
+  }
+
+  bindings[6].binding = 6;
+  bindings[6].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[6].image.sampler = sampler;
+  bindings[6].image.imageView = hiz_view;
+  bindings[6].image.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+  cull_set = descriptors->Get(cull_set_layout, bindings, ARRAY_COUNT(bindings));
+
+  VkComputePipelineCreateInfo pipeline_info = {};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = reduce_module;
+  pipeline_info.stage.pName = "main";
+  pipeline_info.layout = reduce_layout;
+  VK_CHECK(vkCreateComputePipelines(state->device, VK_NULL_HANDLE, 1, &pipeline_info, &state->callbacks, &reduce_pipeline));
+  pipeline_info.stage.module = cull_module;
+  pipeline_info.layout = cull_layout;
+  VK_CHECK(vkCreateComputePipelines(state->device, VK_NULL_HANDLE, 1, &pipeline_info, &state->callbacks, &cull_pipeline));
+
+  vkDestroyShaderModule(state->device, reduce_module, &state->callbacks);
+  vkDestroyShaderModule(state->device, cull_module, &state->callbacks);
+  return true;
+}
+
+// draw_pass is a raster pass the objects are drawn in and depth the graph's
+// depth image, which the pass building the pyramid must sample.
+void OcclusionCuller::AttachToGraph(RenderGraph& graph, uint32_t draw_pass, uint32_t depth)
+{
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+
+  if (!state->LoadShaderModule("meshlet.vert.spv", &vertex_module) || !state->LoadShaderModule("basic.frag.spv", &frag_module))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  draw_pipeline = CreateVertexColorPipeline(*state, graph.RenderPass(draw_pass), draw_layout, vertex_module, frag_module, true);
+  vkDestroyShaderModule(state->device, vertex_module, &state->callbacks);
+  vkDestroyShaderModule(state->device, frag_module, &state->callbacks);
+
+  DescriptorBinding bindings[2] = {};
+  bindings[0].binding = 0;
+  bindings[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[0].image.sampler = sampler;
+  bindings[0].image.imageView = graph.View(depth);
+  bindings[0].image.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  bindings[1].binding = 1;
+  bindings[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  bindings[1].image.imageView = level_views[0];
+  bindings[1].image.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+  reduce_sets[0] = descriptors->Get(reduce_set_layout, bindings, ARRAY_COUNT(bindings));
+}
+
+void OcclusionCuller::Destroy()
+{
+  if (!state)
+  {
+    return;
+  }
+
+  vkDestroyPipeline(state->device, draw_pipeline, &state->callbacks);
+  vkDestroyPipeline(state->device, cull_pipeline, &state->callbacks);
+  vkDestroyPipeline(state->device, reduce_pipeline, &state->callbacks);
+  vkDestroyPipelineLayout(state->device, draw_layout, &state->callbacks);
+  vkDestroyPipelineLayout(state->device, cull_layout, &state->callbacks);
+  vkDestroyPipelineLayout(state->device, reduce_layout, &state->callbacks);
+  vkDestroyDescriptorSetLayout(state->device, cull_set_layout, &state->callbacks);
+  vkDestroyDescriptorSetLayout(state->device, reduce_set_layout, &state->callbacks);
+  vkDestroySampler(state->device, sampler, &state->callbacks);
+
+  for (uint32_t i = 0; i < level_count; ++i)
+  {
+    vkDestroyImageView(state->device, level_views[i], &state->callbacks);
+  }
+
+  vkDestroyImageView(state->device, hiz_view, &state->callbacks);
+  vkDestroyImage(state->device, hiz_image, &state->callbacks);
+  vkFreeMemory(state->device, hiz_memory, &state->callbacks);
+  vkUnmapMemory(state->device, stats_memory);
+
+  const VkBuffer buffers[8] = { vertex_buffer, index_buffer, object_buffer, view_buffer, early_draw_buffer, late_draw_buffer, drawn_buffer, stats_buffer };
+  const VkDeviceMemory memories[8] = { vertex_memory, index_memory, object_memory, view_memory, early_draw_memory, late_draw_memory, drawn_memory, stats_memory };
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(buffers); ++i)
+  {
+    vkDestroyBuffer(state->device, buffers[i], &state->callbacks);
+    vkFreeMemory(state->device, memories[i], &state->callbacks);
+  }
+
+  state = nullptr;
+}
+
+// Record outside a render pass at the start of the frame.  Clearing
+// OCCLUSION_CULL from flags draws everything in the frustum early.
+void OcclusionCuller::EarlyCull(VkCommandBuffer cmd, const Mat4& camera_clip_from_world)
+{
+  prev_clip_from_world = clip_from_world;
+  clip_from_world = camera_clip_from_world;
+
+  OcclusionView view = {};
+  view.clip_from_world = clip_from_world;
+  view.prev_clip_from_world = prev_clip_from_world;
+  ExtractFrustumPlanes(clip_from_world, view.planes);
+  view.hiz_size[0] = (float)extent.width;
+  view.hiz_size[1] = (float)extent.height;
+  view.object_count = object_count;
+  view.flags = flags;
+
+  // Last frame's draws and late cull are done with the buffers.
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+  vkCmdUpdateBuffer(cmd, view_buffer, 0, sizeof(view), &view);
+  vkCmdFillBuffer(cmd, stats_buffer, 0, sizeof(OcclusionStats), 0);
+
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  const uint32_t params[2] = { 0, level_count };
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline);
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_layout, 0, 1, &cull_set, 0, nullptr);
+  vkCmdPushConstants(cmd, cull_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), params);
+  vkCmdDispatch(cmd, (object_count + 63) / 64, 1, 1);
+
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+// Record outside a render pass, with the depth in
+// VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.  Skipped when not culling.
+void OcclusionCuller::BuildPyramid(VkCommandBuffer cmd)
+{
+  if (!(flags & OCCLUSION_CULL))
+  {
+    flags &= ~OCCLUSION_HISTORY;
+    return;
+  }
+
+  // The early cull has finished with last frame's pyramid, so its contents
+  // can go.
+  VkImageMemoryBarrier image_barrier = {};
+  image_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  image_barrier.srcAccessMask = 0;
+  image_barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  image_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  image_barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  image_barrier.image = hiz_image;
+  image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  image_barrier.subresourceRange.levelCount = level_count;
+  image_barrier.subresourceRange.layerCount = 1;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &image_barrier);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, reduce_pipeline);
+
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  VkExtent2D level_extent = extent;
+
+  for (uint32_t i = 0; i < level_count; ++i)
+  {
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, reduce_layout, 0, 1, reduce_sets + i, 0, nullptr);
+    vkCmdDispatch(cmd, (level_extent.width + 7) / 8, (level_extent.height + 7) / 8, 1);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    level_extent.width = (level_extent.width + 1) / 2;
+    level_extent.height = (level_extent.height + 1) / 2;
+  }
+
+  flags |= OCCLUSION_HISTORY;
+}
+
+// Record outside a render pass, after BuildPyramid().
+void OcclusionCuller::LateCull(VkCommandBuffer cmd)
+{
+  const uint32_t params[2] = { 1, level_count };
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline);
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_layout, 0, 1, &cull_set, 0, nullptr);
+  vkCmdPushConstants(cmd, cull_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), params);
+  vkCmdDispatch(cmd, (object_count + 63) / 64, 1, 1);
+
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void OcclusionCuller::DrawEarly(VkCommandBuffer cmd)
+{
+  Draw(cmd, early_draw_buffer);
+}
+
+void OcclusionCuller::DrawLate(VkCommandBuffer cmd)
+{
+  Draw(cmd, late_draw_buffer);
+}
+
+// Record inside the render pass given to AttachToGraph(), or one compatible
+// with it, with the viewport and scissor set.
+void OcclusionCuller::Draw(VkCommandBuffer cmd, VkBuffer draw_buffer)
+{
+  const VkDeviceSize offsets = 0;
+  const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw_pipeline);
+  vkCmdPushConstants(cmd, draw_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(Mat4), &clip_from_world);
+  vkCmdBindVertexBuffers(cmd, 1, 1, &vertex_buffer, &offsets);
+  vkCmdBindIndexBuffer(cmd, index_buffer, 0, VK_INDEX_TYPE_UINT32);
+
+  if (state->multi_draw_indirect)
+  {
+    vkCmdDrawIndexedIndirect(cmd, draw_buffer, 0, object_count, stride);
+    return;
+  }
+
+  for (uint32_t i = 0; i < object_count; ++i)
+  {
+    vkCmdDrawIndexedIndirect(cmd, draw_buffer, (VkDeviceSize)i * stride, 1, stride);
+  }
+}
+
+// occlusion_cull.comp reads objects as a vec4 and four scalars and the view
+// as two matrices, six planes, a vec2 and two scalars.
+void OcclusionCuller::TestLayouts()
+{
+  FailIfNotExpected((size_t)32, sizeof(OcclusionObject), __FUNCTION__);
+  FailIfNotExpected((size_t)224, offsetof(OcclusionView, hiz_size), __FUNCTION__);
+  FailIfNotExpected((size_t)240, sizeof(OcclusionView), __FUNCTION__);
+}
+
+void OcclusionCuller::TestLevelCount()
+{
+  const VkExtent2D extents[4] = { { 1, 1 }, { 5, 3 }, { 1920, 1080 }, { 4096, 16 } };
+  const uint32_t expected[4] = { 1, 4, 12, 13 };
+  uint32_t counts[4] = {};
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(extents); ++i)
+  {
+    counts[i] = LevelCount(extents[i]);
+  }
+
+  FailIfNotExpected(expected, counts, __FUNCTION__);
+}
+
+// Every source texel is covered by the destination texel its center maps to,
+// which is the one culling looks up, for both the depth to level 0 copy and
+// odd sized levels.
+void OcclusionCuller::TestReduceRange()
+{
+  const uint32_t sizes[4][2] = { { 5, 3 }, { 7, 4 }, { 1080, 1080 }, { 1, 1 } };
+
+  for (uint32_t s = 0; s < ARRAY_COUNT(sizes); ++s)
+  {
+    uint32_t source_size = sizes[s][0];
+    uint32_t destination_size = sizes[s][1];
+
+    for (uint32_t i = 0; i < source_size; ++i)
+    {
+      uint32_t texel = (uint32_t)(((i + 0.5f) / source_size) * destination_size);
+      uint32_t first = 0;
+      uint32_t last = 0;
+      ReduceRange(texel, source_size, destination_size, &first, &last);
+      FailIfNotExpected(true, (first <= i) && (i <= last) && (last < source_size), __FUNCTION__);
+    }
+  }
+}
+
+void OcclusionCuller::RunAllTests()
+{
+  TestLayouts();
+  TestLevelCount();
+  TestReduceRange();
+}
+
+// Appends an axis-aligned box, in world space.
+static void AppendBox(const Vec3& min, const Vec3& max, const float* color, Vertex* vertices, uint32_t* vertex_count, uint32_t* indices, uint32_t* index_count)
+{
+  static const uint32_t s_faces[6][4] =
+  {
+    { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, // -x, +x
+    { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, // -y, +y
+    { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, // -z, +z
+  };
+
+  uint32_t first_vertex = *vertex_count;
+
+  for (uint32_t i = 0; i < 8; ++i)
+  {
+    Vertex& vertex = vertices[(*vertex_count)++];
+    vertex.position = Vec3((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+    memcpy(vertex.color, color, sizeof(vertex.color));
+  }
+
+  for (uint32_t f = 0; f < 6; ++f)
+  {
+    uint32_t* quad = indices + *index_count;
+    quad[0] = first_vertex + s_faces[f][0];
+    quad[1] = first_vertex + s_faces[f][1];
+    quad[2] = first_vertex + s_faces[f][2];
+    quad[3] = first_vertex + s_faces[f][0];
+    quad[4] = first_vertex + s_faces[f][2];
+    quad[5] = first_vertex + s_faces[f][3];
+    *index_count += 6;
+  }
+}
+
+struct OcclusionBenchPass
+{
+  OcclusionCuller* culler;
+  VkExtent2D extent;
+};
+
+static void SetOcclusionBenchViewport(VkCommandBuffer cmd, VkExtent2D extent)
+{
+  VkViewport viewport = {};
+  viewport.width = (float)extent.width;
+  viewport.height = (float)extent.height;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = {};
+  scissor.extent = extent;
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+}
+
+static void RecordOcclusionEarlyPass(VkCommandBuffer cmd, void* userdata)
+{
+  OcclusionBenchPass& bench_pass = *(OcclusionBenchPass*)userdata;
+  SetOcclusionBenchViewport(cmd, bench_pass.extent);
+  bench_pass.culler->DrawEarly(cmd);
+}
+
+static void RecordOcclusionPyramidPass(VkCommandBuffer cmd, void* userdata)
+{
+  OcclusionBenchPass& bench_pass = *(OcclusionBenchPass*)userdata;
+  bench_pass.culler->BuildPyramid(cmd);
+  bench_pass.culler->LateCull(cmd);
+}
+
+static void RecordOcclusionLatePass(VkCommandBuffer cmd, void* userdata)
+{
+  OcclusionBenchPass& bench_pass = *(OcclusionBenchPass*)userdata;
+  SetOcclusionBenchViewport(cmd, bench_pass.extent);
+  bench_pass.culler->DrawLate(cmd);
+}
+
+// A 32x32 field of spheres cut into bands by long walls, seen from ground
+// level at one end so each wall hides most of what's behind it.  The camera
+// drifts sideways so the history is always a frame old.  Reports the objects
+// drawn in each pass and the time per frame with frustum culling alone
+// against frustum plus two-pass occlusion culling.
+void RunOcclusionBench(VulkanState& state, const Options& options)
+{
+  const uint32_t grid = 32;
+  const uint32_t rings = 24;
+  const uint32_t segments = 24;
+  const uint32_t wall_count = grid / 4;
+  const uint32_t object_count = (grid * grid) + wall_count;
+  const uint32_t frame_count = 64;
+  const uint32_t frames_per_submit = 16;
+  const char* const mode_names[2] = { "frustum", "frustum + occlusion" };
+  VkExtent2D extent = { (uint32_t)options.width, (uint32_t)options.height };
+
+  uint32_t sphere_vertices = (rings + 1) * (segments + 1);
+  uint32_t sphere_indices = rings * segments * 6;
+  Vertex* vertices = (Vertex*)Alloc(sizeof(Vertex) * ((sphere_vertices * grid * grid) + (8 * wall_count)), 16);
+  uint32_t* indices = (uint32_t*)Alloc(sizeof(uint32_t) * ((sphere_indices * grid * grid) + (36 * wall_count)), 16);
+  OcclusionObject* objects = (OcclusionObject*)Alloc(sizeof(OcclusionObject) * object_count, 16);
+  uint32_t vertex_count = 0;
+  uint32_t index_count = 0;
+
+  for (uint32_t i = 0; i < object_count; ++i)
+  {
+    OcclusionObject& object = objects[i];
+    object = {};
+    object.first_index = index_count;
+
+    if (i < grid * grid)
+    {
+      const float color[4] = { (float)(i % grid) / grid, (float)(i / grid) / grid, 0.5f, 1.0f };
+      object.center = Vec3(((i % grid) * 3.0f) - (grid * 1.5f), 1.0f, (i / grid) * 3.0f);
+      object.radius = 1.0f;
+      AppendSphere(object.center, object.radius, rings, segments, color, vertices, &vertex_count, indices, &index_count);
+    }
+    else
+    {
+      // After every four rows.
+      const float color[4] = { 0.3f, 0.3f, 0.3f, 1.0f };
+      float z = ((i - (grid * grid)) * 12.0f) + 10.5f;
+      Vec3 min(-grid * 1.5f - 2.0f, 0.0f, z - 0.25f);
+      Vec3 max(grid * 1.5f + 2.0f, 4.0f, z + 0.25f);
+      object.center = Vec3((min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f, z);
+      object.radius = Vec3((max.x - min.x) * 0.5f, (max.y - min.y) * 0.5f, (max.z - min.z) * 0.5f).Length();
+      AppendBox(min, max, color, vertices, &vertex_count, indices, &index_count);
+    }
+
+    object.index_count = index_count - object.first_index;
+  }
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage output_image = VK_NULL_HANDLE;
+  VkDeviceMemory output_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &output_image, &output_memory);
+
+  DescriptorAllocator descriptors;
+  descriptors.Create(state, 1);
+  OcclusionCuller culler;
+  OcclusionBenchPass bench_pass = {};
+  bench_pass.culler = &culler;
+  bench_pass.extent = extent;
+
+  if (!culler.Create(state, descriptors, extent, vertices, vertex_count, indices, index_count, objects, object_count))
+  {
+    printf("  skipped, no shaders\n");
+  }
+  else
+  {
+    // The pyramid is imported only so the pass building it counts as live.
+    RenderGraph graph;
+    uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &output_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    uint32_t depth = graph.CreateImage("depth", VK_FORMAT_D32_SFLOAT, extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+    uint32_t hiz = graph.ImportImage("hiz", VK_FORMAT_R32_SFLOAT, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &culler.hiz_image, culler.level_views, VK_IMAGE_LAYOUT_GENERAL);
+    uint32_t early_pass = graph.AddPass("early", RecordOcclusionEarlyPass, &bench_pass);
+    graph.AddUse(early_pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+    graph.AddUse(early_pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+    uint32_t pyramid_pass = graph.AddPass("hiz", RecordOcclusionPyramidPass, &bench_pass);
+    graph.AddUse(pyramid_pass, depth, RENDER_GRAPH_ACCESS_SAMPLED);
+    graph.AddUse(pyramid_pass, hiz, RENDER_GRAPH_ACCESS_STORAGE_WRITE);
+    uint32_t late_pass = graph.AddPass("late", RecordOcclusionLatePass, &bench_pass);
+    graph.AddUse(late_pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+    graph.AddUse(late_pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+    graph.Compile(state);
+    culler.AttachToGraph(graph, early_pass, depth);
+
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    VkCommandPool cmd_pool = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+    VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+    cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buffer_alloc_info.commandPool = cmd_pool;
+    cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buffer_alloc_info.commandBufferCount = 1;
+    VkCommandBuffer cmd = VK_NULL_HANDLE;
+    VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkFence fence = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+    Mat4 view_to_clip;
+    view_to_clip.SetPerspective(1.0471976f, (float)extent.width / extent.height, 0.1f, 200.0f);
+    printf("  %ux%u, %u objects, %u triangles, %u pyramid levels, %u frames\n", extent.width, extent.height, object_count, index_count / 3, culler.level_count, frame_count);
+
+    for (uint32_t m = 0; m < ARRAY_COUNT(mode_names); ++m)
+    {
+      culler.flags = (m == 1) ? OCCLUSION_CULL : 0;
+      double start_ms = 0.0;
+
+      // The first submission warms up and isn't timed.
+      for (uint32_t frame = 0; frame < frame_count + frames_per_submit; frame += frames_per_submit)
+      {
+        if (frame == frames_per_submit)
+        {
+          start_ms = GetTimeMs();
+        }
+
+        VkCommandBufferBeginInfo cmd_buf_info = {};
+        cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+
+        for (uint32_t i = 0; i < frames_per_submit; ++i)
+        {
+          Mat4 world_to_view;
+          world_to_view.SetIdentity();
+          world_to_view.SetPosition(Vec3(-std::sin((frame + i) * 0.05f) * 4.0f, -1.5f, 6.0f));
+          culler.EarlyCull(cmd, view_to_clip * world_to_view);
+          graph.Execute(cmd, 0);
+        }
+
+        VK_CHECK(vkEndCommandBuffer(cmd));
+
+        VkSubmitInfo submit_info = {};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &cmd;
+        VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+        VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+        VK_CHECK(vkResetFences(state.device, 1, &fence));
+      }
+
+      double total_ms = GetTimeMs() - start_ms;
+      const OcclusionStats& stats = *culler.stats;
+      printf("  %-20s %5u frustum culled, %5u early, %5u late, %5u occluded, %8.3f ms per frame\n", mode_names[m], stats.frustum_culled, stats.early_drawn, stats.late_drawn, stats.occluded, total_ms / frame_count);
+    }
+
+    vkDestroyFence(state.device, fence, &state.callbacks);
+    vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+    graph.Destroy();
+    culler.Destroy();
+  }
+
+  descriptors.Destroy();
+  vkDestroyImage(state.device, output_image, &state.callbacks);
+  vkFreeMemory(state.device, output_memory, &state.callbacks);
+  Free(objects);
+  Free(indices);
+  Free(vertices);
+}
+
+// Times composing and inverting 1M transforms as Mat4 and as Affine3x4, and
+// copying them into a mapped per-object buffer, which is where the smaller
+// upload shows up on the CPU.  The GPU side reads 48 bytes per object
+// instead of 64 through PerDrawPath and the scene graph.
+void RunAffineBench(VulkanState& state)
+{
+  const uint32_t count = 1 << 20;
+  const uint32_t repeat_count = 8;
+
+  Mat4* mat4s = (Mat4*)Alloc(sizeof(Mat4) * count * 3, 16);
+  Affine3x4* affines = (Affine3x4*)Alloc(sizeof(Affine3x4) * count * 3, 16);
+  uint32_t rng = 0x2545f491u;
+
+  for (uint32_t i = 0; i < count * 2; ++i)
+  {
+    Affine3x4& a = affines[i];
+
+    for (uint32_t j = 0; j < 12; ++j)
+    {
+      rng ^= rng << 13;
+      rng ^= rng >> 17;
+      rng ^= rng << 5;
+      a.m[j] = ((float)(rng & 0xffff) / 65535.0f) - 0.5f;
+    }
+
+    // Keep it comfortably invertible.
+    a.m[0] += 2.0f;
+    a.m[5] += 2.0f;
+    a.m[10] += 2.0f;
+    mat4s[i] = a.ToMat4();
+  }
+
+  Mat4* mat4_results = mat4s + (count * 2);
+  Affine3x4* affine_results = affines + (count * 2);
+  double mat4_ms = 0.0;
+  double affine_ms = 0.0;
+  double inverse_ms = 0.0;
+  float checksum = 0.0f;
+
+  for (uint32_t r = 0; r < repeat_count; ++r)
+  {
+    double start_ms = GetTimeMs();
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      mat4_results[i] = mat4s[i] * mat4s[count + i];
+    }
+
+    mat4_ms += GetTimeMs() - start_ms;
+    start_ms = GetTimeMs();
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      affine_results[i] = affines[i] * affines[count + i];
+    }
+
+    affine_ms += GetTimeMs() - start_ms;
+    checksum += mat4_results[r].m[3] + affine_results[r].m[3];
+    start_ms = GetTimeMs();
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      affine_results[i] = affines[i].Inverse();
+    }
+
+    inverse_ms += GetTimeMs() - start_ms;
+    checksum += affine_results[r].m[3];
+  }
+
+  const double ns_per_op = 1000000.0 / ((double)count * repeat_count);
+  printf("Affine transforms, %u per pass, %u passes (checksum %g):\n", count, repeat_count, (double)checksum);
+  printf("  Mat4 * Mat4             %7.2f ns\n", mat4_ms * ns_per_op);
+  printf("  Affine3x4 * Affine3x4   %7.2f ns\n", affine_ms * ns_per_op);
+  printf("  Affine3x4::Inverse()    %7.2f ns\n", inverse_ms * ns_per_op);
+
+  VkBuffer object_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory object_memory = VK_NULL_HANDLE;
+  uint8_t* mapped = nullptr;
+  state.CreateBuffer(sizeof(Mat4) * count, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &object_buffer, &object_memory);
+  VK_CHECK(vkMapMemory(state.device, object_memory, 0, VK_WHOLE_SIZE, 0, (void**)&mapped));
+
+  const char* const layout_names[2] = { "Mat4", "Affine3x4" };
+  const void* sources[2] = { mat4_results, affine_results };
+  const size_t strides[2] = { sizeof(Mat4), sizeof(Affine3x4) };
+
+  for (uint32_t l = 0; l < ARRAY_COUNT(layout_names); ++l)
+  {
+    double start_ms = GetTimeMs();
+
+    for (uint32_t r = 0; r < repeat_count; ++r)
+    {
+      memcpy(mapped, sources[l], strides[l] * count);
+    }
+
+    double ms = (GetTimeMs() - start_ms) / repeat_count;
+    double mb = (double)(strides[l] * count) / (1024.0 * 1024.0);
+    printf("  upload %-10s %2u bytes per object, %6.1f MB per frame, %7.3f ms (%.1f GB/s)\n", layout_names[l], (uint32_t)strides[l], mb, ms, (mb / 1024.0) / (ms / 1000.0));
+  }
+
+  printf("  CubeUniforms %u bytes against %u as three Mat4s\n", (uint32_t)sizeof(CubeUniforms), (uint32_t)(sizeof(Mat4) * 3));
+
+  vkUnmapMemory(state.device, object_memory);
+  vkDestroyBuffer(state.device, object_buffer, &state.callbacks);
+  vkFreeMemory(state.device, object_memory, &state.callbacks);
+  Free(affines);
+  Free(mat4s);
+}
+
+// One view of a multiview batch, laid out for multiview.vert.
+struct MultiviewCamera
+{
+  Affine3x4 view_from_world;
+  Mat4 clip_from_view; // Row major.
+};
+
+struct MultiviewBenchPass
+{
+  VkPipeline pipeline;
+  VkPipelineLayout pipeline_layout;
+  VkDescriptorSet set;
+  VkBuffer vertex_buffer;
+  VkBuffer index_buffer;
+  uint32_t index_count;
+  uint32_t first_view;
+  VkExtent2D extent;
+};
+
+static void RecordMultiviewBenchPass(VkCommandBuffer cmd, void* userdata)
+{
+  const MultiviewBenchPass& pass = *(const MultiviewBenchPass*)userdata;
+  const VkDeviceSize offsets = 0;
+  VkViewport viewport = {};
+  viewport.width = (float)pass.extent.width;
+  viewport.height = (float)pass.extent.height;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = {};
+  scissor.extent = pass.extent;
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pass.pipeline);
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pass.pipeline_layout, 0, 1, &pass.set, 0, nullptr);
+  vkCmdPushConstants(cmd, pass.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(uint32_t), &pass.first_view);
+  vkCmdBindVertexBuffers(cmd, 1, 1, &pass.vertex_buffer, &offsets);
+  vkCmdBindIndexBuffer(cmd, pass.index_buffer, 0, VK_INDEX_TYPE_UINT32);
+  vkCmdDrawIndexed(cmd, pass.index_count, 1, 0, 0, 0);
+}
+
+// A ring of cameras around a field of spheres, all looking at its middle,
+// the same layout as a camera array rig.
+static void SetMultiviewCameras(uint32_t count, float aspect, MultiviewCamera* cameras)
+{
+  const float pi = 3.14159265f;
+  const float radius = 20.0f;
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    float angle = (2.0f * pi * i) / count;
+    float s = std::sin(angle);
+    float c = std::cos(angle);
+    Vec3 position(radius * s, 4.0f, -radius * c);
+
+    // Right, up and forward rows, forward pointing back at the origin.
+    Affine3x4& view = cameras[i].view_from_world;
+    view = { c, 0.0f, s, 0.0f,
+             0.0f, 1.0f, 0.0f, 0.0f,
+             -s, 0.0f, c, 0.0f };
+    view.SetPosition(Vec3(-((c * position.x) + (s * position.z)), -position.y, -((c * position.z) - (s * position.x))));
+    cameras[i].clip_from_view.SetPerspective(1.5707964f, aspect, 0.1f, 100.0f);
+  }
+}
+
+// Draws 2 to 64 views of an 8x8 field of spheres at 512x512, as one render
+// pass per view against multiview passes drawing up to maxMultiviewViewCount
+// layers at once.  Reports the time per frame of all the views.
+void RunMultiviewBench(VulkanState& state)
+{
+  const uint32_t max_views = 64;
+  const uint32_t grid = 8;
+  const uint32_t rings = 16;
+  const uint32_t segments = 16;
+  const uint32_t frame_count = 64;
+  const uint32_t frames_per_submit = 16;
+  const uint32_t view_counts[] = { 2, 4, 8, 16, 32, 64 };
+  const VkExtent2D extent = { 512, 512 };
+
+  uint32_t views_per_pass = (state.max_multiview_views < 32) ? state.max_multiview_views : 32;
+  printf("Multiview: %ux%u views, up to %u per pass\n", extent.width, extent.height, views_per_pass);
+
+  if (!state.multiview)
+  {
+    printf("  skipped, no multiview\n");
+    return;
+  }
+
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+
+  if (!state.LoadShaderModule("multiview.vert.spv", &vertex_module) || !state.LoadShaderModule("basic.frag.spv", &frag_module))
+  {
+    vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+    printf("  skipped, no shaders\n");
+    return;
+  }
+
+  uint32_t sphere_vertices = (rings + 1) * (segments + 1);
+  uint32_t sphere_indices = rings * segments * 6;
+  Vertex* vertices = (Vertex*)Alloc(sizeof(Vertex) * sphere_vertices * grid * grid, 16);
+  uint32_t* indices = (uint32_t*)Alloc(sizeof(uint32_t) * sphere_indices * grid * grid, 16);
+  uint32_t vertex_count = 0;
+  uint32_t index_count = 0;
+
+  for (uint32_t i = 0; i < grid * grid; ++i)
+  {
+    const float color[4] = { (float)(i % grid) / grid, (float)(i / grid) / grid, 0.5f, 1.0f };
+    Vec3 center(((i % grid) * 3.0f) - (grid * 1.5f), 1.0f, ((i / grid) * 3.0f) - (grid * 1.5f));
+    AppendSphere(center, 1.0f, rings, segments, color, vertices, &vertex_count, indices, &index_count);
+  }
+
+  MultiviewCamera* cameras = (MultiviewCamera*)Alloc(sizeof(MultiviewCamera) * max_views, 16);
+  VkBuffer vertex_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory vertex_memory = VK_NULL_HANDLE;
+  VkBuffer index_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory index_memory = VK_NULL_HANDLE;
+  VkBuffer camera_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory camera_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(sizeof(Vertex) * vertex_count, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertex_buffer, &vertex_memory);
+  state.CreateBuffer(sizeof(uint32_t) * index_count, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer, &index_memory);
+  state.CreateBuffer(sizeof(MultiviewCamera) * max_views, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &camera_buffer, &camera_memory);
+  state.UploadBuffer(vertex_buffer, vertices, sizeof(Vertex) * vertex_count);
+  state.UploadBuffer(index_buffer, indices, sizeof(uint32_t) * index_count);
+
+  VkDescriptorSetLayoutBinding layout_binding = {};
+  layout_binding.binding = 0;
+  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  layout_binding.descriptorCount = 1;
+  layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.bindingCount = 1;
+  descriptor_layout.pBindings = &layout_binding;
+  VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateDescriptorSetLayout(state.device, &descriptor_layout, &state.callbacks, &set_layout));
+
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.size = sizeof(uint32_t);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.setLayoutCount = 1;
+  pipeline_layout_create_info.pSetLayouts = &set_layout;
+  pipeline_layout_create_info.pushConstantRangeCount = 1;
+  pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_create_info, &state.callbacks, &pipeline_layout));
+
+  DescriptorAllocator descriptors;
+  descriptors.Create(state, 1);
+  DescriptorBinding binding = {};
+  binding.binding = 0;
+  binding.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  binding.buffer.buffer = camera_buffer;
+  binding.buffer.range = VK_WHOLE_SIZE;
+
+  MultiviewBenchPass base_pass = {};
+  base_pass.pipeline_layout = pipeline_layout;
+  base_pass.set = descriptors.Get(set_layout, &binding, 1);
+  base_pass.vertex_buffer = vertex_buffer;
+  base_pass.index_buffer = index_buffer;
+  base_pass.index_count = index_count;
+  base_pass.extent = extent;
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  for (uint32_t v = 0; v < ARRAY_COUNT(view_counts); ++v)
+  {
+    uint32_t view_count = view_counts[v];
+    uint32_t batch_count = (view_count + views_per_pass - 1) / views_per_pass;
+    SetMultiviewCameras(view_count, (float)extent.width / extent.height, cameras);
+    state.UploadBuffer(camera_buffer, cameras, sizeof(MultiviewCamera) * view_count);
+
+    // Plain passes each draw one view into the same image, which costs them
+    // the same as separate images would.  Multiview batches get a layered
+    // image each.
+    VkImage images[max_views] = {};
+    VkDeviceMemory memories[max_views] = {};
+    MultiviewBenchPass passes[max_views] = {};
+    RenderGraph graphs[2];
+
+    for (uint32_t b = 0; b <= batch_count; ++b)
+    {
+      image_create_info.arrayLayers = b ? views_per_pass : 1;
+      state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, images + b, memories + b);
+    }
+
+    uint32_t output = graphs[0].ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, images, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    uint32_t depth = graphs[0].CreateImage("depth", VK_FORMAT_D32_SFLOAT, extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+    uint32_t pass = graphs[0].AddPass("view", RecordMultiviewBenchPass, passes);
+    graphs[0].AddUse(pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+    graphs[0].AddUse(pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+    graphs[0].Compile(state);
+    passes[0] = base_pass;
+    passes[0].pipeline = CreateVertexColorPipeline(state, graphs[0].RenderPass(pass), pipeline_layout, vertex_module, frag_module, true);
+
+    for (uint32_t b = 0; b < batch_count; ++b)
+    {
+      uint32_t first_view = b * views_per_pass;
+      uint32_t batch_views = ((view_count - first_view) < views_per_pass) ? (view_count - first_view) : views_per_pass;
+      output = graphs[1].ImportImage("views", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, images + b + 1, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, views_per_pass);
+      depth = graphs[1].CreateImage("depth", VK_FORMAT_D32_SFLOAT, extent, VK_IMAGE_ASPECT_DEPTH_BIT, views_per_pass);
+      pass = graphs[1].AddPass("multiview", RecordMultiviewBenchPass, passes + b + 1);
+      graphs[1].AddUse(pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+      graphs[1].AddUse(pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+      graphs[1].SetViewMask(pass, (batch_views == 32) ? 0xffffffffu : ((1u << batch_views) - 1));
+      passes[b + 1] = base_pass;
+      passes[b + 1].first_view = first_view;
+    }
+
+    graphs[1].Compile(state);
+
+    // Each view mask needs its own pipeline.
+    for (uint32_t b = 0; b < batch_count; ++b)
+    {
+      passes[b + 1].pipeline = CreateVertexColorPipeline(state, graphs[1].RenderPass(b), pipeline_layout, vertex_module, frag_module, true);
+    }
+
+    double frame_ms[2] = {};
+
+    for (uint32_t mode = 0; mode < 2; ++mode)
+    {
+      double start_ms = 0.0;
+
+      // The first submission warms up and isn't timed.
+      for (uint32_t frame = 0; frame < frame_count + frames_per_submit; frame += frames_per_submit)
+      {
+        if (frame == frames_per_submit)
+        {
+          start_ms = GetTimeMs();
+        }
+
+        VkCommandBufferBeginInfo cmd_buf_info = {};
+        cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+
+        for (uint32_t i = 0; i < frames_per_submit; ++i)
+        {
+          if (mode == 1)
+          {
+            graphs[1].Execute(cmd, 0);
+            continue;
+          }
+
+          for (uint32_t view = 0; view < view_count; ++view)
+          {
+            passes[0].first_view = view;
+            graphs[0].Execute(cmd, 0);
+          }
+        }
+
+        VK_CHECK(vkEndCommandBuffer(cmd));
+
+        VkSubmitInfo submit_info = {};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &cmd;
+        VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+        VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+        VK_CHECK(vkResetFences(state.device, 1, &fence));
+      }
+
+      frame_ms[mode] = (GetTimeMs() - start_ms) / frame_count;
+    }
+
+    printf("  %2u views: %8.3f ms as %2u passes, %8.3f ms as %2u multiview passes\n", view_count, frame_ms[0], view_count, frame_ms[1], batch_count);
+
+    for (uint32_t b = 0; b <= batch_count; ++b)
+    {
+      vkDestroyPipeline(state.device, passes[b].pipeline, &state.callbacks);
+      vkDestroyImage(state.device, images[b], &state.callbacks);
+      vkFreeMemory(state.device, memories[b], &state.callbacks);
+    }
+
+    graphs[0].Destroy();
+    graphs[1].Destroy();
+  }
+
+  vkDestroyFence(state.device, fence, &state.callbacks);
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+  descriptors.Destroy();
+  vkDestroyPipelineLayout(state.device, pipeline_layout, &state.callbacks);
+  vkDestroyDescriptorSetLayout(state.device, set_layout, &state.callbacks);
+  vkDestroyBuffer(state.device, camera_buffer, &state.callbacks);
+  vkFreeMemory(state.device, camera_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, index_buffer, &state.callbacks);
+  vkFreeMemory(state.device, index_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, vertex_buffer, &state.callbacks);
+  vkFreeMemory(state.device, vertex_memory, &state.callbacks);
+  vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+  vkDestroyShaderModule(state.device, frag_module, &state.callbacks);
+  Free(cameras);
+  Free(indices);
+  Free(vertices);
+}
+
+// A render job, read from a .job file in the service's drop directory.  One
+// key per line, unknown keys fail the job and '#' starts a comment:
+//
+//   output frames/0001.y4m
+//   size 1920 1080
+//   scene 8
+//   camera 0 4 -20 0
+struct RenderJob
+{
+  char name[MAX_PATH];   // File name, for the report.
+  char output[MAX_PATH]; // One Y4M frame if it ends in .y4m, raw RGBA texels otherwise.
+  VkExtent2D extent;
+  uint32_t scene_grid;   // Spheres per side of the field.
+  Vec3 camera_position;
+  float camera_yaw;      // Radians, 0 looks down +z.
+  double queued_ms;      // When the service picked the job up.
+};
+
+// Renders jobs dropped into a directory until a file named 'stop' appears.
+// Up to ARRAY_COUNT(slots) jobs are in flight, each with its own target,
+// readback buffer, command buffer and fence; the pipeline, the render graph
+// and the scenes are shared by every job.  Producers should write a job under
+// another name and rename it to .job, since the service reads and deletes
+// any .job file it sees, oldest name first.
+struct RenderService
+{
+  // A field of spheres, built the first time a job asks for its size.
+  struct Scene
+  {
+    uint32_t grid;
+    VkBuffer vertex_buffer;
+    VkDeviceMemory vertex_memory;
+    VkBuffer index_buffer;
+    VkDeviceMemory index_memory;
+    uint32_t index_count;
+  };
+
+  struct Slot
+  {
+    bool busy;
+    RenderJob job;
+    const Scene* scene;
+    Mat4 clip_from_world;
+    VkImage image;
+    VkDeviceMemory image_memory;
+    VkBuffer readback_buffer;
+    VkDeviceMemory readback_memory;
+    uint8_t* mapped;
+    VkCommandBuffer cmd;
+    VkFence fence;
+  };
+
+  struct Stats
+  {
+    uint32_t completed;
+    uint32_t failed;
+    double first_ms; // First job picked up.
+    double last_ms;  // Last job written.
+    double min_latency_ms;
+    double max_latency_ms;
+    double total_latency_ms;
+  };
+
+  VulkanState* state = nullptr;
+  const char* directory = nullptr;
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE; // Made once; every target's render pass is compatible with it.
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  Scene scenes[8] = {};
+  uint32_t scene_count = 0;
+  Slot slots[3] = {};
+  uint32_t next_slot = 0; // Next to submit into.
+  uint32_t poll_slot = 0; // Oldest that may be busy.
+  uint32_t recording_slot = 0;
+  bool coherent = false;
+
+  // The targets, rebuilt when a job asks for another size.
+  RenderGraph graph;
+  VkExtent2D extent = {};
+  uint8_t* yuv = nullptr;
+
+  Stats stats = {};
+
+  bool Create(VulkanState& vulkan_state, const char* drop_directory);
+  void Destroy();
+  void Run(uint32_t max_jobs);
+  bool NextJob(RenderJob* job, bool* stop);
+  const Scene* GetScene(uint32_t grid);
+  void CreateTargets(VkExtent2D target_extent);
+  void DestroyTargets();
+  void Submit(const RenderJob& job);
+  void Finish(Slot& slot);
+  void Poll(bool wait);
+
+  static bool ParseJob(const char* text, RenderJob* job);
+
+  // Tests.
+  static void TestParseJob();
+  static void RunAllTests();
+};
+
+static void RecordRenderServicePass(VkCommandBuffer cmd, void* userdata)
+{
+  const RenderService& service = *(const RenderService*)userdata;
+  const RenderService::Slot& slot = service.slots[service.recording_slot];
+  const VkDeviceSize offsets = 0;
+  VkViewport viewport = {};
+  viewport.width = (float)service.extent.width;
+  viewport.height = (float)service.extent.height;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = {};
+  scissor.extent = service.extent;
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, service.pipeline);
+  vkCmdPushConstants(cmd, service.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(Mat4), &slot.clip_from_world);
+  vkCmdBindVertexBuffers(cmd, 1, 1, &slot.scene->vertex_buffer, &offsets);
+  vkCmdBindIndexBuffer(cmd, slot.scene->index_buffer, 0, VK_INDEX_TYPE_UINT32);
+  vkCmdDrawIndexed(cmd, slot.scene->index_count, 1, 0, 0, 0);
+}
+
+// Returns false if the shaders aren't there.
+bool RenderService::Create(VulkanState& vulkan_state, const char* drop_directory)
+{
+  state = &vulkan_state;
+  directory = drop_directory;
+
+  if (!state->LoadShaderModule("meshlet.vert.spv", &vertex_module) || !state->LoadShaderModule("basic.frag.spv", &frag_module))
+  {
+    vkDestroyShaderModule(state->device, vertex_module, &state->callbacks);
+    vertex_module = VK_NULL_HANDLE;
+    state = nullptr;
+    return false;
+  }
+
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.size = sizeof(Mat4);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.pushConstantRangeCount = 1;
+  pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+  VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &pipeline_layout));
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state->queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VK_CHECK(vkCreateCommandPool(state->device, &cmd_pool_info, &state->callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(slots); ++i)
+  {
+    VK_CHECK(vkAllocateCommandBuffers(state->device, &cmd_buffer_alloc_info, &slots[i].cmd));
+    VK_CHECK(vkCreateFence(state->device, &fence_create_info, &state->callbacks, &slots[i].fence));
+  }
+
+  stats = {};
+  return true;
+}
+
+// Finishes every job in flight first.
+void RenderService::Destroy()
+{
+  if (!state)
+  {
+    return;
+  }
+
+  while (slots[poll_slot].busy)
+  {
+    Poll(true);
+  }
+
+  DestroyTargets();
+
+  for (uint32_t i = 0; i < scene_count; ++i)
+  {
+    vkDestroyBuffer(state->device, scenes[i].index_buffer, &state->callbacks);
+    vkFreeMemory(state->device, scenes[i].index_memory, &state->callbacks);
+    vkDestroyBuffer(state->device, scenes[i].vertex_buffer, &state->callbacks);
+    vkFreeMemory(state->device, scenes[i].vertex_memory, &state->callbacks);
+  }
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(slots); ++i)
+  {
+    vkDestroyFence(state->device, slots[i].fence, &state->callbacks);
+  }
+
+  vkDestroyCommandPool(state->device, cmd_pool, &state->callbacks);
+  vkDestroyPipeline(state->device, pipeline, &state->callbacks);
+  vkDestroyPipelineLayout(state->device, pipeline_layout, &state->callbacks);
+  vkDestroyShaderModule(state->device, vertex_module, &state->callbacks);
+  vkDestroyShaderModule(state->device, frag_module, &state->callbacks);
+  scene_count = 0;
+  state = nullptr;
+}
+
+// Serves jobs until a 'stop' file is dropped or max_jobs have been picked up,
+// 0 for no limit, then finishes the ones in flight and prints the report.
+void RenderService::Run(uint32_t max_jobs)
+{
+  printf("Render service: watching '%s' for .job files with %u in flight, drop a file named 'stop' to quit\n", directory, (uint32_t)ARRAY_COUNT(slots));
+  uint32_t picked = 0;
+  bool stop = false;
+  bool have_job = false;
+  RenderJob job = {};
+
+  for (;;)
+  {
+    Poll(false);
+
+    if (!have_job && !stop)
+    {
+      have_job = NextJob(&job, &stop);
+      picked += have_job ? 1 : 0;
+      stop = stop || (max_jobs && (picked == max_jobs));
+    }
+
+    if (!have_job)
+    {
+      if (slots[poll_slot].busy)
+      {
+        Poll(true);
+      }
+      else if (stop)
+      {
+        break;
+      }
+      else
+      {
+        Sleep(10);
+      }
+
+      continue;
+    }
+
+    // Every slot shares the graph, so a new size waits for the jobs already
+    // in flight, and for a free slot like any other job.
+    bool resize = (job.extent.width != extent.width) || (job.extent.height != extent.height);
+
+    if ((resize && slots[poll_slot].busy) || slots[next_slot].busy)
+    {
+      Poll(true);
+      continue;
+    }
+
+    if (resize)
+    {
+      DestroyTargets();
+      CreateTargets(job.extent);
+    }
+
+    Submit(job);
+    have_job = false;
+  }
+
+  if (!stats.completed)
+  {
+    printf("Render service: no jobs completed, %u failed\n", stats.failed);
+    return;
+  }
+
+  double total_ms = stats.last_ms - stats.first_ms;
+  printf("Render service: %u jobs in %.1f ms, %.2f jobs/s, latency %.2f ms min, %.2f ms average, %.2f ms max, %u failed\n",
+    stats.completed, total_ms, (stats.completed * 1000.0) / total_ms, stats.min_latency_ms, stats.total_latency_ms / stats.completed, stats.max_latency_ms, stats.failed);
+}
+
+// Takes the .job file with the lowest name out of the directory.  Returns
+// false if there is none; jobs that don't parse are deleted and counted as
+// failed.  Sets stop, and deletes the file, if 'stop' is there.
+bool RenderService::NextJob(RenderJob* job, bool* stop)
+{
+  for (;;)
+  {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s\\*", directory);
+    WIN32_FIND_DATAA find_data = {};
+    HANDLE find = FindFirstFileA(path, &find_data);
+
+    if (find == INVALID_HANDLE_VALUE)
+    {
+      return false;
+    }
+
+    char name[MAX_PATH] = {};
+
+    do
+    {
+      const char* file_name = find_data.cFileName;
+      size_t length = strlen(file_name);
+
+      if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+      {
+        continue;
+      }
+
+      if (!_stricmp(file_name, "stop"))
+      {
+        *stop = true;
+      }
+      else if ((length > 4) && !_stricmp(file_name + length - 4, ".job") && (!name[0] || (strcmp(file_name, name) < 0)))
+      {
+        strcpy(name, file_name);
+      }
+    }
+    while (FindNextFileA(find, &find_data));
+
+    FindClose(find);
+
+    if (*stop)
+    {
+      snprintf(path, sizeof(path), "%s\\stop", directory);
+      DeleteFileA(path);
+    }
+
+    if (!name[0])
+    {
+      return false;
+    }
+
+    char text[4096] = {};
+    snprintf(path, sizeof(path), "%s\\%s", directory, name);
+    FILE* file = fopen(path, "rb");
+
+    if (file)
+    {
+      fread(text, 1, sizeof(text) - 1, file);
+      fclose(file);
+    }
+
+    DeleteFileA(path);
+    *job = {};
+    strcpy(job->name, name);
+    job->queued_ms = GetTimeMs();
+
+    if (file && ParseJob(text, job))
+    {
+      if (stats.first_ms == 0.0)
+      {
+        stats.first_ms = job->queued_ms;
+      }
+
+      return true;
+    }
+
+    printf("  %s: failed, bad job file\n", name);
+    ++stats.failed;
+  }
+}
+
+// Builds the scene the first time a size is asked for.  The upload waits for
+// the device to go idle, which only the first job of each size pays for.
+const RenderService::Scene* RenderService::GetScene(uint32_t grid)
+{
+  const uint32_t rings = 16;
+  const uint32_t segments = 16;
+
+  for (uint32_t i = 0; i < scene_count; ++i)
+  {
+    if (scenes[i].grid == grid)
+    {
+      return scenes + i;
+    }
+  }
+
+  // Out of room, so the oldest scene makes way.
+  if (scene_count == ARRAY_COUNT(scenes))
+  {
+    while (slots[poll_slot].busy)
+    {
+      Poll(true);
+    }
+
+    vkDestroyBuffer(state->device, scenes[0].index_buffer, &state->callbacks);
+    vkFreeMemory(state->device, scenes[0].index_memory, &state->callbacks);
+    vkDestroyBuffer(state->device, scenes[0].vertex_buffer, &state->callbacks);
+    vkFreeMemory(state->device, scenes[0].vertex_memory, &state->callbacks);
+    memmove(scenes, scenes + 1, sizeof(Scene) * (scene_count - 1));
+    --scene_count;
+  }
+
+  uint32_t sphere_vertices = (rings + 1) * (segments + 1);
+  uint32_t sphere_indices = rings * segments * 6;
+  Vertex* vertices = (Vertex*)Alloc(sizeof(Vertex) * sphere_vertices * grid * grid, 16);
+  uint32_t* indices = (uint32_t*)Alloc(sizeof(uint32_t) * sphere_indices * grid * grid, 16);
+  uint32_t vertex_count = 0;
+  uint32_t index_count = 0;
+
+  for (uint32_t i = 0; i < grid * grid; ++i)
+  {
+    const float color[4] = { (float)(i % grid) / grid, (float)(i / grid) / grid, 0.5f, 1.0f };
+    Vec3 center(((i % grid) * 3.0f) - (grid * 1.5f), 1.0f, ((i / grid) * 3.0f) - (grid * 1.5f));
+    AppendSphere(center, 1.0f, rings, segments, color, vertices, &vertex_count, indices, &index_count);
+  }
+
+  Scene& scene = scenes[scene_count++];
+  scene.grid = grid;
+  scene.index_count = index_count;
+  state->CreateBuffer(sizeof(Vertex) * vertex_count, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &scene.vertex_buffer, &scene.vertex_memory);
+  state->CreateBuffer(sizeof(uint32_t) * index_count, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &scene.index_buffer, &scene.index_memory);
+  state->UploadBuffer(scene.vertex_buffer, vertices, sizeof(Vertex) * vertex_count);
+  state->UploadBuffer(scene.index_buffer, indices, sizeof(uint32_t) * index_count);
+  Free(indices);
+  Free(vertices);
+  return &scene;
+}
+
+// No job may be in flight.
+void RenderService::CreateTargets(VkExtent2D target_extent)
+{
+  extent = target_extent;
+  VkDeviceSize frame_bytes = (VkDeviceSize)extent.width * extent.height * 4;
+  yuv = (uint8_t*)Alloc((size_t)extent.width * extent.height + (2 * ((extent.width + 1) / 2) * ((extent.height + 1) / 2)), 16);
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  // Cached memory is preferred for the readback, as in FrameReadback.
+  const VkPhysicalDeviceMemoryProperties& memory_properties = state->memory_properties[state->physical_device_index];
+  VkImage images[ARRAY_COUNT(slots)] = {};
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(slots); ++i)
+  {
+    Slot& slot = slots[i];
+    state->CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &slot.image, &slot.image_memory);
+    images[i] = slot.image;
+
+    VkBufferCreateInfo buffer_create_info = {};
+    buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_create_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_create_info.size = frame_bytes;
+    buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK(vkCreateBuffer(state->device, &buffer_create_info, &state->callbacks, &slot.readback_buffer));
+
+    VkMemoryRequirements memory_requirements = {};
+    vkGetBufferMemoryRequirements(state->device, slot.readback_buffer, &memory_requirements);
+    uint32_t memory_type = memory_properties.memoryTypeCount;
+
+    for (uint32_t t = 0; t < memory_properties.memoryTypeCount; ++t)
+    {
+      const VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+
+      if ((memory_requirements.memoryTypeBits & (1 << t)) && ((memory_properties.memoryTypes[t].propertyFlags & cached) == cached))
+      {
+        memory_type = t;
+        break;
+      }
+    }
+
+    if (memory_type == memory_properties.memoryTypeCount)
+    {
+      memory_type = state->FindMemoryType(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+
+    coherent = (memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = memory_requirements.size;
+    alloc_info.memoryTypeIndex = memory_type;
+    VK_CHECK(vkAllocateMemory(state->device, &alloc_info, &state->callbacks, &slot.readback_memory));
+    VK_CHECK(vkBindBufferMemory(state->device, slot.readback_buffer, slot.readback_memory, 0));
+    VK_CHECK(vkMapMemory(state->device, slot.readback_memory, 0, VK_WHOLE_SIZE, 0, (void**)&slot.mapped));
+  }
+
+  // Each slot draws into its own image, picked by the frame passed to
+  // Execute().  The depth buffer is shared; queue order keeps it safe.
+  uint32_t color = graph.ImportImage("color", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, ARRAY_COUNT(slots), images, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  uint32_t depth = graph.CreateImage("depth", VK_FORMAT_D32_SFLOAT, extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+  uint32_t pass = graph.AddPass("draw", RecordRenderServicePass, this);
+  graph.AddUse(pass, color, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.AddUse(pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+  graph.Compile(*state);
+
+  if (!pipeline)
+  {
+    pipeline = CreateVertexColorPipeline(*state, graph.RenderPass(pass), pipeline_layout, vertex_module, frag_module, true);
+  }
+
+  printf("  targets: %ux%u, %s readback\n", extent.width, extent.height, coherent ? "coherent" : "cached");
+}
+
+// No job may be in flight.
+void RenderService::DestroyTargets()
+{
+  if (!extent.width)
+  {
+    return;
+  }
+
+  graph.Destroy();
+  graph = RenderGraph();
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(slots); ++i)
+  {
+    Slot& slot = slots[i];
+    vkUnmapMemory(state->device, slot.readback_memory);
+    vkDestroyBuffer(state->device, slot.readback_buffer, &state->callbacks);
+    vkFreeMemory(state->device, slot.readback_memory, &state->callbacks);
+    vkDestroyImage(state->device, slot.image, &state->callbacks);
+    vkFreeMemory(state->device, slot.image_memory, &state->callbacks);
+  }
+
+  Free(yuv);
+  yuv = nullptr;
+  extent = {};
+}
+
+// Records and submits job into next_slot, which must be free, with targets
+// of the job's size.
+void RenderService::Submit(const RenderJob& job)
+{
+  uint32_t index = next_slot;
+  Slot& slot = slots[index];
+  slot.job = job;
+  slot.scene = GetScene(job.scene_grid);
+
+  // Right, up and forward rows for the yaw, then the position moved into
+  // view space.
+  float s = std::sin(job.camera_yaw);
+  float c = std::cos(job.camera_yaw);
+  const Vec3& p = job.camera_position;
+  Affine3x4 view_from_world = { c, 0.0f, -s, 0.0f,
+                                0.0f, 1.0f, 0.0f, 0.0f,
+                                s, 0.0f, c, 0.0f };
+  view_from_world.SetPosition(Vec3(-((c * p.x) - (s * p.z)), -p.y, -((s * p.x) + (c * p.z))));
+  Mat4 clip_from_view;
+  clip_from_view.SetPerspective(1.0471976f, (float)extent.width / extent.height, 0.1f, 200.0f);
+  slot.clip_from_world = clip_from_view * view_from_world.ToMat4();
+
+  VkCommandBufferBeginInfo cmd_buf_info = {};
+  cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK(vkBeginCommandBuffer(slot.cmd, &cmd_buf_info));
+  recording_slot = index;
+  graph.Execute(slot.cmd, index);
+
+  // The graph leaves the image as a color attachment, where the next job
+  // expects it.
+  VkImageMemoryBarrier image_barrier = {};
+  image_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  image_barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  image_barrier.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  image_barrier.image = slot.image;
+  image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  image_barrier.subresourceRange.levelCount = 1;
+  image_barrier.subresourceRange.layerCount = 1;
+  vkCmdPipelineBarrier(slot.cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &image_barrier);
+
+  VkBufferImageCopy region = {};
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent.width = extent.width;
+  region.imageExtent.height = extent.height;
+  region.imageExtent.depth = 1;
+  vkCmdCopyImageToBuffer(slot.cmd, slot.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.readback_buffer, 1, &region);
+
+  image_barrier.srcAccessMask = 0;
+  image_barrier.dstAccessMask = 0;
+  image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  image_barrier.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  VkBufferMemoryBarrier buffer_barrier = {};
+  buffer_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  buffer_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  buffer_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  buffer_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  buffer_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  buffer_barrier.buffer = slot.readback_buffer;
+  buffer_barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(slot.cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 1, &buffer_barrier, 1, &image_barrier);
+  VK_CHECK(vkEndCommandBuffer(slot.cmd));
+
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &slot.cmd;
+  VK_CHECK(vkQueueSubmit(state->queue, 1, &submit_info, slot.fence));
+  slot.busy = true;
+  next_slot = (next_slot + 1) % ARRAY_COUNT(slots);
+}
+
+// Writes out a job whose fence has signaled.
+void RenderService::Finish(Slot& slot)
+{
+  const RenderJob& job = slot.job;
+
+  if (!coherent)
+  {
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = slot.readback_memory;
+    range.size = VK_WHOLE_SIZE;
+    VK_CHECK(vkInvalidateMappedMemoryRanges(state->device, 1, &range));
+  }
+
+  size_t length = strlen(job.output);
+  bool y4m = (length > 4) && !_stricmp(job.output + length - 4, ".y4m");
+  size_t bytes = (size_t)extent.width * extent.height * 4;
+  const uint8_t* data = slot.mapped;
+  FILE* file = fopen(job.output, "wb");
+
+  if (!file)
+  {
+    printf("  %s: failed, could not open '%s'\n", job.name, job.output);
+    ++stats.failed;
+    return;
+  }
+
+  if (y4m)
+  {
+    FrameReadback::ConvertToI420(slot.mapped, false, extent.width, extent.height, yuv);
+    fprintf(file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C420jpeg\nFRAME\n", extent.width, extent.height);
+    bytes = (size_t)extent.width * extent.height + (2 * ((extent.width + 1) / 2) * ((extent.height + 1) / 2));
+    data = yuv;
+  }
+
+  fwrite(data, 1, bytes, file);
+  fclose(file);
+
+  double now_ms = GetTimeMs();
+  double latency_ms = now_ms - job.queued_ms;
+  stats.min_latency_ms = (!stats.completed || (latency_ms < stats.min_latency_ms)) ? latency_ms : stats.min_latency_ms;
+  stats.max_latency_ms = (latency_ms > stats.max_latency_ms) ? latency_ms : stats.max_latency_ms;
+  stats.total_latency_ms += latency_ms;
+  stats.last_ms = now_ms;
+  ++stats.completed;
+  printf("  %s: %ux%u, %u spheres, %.2f ms\n", job.name, extent.width, extent.height, job.scene_grid * job.scene_grid, latency_ms);
+}
+
+// Writes out the jobs that have finished, in submission order.  With wait,
+// blocks until at least the oldest one has.
+void RenderService::Poll(bool wait)
+{
+  if (wait && slots[poll_slot].busy)
+  {
+    VK_CHECK(vkWaitForFences(state->device, 1, &slots[poll_slot].fence, VK_TRUE, UINT64_MAX));
+  }
+
+  while (slots[poll_slot].busy && (vkGetFenceStatus(state->device, slots[poll_slot].fence) == VK_SUCCESS))
+  {
+    Slot& slot = slots[poll_slot];
+    VK_CHECK(vkResetFences(state->device, 1, &slot.fence));
+    Finish(slot);
+    slot.busy = false;
+    poll_slot = (poll_slot + 1) % ARRAY_COUNT(slots);
+  }
+}
+
+// Fills in job from the text of a job file.  Returns false if a line doesn't
+// parse or there is no output.
+bool RenderService::ParseJob(const char* text, RenderJob* job)
+{
+  job->output[0] = 0;
+  job->extent.width = 1280;
+  job->extent.height = 720;
+  job->scene_grid = 8;
+  job->camera_position = Vec3(0.0f, 4.0f, -20.0f);
+  job->camera_yaw = 0.0f;
+
+  const char* next = text;
+
+  while (next)
+  {
+    const char* line = next;
+    next = strchr(line, '\n');
+    next = next ? (next + 1) : nullptr;
+
+    while ((*line == ' ') || (*line == '\t'))
+    {
+      ++line;
+    }
+
+    if ((*line == 0) || (*line == '\r') || (*line == '\n') || (*line == '#'))
+    {
+      continue;
+    }
+
+    Vec3& p = job->camera_position;
+    bool parsed = (sscanf(line, "output %259[^\r\n]", job->output) == 1) ||
+      (sscanf(line, "size %u %u", &job->extent.width, &job->extent.height) == 2) ||
+      (sscanf(line, "scene %u", &job->scene_grid) == 1) ||
+      (sscanf(line, "camera %f %f %f %f", &p.x, &p.y, &p.z, &job->camera_yaw) == 4);
+
+    if (!parsed)
+    {
+      return false;
+    }
+  }
+
+  bool size_ok = (job->extent.width > 0) && (job->extent.width <= 8192) && (job->extent.height > 0) && (job->extent.height <= 8192);
+  bool scene_ok = (job->scene_grid > 0) && (job->scene_grid <= 32);
+  return job->output[0] && size_ok && scene_ok;
+}
+
+void RenderService::TestParseJob()
+{
+  RenderJob job = {};
+  FailIfNotExpected(true, ParseJob("# A comment.\r\noutput frames/0001.y4m\r\n  size 640 480\r\nscene 4\r\ncamera 1 2 -3 0.5\r\n", &job), __FUNCTION__);
+  FailIfNotExpected(0, strcmp(job.output, "frames/0001.y4m"), __FUNCTION__);
+  FailIfNotExpected(640u, job.extent.width, __FUNCTION__);
+  FailIfNotExpected(480u, job.extent.height, __FUNCTION__);
+  FailIfNotExpected(4u, job.scene_grid, __FUNCTION__);
+  FailIfNotExpected(-3.0f, job.camera_position.z, __FUNCTION__);
+  FailIfNotExpected(0.5f, job.camera_yaw, __FUNCTION__);
+
+  // Everything but the output has a default.
+  FailIfNotExpected(true, ParseJob("output a.raw", &job), __FUNCTION__);
+  FailIfNotExpected(1280u, job.extent.width, __FUNCTION__);
+  FailIfNotExpected(8u, job.scene_grid, __FUNCTION__);
+
+  FailIfNotExpected(false, ParseJob("size 640 480\n", &job), __FUNCTION__);
+  FailIfNotExpected(false, ParseJob("output a.raw\nsize 640\n", &job), __FUNCTION__);
+  FailIfNotExpected(false, ParseJob("output a.raw\nsize 0 480\n", &job), __FUNCTION__);
+  FailIfNotExpected(false, ParseJob("output a.raw\nscene 64\n", &job), __FUNCTION__);
+  FailIfNotExpected(false, ParseJob("output a.raw\nformat png\n", &job), __FUNCTION__);
+}
+
+void RenderService::RunAllTests()
+{
+  TestParseJob();
+}
+
+enum ResidencyPriority
+{
+  RESIDENCY_PRIORITY_LOW,    // Caches that can be rebuilt or streamed, demoted first.
+  RESIDENCY_PRIORITY_NORMAL,
+  RESIDENCY_PRIORITY_HIGH,   // Touched every frame, demoted last.
+  RESIDENCY_PRIORITY_COUNT,
+};
+
+// Keeps buffers in the device-local heap while it's under budget, and in
+// host memory when it isn't.  Budgets come from VK_EXT_memory_budget when
+// the device has it, otherwise from the heap sizes.  Once a frame Update()
+// demotes the least important, least recently used buffers while the heap is
+// over budget, and promotes the most important demoted one when it fits,
+// demoting less important ones to make room.  Moves are copies recorded into
+// the frame's command buffer, so buffer handles change; look them up with
+// Buffer() after Update().
+struct ResidencyManager
+{
+  struct Allocation
+  {
+    bool live;
+    bool resident; // In device-local memory.
+    ResidencyPriority priority;
+    VkBufferUsageFlags usage;
+    VkDeviceSize size;
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    uint32_t heap;
+    uint64_t last_used; // Frame of the last Touch().
+  };
+
+  // Memory a move or DestroyBuffer() replaced, freed once its frame is done.
+  struct Retired
+  {
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    uint32_t heap;
+    uint64_t frame;
+  };
+
+  struct Stats
+  {
+    uint32_t demotions;
+    uint32_t promotions;
+    uint32_t fallbacks; // Buffers that started out in host memory.
+    VkDeviceSize moved_bytes;
+  };
+
+  VulkanState* state = nullptr;
+#ifdef VK_EXT_memory_budget
+  PFN_vkGetPhysicalDeviceMemoryProperties2KHR get_memory_properties2 = nullptr;
+#endif
+  uint32_t device_heap = 0;
+  bool can_demote = false; // There is host memory to demote to.
+  VkDeviceSize budget_cap = 0; // Lowers the device heap's budget, 0 for none.
+  VkDeviceSize move_bytes_per_update = 64ull << 20;
+  VkDeviceSize heap_budget[VK_MAX_MEMORY_HEAPS] = {};
+  VkDeviceSize heap_usage[VK_MAX_MEMORY_HEAPS] = {};   // Everyone's, as the driver last reported plus our changes since.
+  VkDeviceSize heap_managed[VK_MAX_MEMORY_HEAPS] = {}; // Ours, retired memory included.
+  Allocation* allocations = nullptr;
+  uint32_t allocation_count = 0;
+  uint32_t max_allocations = 0;
+  Retired retired[256] = {};
+  uint32_t retired_count = 0;
+  uint64_t frame = 0;
+  Stats stats = {};
+
+  void Create(VulkanState& vulkan_state, uint32_t allocation_capacity);
+  void Destroy();
+  uint32_t CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, ResidencyPriority priority);
+  void DestroyBuffer(uint32_t id);
+  VkBuffer Buffer(uint32_t id) const { return allocations[id].buffer; }
+  void Touch(uint32_t id) { allocations[id].last_used = frame; }
+  void Update(VkCommandBuffer cmd, uint64_t completed_frame);
+  void QueryBudget();
+  void PrintHeaps() const;
+
+  bool Allocate(Allocation& allocation, bool device_local);
+  void Retire(VkBuffer buffer, VkDeviceMemory memory, VkDeviceSize size, uint32_t heap);
+  bool Move(uint32_t id, VkCommandBuffer cmd);
+  static uint32_t PickVictims(const Allocation* allocations, uint32_t count, ResidencyPriority below, VkDeviceSize needed, uint32_t max_victims, uint32_t* victims);
+
+  // Tests.
+  static void TestPickVictims();
+  static void RunAllTests();
+};
+
+void ResidencyManager::Create(VulkanState& vulkan_state, uint32_t allocation_capacity)
+{
+  state = &vulkan_state;
+  const VkPhysicalDeviceMemoryProperties& properties = state->memory_properties[state->physical_device_index];
+  device_heap = properties.memoryTypes[state->FindMemoryType(UINT32_MAX, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)].heapIndex;
+  can_demote = false;
+
+  for (uint32_t t = 0; t < properties.memoryTypeCount; ++t)
+  {
+    can_demote = can_demote || (properties.memoryTypes[t].heapIndex != device_heap);
+  }
+
+#ifdef VK_EXT_memory_budget
+  get_memory_properties2 = state->memory_budget ? (PFN_vkGetPhysicalDeviceMemoryProperties2KHR)vkGetInstanceProcAddr(state->instance, "vkGetPhysicalDeviceMemoryProperties2KHR") : nullptr;
+#endif
+
+  max_allocations = allocation_capacity;
+  allocations = (Allocation*)Alloc(sizeof(Allocation) * max_allocations, 16);
+  memset(allocations, 0, sizeof(Allocation) * max_allocations);
+  allocation_count = 0;
+  retired_count = 0;
+  frame = 0;
+  stats = {};
+  memset(heap_usage, 0, sizeof(heap_usage));
+  memset(heap_managed, 0, sizeof(heap_managed));
+  QueryBudget();
+}
+
+// The device must be idle.
+void ResidencyManager::Destroy()
+{
+  Update(VK_NULL_HANDLE, UINT64_MAX);
+
+  for (uint32_t i = 0; i < allocation_count; ++i)
+  {
+    if (allocations[i].live)
+    {
+      vkDestroyBuffer(state->device, allocations[i].buffer, &state->callbacks);
+      vkFreeMemory(state->device, allocations[i].memory, &state->callbacks);
+    }
+  }
+
+  Free(allocations);
+  allocations = nullptr;
+  allocation_count = 0;
+  state = nullptr;
+}
+
+// Reads each heap's budget and usage.  Without VK_EXT_memory_budget the
+// budget is 80% of the heap, leaving the rest to everything else on the
+// system, and usage is only what this manager allocated.
+void ResidencyManager::QueryBudget()
+{
+  const VkPhysicalDeviceMemoryProperties& properties = state->memory_properties[state->physical_device_index];
+  bool queried = false;
+
+#ifdef VK_EXT_memory_budget
+  if (get_memory_properties2)
+  {
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget_properties = {};
+    budget_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    VkPhysicalDeviceMemoryProperties2KHR properties2 = {};
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR;
+    properties2.pNext = &budget_properties;
+    get_memory_properties2(state->physical_device, &properties2);
+
+    for (uint32_t h = 0; h < properties.memoryHeapCount; ++h)
+    {
+      heap_budget[h] = budget_properties.heapBudget[h];
+      heap_usage[h] = budget_properties.heapUsage[h];
+    }
+
+    queried = true;
+  }
+#endif
+
+  for (uint32_t h = 0; !queried && (h < properties.memoryHeapCount); ++h)
+  {
+    heap_budget[h] = (properties.memoryHeaps[h].size / 10) * 8;
+    heap_usage[h] = heap_managed[h];
+  }
+
+  if (budget_cap && (heap_budget[device_heap] > budget_cap))
+  {
+    heap_budget[device_heap] = budget_cap;
+  }
+}
+
+// Allocates and binds allocation.buffer in the device-local heap if it fits
+// the budget, or in host memory otherwise.  A device-local request with no
+// host memory to fall back to, as with a single heap, goes over budget in
+// the device heap instead.  Returns false if nothing works.
+bool ResidencyManager::Allocate(Allocation& allocation, bool device_local)
+{
+  const VkPhysicalDeviceMemoryProperties& properties = state->memory_properties[state->physical_device_index];
+  VkMemoryRequirements memory_requirements = {};
+  vkGetBufferMemoryRequirements(state->device, allocation.buffer, &memory_requirements);
+  bool fits = (heap_usage[device_heap] + memory_requirements.size) <= heap_budget[device_heap];
+  uint32_t end_pass = device_local ? 3 : 2;
+
+  VkMemoryAllocateInfo alloc_info = {};
+  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  alloc_info.allocationSize = memory_requirements.size;
+  VkResult result = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+
+  // Device-local first when it fits, then any type outside the device heap,
+  // then device-local again regardless of the budget.
+  for (uint32_t pass = (device_local && fits) ? 0 : 1; (result != VK_SUCCESS) && (pass < end_pass); ++pass)
+  {
+    for (uint32_t t = 0; (result != VK_SUCCESS) && (t < properties.memoryTypeCount); ++t)
+    {
+      bool in_device_heap = (properties.memoryTypes[t].heapIndex == device_heap);
+      bool wanted = (pass == 1) ? !in_device_heap : ((properties.memoryTypes[t].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0);
+
+      if ((memory_requirements.memoryTypeBits & (1 << t)) && wanted)
+      {
+        alloc_info.memoryTypeIndex = t;
+        result = vkAllocateMemory(state->device, &alloc_info, &state->callbacks, &allocation.memory);
+        allocation.heap = properties.memoryTypes[t].heapIndex;
+        allocation.resident = (pass != 1);
+      }
+    }
+  }
+
+  if (result != VK_SUCCESS)
+  {
+    allocation.memory = VK_NULL_HANDLE;
+    return false;
+  }
+
+  VK_CHECK(vkBindBufferMemory(state->device, allocation.buffer, allocation.memory, 0));
+  heap_usage[allocation.heap] += memory_requirements.size;
+  heap_managed[allocation.heap] += memory_requirements.size;
+  allocation.size = memory_requirements.size;
+  return true;
+}
+
+// Returns an id for Buffer(), Touch() and DestroyBuffer().  The buffer can be
+// copied to and from, which moves need.
+uint32_t ResidencyManager::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, ResidencyPriority priority)
+{
+  uint32_t id = 0;
+
+  while ((id < allocation_count) && allocations[id].live)
+  {
+    ++id;
+  }
+
+  if (id == max_allocations)
+  {
+    Fail(__FUNCTION__);
+  }
+
+  allocation_count = (id == allocation_count) ? (allocation_count + 1) : allocation_count;
+  Allocation& allocation = allocations[id];
+  allocation = {};
+  allocation.live = true;
+  allocation.priority = priority;
+  allocation.usage = usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  allocation.last_used = frame;
+
+  VkBufferCreateInfo buffer_create_info = {};
+  buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_create_info.usage = allocation.usage;
+  buffer_create_info.size = size;
+  buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VK_CHECK(vkCreateBuffer(state->device, &buffer_create_info, &state->callbacks, &allocation.buffer));
+
+  if (!Allocate(allocation, true))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  stats.fallbacks += allocation.resident ? 0 : 1;
+  return id;
+}
+
+// The buffer is freed once the current frame is done with it.
+void ResidencyManager::DestroyBuffer(uint32_t id)
+{
+  Allocation& allocation = allocations[id];
+  Retire(allocation.buffer, allocation.memory, allocation.size, allocation.heap);
+  allocation.live = false;
+}
+
+void ResidencyManager::Retire(VkBuffer buffer, VkDeviceMemory memory, VkDeviceSize size, uint32_t heap)
+{
+  if (retired_count == ARRAY_COUNT(retired))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  retired[retired_count++] = { buffer, memory, size, heap, frame };
+}
+
+// Copies the buffer to the other side of the device heap, into a new buffer.
+// Returns false, leaving it where it was, if the allocation fails.
+bool ResidencyManager::Move(uint32_t id, VkCommandBuffer cmd)
+{
+  Allocation& allocation = allocations[id];
+  Allocation moved = allocation;
+  moved.buffer = VK_NULL_HANDLE;
+  moved.memory = VK_NULL_HANDLE;
+  moved.size = 0;
+
+  VkBufferCreateInfo buffer_create_info = {};
+  buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_create_info.usage = allocation.usage;
+  buffer_create_info.size = allocation.size;
+  buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VK_CHECK(vkCreateBuffer(state->device, &buffer_create_info, &state->callbacks, &moved.buffer));
+
+  if (!Allocate(moved, !allocation.resident) || (moved.resident == allocation.resident))
+  {
+    if (moved.memory)
+    {
+      heap_usage[moved.heap] -= moved.size;
+      heap_managed[moved.heap] -= moved.size;
+      vkFreeMemory(state->device, moved.memory, &state->callbacks);
+    }
+
+    vkDestroyBuffer(state->device, moved.buffer, &state->callbacks);
+    return false;
+  }
+
+  VkBufferCopy region = {};
+  region.size = allocation.size;
+  vkCmdCopyBuffer(cmd, allocation.buffer, moved.buffer, 1, &region);
+  Retire(allocation.buffer, allocation.memory, allocation.size, allocation.heap);
+  stats.demotions += moved.resident ? 0 : 1;
+  stats.promotions += moved.resident ? 1 : 0;
+  stats.moved_bytes += allocation.size;
+  allocation = moved;
+  return true;
+}
+
+// Call at the start of each frame's command buffer, before anything uses a
+// managed buffer, with the last frame the GPU has finished.
+void ResidencyManager::Update(VkCommandBuffer cmd, uint64_t completed_frame)
+{
+  uint32_t kept = 0;
+
+  for (uint32_t i = 0; i < retired_count; ++i)
+  {
+    Retired& r = retired[i];
+
+    if (r.frame > completed_frame)
+    {
+      retired[kept++] = r;
+      continue;
+    }
+
+    vkDestroyBuffer(state->device, r.buffer, &state->callbacks);
+    vkFreeMemory(state->device, r.memory, &state->callbacks);
+    heap_usage[r.heap] -= (heap_usage[r.heap] > r.size) ? r.size : heap_usage[r.heap];
+    heap_managed[r.heap] -= r.size;
+  }
+
+  retired_count = kept;
+  ++frame;
+
+  if (!cmd || !can_demote)
+  {
+    return;
+  }
+
+  QueryBudget();
+  VkDeviceSize budget = heap_budget[device_heap];
+  VkDeviceSize usage = heap_usage[device_heap];
+  uint32_t victims[64];
+  uint32_t victim_count = 0;
+  uint32_t promote = UINT32_MAX;
+
+  if (usage > budget)
+  {
+    // Over budget, from our allocations or someone else's: demote the least
+    // important buffers.  What they free only counts once it's retired.
+    victim_count = PickVictims(allocations, allocation_count, RESIDENCY_PRIORITY_COUNT, usage - budget, ARRAY_COUNT(victims), victims);
+  }
+  else
+  {
+    // Under budget: bring back the most important, most recently used demoted
+    // buffer, or make room for it by demoting less important ones.
+    for (uint32_t i = 0; i < allocation_count; ++i)
+    {
+      const Allocation& a = allocations[i];
+
+      if (a.live && !a.resident && ((promote == UINT32_MAX) || (a.priority > allocations[promote].priority) ||
+        ((a.priority == allocations[promote].priority) && (a.last_used > allocations[promote].last_used))))
+      {
+        promote = i;
+      }
+    }
+
+    VkDeviceSize headroom = budget - usage;
+
+    if ((promote != UINT32_MAX) && (allocations[promote].size > headroom))
+    {
+      VkDeviceSize needed = allocations[promote].size - headroom;
+      victim_count = PickVictims(allocations, allocation_count, allocations[promote].priority, needed, ARRAY_COUNT(victims), victims);
+      VkDeviceSize freed = 0;
+
+      for (uint32_t i = 0; i < victim_count; ++i)
+      {
+        freed += allocations[victims[i]].size;
+      }
+
+      // Promoted next time, once the victims' memory is freed.
+      victim_count = (freed >= needed) ? victim_count : 0;
+      promote = UINT32_MAX;
+    }
+  }
+
+  if (!victim_count && (promote == UINT32_MAX))
+  {
+    return;
+  }
+
+  // Whatever wrote the buffers before this frame is done by the copies, and
+  // the copies are done before anything after them reads.
+  VkMemoryBarrier memory_barrier = {};
+  memory_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  memory_barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  memory_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memory_barrier, 0, nullptr, 0, nullptr);
+
+  VkDeviceSize moved_bytes = 0;
+
+  for (uint32_t i = 0; (i < victim_count) && (moved_bytes < move_bytes_per_update); ++i)
+  {
+    moved_bytes += Move(victims[i], cmd) ? allocations[victims[i]].size : 0;
+  }
+
+  if (promote != UINT32_MAX)
+  {
+    Move(promote, cmd);
+  }
+
+  memory_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  memory_barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &memory_barrier, 0, nullptr, 0, nullptr);
+}
+
+void ResidencyManager::PrintHeaps() const
+{
+  const VkPhysicalDeviceMemoryProperties& properties = state->memory_properties[state->physical_device_index];
+
+  for (uint32_t h = 0; h < properties.memoryHeapCount; ++h)
+  {
+    printf("  heap %u%s: %7.1f MB, budget %7.1f MB, used %7.1f MB, managed %7.1f MB\n", h, (h == device_heap) ? " (device)" : "",
+      properties.memoryHeaps[h].size / (1024.0 * 1024.0), heap_budget[h] / (1024.0 * 1024.0), heap_usage[h] / (1024.0 * 1024.0), heap_managed[h] / (1024.0 * 1024.0));
+  }
+}
+
+// Resident buffers with a priority below below, lowest priority then least
+// recently used first, until they add up to needed or max_victims.
+uint32_t ResidencyManager::PickVictims(const Allocation* allocations, uint32_t count, ResidencyPriority below, VkDeviceSize needed, uint32_t max_victims, uint32_t* victims)
+{
+  uint32_t victim_count = 0;
+  VkDeviceSize freed = 0;
+
+  while ((freed < needed) && (victim_count < max_victims))
+  {
+    uint32_t best = UINT32_MAX;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      const Allocation& a = allocations[i];
+      bool taken = false;
+
+      for (uint32_t v = 0; v < victim_count; ++v)
+      {
+        taken = taken || (victims[v] == i);
+      }
+
+      if (!a.live || !a.resident || (a.priority >= below) || taken)
+      {
+        continue;
+      }
+
+      if ((best == UINT32_MAX) || (a.priority < allocations[best].priority) ||
+        ((a.priority == allocations[best].priority) && (a.last_used < allocations[best].last_used)))
+      {
+        best = i;
+      }
+    }
+
+    if (best == UINT32_MAX)
+    {
+      break;
+    }
+
+    victims[victim_count++] = best;
+    freed += allocations[best].size;
+  }
+
+  return victim_count;
+}
+
+void ResidencyManager::TestPickVictims()
+{
+  Allocation allocations[5] = {};
+  const ResidencyPriority priorities[5] = { RESIDENCY_PRIORITY_HIGH, RESIDENCY_PRIORITY_LOW, RESIDENCY_PRIORITY_NORMAL, RESIDENCY_PRIORITY_LOW, RESIDENCY_PRIORITY_LOW };
+  const uint64_t last_used[5] = { 1, 9, 2, 3, 5 };
+
+  for (uint32_t i = 0; i < 5; ++i)
+  {
+    allocations[i].live = true;
+    allocations[i].resident = true;
+    allocations[i].priority = priorities[i];
+    allocations[i].size = 100;
+    allocations[i].last_used = last_used[i];
+  }
+
+  // The demoted one is skipped; low before normal, oldest first.
+  allocations[4].resident = false;
+  uint32_t victims[5] = {};
+  FailIfNotExpected(3u, PickVictims(allocations, 5, RESIDENCY_PRIORITY_COUNT, 250, 5, victims), __FUNCTION__);
+  FailIfNotExpected(3u, victims[0], __FUNCTION__);
+  FailIfNotExpected(1u, victims[1], __FUNCTION__);
+  FailIfNotExpected(2u, victims[2], __FUNCTION__);
+
+  // Only less important buffers make room, even if that isn't enough.
+  FailIfNotExpected(2u, PickVictims(allocations, 5, RESIDENCY_PRIORITY_NORMAL, 1000, 5, victims), __FUNCTION__);
+  FailIfNotExpected(0u, PickVictims(allocations, 5, RESIDENCY_PRIORITY_LOW, 100, 5, victims), __FUNCTION__);
+  FailIfNotExpected(1u, PickVictims(allocations, 5, RESIDENCY_PRIORITY_COUNT, 250, 1, victims), __FUNCTION__);
+}
+
+void ResidencyManager::RunAllTests()
+{
+  TestPickVictims();
+}
+
+// Oversubscribes the device heap, capped to what's in use plus 256 MB, with
+// 48 8 MB buffers of mixed priority, and touches a working set that drifts
+// across them.  Reports where the bytes are and how much moved.
+void RunResidencyBench(VulkanState& state)
+{
+  const uint32_t buffer_count = 48;
+  const VkDeviceSize buffer_size = 8ull << 20;
+  const uint32_t working_set = 12;
+  const uint32_t frame_count = 240;
+  const double mb = 1024.0 * 1024.0;
+
+  ResidencyManager residency;
+  residency.Create(state, buffer_count);
+  printf("Residency: %s budget, %u x %.0f MB buffers\n", state.memory_budget ? "VK_EXT_memory_budget" : "estimated", buffer_count, buffer_size / mb);
+
+  if (!residency.can_demote)
+  {
+    printf("  skipped, no host memory to demote to\n");
+    residency.Destroy();
+    return;
+  }
+
+  residency.budget_cap = residency.heap_usage[residency.device_heap] + (256ull << 20);
+  residency.QueryBudget();
+  residency.PrintHeaps();
+  uint32_t ids[buffer_count];
+
+  for (uint32_t i = 0; i < buffer_count; ++i)
+  {
+    ResidencyPriority priority = (i % 4 == 0) ? RESIDENCY_PRIORITY_HIGH : ((i % 4 == 1) ? RESIDENCY_PRIORITY_NORMAL : RESIDENCY_PRIORITY_LOW);
+    ids[i] = residency.CreateBuffer(buffer_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, priority);
+  }
+
+  printf("  created, %u straight to host memory\n", residency.stats.fallbacks);
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+  double update_ms = 0.0;
+  double start_ms = GetTimeMs();
+
+  for (uint32_t frame = 0; frame < frame_count; ++frame)
+  {
+    VkCommandBufferBeginInfo cmd_buf_info = {};
+    cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+
+    // The high priority buffers are used every frame, the rest in a window
+    // that moves along by one buffer every 8 frames.
+    double update_start_ms = GetTimeMs();
+    residency.Update(cmd, residency.frame);
+    update_ms += GetTimeMs() - update_start_ms;
+
+    for (uint32_t i = 0; i < buffer_count; ++i)
+    {
+      uint32_t window = (i + buffer_count - ((frame / 8) % buffer_count)) % buffer_count;
+
+      if ((residency.allocations[ids[i]].priority == RESIDENCY_PRIORITY_HIGH) || (window < working_set))
+      {
+        residency.Touch(ids[i]);
+        vkCmdFillBuffer(cmd, residency.Buffer(ids[i]), 0, 4096, frame);
+      }
+    }
+
+    VK_CHECK(vkEndCommandBuffer(cmd));
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &cmd;
+    VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+    VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+    VK_CHECK(vkResetFences(state.device, 1, &fence));
+
+    if ((frame + 1) % 60 == 0)
+    {
+      VkDeviceSize resident[RESIDENCY_PRIORITY_COUNT] = {};
+
+      for (uint32_t i = 0; i < buffer_count; ++i)
+      {
+        const ResidencyManager::Allocation& a = residency.allocations[ids[i]];
+        resident[a.priority] += a.resident ? a.size : 0;
+      }
+
+      printf("  frame %3u: resident high %5.0f MB, normal %5.0f MB, low %5.0f MB; %u demotions, %u promotions, %.0f MB moved\n", frame + 1,
+        resident[RESIDENCY_PRIORITY_HIGH] / mb, resident[RESIDENCY_PRIORITY_NORMAL] / mb, resident[RESIDENCY_PRIORITY_LOW] / mb,
+        residency.stats.demotions, residency.stats.promotions, residency.stats.moved_bytes / mb);
+    }
+  }
+
+  double total_ms = GetTimeMs() - start_ms;
+  printf("  %.3f ms per frame, %.3f ms of it in Update()\n", total_ms / frame_count, update_ms / frame_count);
+  residency.PrintHeaps();
+
+  vkDestroyFence(state.device, fence, &state.callbacks);
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+
+  for (uint32_t i = 0; i < buffer_count; ++i)
+  {
+    residency.DestroyBuffer(ids[i]);
+  }
+
+  residency.Destroy();
+}
+
+// A depth prepass: a depth-only pipeline that reads positions from their own
+// stream, then the main pass shading only the fragments that survived it,
+// testing EQUAL with depth writes off.  The two vertex shaders must compute
+// gl_Position identically (both are invariant), and the main pass's render
+// pass reads the depth attachment the prepass wrote.
+struct DepthPrepass
+{
+  VkPipeline depth_pipeline = VK_NULL_HANDLE;
+  VkPipeline shade_pipeline = VK_NULL_HANDLE;
+
+  void Create(VulkanState& state, VkRenderPass depth_pass, VkRenderPass shade_pass, VkPipelineLayout layout, VkShaderModule depth_vertex_module, VkShaderModule vertex_module, VkShaderModule frag_module);
+  void Destroy(VulkanState& state);
+  static void SplitPositions(const Vertex* vertices, uint32_t count, Vec3* positions);
+
+  // Tests.
+  static void TestSplitPositions();
+  static void RunAllTests();
+};
+
+void DepthPrepass::Create(VulkanState& state, VkRenderPass depth_pass, VkRenderPass shade_pass, VkPipelineLayout layout, VkShaderModule depth_vertex_module, VkShaderModule vertex_module, VkShaderModule frag_module)
+{
+  shade_pipeline = CreateVertexColorPipeline(state, shade_pass, layout, vertex_module, frag_module, true, true);
+
+  VkDynamicState dynamic_state_enables[2] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+  VkPipelineDynamicStateCreateInfo dynamic_create_info = {};
+  dynamic_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamic_create_info.dynamicStateCount = ARRAY_COUNT(dynamic_state_enables);
+  dynamic_create_info.pDynamicStates = dynamic_state_enables;
+
+  VkVertexInputBindingDescription vi_binding = {};
+  vi_binding.binding = 0;
+  vi_binding.stride = sizeof(Vec3);
+  vi_binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+  VkVertexInputAttributeDescription vi_attrib = {};
+  vi_attrib.location = 0;
+  vi_attrib.binding = 0;
+  vi_attrib.format = VK_FORMAT_R32G32B32_SFLOAT;
+
+  VkPipelineVertexInputStateCreateInfo vi = {};
+  vi.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vi.vertexBindingDescriptionCount = 1;
+  vi.pVertexBindingDescriptions = &vi_binding;
+  vi.vertexAttributeDescriptionCount = 1;
+  vi.pVertexAttributeDescriptions = &vi_attrib;
+
+  VkPipelineInputAssemblyStateCreateInfo ia = {};
+  ia.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+  VkPipelineRasterizationStateCreateInfo rs = {};
+  rs.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rs.polygonMode = VK_POLYGON_MODE_FILL;
+  rs.cullMode = VK_CULL_MODE_NONE;
+  rs.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  rs.lineWidth = 1.0f;
+
+  // No color attachments, so no blend state.
+  VkPipelineColorBlendStateCreateInfo cb = {};
+  cb.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+
+  VkPipelineViewportStateCreateInfo vp = {};
+  vp.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  vp.viewportCount = 1;
+  vp.scissorCount = 1;
+
+  VkPipelineMultisampleStateCreateInfo ms = {};
+  ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+  VkPipelineDepthStencilStateCreateInfo ds = {};
+  ds.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  ds.depthTestEnable = VK_TRUE;
+  ds.depthWriteEnable = VK_TRUE;
+  ds.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+  // Depth only, so no fragment shader.
+  VkPipelineShaderStageCreateInfo shader_stage_create_info = {};
+  shader_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stage_create_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
+  shader_stage_create_info.module = depth_vertex_module;
+  shader_stage_create_info.pName = "main";
+
+  VkGraphicsPipelineCreateInfo pipeline_create_info = {};
+  pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipeline_create_info.layout = layout;
+  pipeline_create_info.pVertexInputState = &vi;
+  pipeline_create_info.pInputAssemblyState = &ia;
+  pipeline_create_info.pRasterizationState = &rs;
+  pipeline_create_info.pColorBlendState = &cb;
+  pipeline_create_info.pMultisampleState = &ms;
+  pipeline_create_info.pDynamicState = &dynamic_create_info;
+  pipeline_create_info.pViewportState = &vp;
+  pipeline_create_info.pDepthStencilState = &ds;
+  pipeline_create_info.pStages = &shader_stage_create_info;
+  pipeline_create_info.stageCount = 1;
+  pipeline_create_info.renderPass = depth_pass;
+  VK_CHECK(vkCreateGraphicsPipelines(state.device, VK_NULL_HANDLE, 1, &pipeline_create_info, &state.callbacks, &depth_pipeline));
+}
+
+void DepthPrepass::Destroy(VulkanState& state)
+{
+  vkDestroyPipeline(state.device, depth_pipeline, &state.callbacks);
+  vkDestroyPipeline(state.device, shade_pipeline, &state.callbacks);
+  depth_pipeline = VK_NULL_HANDLE;
+  shade_pipeline = VK_NULL_HANDLE;
+}
+
+// The position-only stream for the prepass, in the same vertex order.
+void DepthPrepass::SplitPositions(const Vertex* vertices, uint32_t count, Vec3* positions)
+{
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    positions[i] = vertices[i].position;
+  }
+}
+
+void DepthPrepass::TestSplitPositions()
+{
+  Vec3 positions[ARRAY_COUNT(s_ClipSpaceTriangleVertices)];
+  SplitPositions(s_ClipSpaceTriangleVertices, ARRAY_COUNT(s_ClipSpaceTriangleVertices), positions);
+  FailIfNotExpected(12u, (uint32_t)sizeof(Vec3), __FUNCTION__);
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(s_ClipSpaceTriangleVertices); ++i)
+  {
+    FailIfNotExpected(s_ClipSpaceTriangleVertices[i].position.x, positions[i].x, __FUNCTION__);
+    FailIfNotExpected(s_ClipSpaceTriangleVertices[i].position.y, positions[i].y, __FUNCTION__);
+    FailIfNotExpected(s_ClipSpaceTriangleVertices[i].position.z, positions[i].z, __FUNCTION__);
+  }
+}
+
+void DepthPrepass::RunAllTests()
+{
+  TestSplitPositions();
+}
+
+struct PrepassBenchPass
+{
+  VkPipeline pipeline;
+  VkPipelineLayout pipeline_layout;
+  VkBuffer vertex_buffer; // Vertex, or Vec3 for the prepass.
+  uint32_t vertex_binding;
+  VkBuffer index_buffer;
+  uint32_t first_index;
+  uint32_t index_count;
+  Mat4 clip_from_world;
+  VkExtent2D extent;
+};
+
+static void RecordPrepassBenchPass(VkCommandBuffer cmd, void* userdata)
+{
+  const PrepassBenchPass& pass = *(const PrepassBenchPass*)userdata;
+  const VkDeviceSize offsets = 0;
+  VkViewport viewport = {};
+  viewport.width = (float)pass.extent.width;
+  viewport.height = (float)pass.extent.height;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = {};
+  scissor.extent = pass.extent;
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pass.pipeline);
+  vkCmdPushConstants(cmd, pass.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(Mat4), &pass.clip_from_world);
+  vkCmdBindVertexBuffers(cmd, pass.vertex_binding, 1, &pass.vertex_buffer, &offsets);
+  vkCmdBindIndexBuffer(cmd, pass.index_buffer, 0, VK_INDEX_TYPE_UINT32);
+  vkCmdDrawIndexed(cmd, pass.index_count, 1, pass.first_index, 0, 0);
+}
+
+// Stacks of overlapping spheres drawn back to front, the worst order for
+// early depth testing, with an expensive fragment shader.  Each scene is
+// drawn with one depth-tested pass and with a depth prepass, reporting frame
+// time and, when the device has pipeline statistics, fragment shader
+// invocations per pixel.
+void RunPrepassBench(VulkanState& state)
+{
+  const uint32_t layer_counts[] = { 1, 4, 16, 32 };
+  const uint32_t max_layers = 32;
+  const uint32_t grid = 6;
+  const uint32_t rings = 12;
+  const uint32_t segments = 12;
+  const uint32_t frame_count = 64;
+  const uint32_t frames_per_submit = 16;
+  const VkExtent2D extent = { 1024, 1024 };
+
+  printf("Depth prepass: %ux%u, %s\n", extent.width, extent.height, state.pipeline_statistics ? "with pipeline statistics" : "no pipeline statistics");
+  VkShaderModule depth_vertex_module = VK_NULL_HANDLE;
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+
+  if (!state.LoadShaderModule("depth_prepass.vert.spv", &depth_vertex_module) || !state.LoadShaderModule("meshlet.vert.spv", &vertex_module) ||
+    !state.LoadShaderModule("overdraw.frag.spv", &frag_module))
+  {
+    vkDestroyShaderModule(state.device, depth_vertex_module, &state.callbacks);
+    vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+    printf("  skipped, no shaders\n");
+    return;
+  }
+
+  // Layer l is a grid of overlapping spheres at depth 4 + l, offset from
+  // the layers next to it so deeper layers show through the gaps.  Layers go
+  // in farthest first, so the last n layers are the nearest n in back to
+  // front order.
+  uint32_t sphere_vertices = (rings + 1) * (segments + 1);
+  uint32_t sphere_indices = rings * segments * 6;
+  uint32_t max_vertices = sphere_vertices * grid * grid * max_layers;
+  Vertex* vertices = (Vertex*)Alloc(sizeof(Vertex) * max_vertices, 16);
+  Vec3* positions = (Vec3*)Alloc(sizeof(Vec3) * max_vertices, 16);
+  uint32_t* indices = (uint32_t*)Alloc(sizeof(uint32_t) * sphere_indices * grid * grid * max_layers, 16);
+  uint32_t vertex_count = 0;
+  uint32_t index_count = 0;
+
+  for (uint32_t l = max_layers; l-- > 0;)
+  {
+    for (uint32_t i = 0; i < grid * grid; ++i)
+    {
+      const float color[4] = { (float)l / max_layers, (float)(i % grid) / grid, (float)(i / grid) / grid, 1.0f };
+      float offset = (l % 2) ? 0.5f : 0.0f;
+      Vec3 center((((i % grid) + offset) * 1.5f) - (grid * 0.75f), (((i / grid) + offset) * 1.5f) - (grid * 0.75f), 4.0f + l);
+      AppendSphere(center, 1.0f, rings, segments, color, vertices, &vertex_count, indices, &index_count);
+    }
+  }
+
+  DepthPrepass::SplitPositions(vertices, vertex_count, positions);
+
+  VkBuffer vertex_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory vertex_memory = VK_NULL_HANDLE;
+  VkBuffer position_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory position_memory = VK_NULL_HANDLE;
+  VkBuffer index_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory index_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(sizeof(Vertex) * vertex_count, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertex_buffer, &vertex_memory);
+  state.CreateBuffer(sizeof(Vec3) * vertex_count, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &position_buffer, &position_memory);
+  state.CreateBuffer(sizeof(uint32_t) * index_count, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer, &index_memory);
+  state.UploadBuffer(vertex_buffer, vertices, sizeof(Vertex) * vertex_count);
+  state.UploadBuffer(position_buffer, positions, sizeof(Vec3) * vertex_count);
+  state.UploadBuffer(index_buffer, indices, sizeof(uint32_t) * index_count);
+  Free(vertices);
+  Free(positions);
+  Free(indices);
+
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.size = sizeof(Mat4);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.pushConstantRangeCount = 1;
+  pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_create_info, &state.callbacks, &pipeline_layout));
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage color_image = VK_NULL_HANDLE;
+  VkDeviceMemory color_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &color_image, &color_memory);
+
+  // graphs[0] draws in one depth-tested pass, graphs[1] lays down depth in a
+  // prepass and shades in a second pass that only reads it.
+  PrepassBenchPass passes[3] = {};
+  RenderGraph graphs[2];
+  uint32_t output = graphs[0].ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &color_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  uint32_t depth = graphs[0].CreateImage("depth", VK_FORMAT_D32_SFLOAT, extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+  uint32_t scene_pass = graphs[0].AddPass("scene", RecordPrepassBenchPass, passes);
+  graphs[0].AddUse(scene_pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graphs[0].AddUse(scene_pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+  graphs[0].Compile(state);
+
+  output = graphs[1].ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &color_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  depth = graphs[1].CreateImage("depth", VK_FORMAT_D32_SFLOAT, extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+  uint32_t depth_pass = graphs[1].AddPass("depth prepass", RecordPrepassBenchPass, passes + 1);
+  graphs[1].AddUse(depth_pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+  uint32_t shade_pass = graphs[1].AddPass("shade", RecordPrepassBenchPass, passes + 2);
+  graphs[1].AddUse(shade_pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graphs[1].AddUse(shade_pass, depth, RENDER_GRAPH_ACCESS_DEPTH_READ);
+  graphs[1].Compile(state);
+
+  DepthPrepass prepass;
+  prepass.Create(state, graphs[1].RenderPass(depth_pass), graphs[1].RenderPass(shade_pass), pipeline_layout, depth_vertex_module, vertex_module, frag_module);
+
+  // Looking down +z at the stack from just in front of it.
+  Mat4 world_to_view;
+  world_to_view.SetIdentity();
+  world_to_view.SetPosition(Vec3(0.0f, 0.0f, 1.0f));
+  Mat4 view_to_clip;
+  view_to_clip.SetPerspective(1.5707964f, (float)extent.width / extent.height, 0.1f, 100.0f);
+
+  passes[0].pipeline = CreateVertexColorPipeline(state, graphs[0].RenderPass(scene_pass), pipeline_layout, vertex_module, frag_module, true);
+  passes[0].vertex_buffer = vertex_buffer;
+  passes[0].vertex_binding = 1;
+  passes[1].pipeline = prepass.depth_pipeline;
+  passes[1].vertex_buffer = position_buffer;
+  passes[1].vertex_binding = 0;
+  passes[2].pipeline = prepass.shade_pipeline;
+  passes[2].vertex_buffer = vertex_buffer;
+  passes[2].vertex_binding = 1;
+
+  for (uint32_t p = 0; p < ARRAY_COUNT(passes); ++p)
+  {
+    passes[p].pipeline_layout = pipeline_layout;
+    passes[p].index_buffer = index_buffer;
+    passes[p].clip_from_world = view_to_clip * world_to_view;
+    passes[p].extent = extent;
+  }
+
+  VkQueryPool statistics_pool = VK_NULL_HANDLE;
+
+  if (state.pipeline_statistics)
+  {
+    VkQueryPoolCreateInfo query_pool_info = {};
+    query_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_pool_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    query_pool_info.queryCount = 1;
+    query_pool_info.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+    VK_CHECK(vkCreateQueryPool(state.device, &query_pool_info, &state.callbacks, &statistics_pool));
+  }
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+  const char* const mode_names[2] = { "depth tested", "depth prepass" };
+  double pixels = (double)extent.width * extent.height;
+
+  for (uint32_t s = 0; s < ARRAY_COUNT(layer_counts); ++s)
+  {
+    uint32_t layers = layer_counts[s];
+
+    for (uint32_t p = 0; p < ARRAY_COUNT(passes); ++p)
+    {
+      passes[p].index_count = layers * grid * grid * sphere_indices;
+      passes[p].first_index = index_count - passes[p].index_count;
+    }
+
+    printf("  %2u layers, %u spheres:\n", layers, layers * grid * grid);
+
+    for (uint32_t mode = 0; mode < 2; ++mode)
+    {
+      double start_ms = 0.0;
+
+      // The first submission warms up and isn't timed, and counts the first
+      // frame's fragment shader invocations.
+      for (uint32_t frame = 0; frame < frame_count + frames_per_submit; frame += frames_per_submit)
+      {
+        if (frame == frames_per_submit)
+        {
+          start_ms = GetTimeMs();
+        }
+
+        VkCommandBufferBeginInfo cmd_buf_info = {};
+        cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+        bool count_fragments = statistics_pool && !frame;
+
+        if (count_fragments)
+        {
+          vkCmdResetQueryPool(cmd, statistics_pool, 0, 1);
+          vkCmdBeginQuery(cmd, statistics_pool, 0, 0);
+        }
+
+        for (uint32_t i = 0; i < frames_per_submit; ++i)
+        {
+          graphs[mode].Execute(cmd, 0);
+
+          if (count_fragments && !i)
+          {
+            vkCmdEndQuery(cmd, statistics_pool, 0);
+          }
+        }
+
+        VK_CHECK(vkEndCommandBuffer(cmd));
+
+        VkSubmitInfo submit_info = {};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &cmd;
+        VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+        VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+        VK_CHECK(vkResetFences(state.device, 1, &fence));
+      }
+
+      double frame_ms = (GetTimeMs() - start_ms) / frame_count;
+      uint64_t fragments = 0;
+
+      if (statistics_pool)
+      {
+        VK_CHECK(vkGetQueryPoolResults(state.device, statistics_pool, 0, 1, sizeof(fragments), &fragments, sizeof(fragments), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+        printf("    %-13s %8.3f ms per frame, %10llu fragments shaded (%.2f per pixel)\n", mode_names[mode], frame_ms, (unsigned long long)fragments, fragments / pixels);
+      }
+      else
+      {
+        printf("    %-13s %8.3f ms per frame\n", mode_names[mode], frame_ms);
+      }
+    }
+  }
+
+  vkDestroyFence(state.device, fence, &state.callbacks);
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+
+  if (statistics_pool)
+  {
+    vkDestroyQueryPool(state.device, statistics_pool, &state.callbacks);
+  }
+
+  vkDestroyPipeline(state.device, passes[0].pipeline, &state.callbacks);
+  prepass.Destroy(state);
+  graphs[0].Destroy();
+  graphs[1].Destroy();
+  vkDestroyImage(state.device, color_image, &state.callbacks);
+  vkFreeMemory(state.device, color_memory, &state.callbacks);
+  vkDestroyPipelineLayout(state.device, pipeline_layout, &state.callbacks);
+  vkDestroyBuffer(state.device, index_buffer, &state.callbacks);
+  vkFreeMemory(state.device, index_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, position_buffer, &state.callbacks);
+  vkFreeMemory(state.device, position_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, vertex_buffer, &state.callbacks);
+  vkFreeMemory(state.device, vertex_memory, &state.callbacks);
+  vkDestroyShaderModule(state.device, depth_vertex_module, &state.callbacks);
+  vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+  vkDestroyShaderModule(state.device, frag_module, &state.callbacks);
+}
+
+// Skips binds and dynamic state that match what the command buffer already
+// has.  Reset() at the start of every command buffer and after anything that
+// disturbs the state outside the cache, like a new render pass.  With
+// enabled false every call goes through, for comparison.
+struct DrawStateCache
+{
+  struct Stats
+  {
+    uint32_t pipeline_binds;
+    uint32_t descriptor_binds;
+    uint32_t vertex_binds;
+    uint32_t index_binds;
+    uint32_t viewport_sets;
+    uint32_t scissor_sets;
+    uint32_t skipped;
+  };
+
+  bool enabled = true;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  VkBuffer vertex_buffer = VK_NULL_HANDLE;
+  VkBuffer index_buffer = VK_NULL_HANDLE;
+  bool has_viewport = false;
+  VkViewport viewport = {};
+  bool has_scissor = false;
+  VkRect2D scissor = {};
+  Stats stats = {};
+
+  void Reset();
+  void BindPipeline(VkCommandBuffer cmd, VkPipeline new_pipeline);
+  void BindDescriptorSet(VkCommandBuffer cmd, VkPipelineLayout layout, VkDescriptorSet new_set);
+  void BindVertexBuffer(VkCommandBuffer cmd, uint32_t binding, VkBuffer buffer);
+  void BindIndexBuffer(VkCommandBuffer cmd, VkBuffer buffer);
+  void SetViewport(VkCommandBuffer cmd, const VkViewport& new_viewport);
+  void SetScissor(VkCommandBuffer cmd, const VkRect2D& new_scissor);
+  uint32_t Binds() const { return stats.pipeline_binds + stats.descriptor_binds + stats.vertex_binds + stats.index_binds + stats.viewport_sets + stats.scissor_sets; }
+};
+
+void DrawStateCache::Reset()
+{
+  pipeline = VK_NULL_HANDLE;
+  set = VK_NULL_HANDLE;
+  vertex_buffer = VK_NULL_HANDLE;
+  index_buffer = VK_NULL_HANDLE;
+  has_viewport = false;
+  has_scissor = false;
+}
+
+void DrawStateCache::BindPipeline(VkCommandBuffer cmd, VkPipeline new_pipeline)
+{
+  if (enabled && (new_pipeline == pipeline))
+  {
+    ++stats.skipped;
+    return;
+  }
+
+  // Sets stay bound across pipelines with compatible layouts, and every
+  // pipeline here shares one.
+  pipeline = new_pipeline;
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+  ++stats.pipeline_binds;
+}
+
+void DrawStateCache::BindDescriptorSet(VkCommandBuffer cmd, VkPipelineLayout layout, VkDescriptorSet new_set)
+{
+  if (enabled && (new_set == set))
+  {
+    ++stats.skipped;
+    return;
+  }
+
+  set = new_set;
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1, &set, 0, nullptr);
+  ++stats.descriptor_binds;
+}
+
+void DrawStateCache::BindVertexBuffer(VkCommandBuffer cmd, uint32_t binding, VkBuffer buffer)
+{
+  if (enabled && (buffer == vertex_buffer))
+  {
+    ++stats.skipped;
+    return;
+  }
+
+  const VkDeviceSize offset = 0;
+  vertex_buffer = buffer;
+  vkCmdBindVertexBuffers(cmd, binding, 1, &vertex_buffer, &offset);
+  ++stats.vertex_binds;
+}
+
+void DrawStateCache::BindIndexBuffer(VkCommandBuffer cmd, VkBuffer buffer)
+{
+  if (enabled && (buffer == index_buffer))
+  {
+    ++stats.skipped;
+    return;
+  }
+
+  index_buffer = buffer;
+  vkCmdBindIndexBuffer(cmd, index_buffer, 0, VK_INDEX_TYPE_UINT32);
+  ++stats.index_binds;
+}
+
+void DrawStateCache::SetViewport(VkCommandBuffer cmd, const VkViewport& new_viewport)
+{
+  if (enabled && has_viewport && !memcmp(&new_viewport, &viewport, sizeof(viewport)))
+  {
+    ++stats.skipped;
+    return;
+  }
+
+  has_viewport = true;
+  viewport = new_viewport;
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  ++stats.viewport_sets;
+}
+
+void DrawStateCache::SetScissor(VkCommandBuffer cmd, const VkRect2D& new_scissor)
+{
+  if (enabled && has_scissor && !memcmp(&new_scissor, &scissor, sizeof(scissor)))
+  {
+    ++stats.skipped;
+    return;
+  }
+
+  has_scissor = true;
+  scissor = new_scissor;
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+  ++stats.scissor_sets;
+}
+
+// What a DrawList's ids refer to.  Every pipeline uses layout, with the
+// material's set at set 0.
+struct DrawMesh
+{
+  VkBuffer vertex_buffer;
+  VkBuffer index_buffer;
+  uint32_t first_index;
+  uint32_t index_count;
+};
+
+struct DrawTables
+{
+  const VkPipeline* pipelines;
+  VkPipelineLayout layout;
+  const VkDescriptorSet* materials;
+  const DrawMesh* meshes;
+  uint32_t vertex_binding;
+  VkViewport viewport;
+  VkRect2D scissor;
+};
+
+// Draws collected in any order and recorded sorted by a 64-bit key, so draws
+// sharing a pipeline, then a material, then a mesh end up next to each other
+// and the DrawStateCache can skip most binds.  Keys sort with an LSD radix
+// sort on the JobSystem, 8 bits a pass, skipping bytes every key shares.
+struct DrawList
+{
+  struct Draw
+  {
+    uint32_t pipeline;
+    uint32_t material;
+    uint32_t mesh;
+    uint32_t instance; // firstInstance, for per-object data.
+  };
+
+  // Most significant first.  Depth is last, so it only orders draws that
+  // share everything else, front to back.
+  static const uint32_t s_PassBits = 4;
+  static const uint32_t s_PipelineBits = 12;
+  static const uint32_t s_MaterialBits = 16;
+  static const uint32_t s_MeshBits = 16;
+  static const uint32_t s_DepthBits = 16;
+  static const uint32_t s_SortBlocks = 64; // Histogram blocks, split across workers.
+
+  uint64_t* keys = nullptr;
+  uint32_t* order = nullptr; // The draw each key belongs to.
+  uint64_t* scratch_keys = nullptr;
+  uint32_t* scratch_order = nullptr;
+  Draw* draws = nullptr;
+  uint32_t count = 0;
+  uint32_t capacity = 0;
+
+  void Create(uint32_t draw_capacity);
+  void Destroy();
+  void Clear() { count = 0; }
+  void Add(uint32_t pass, const Draw& draw, float depth);
+  void Sort(JobSystem* jobs);
+  void Record(VkCommandBuffer cmd, const DrawTables& tables, DrawStateCache& cache) const;
+  static uint64_t MakeKey(uint32_t pass, uint32_t pipeline, uint32_t material, uint32_t mesh, float depth);
+
+  // Tests.
+  static void TestKeyOrder();
+  static void TestSort();
+  static void RunAllTests();
+};
+
+void DrawList::Create(uint32_t draw_capacity)
+{
+  capacity = draw_capacity;
+  count = 0;
+  keys = (uint64_t*)Alloc(sizeof(uint64_t) * capacity, 16);
+  scratch_keys = (uint64_t*)Alloc(sizeof(uint64_t) * capacity, 16);
+  order = (uint32_t*)Alloc(sizeof(uint32_t) * capacity, 16);
+  scratch_order = (uint32_t*)Alloc(sizeof(uint32_t) * capacity, 16);
+  draws = (Draw*)Alloc(sizeof(Draw) * capacity, 16);
+}
+
+void DrawList::Destroy()
+{
+  Free(keys);
+  Free(scratch_keys);
+  Free(order);
+  Free(scratch_order);
+  Free(draws);
+  keys = nullptr;
+  scratch_keys = nullptr;
+  order = nullptr;
+  scratch_order = nullptr;
+  draws = nullptr;
+  count = 0;
+  capacity = 0;
+}
+
+// depth is 0 at the near plane and 1 at the far plane; anything outside is
+// clamped.  Ids past their field's width wrap, which only costs sorting.
+uint64_t DrawList::MakeKey(uint32_t pass, uint32_t pipeline, uint32_t material, uint32_t mesh, float depth)
+{
+  const uint32_t max_depth = (1u << s_DepthBits) - 1;
+  depth = (depth < 0.0f) ? 0.0f : ((depth > 1.0f) ? 1.0f : depth);
+  uint64_t key = pass & ((1u << s_PassBits) - 1);
+  key = (key << s_PipelineBits) | (pipeline & ((1u << s_PipelineBits) - 1));
+  key = (key << s_MaterialBits) | (material & ((1u << s_MaterialBits) - 1));
+  key = (key << s_MeshBits) | (mesh & ((1u << s_MeshBits) - 1));
+  key = (key << s_DepthBits) | (uint32_t)(depth * max_depth);
+  return key;
+}
+
+void DrawList::Add(uint32_t pass, const Draw& draw, float depth)
+{
+  if (count == capacity)
+  {
+    Fail(__FUNCTION__);
+  }
+
+  keys[count] = MakeKey(pass, draw.pipeline, draw.material, draw.mesh, depth);
+  order[count] = count;
+  draws[count] = draw;
+  ++count;
+}
+
+struct RadixSortJobData
+{
+  const uint64_t* keys;
+  const uint32_t* values;
+  uint64_t* out_keys;
+  uint32_t* out_values;
+  uint32_t count;
+  uint32_t block_size;
+  uint32_t shift;
+  uint32_t (*histograms)[256]; // Per block, then turned into each block's offsets.
+};
+
+static void RadixHistogramJob(void* data, uint32_t begin, uint32_t end)
+{
+  const RadixSortJobData& sort = *(const RadixSortJobData*)data;
+
+  for (uint32_t b = begin; b < end; ++b)
+  {
+    uint32_t* histogram = sort.histograms[b];
+    uint32_t first = b * sort.block_size;
+    uint32_t last = ((first + sort.block_size) < sort.count) ? (first + sort.block_size) : sort.count;
+    memset(histogram, 0, sizeof(uint32_t) * 256);
+
+    for (uint32_t i = first; i < last; ++i)
+    {
+      ++histogram[(sort.keys[i] >> sort.shift) & 0xff];
+    }
+  }
+}
+
+// Each block writes its keys in order from its own offset per digit, which
+// keeps the sort stable.
+static void RadixScatterJob(void* data, uint32_t begin, uint32_t end)
+{
+  const RadixSortJobData& sort = *(const RadixSortJobData*)data;
+
+  for (uint32_t b = begin; b < end; ++b)
+  {
+    uint32_t* offsets = sort.histograms[b];
+    uint32_t first = b * sort.block_size;
+    uint32_t last = ((first + sort.block_size) < sort.count) ? (first + sort.block_size) : sort.count;
+
+    for (uint32_t i = first; i < last; ++i)
+    {
+      uint32_t slot = offsets[(sort.keys[i] >> sort.shift) & 0xff]++;
+      sort.out_keys[slot] = sort.keys[i];
+      sort.out_values[slot] = sort.values[i];
+    }
+  }
+}
+
+// Sorts keys, and order with them.  Without a JobSystem the blocks run on
+// the calling thread.
+void DrawList::Sort(JobSystem* jobs)
+{
+  if (count < 2)
+  {
+    return;
+  }
+
+  uint32_t histograms[s_SortBlocks][256];
+  RadixSortJobData sort = {};
+  sort.count = count;
+  sort.block_size = (count + s_SortBlocks - 1) / s_SortBlocks;
+  sort.histograms = histograms;
+  uint32_t block_count = (count + sort.block_size - 1) / sort.block_size;
+
+  for (uint32_t shift = 0; shift < 64; shift += 8)
+  {
+    sort.keys = keys;
+    sort.values = order;
+    sort.out_keys = scratch_keys;
+    sort.out_values = scratch_order;
+    sort.shift = shift;
+
+    if (jobs)
+    {
+      JobCounter counter;
+      jobs->ParallelFor(block_count, 1, RadixHistogramJob, &sort, &counter);
+      jobs->Wait(&counter);
+    }
+    else
+    {
+      RadixHistogramJob(&sort, 0, block_count);
+    }
+
+    // Digit by digit, block by block, so each block's run of a digit lands
+    // after the earlier blocks' runs.  A byte every key shares moves nothing.
+    uint32_t offset = 0;
+    bool shared = false;
+
+    for (uint32_t d = 0; d < 256; ++d)
+    {
+      uint32_t digit_count = 0;
+
+      for (uint32_t b = 0; b < block_count; ++b)
+      {
+        uint32_t n = histograms[b][d];
+        histograms[b][d] = offset;
+        offset += n;
+        digit_count += n;
+      }
+
+      shared = shared || (digit_count == count);
+    }
+
+    if (shared)
+    {
+      continue;
+    }
+
+    if (jobs)
+    {
+      JobCounter counter;
+      jobs->ParallelFor(block_count, 1, RadixScatterJob, &sort, &counter);
+      jobs->Wait(&counter);
+    }
+    else
+    {
+      RadixScatterJob(&sort, 0, block_count);
+    }
+
+    uint64_t* swap_keys = keys;
+    keys = scratch_keys;
+    scratch_keys = swap_keys;
+    uint32_t* swap_order = order;
+    order = scratch_order;
+    scratch_order = swap_order;
+  }
+}
+
+// Records every draw in key order.  The caller has begun the render pass and
+// reset the cache for it.
+void DrawList::Record(VkCommandBuffer cmd, const DrawTables& tables, DrawStateCache& cache) const
+{
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    const Draw& draw = draws[order[i]];
+    const DrawMesh& mesh = tables.meshes[draw.mesh];
+    cache.BindPipeline(cmd, tables.pipelines[draw.pipeline]);
+    cache.BindDescriptorSet(cmd, tables.layout, tables.materials[draw.material]);
+    cache.BindVertexBuffer(cmd, tables.vertex_binding, mesh.vertex_buffer);
+    cache.BindIndexBuffer(cmd, mesh.index_buffer);
+    cache.SetViewport(cmd, tables.viewport);
+    cache.SetScissor(cmd, tables.scissor);
+    vkCmdDrawIndexed(cmd, mesh.index_count, 1, mesh.first_index, 0, draw.instance);
+  }
+}
+
+void DrawList::TestKeyOrder()
+{
+  // Each field outranks everything after it.
+  uint64_t base = MakeKey(1, 5, 5, 5, 0.5f);
+  FailIfNotExpected(true, base < MakeKey(2, 0, 0, 0, 0.0f), __FUNCTION__);
+  FailIfNotExpected(true, base < MakeKey(1, 6, 0, 0, 0.0f), __FUNCTION__);
+  FailIfNotExpected(true, base < MakeKey(1, 5, 6, 0, 0.0f), __FUNCTION__);
+  FailIfNotExpected(true, base < MakeKey(1, 5, 5, 6, 0.0f), __FUNCTION__);
+  FailIfNotExpected(true, base < MakeKey(1, 5, 5, 5, 0.6f), __FUNCTION__);
+  FailIfNotExpected(MakeKey(1, 5, 5, 5, 0.0f), MakeKey(1, 5, 5, 5, -3.0f), __FUNCTION__);
+  FailIfNotExpected(MakeKey(1, 5, 5, 5, 1.0f), MakeKey(1, 5, 5, 5, 7.0f), __FUNCTION__);
+}
+
+void DrawList::TestSort()
+{
+  DrawList list;
+  list.Create(1000);
+  uint32_t rng = 0x2545f491u;
+
+  for (uint32_t i = 0; i < 1000; ++i)
+  {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    Draw draw = { rng % 7, (rng >> 8) % 3, (rng >> 16) % 5, i };
+    list.Add((rng >> 24) % 2, draw, (float)(i % 10) / 10.0f);
+  }
+
+  // Duplicate keys keep the order they were added in.
+  list.Sort(nullptr);
+
+  for (uint32_t i = 1; i < list.count; ++i)
+  {
+    FailIfNotExpected(true, list.keys[i - 1] <= list.keys[i], __FUNCTION__);
+    FailIfNotExpected(true, (list.keys[i - 1] < list.keys[i]) || (list.order[i - 1] < list.order[i]), __FUNCTION__);
+  }
+
+  // Every key still belongs to its draw.
+  const uint64_t state_mask = (1ull << (s_PipelineBits + s_MaterialBits + s_MeshBits)) - 1;
+
+  for (uint32_t i = 0; i < list.count; ++i)
+  {
+    const Draw& draw = list.draws[list.order[i]];
+    FailIfNotExpected(list.order[i], draw.instance, __FUNCTION__);
+    FailIfNotExpected(MakeKey(0, draw.pipeline, draw.material, draw.mesh, 0.0f) >> s_DepthBits, (list.keys[i] >> s_DepthBits) & state_mask, __FUNCTION__);
+  }
+
+  list.Destroy();
+}
+
+void DrawList::RunAllTests()
+{
+  TestKeyOrder();
+  TestSort();
+}
+
+struct DrawListBenchPass
+{
+  const DrawList* list;
+  const DrawTables* tables;
+  DrawStateCache* cache;
+  double record_ms;
+};
+
+static void RecordDrawListBenchPass(VkCommandBuffer cmd, void* userdata)
+{
+  DrawListBenchPass& pass = *(DrawListBenchPass*)userdata;
+  double start_ms = GetTimeMs();
+  pass.cache->Reset();
+  pass.list->Record(cmd, *pass.tables, *pass.cache);
+  pass.record_ms += GetTimeMs() - start_ms;
+}
+
+// The same draws every call, in the order a scene traversal might produce
+// them: no order at all.
+static void AddDrawListBenchDraws(DrawList& list, uint32_t draw_count, uint32_t pipeline_count, uint32_t material_count, uint32_t mesh_count)
+{
+  uint32_t rng = 0x2545f491u;
+  list.Clear();
+
+  for (uint32_t i = 0; i < draw_count; ++i)
+  {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    DrawList::Draw draw = { rng % pipeline_count, (rng >> 8) % material_count, (rng >> 16) % mesh_count, i };
+    list.Add(0, draw, (float)(rng >> 24) / 255.0f);
+  }
+}
+
+// 100k tiny draws over 16 pipelines, 256 materials and 64 meshes, recorded
+// three ways: in submission order binding everything for every draw, in
+// submission order skipping redundant binds, and radix sorted by key
+// skipping redundant binds.  Reports binds and recording time per frame.
+void RunDrawListBench(VulkanState& state)
+{
+  const uint32_t draw_count = 100000;
+  const uint32_t pipeline_count = 16;
+  const uint32_t material_count = 256;
+  const uint32_t mesh_count = 64;
+  const uint32_t frame_count = 16;
+  const VkDeviceSize material_stride = 256; // Covers minUniformBufferOffsetAlignment.
+  const VkExtent2D extent = { 512, 512 };
+  enum { MODE_EVERY_BIND, MODE_CACHED, MODE_SORTED, MODE_COUNT };
+  const char* const mode_names[MODE_COUNT] = { "unsorted, every bind", "unsorted, cached", "sorted, cached" };
+
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+  printf("Draw list: %u draws, %u pipelines, %u materials, %u meshes\n", draw_count, pipeline_count, material_count, mesh_count);
+
+  if (!state.LoadShaderModule("basic.vert.spv", &vertex_module) || !state.LoadShaderModule("basic.frag.spv", &frag_module))
+  {
+    vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+    printf("  skipped, no shaders\n");
+    return;
+  }
+
+  // Every mesh is a tiny triangle in its own vertex buffer, sharing one
+  // index buffer.
+  VkBuffer vertex_buffers[mesh_count] = {};
+  VkDeviceMemory vertex_memories[mesh_count] = {};
+  DrawMesh meshes[mesh_count] = {};
+  VkBuffer index_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory index_memory = VK_NULL_HANDLE;
+  const uint32_t triangle_indices[3] = { 0, 1, 2 };
+  state.CreateBuffer(sizeof(triangle_indices), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer, &index_memory);
+  state.UploadBuffer(index_buffer, triangle_indices, sizeof(triangle_indices));
+
+  for (uint32_t m = 0; m < mesh_count; ++m)
+  {
+    Vertex triangle[3];
+    memcpy(triangle, s_ClipSpaceTriangleVertices, sizeof(triangle));
+    Vec3 center(((m % 8) / 4.0f) - 0.875f, ((m / 8) / 4.0f) - 0.875f, 0.5f);
+
+    for (uint32_t v = 0; v < 3; ++v)
+    {
+      triangle[v].position = Vec3(center.x + (triangle[v].position.x * 0.02f), center.y + (triangle[v].position.y * 0.02f), center.z);
+    }
+
+    state.CreateBuffer(sizeof(triangle), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertex_buffers + m, vertex_memories + m);
+    state.UploadBuffer(vertex_buffers[m], triangle, sizeof(triangle));
+    meshes[m].vertex_buffer = vertex_buffers[m];
+    meshes[m].index_buffer = index_buffer;
+    meshes[m].index_count = 3;
+  }
+
+  // Materials are regions of one uniform buffer.  basic.vert declares the
+  // uniforms but doesn't read them, so the contents don't matter.
+  VkBuffer material_buffer = VK_NULL_HANDLE;
+  VkDeviceMemory material_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(material_stride * material_count, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &material_buffer, &material_memory);
+
+  VkDescriptorSetLayoutBinding layout_binding = {};
+  layout_binding.binding = 0;
+  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  layout_binding.descriptorCount = 1;
+  layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.bindingCount = 1;
+  descriptor_layout.pBindings = &layout_binding;
+  VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateDescriptorSetLayout(state.device, &descriptor_layout, &state.callbacks, &set_layout));
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.setLayoutCount = 1;
+  pipeline_layout_create_info.pSetLayouts = &set_layout;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_create_info, &state.callbacks, &pipeline_layout));
+
+  DescriptorAllocator descriptors;
+  descriptors.Create(state, 1);
+  VkDescriptorSet materials[material_count] = {};
+
+  for (uint32_t m = 0; m < material_count; ++m)
+  {
+    DescriptorBinding binding = {};
+    binding.binding = 0;
+    binding.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    binding.buffer.buffer = material_buffer;
+    binding.buffer.offset = m * material_stride;
+    binding.buffer.range = material_stride;
+    materials[m] = descriptors.Get(set_layout, &binding, 1);
+  }
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage color_image = VK_NULL_HANDLE;
+  VkDeviceMemory color_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &color_image, &color_memory);
+
+  DrawList list;
+  list.Create(draw_count);
+  DrawStateCache cache;
+  DrawListBenchPass bench_pass = {};
+  RenderGraph graph;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &color_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  uint32_t pass = graph.AddPass("draws", RecordDrawListBenchPass, &bench_pass);
+  graph.AddUse(pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.Compile(state);
+
+  // Identical pipelines, but separate objects as far as binding goes.
+  VkPipeline pipelines[pipeline_count] = {};
+
+  for (uint32_t p = 0; p < pipeline_count; ++p)
+  {
+    pipelines[p] = CreateVertexColorPipeline(state, graph.RenderPass(pass), pipeline_layout, vertex_module, frag_module);
+  }
+
+  DrawTables tables = {};
+  tables.pipelines = pipelines;
+  tables.layout = pipeline_layout;
+  tables.materials = materials;
+  tables.meshes = meshes;
+  tables.vertex_binding = 1;
+  tables.viewport.width = (float)extent.width;
+  tables.viewport.height = (float)extent.height;
+  tables.viewport.maxDepth = 1.0f;
+  tables.scissor.extent = extent;
+  bench_pass.list = &list;
+  bench_pass.tables = &tables;
+  bench_pass.cache = &cache;
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+  JobSystem jobs;
+  jobs.Create(JobSystem::DefaultWorkerCount());
+
+  for (uint32_t mode = 0; mode < MODE_COUNT; ++mode)
+  {
+    double sort_ms = 0.0;
+    bench_pass.record_ms = 0.0;
+    cache.enabled = (mode != MODE_EVERY_BIND);
+
+    // The first frame warms up and isn't counted.
+    for (uint32_t frame = 0; frame <= frame_count; ++frame)
+    {
+      if (frame == 1)
+      {
+        sort_ms = 0.0;
+        bench_pass.record_ms = 0.0;
+        cache.stats = {};
+      }
+
+      AddDrawListBenchDraws(list, draw_count, pipeline_count, material_count, mesh_count);
+
+      if (mode == MODE_SORTED)
+      {
+        double start_ms = GetTimeMs();
+        list.Sort(&jobs);
+        sort_ms += GetTimeMs() - start_ms;
+      }
+
+      VkCommandBufferBeginInfo cmd_buf_info = {};
+      cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+      graph.Execute(cmd, 0);
+      VK_CHECK(vkEndCommandBuffer(cmd));
+
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.commandBufferCount = 1;
+      submit_info.pCommandBuffers = &cmd;
+      VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+      VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+      VK_CHECK(vkResetFences(state.device, 1, &fence));
+    }
+
+    const DrawStateCache::Stats& stats = cache.stats;
+    printf("  %-21s %8.3f ms recording, %6.3f ms sorting, %7u binds per frame\n", mode_names[mode], bench_pass.record_ms / frame_count, sort_ms / frame_count, cache.Binds() / frame_count);
+    printf("    pipelines %u, descriptor sets %u, vertex buffers %u, index buffers %u, viewports %u, scissors %u, skipped %u\n",
+      stats.pipeline_binds / frame_count, stats.descriptor_binds / frame_count, stats.vertex_binds / frame_count, stats.index_binds / frame_count,
+      stats.viewport_sets / frame_count, stats.scissor_sets / frame_count, stats.skipped / frame_count);
+  }
+
+  // The same sort on one thread, for what the workers bought.
+  double sort_ms = 0.0;
+
+  for (uint32_t frame = 0; frame < frame_count; ++frame)
+  {
+    AddDrawListBenchDraws(list, draw_count, pipeline_count, material_count, mesh_count);
+    double start_ms = GetTimeMs();
+    list.Sort(nullptr);
+    sort_ms += GetTimeMs() - start_ms;
+  }
+
+  printf("  sorting on 1 thread: %.3f ms, on %u workers above\n", sort_ms / frame_count, jobs.worker_count);
+
+  jobs.Destroy();
+  vkDestroyFence(state.device, fence, &state.callbacks);
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+
+  for (uint32_t p = 0; p < pipeline_count; ++p)
+  {
+    vkDestroyPipeline(state.device, pipelines[p], &state.callbacks);
+  }
+
+  graph.Destroy();
+  list.Destroy();
+  vkDestroyImage(state.device, color_image, &state.callbacks);
+  vkFreeMemory(state.device, color_memory, &state.callbacks);
+  descriptors.Destroy();
+  vkDestroyPipelineLayout(state.device, pipeline_layout, &state.callbacks);
+  vkDestroyDescriptorSetLayout(state.device, set_layout, &state.callbacks);
+  vkDestroyBuffer(state.device, material_buffer, &state.callbacks);
+  vkFreeMemory(state.device, material_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, index_buffer, &state.callbacks);
+  vkFreeMemory(state.device, index_memory, &state.callbacks);
+
+  for (uint32_t m = 0; m < mesh_count; ++m)
+  {
+    vkDestroyBuffer(state.device, vertex_buffers[m], &state.callbacks);
+    vkFreeMemory(state.device, vertex_memories[m], &state.callbacks);
+  }
+
+  vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+  vkDestroyShaderModule(state.device, frag_module, &state.callbacks);
+}
+
+// Renders Vertex triangles on the CPU the way basic.vert and basic.frag
+// would with CubeUniforms applied: clip = clip_from_view * view_from_world *
+// world_from_obj * position, perspective-correct color interpolation, a
+// LESS_OR_EQUAL depth test with depth writes, no culling, and Vulkan's
+// viewport and top-left fill rule, into RGBA8 texels laid out like a
+// VK_FORMAT_R8G8B8A8_UNORM image.
+//
+// Draw() transforms, clips against the near and far planes and sets up
+// triangles on the calling thread.  Flush() bins them into 64x64 tiles and
+// rasterizes each tile as its own job, four pixels at a time with SSE edge
+// functions.  Tiles keep their triangles in submission order, so the result
+// doesn't depend on the worker count.
+struct CpuRasterizer
+{
+  static const uint32_t s_TileSize = 64;
+
+  struct Triangle
+  {
+    float edge_a[3]; // Edge i, opposite vertex i: e = a x + b y + c, positive inside.
+    float edge_b[3];
+    float edge_c[3];
+    uint32_t top_left[3]; // ~0u where e == 0 counts as inside.
+    float inv_area;
+    float z[3];
+    float inv_w[3];
+    float color_over_w[3][4];
+    int32_t min_x;
+    int32_t min_y;
+    int32_t max_x;
+    int32_t max_y;
+  };
+
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t stride = 0; // Texels per row, a multiple of 4.
+  uint32_t tiles_x = 0;
+  uint32_t tiles_y = 0;
+  uint32_t* color = nullptr;
+  float* depth = nullptr;
+  Triangle* triangles = nullptr;
+  uint32_t triangle_count = 0;
+  uint32_t max_triangles = 0;
+  uint32_t* bin_offsets = nullptr; // Per tile, then one past the end.
+  uint32_t* bins = nullptr;        // Triangle indices, tile by tile.
+  uint32_t bin_capacity = 0;
+  uint64_t* tile_fragments = nullptr; // Fragments that passed coverage, per tile.
+  uint64_t fragments = 0;
+  JobSystem* jobs = nullptr; // Rasterizes on the calling thread when null.
+
+  void Create(uint32_t target_width, uint32_t target_height, uint32_t triangle_capacity);
+  void Destroy();
+  void Clear(uint32_t clear_color, float clear_depth);
+  void Draw(const Vertex* vertices, const uint32_t* indices, uint32_t index_count, const CubeUniforms& uniforms);
+  void Flush();
+  void SetupTriangle(const Vec4* clip, const float (*colors)[4]);
+  void RasterTile(uint32_t tile);
+  static void RasterTileJob(void* data, uint32_t begin, uint32_t end);
+  static uint32_t PackColor(const float* color);
+
+  // Tests.
+  static void TestCoverage();
+  static void TestDepthTest();
+  static void TestInterpolation();
+  static void RunAllTests();
+};
+
+void CpuRasterizer::Create(uint32_t target_width, uint32_t target_height, uint32_t triangle_capacity)
+{
+  width = target_width;
+  height = target_height;
+  stride = (width + 3) & ~3u;
+  tiles_x = (width + s_TileSize - 1) / s_TileSize;
+  tiles_y = (height + s_TileSize - 1) / s_TileSize;
+  color = (uint32_t*)Alloc(sizeof(uint32_t) * stride * height, 16);
+  depth = (float*)Alloc(sizeof(float) * stride * height, 16);
+  max_triangles = triangle_capacity;
+  triangles = (Triangle*)Alloc(sizeof(Triangle) * max_triangles, 16);
+  triangle_count = 0;
+  bin_offsets = (uint32_t*)Alloc(sizeof(uint32_t) * ((tiles_x * tiles_y) + 1), 16);
+  bin_capacity = max_triangles;
+  bins = (uint32_t*)Alloc(sizeof(uint32_t) * bin_capacity, 16);
+  tile_fragments = (uint64_t*)Alloc(sizeof(uint64_t) * tiles_x * tiles_y, 16);
+  fragments = 0;
+}
+
+void CpuRasterizer::Destroy()
+{
+  Free(color);
+  Free(depth);
+  Free(triangles);
+  Free(bin_offsets);
+  Free(bins);
+  Free(tile_fragments);
+  color = nullptr;
+  depth = nullptr;
+  triangles = nullptr;
+  bin_offsets = nullptr;
+  bins = nullptr;
+  tile_fragments = nullptr;
+}
+
+void CpuRasterizer::Clear(uint32_t clear_color, float clear_depth)
+{
+  for (uint32_t i = 0; i < stride * height; ++i)
+  {
+    color[i] = clear_color;
+    depth[i] = clear_depth;
+  }
+
+  triangle_count = 0;
+  fragments = 0;
+}
+
+uint32_t CpuRasterizer::PackColor(const float* color)
+{
+  uint32_t packed = 0;
+
+  for (uint32_t c = 0; c < 4; ++c)
+  {
+    float v = (color[c] < 0.0f) ? 0.0f : ((color[c] > 1.0f) ? 1.0f : color[c]);
+    packed |= (uint32_t)((v * 255.0f) + 0.5f) << (c * 8);
+  }
+
+  return packed;
+}
+
+// The triangle list indexed by indices, or vertices in order without them.
+void CpuRasterizer::Draw(const Vertex* vertices, const uint32_t* indices, uint32_t index_count, const CubeUniforms& uniforms)
+{
+  Mat4 clip_from_obj = uniforms.clip_from_view * (uniforms.view_from_world * uniforms.world_from_obj).ToMat4();
+
+  for (uint32_t i = 0; i + 2 < index_count; i += 3)
+  {
+    // Clip against 0 <= z <= w, which is all that Vulkan's clipping does
+    // that the viewport and tile bounds don't.
+    Vec4 polygon[2][5];
+    float colors[2][5][4];
+    uint32_t count = 3;
+
+    for (uint32_t v = 0; v < 3; ++v)
+    {
+      const Vertex& vertex = vertices[indices ? indices[i + v] : (i + v)];
+      polygon[0][v] = clip_from_obj * Vec4(vertex.position.x, vertex.position.y, vertex.position.z, 1.0f);
+      memcpy(colors[0][v], vertex.color, sizeof(vertex.color));
+    }
+
+    uint32_t in = 0;
+
+    for (uint32_t plane = 0; (plane < 2) && (count >= 3); ++plane)
+    {
+      uint32_t out_count = 0;
+
+      for (uint32_t v = 0; v < count; ++v)
+      {
+        const Vec4& a = polygon[in][v];
+        const Vec4& b = polygon[in][(v + 1) % count];
+        float da = plane ? (a.w - a.z) : a.z;
+        float db = plane ? (b.w - b.z) : b.z;
+
+        if (da >= 0.0f)
+        {
+          polygon[in ^ 1][out_count] = a;
+          memcpy(colors[in ^ 1][out_count++], colors[in][v], sizeof(colors[0][0]));
+        }
+
+        if ((da >= 0.0f) != (db >= 0.0f))
+        {
+          float t = da / (da - db);
+          const float* ca = colors[in][v];
+          const float* cb = colors[in][(v + 1) % count];
+          polygon[in ^ 1][out_count] = Vec4(a.x + ((b.x - a.x) * t), a.y + ((b.y - a.y) * t), a.z + ((b.z - a.z) * t), a.w + ((b.w - a.w) * t));
+
+          for (uint32_t c = 0; c < 4; ++c)
+          {
+            colors[in ^ 1][out_count][c] = ca[c] + ((cb[c] - ca[c]) * t);
+          }
+
+          ++out_count;
+        }
+      }
+
+      count = out_count;
+      in ^= 1;
+    }
+
+    for (uint32_t v = 1; v + 1 < count; ++v)
+    {
+      const Vec4 clip[3] = { polygon[in][0], polygon[in][v], polygon[in][v + 1] };
+      const float triangle_colors[3][4] = {
+        { colors[in][0][0], colors[in][0][1], colors[in][0][2], colors[in][0][3] },
+        { colors[in][v][0], colors[in][v][1], colors[in][v][2], colors[in][v][3] },
+        { colors[in][v + 1][0], colors[in][v + 1][1], colors[in][v + 1][2], colors[in][v + 1][3] } };
+      SetupTriangle(clip, triangle_colors);
+    }
+  }
+}
+
+// Projects a clipped triangle to the viewport and queues it for Flush().
+void CpuRasterizer::SetupTriangle(const Vec4* clip, const float (*colors)[4])
+{
+  float x[3];
+  float y[3];
+  Triangle triangle = {};
+
+  for (uint32_t v = 0; v < 3; ++v)
+  {
+    if (clip[v].w <= 0.0f)
+    {
+      return;
+    }
+
+    float inv_w = 1.0f / clip[v].w;
+    x[v] = ((clip[v].x * inv_w * 0.5f) + 0.5f) * width;
+    y[v] = ((clip[v].y * inv_w * 0.5f) + 0.5f) * height;
+    triangle.z[v] = clip[v].z * inv_w;
+    triangle.inv_w[v] = inv_w;
+
+    for (uint32_t c = 0; c < 4; ++c)
+    {
+      triangle.color_over_w[v][c] = colors[v][c] * inv_w;
+    }
+  }
+
+  // No culling: clockwise triangles are flipped so inside is positive.
+  float area = ((x[2] - x[1]) * (y[0] - y[1])) - ((y[2] - y[1]) * (x[0] - x[1]));
+
+  if (area == 0.0f)
+  {
+    return;
+  }
+
+  uint32_t order[3] = { 0, 1, 2 };
+
+  if (area < 0.0f)
+  {
+    order[1] = 2;
+    order[2] = 1;
+    area = -area;
+  }
+
+  Triangle setup = triangle;
+
+  for (uint32_t v = 0; v < 3; ++v)
+  {
+    setup.z[v] = triangle.z[order[v]];
+    setup.inv_w[v] = triangle.inv_w[order[v]];
+    memcpy(setup.color_over_w[v], triangle.color_over_w[order[v]], sizeof(setup.color_over_w[v]));
+  }
+
+  // Pixels are sampled at their centers.  Pixels exactly on an edge belong
+  // to the triangle if it's a left edge or a top edge.
+  for (uint32_t e = 0; e < 3; ++e)
+  {
+    uint32_t j = order[(e + 1) % 3];
+    uint32_t k = order[(e + 2) % 3];
+    float a = y[j] - y[k];
+    float b = x[k] - x[j];
+    bool top_left = (a > 0.0f) || ((a == 0.0f) && (b > 0.0f));
+    setup.edge_a[e] = a;
+    setup.edge_b[e] = b;
+    setup.edge_c[e] = -((a * (x[j] - 0.5f)) + (b * (y[j] - 0.5f)));
+    setup.top_left[e] = top_left ? ~0u : 0u;
+  }
+
+  setup.inv_area = 1.0f / area;
+  float min_x = (x[0] < x[1]) ? ((x[0] < x[2]) ? x[0] : x[2]) : ((x[1] < x[2]) ? x[1] : x[2]);
+  float max_x = (x[0] > x[1]) ? ((x[0] > x[2]) ? x[0] : x[2]) : ((x[1] > x[2]) ? x[1] : x[2]);
+  float min_y = (y[0] < y[1]) ? ((y[0] < y[2]) ? y[0] : y[2]) : ((y[1] < y[2]) ? y[1] : y[2]);
+  float max_y = (y[0] > y[1]) ? ((y[0] > y[2]) ? y[0] : y[2]) : ((y[1] > y[2]) ? y[1] : y[2]);
+  setup.min_x = (min_x < 0.0f) ? 0 : (int32_t)min_x;
+  setup.min_y = (min_y < 0.0f) ? 0 : (int32_t)min_y;
+  setup.max_x = (max_x >= (float)width) ? (int32_t)width - 1 : (int32_t)max_x;
+  setup.max_y = (max_y >= (float)height) ? (int32_t)height - 1 : (int32_t)max_y;
+
+  if ((setup.min_x > setup.max_x) || (setup.min_y > setup.max_y))
+  {
+    return;
+  }
+
+  if (triangle_count == max_triangles)
+  {
+    Flush();
+  }
+
+  triangles[triangle_count++] = setup;
+}
+
+// Rasterizes everything drawn since the last Flush().
+void CpuRasterizer::Flush()
+{
+  uint32_t tile_count = tiles_x * tiles_y;
+  memset(bin_offsets, 0, sizeof(uint32_t) * (tile_count + 1));
+
+  // Count, prefix sum, then fill, so each tile's list stays in draw order.
+  for (uint32_t t = 0; t < triangle_count; ++t)
+  {
+    const Triangle& triangle = triangles[t];
+
+    for (int32_t ty = triangle.min_y / s_TileSize; ty <= triangle.max_y / (int32_t)s_TileSize; ++ty)
+    {
+      for (int32_t tx = triangle.min_x / s_TileSize; tx <= triangle.max_x / (int32_t)s_TileSize; ++tx)
+      {
+        ++bin_offsets[(ty * tiles_x) + tx + 1];
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < tile_count; ++i)
+  {
+    bin_offsets[i + 1] += bin_offsets[i];
+  }
+
+  if (bin_offsets[tile_count] > bin_capacity)
+  {
+    Free(bins);
+    bin_capacity = bin_offsets[tile_count] * 2;
+    bins = (uint32_t*)Alloc(sizeof(uint32_t) * bin_capacity, 16);
+  }
+
+  for (uint32_t t = 0; t < triangle_count; ++t)
+  {
+    const Triangle& triangle = triangles[t];
+
+    for (int32_t ty = triangle.min_y / s_TileSize; ty <= triangle.max_y / (int32_t)s_TileSize; ++ty)
+    {
+      for (int32_t tx = triangle.min_x / s_TileSize; tx <= triangle.max_x / (int32_t)s_TileSize; ++tx)
+      {
+        bins[bin_offsets[(ty * tiles_x) + tx]++] = t;
+      }
+    }
+  }
+
+  // The fill moved each offset to the start of the next tile.
+  for (uint32_t i = tile_count; i > 0; --i)
+  {
+    bin_offsets[i] = bin_offsets[i - 1];
+  }
+
+  bin_offsets[0] = 0;
+
+  if (jobs)
+  {
+    JobCounter counter;
+    jobs->ParallelFor(tile_count, 1, RasterTileJob, this, &counter);
+    jobs->Wait(&counter);
+  }
+  else
+  {
+    RasterTileJob(this, 0, tile_count);
+  }
+
+  for (uint32_t i = 0; i < tile_count; ++i)
+  {
+    fragments += tile_fragments[i];
+  }
+
+  triangle_count = 0;
+}
+
+void CpuRasterizer::RasterTileJob(void* data, uint32_t begin, uint32_t end)
+{
+  CpuRasterizer& rasterizer = *(CpuRasterizer*)data;
+
+  for (uint32_t tile = begin; tile < end; ++tile)
+  {
+    rasterizer.RasterTile(tile);
+  }
+}
+
+static const uint8_t s_LaneCounts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+void CpuRasterizer::RasterTile(uint32_t tile)
+{
+  const int32_t tile_x = (tile % tiles_x) * s_TileSize;
+  const int32_t tile_y = (tile / tiles_x) * s_TileSize;
+  const int32_t tile_max_x = ((tile_x + (int32_t)s_TileSize) < (int32_t)width) ? (tile_x + s_TileSize - 1) : (width - 1);
+  const int32_t tile_max_y = ((tile_y + (int32_t)s_TileSize) < (int32_t)height) ? (tile_y + s_TileSize - 1) : (height - 1);
+  const __m128 lane_offsets = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(255.0f);
+  uint64_t tile_fragment_count = 0;
+
+  for (uint32_t b = bin_offsets[tile]; b < bin_offsets[tile + 1]; ++b)
+  {
+    const Triangle& triangle = triangles[bins[b]];
+    int32_t min_x = (triangle.min_x > tile_x) ? triangle.min_x : tile_x;
+    int32_t min_y = (triangle.min_y > tile_y) ? triangle.min_y : tile_y;
+    int32_t max_x = (triangle.max_x < tile_max_x) ? triangle.max_x : tile_max_x;
+    int32_t max_y = (triangle.max_y < tile_max_y) ? triangle.max_y : tile_max_y;
+    min_x &= ~3; // Rows start on a 4 texel boundary; the masks trim the rest.
+    __m128 a[3];
+    __m128 top_left[3];
+    __m128 step[3];
+    __m128 z[3];
+    __m128 inv_w[3];
+    __m128 color_over_w[3][4];
+
+    for (uint32_t e = 0; e < 3; ++e)
+    {
+      a[e] = _mm_set1_ps(triangle.edge_a[e]);
+      top_left[e] = _mm_castsi128_ps(_mm_set1_epi32((int)triangle.top_left[e]));
+      step[e] = _mm_set1_ps(triangle.edge_a[e] * 4.0f);
+      z[e] = _mm_set1_ps(triangle.z[e]);
+      inv_w[e] = _mm_set1_ps(triangle.inv_w[e]);
+
+      for (uint32_t c = 0; c < 4; ++c)
+      {
+        color_over_w[e][c] = _mm_set1_ps(triangle.color_over_w[e][c]);
+      }
+    }
+
+    const __m128 inv_area = _mm_set1_ps(triangle.inv_area);
+    const __m128i max_lane = _mm_set1_epi32(max_x);
+
+    for (int32_t y = min_y; y <= max_y; ++y)
+    {
+      __m128 edge[3];
+
+      for (uint32_t e = 0; e < 3; ++e)
+      {
+        float row = (triangle.edge_a[e] * min_x) + (triangle.edge_b[e] * y) + triangle.edge_c[e];
+        edge[e] = _mm_add_ps(_mm_set1_ps(row), _mm_mul_ps(a[e], lane_offsets));
+      }
+
+      uint32_t* color_row = color + ((size_t)y * stride);
+      float* depth_row = depth + ((size_t)y * stride);
+
+      for (int32_t x = min_x; x <= max_x; x += 4)
+      {
+        __m128i lanes = _mm_add_epi32(_mm_set1_epi32(x), _mm_set_epi32(3, 2, 1, 0));
+        __m128 inside = _mm_cmpeq_ps(zero, zero);
+
+        for (uint32_t e = 0; e < 3; ++e)
+        {
+          __m128 on_edge = _mm_and_ps(_mm_cmpeq_ps(edge[e], zero), top_left[e]);
+          inside = _mm_and_ps(inside, _mm_or_ps(_mm_cmpgt_ps(edge[e], zero), on_edge));
+        }
+
+        inside = _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(lanes, max_lane)), inside);
+
+        if (_mm_movemask_ps(inside))
+        {
+          __m128 b0 = _mm_mul_ps(edge[0], inv_area);
+          __m128 b1 = _mm_mul_ps(edge[1], inv_area);
+          __m128 b2 = _mm_mul_ps(edge[2], inv_area);
+          __m128 pixel_z = _mm_add_ps(_mm_mul_ps(b0, z[0]), _mm_add_ps(_mm_mul_ps(b1, z[1]), _mm_mul_ps(b2, z[2])));
+          __m128 old_z = _mm_load_ps(depth_row + x);
+          tile_fragment_count += s_LaneCounts[_mm_movemask_ps(inside)];
+          __m128 pass = _mm_and_ps(inside, _mm_cmple_ps(pixel_z, old_z));
+
+          if (_mm_movemask_ps(pass))
+          {
+            __m128 w = _mm_div_ps(one, _mm_add_ps(_mm_mul_ps(b0, inv_w[0]), _mm_add_ps(_mm_mul_ps(b1, inv_w[1]), _mm_mul_ps(b2, inv_w[2]))));
+            __m128i packed = _mm_setzero_si128();
+
+            for (uint32_t c = 0; c < 4; ++c)
+            {
+              __m128 value = _mm_add_ps(_mm_mul_ps(b0, color_over_w[0][c]), _mm_add_ps(_mm_mul_ps(b1, color_over_w[1][c]), _mm_mul_ps(b2, color_over_w[2][c])));
+              value = _mm_min_ps(_mm_max_ps(_mm_mul_ps(value, w), zero), one);
+              __m128i channel = _mm_cvtps_epi32(_mm_mul_ps(value, scale));
+              packed = _mm_or_si128(packed, _mm_slli_epi32(channel, c * 8));
+            }
+
+            __m128i pass_mask = _mm_castps_si128(pass);
+            __m128i old_color = _mm_load_si128((const __m128i*)(color_row + x));
+            _mm_store_si128((__m128i*)(color_row + x), _mm_or_si128(_mm_and_si128(pass_mask, packed), _mm_andnot_si128(pass_mask, old_color)));
+            _mm_store_ps(depth_row + x, _mm_or_ps(_mm_and_ps(pass, pixel_z), _mm_andnot_ps(pass, old_z)));
+          }
+        }
+
+        for (uint32_t e = 0; e < 3; ++e)
+        {
+          edge[e] = _mm_add_ps(edge[e], step[e]);
+        }
+      }
+    }
+  }
+
+  tile_fragments[tile] = tile_fragment_count;
+}
+
+static CubeUniforms IdentityCubeUniforms()
+{
+  CubeUniforms uniforms;
+  uniforms.world_from_obj.SetIdentity();
+  uniforms.view_from_world.SetIdentity();
+  uniforms.clip_from_view.SetIdentity();
+  return uniforms;
+}
+
+void CpuRasterizer::TestCoverage()
+{
+  // Two triangles sharing a diagonal cover every pixel exactly once, on a
+  // target whose width isn't a multiple of 4 and that spans several tiles.
+  const Vertex quad[6] = {
+    {{-1.0f, -1.0f, 0.5f}, {1.0f, 0.0f, 0.0f, 1.0f}}, {{1.0f, -1.0f, 0.5f}, {1.0f, 0.0f, 0.0f, 1.0f}}, {{1.0f, 1.0f, 0.5f}, {1.0f, 0.0f, 0.0f, 1.0f}},
+    {{-1.0f, -1.0f, 0.5f}, {0.0f, 1.0f, 0.0f, 1.0f}}, {{1.0f, 1.0f, 0.5f}, {0.0f, 1.0f, 0.0f, 1.0f}}, {{-1.0f, 1.0f, 0.5f}, {0.0f, 1.0f, 0.0f, 1.0f}} };
+  CpuRasterizer rasterizer;
+  rasterizer.Create(130, 70, 16);
+  rasterizer.Clear(0, 1.0f);
+  rasterizer.Draw(quad, nullptr, 6, IdentityCubeUniforms());
+  rasterizer.Flush();
+  FailIfNotExpected(130ull * 70ull, (unsigned long long)rasterizer.fragments, __FUNCTION__);
+
+  for (uint32_t y = 0; y < 70; ++y)
+  {
+    for (uint32_t x = 0; x < 130; ++x)
+    {
+      FailIfNotExpected(true, rasterizer.color[(y * rasterizer.stride) + x] != 0, __FUNCTION__);
+    }
+  }
+
+  // Off screen and behind the camera draw nothing.
+  const Vertex hidden[6] = {
+    {{2.0f, 2.0f, 0.5f}, {1.0f, 1.0f, 1.0f, 1.0f}}, {{3.0f, 2.0f, 0.5f}, {1.0f, 1.0f, 1.0f, 1.0f}}, {{2.0f, 3.0f, 0.5f}, {1.0f, 1.0f, 1.0f, 1.0f}},
+    {{-1.0f, -1.0f, -0.5f}, {1.0f, 1.0f, 1.0f, 1.0f}}, {{1.0f, -1.0f, -0.5f}, {1.0f, 1.0f, 1.0f, 1.0f}}, {{0.0f, 1.0f, -0.5f}, {1.0f, 1.0f, 1.0f, 1.0f}} };
+  rasterizer.Clear(0, 1.0f);
+  rasterizer.Draw(hidden, nullptr, 6, IdentityCubeUniforms());
+  rasterizer.Flush();
+  FailIfNotExpected(0ull, (unsigned long long)rasterizer.fragments, __FUNCTION__);
+  rasterizer.Destroy();
+}
+
+void CpuRasterizer::TestDepthTest()
+{
+  const Vertex near_triangle[3] = { {{0.0f, -1.0f, 0.25f}, {1.0f, 0.0f, 0.0f, 1.0f}}, {{1.0f, 1.0f, 0.25f}, {1.0f, 0.0f, 0.0f, 1.0f}}, {{-1.0f, 1.0f, 0.25f}, {1.0f, 0.0f, 0.0f, 1.0f}} };
+  const Vertex far_triangle[3] = { {{0.0f, -1.0f, 0.75f}, {0.0f, 1.0f, 0.0f, 1.0f}}, {{1.0f, 1.0f, 0.75f}, {0.0f, 1.0f, 0.0f, 1.0f}}, {{-1.0f, 1.0f, 0.75f}, {0.0f, 1.0f, 0.0f, 1.0f}} };
+  const Vertex equal_triangle[3] = { {{0.0f, -1.0f, 0.25f}, {0.0f, 0.0f, 1.0f, 1.0f}}, {{1.0f, 1.0f, 0.25f}, {0.0f, 0.0f, 1.0f, 1.0f}}, {{-1.0f, 1.0f, 0.25f}, {0.0f, 0.0f, 1.0f, 1.0f}} };
+  const uint32_t red = 0xff0000ffu;
+  const uint32_t blue = 0xffff0000u;
+  CpuRasterizer rasterizer;
+  rasterizer.Create(32, 32, 16);
+  rasterizer.Clear(0, 1.0f);
+
+  // Nearer wins whatever the order, and LESS_OR_EQUAL lets an equal depth
+  // drawn later through.
+  rasterizer.Draw(near_triangle, nullptr, 3, IdentityCubeUniforms());
+  rasterizer.Draw(far_triangle, nullptr, 3, IdentityCubeUniforms());
+  rasterizer.Flush();
+  FailIfNotExpected(red, rasterizer.color[(16 * rasterizer.stride) + 16], __FUNCTION__);
+  FailIfNotExpected(0.25f, rasterizer.depth[(16 * rasterizer.stride) + 16], __FUNCTION__);
+  rasterizer.Draw(equal_triangle, nullptr, 3, IdentityCubeUniforms());
+  rasterizer.Flush();
+  FailIfNotExpected(blue, rasterizer.color[(16 * rasterizer.stride) + 16], __FUNCTION__);
+  rasterizer.Destroy();
+}
+
+void CpuRasterizer::TestInterpolation()
+{
+  // Red on the left edge to blue on the right, through the uniforms: the
+  // quad is half size, moved right by half, so it covers x in [0, 1].
+  const Vertex quad[6] = {
+    {{-1.0f, -1.0f, 0.5f}, {1.0f, 0.0f, 0.0f, 1.0f}}, {{1.0f, -1.0f, 0.5f}, {0.0f, 0.0f, 1.0f, 1.0f}}, {{1.0f, 1.0f, 0.5f}, {0.0f, 0.0f, 1.0f, 1.0f}},
+    {{-1.0f, -1.0f, 0.5f}, {1.0f, 0.0f, 0.0f, 1.0f}}, {{1.0f, 1.0f, 0.5f}, {0.0f, 0.0f, 1.0f, 1.0f}}, {{-1.0f, 1.0f, 0.5f}, {1.0f, 0.0f, 0.0f, 1.0f}} };
+  CubeUniforms uniforms = IdentityCubeUniforms();
+  uniforms.world_from_obj.m[0] = 0.5f;
+  uniforms.world_from_obj.m[5] = 0.5f;
+  uniforms.view_from_world.SetPosition(Vec3(0.5f, 0.5f, 0.0f));
+  CpuRasterizer rasterizer;
+  rasterizer.Create(64, 64, 16);
+  rasterizer.Clear(0, 1.0f);
+  rasterizer.Draw(quad, nullptr, 6, uniforms);
+  rasterizer.Flush();
+
+  uint32_t left = rasterizer.color[(48 * rasterizer.stride) + 32];
+  uint32_t middle = rasterizer.color[(48 * rasterizer.stride) + 48];
+  FailIfNotExpected(0u, rasterizer.color[(16 * rasterizer.stride) + 16], __FUNCTION__);
+  FailIfNotExpected(true, (left & 0xff) >= 250, __FUNCTION__);
+  FailIfNotExpected(true, ((middle & 0xff) >= 120) && ((middle & 0xff) <= 135), __FUNCTION__);
+  FailIfNotExpected(true, (((middle >> 16) & 0xff) >= 120) && (((middle >> 16) & 0xff) <= 135), __FUNCTION__);
+  rasterizer.Destroy();
+}
+
+void CpuRasterizer::RunAllTests()
+{
+  TestCoverage();
+  TestDepthTest();
+  TestInterpolation();
+}
+
+// The depth prepass bench's sphere stack, rendered by CpuRasterizer at each
+// worker count and, with a device, by Vulkan through meshlet.vert and
+// basic.frag with the same transforms.  On a machine without a GPU the
+// device is usually lavapipe, which makes it a CPU against CPU comparison.
+// The last Vulkan frame is read back and compared with the CPU's.
+void RunCpuRasterBench(VulkanState* state)
+{
+  const uint32_t layers = 16;
+  const uint32_t grid = 6;
+  const uint32_t rings = 12;
+  const uint32_t segments = 12;
+  const uint32_t frame_count = 16;
+  const VkExtent2D extent = { 1024, 1024 };
+
+  uint32_t sphere_vertices = (rings + 1) * (segments + 1);
+  uint32_t sphere_indices = rings * segments * 6;
+  Vertex* vertices = (Vertex*)Alloc(sizeof(Vertex) * sphere_vertices * grid * grid * layers, 16);
+  uint32_t* indices = (uint32_t*)Alloc(sizeof(uint32_t) * sphere_indices * grid * grid * layers, 16);
+  uint32_t vertex_count = 0;
+  uint32_t index_count = 0;
+
+  for (uint32_t l = layers; l-- > 0;)
+  {
+    for (uint32_t i = 0; i < grid * grid; ++i)
+    {
+      const float color[4] = { (float)l / layers, (float)(i % grid) / grid, (float)(i / grid) / grid, 1.0f };
+      float offset = (l % 2) ? 0.5f : 0.0f;
+      Vec3 center((((i % grid) + offset) * 1.5f) - (grid * 0.75f), (((i / grid) + offset) * 1.5f) - (grid * 0.75f), 4.0f + l);
+      AppendSphere(center, 1.0f, rings, segments, color, vertices, &vertex_count, indices, &index_count);
+    }
+  }
+
+  CubeUniforms uniforms;
+  uniforms.world_from_obj.SetIdentity();
+  uniforms.view_from_world.SetIdentity();
+  uniforms.view_from_world.SetPosition(Vec3(0.0f, 0.0f, 1.0f));
+  uniforms.clip_from_view.SetPerspective(1.5707964f, (float)extent.width / extent.height, 0.1f, 100.0f);
+  printf("CPU raster: %ux%u, %u triangles\n", extent.width, extent.height, index_count / 3);
+
+  CpuRasterizer rasterizer;
+  rasterizer.Create(extent.width, extent.height, 16384);
+  uint32_t max_workers = JobSystem::DefaultWorkerCount();
+  double pixels = (double)extent.width * extent.height;
+
+  for (uint32_t workers = 1;; workers = ((workers * 2) < max_workers) ? (workers * 2) : max_workers)
+  {
+    // One worker is the calling thread alone, without a job system.
+    JobSystem jobs;
+    rasterizer.jobs = nullptr;
+
+    if (workers > 1)
+    {
+      jobs.Create(workers);
+      rasterizer.jobs = &jobs;
+    }
+
+    double start_ms = 0.0;
+
+    // The first frame warms up and isn't counted.
+    for (uint32_t frame = 0; frame <= frame_count; ++frame)
+    {
+      if (frame == 1)
+      {
+        start_ms = GetTimeMs();
+      }
+
+      rasterizer.Clear(0, 1.0f);
+      rasterizer.Draw(vertices, indices, index_count, uniforms);
+      rasterizer.Flush();
+    }
+
+    printf("  CPU, %2u worker%s %8.3f ms per frame, %.2f fragments per pixel\n", workers, (workers == 1) ? ": " : "s:", (GetTimeMs() - start_ms) / frame_count, rasterizer.fragments / pixels);
+
+    if (workers > 1)
+    {
+      jobs.Destroy();
+    }
+
+    if (workers >= max_workers)
+    {
+      break;
+    }
+  }
+
+  rasterizer.jobs = nullptr;
+
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+
+  if (!state)
+  {
+    printf("  Vulkan skipped, no device\n");
+  }
+  else if (!state->LoadShaderModule("meshlet.vert.spv", &vertex_module) || !state->LoadShaderModule("basic.frag.spv", &frag_module))
+  {
+    vkDestroyShaderModule(state->device, vertex_module, &state->callbacks);
+    printf("  Vulkan skipped, no shaders\n");
+  }
+  else
+  {
+    VkBuffer vertex_buffer = VK_NULL_HANDLE;
+    VkDeviceMemory vertex_memory = VK_NULL_HANDLE;
+    VkBuffer index_buffer = VK_NULL_HANDLE;
+    VkDeviceMemory index_memory = VK_NULL_HANDLE;
+    state->CreateBuffer(sizeof(Vertex) * vertex_count, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertex_buffer, &vertex_memory);
+    state->CreateBuffer(sizeof(uint32_t) * index_count, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer, &index_memory);
+    state->UploadBuffer(vertex_buffer, vertices, sizeof(Vertex) * vertex_count);
+    state->UploadBuffer(index_buffer, indices, sizeof(uint32_t) * index_count);
+
+    VkBuffer readback_buffer = VK_NULL_HANDLE;
+    VkDeviceMemory readback_memory = VK_NULL_HANDLE;
+    uint8_t* readback = nullptr;
+    state->CreateBuffer(pixels * 4, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &readback_buffer, &readback_memory);
+    VK_CHECK(vkMapMemory(state->device, readback_memory, 0, VK_WHOLE_SIZE, 0, (void**)&readback));
+
+    VkPushConstantRange push_constant_range = {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    push_constant_range.size = sizeof(Mat4);
+
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+    pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+    VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+    VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &pipeline_layout));
+
+    VkImageCreateInfo image_create_info = {};
+    image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_create_info.imageType = VK_IMAGE_TYPE_2D;
+    image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+    image_create_info.extent.width = extent.width;
+    image_create_info.extent.height = extent.height;
+    image_create_info.extent.depth = 1;
+    image_create_info.mipLevels = 1;
+    image_create_info.arrayLayers = 1;
+    image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkImage color_image = VK_NULL_HANDLE;
+    VkDeviceMemory color_memory = VK_NULL_HANDLE;
+    state->CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &color_image, &color_memory);
+
+    PrepassBenchPass pass = {};
+    RenderGraph graph;
+    uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &color_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    uint32_t depth = graph.CreateImage("depth", VK_FORMAT_D32_SFLOAT, extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+    uint32_t scene_pass = graph.AddPass("scene", RecordPrepassBenchPass, &pass);
+    graph.AddUse(scene_pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+    graph.AddUse(scene_pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+    graph.Compile(*state);
+
+    pass.pipeline = CreateVertexColorPipeline(*state, graph.RenderPass(scene_pass), pipeline_layout, vertex_module, frag_module, true);
+    pass.pipeline_layout = pipeline_layout;
+    pass.vertex_buffer = vertex_buffer;
+    pass.vertex_binding = 1;
+    pass.index_buffer = index_buffer;
+    pass.index_count = index_count;
+    pass.clip_from_world = uniforms.clip_from_view * (uniforms.view_from_world * uniforms.world_from_obj).ToMat4();
+    pass.extent = extent;
+
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.queueFamilyIndex = state->queue_family_index;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    VkCommandPool cmd_pool = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateCommandPool(state->device, &cmd_pool_info, &state->callbacks, &cmd_pool));
+
+    VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+    cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buffer_alloc_info.commandPool = cmd_pool;
+    cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buffer_alloc_info.commandBufferCount = 1;
+    VkCommandBuffer cmd = VK_NULL_HANDLE;
+    VK_CHECK(vkAllocateCommandBuffers(state->device, &cmd_buffer_alloc_info, &cmd));
+
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkFence fence = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateFence(state->device, &fence_create_info, &state->callbacks, &fence));
+
+    double start_ms = 0.0;
+
+    // One submission per frame, waited on, so both sides do the same work
+    // per frame.  The first is a warm-up and the last also reads back.
+    for (uint32_t frame = 0; frame <= frame_count; ++frame)
+    {
+      if (frame == 1)
+      {
+        start_ms = GetTimeMs();
+      }
+
+      VkCommandBufferBeginInfo cmd_buf_info = {};
+      cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+      graph.Execute(cmd, 0);
+
+      if (frame == frame_count)
+      {
+        VkImageMemoryBarrier image_barrier = {};
+        image_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        image_barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        image_barrier.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        image_barrier.image = color_image;
+        image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        image_barrier.subresourceRange.levelCount = 1;
+        image_barrier.subresourceRange.layerCount = 1;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &image_barrier);
+
+        VkBufferImageCopy region = {};
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent.width = extent.width;
+        region.imageExtent.height = extent.height;
+        region.imageExtent.depth = 1;
+        vkCmdCopyImageToBuffer(cmd, color_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback_buffer, 1, &region);
+
+        VkBufferMemoryBarrier buffer_barrier = {};
+        buffer_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        buffer_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        buffer_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        buffer_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        buffer_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        buffer_barrier.buffer = readback_buffer;
+        buffer_barrier.size = VK_WHOLE_SIZE;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &buffer_barrier, 0, nullptr);
+      }
+
+      VK_CHECK(vkEndCommandBuffer(cmd));
+
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.commandBufferCount = 1;
+      submit_info.pCommandBuffers = &cmd;
+      VK_CHECK(vkQueueSubmit(state->queue, 1, &submit_info, fence));
+      VK_CHECK(vkWaitForFences(state->device, 1, &fence, VK_TRUE, UINT64_MAX));
+      VK_CHECK(vkResetFences(state->device, 1, &fence));
+    }
+
+    // Includes the readback of the last frame.
+    printf("  Vulkan (%s) %8.3f ms per frame\n", state->physical_device_properties.deviceName, (GetTimeMs() - start_ms) / frame_count);
+
+    // Rasterization rules let edge pixels and rounding differ a little
+    // between implementations, so this counts clear differences only.
+    uint32_t differing = 0;
+
+    for (uint32_t y = 0; y < extent.height; ++y)
+    {
+      const uint8_t* cpu_row = (const uint8_t*)(rasterizer.color + ((size_t)y * rasterizer.stride));
+      const uint8_t* gpu_row = readback + ((size_t)y * extent.width * 4);
+
+      for (uint32_t i = 0; i < extent.width * 4; i += 4)
+      {
+        for (uint32_t c = 0; c < 4; ++c)
+        {
+          if (abs((int)cpu_row[i + c] - (int)gpu_row[i + c]) > 8)
+          {
+            ++differing;
+            break;
+          }
+        }
+      }
+    }
+
+    printf("  %.3f%% of pixels differ between CPU and Vulkan\n", differing * 100.0 / pixels);
+
+    vkDestroyFence(state->device, fence, &state->callbacks);
+    vkDestroyCommandPool(state->device, cmd_pool, &state->callbacks);
+    vkDestroyPipeline(state->device, pass.pipeline, &state->callbacks);
+    graph.Destroy();
+    vkDestroyImage(state->device, color_image, &state->callbacks);
+    vkFreeMemory(state->device, color_memory, &state->callbacks);
+    vkDestroyPipelineLayout(state->device, pipeline_layout, &state->callbacks);
+    vkDestroyBuffer(state->device, readback_buffer, &state->callbacks);
+    vkFreeMemory(state->device, readback_memory, &state->callbacks);
+    vkDestroyBuffer(state->device, index_buffer, &state->callbacks);
+    vkFreeMemory(state->device, index_memory, &state->callbacks);
+    vkDestroyBuffer(state->device, vertex_buffer, &state->callbacks);
+    vkFreeMemory(state->device, vertex_memory, &state->callbacks);
+    vkDestroyShaderModule(state->device, vertex_module, &state->callbacks);
+    vkDestroyShaderModule(state->device, frag_module, &state->callbacks);
+  }
+
+  rasterizer.Destroy();
+  Free(vertices);
+  Free(indices);
+}
+
+// --cpu: renders without Vulkan.  Draws the clip space triangle the way the
+// window would show it, or runs the CPU half of --bench cpuraster.
+int RunCpuRenderer(const Options& options)
+{
+  CpuRasterizer::RunAllTests();
+
+  if (options.bench)
+  {
+    if (!strcmp(options.bench, "cpuraster"))
+    {
+      RunCpuRasterBench(nullptr);
+    }
+    else
+    {
+      printf("Unknown benchmark '%s' with --cpu, expected cpuraster\n", options.bench);
+    }
+
+    return 0;
+  }
+
+  uint32_t width = (uint32_t)options.width;
+  uint32_t height = (uint32_t)options.height;
+  uint32_t frame_count = (options.max_frames > 0) ? (uint32_t)options.max_frames : 1;
+  CubeUniforms uniforms;
+  uniforms.world_from_obj.SetIdentity();
+  uniforms.view_from_world.SetIdentity();
+  uniforms.clip_from_view.SetIdentity();
+
+  JobSystem jobs;
+  jobs.Create(JobSystem::DefaultWorkerCount());
+  CpuRasterizer rasterizer;
+  rasterizer.Create(width, height, 1024);
+  rasterizer.jobs = &jobs;
+  uint8_t* texels = (uint8_t*)Alloc((size_t)width * height * 4, 16);
+  size_t yuv_bytes = ((size_t)width * height) + (2 * ((width + 1) / 2) * ((height + 1) / 2));
+  uint8_t* yuv = (uint8_t*)Alloc(yuv_bytes, 16);
+  FILE* file = nullptr;
+  bool y4m = false;
+
+  if (options.dump)
+  {
+    size_t length = strlen(options.dump);
+    y4m = (length > 4) && !_stricmp(options.dump + length - 4, ".y4m");
+    file = fopen(options.dump, "wb");
+
+    if (!file)
+    {
+      printf("Could not open '%s'\n", options.dump);
+    }
+    else if (y4m)
+    {
+      fprintf(file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C420jpeg\n", width, height);
+    }
+  }
+
+  double render_ms = 0.0;
+
+  for (uint32_t frame = 0; frame < frame_count; ++frame)
+  {
+    double start_ms = GetTimeMs();
+    rasterizer.Clear(0xff000000u, 1.0f);
+    rasterizer.Draw(s_ClipSpaceTriangleVertices, nullptr, ARRAY_COUNT(s_ClipSpaceTriangleVertices), uniforms);
+    rasterizer.Flush();
+    render_ms += GetTimeMs() - start_ms;
+
+    if (file)
+    {
+      for (uint32_t y = 0; y < height; ++y)
+      {
+        memcpy(texels + ((size_t)y * width * 4), rasterizer.color + ((size_t)y * rasterizer.stride), (size_t)width * 4);
+      }
+
+      if (y4m)
+      {
+        FrameReadback::ConvertToI420(texels, false, width, height, yuv);
+        fprintf(file, "FRAME\n");
+        fwrite(yuv, 1, yuv_bytes, file);
+      }
+      else
+      {
+        fwrite(texels, 1, (size_t)width * height * 4, file);
+      }
+    }
+  }
+
+  printf("CPU renderer: %u frames at %ux%u, %.3f ms per frame\n", frame_count, width, height, render_ms / frame_count);
+
+  if (file)
+  {
+    fclose(file);
+  }
+
+  Free(texels);
+  Free(yuv);
+  rasterizer.Destroy();
+  jobs.Destroy();
+  return 0;
+}
+
+// Lock-free queue of small indices between exactly one producer thread and
+// one consumer thread.  Only the producer writes tail and only the consumer
+// writes head, each with an interlocked exchange after touching items, so
+// the other side never sees an index before its item.  Head and tail count
+// up forever and are masked into items.
+struct SpscQueue
+{
+  static const uint32_t s_Capacity = 8; // A power of two.
+
+  uint32_t items[s_Capacity];
+  char padding[64]; // Keeps the two ends on separate cache lines.
+  volatile long head = 0;
+  char padding2[64];
+  volatile long tail = 0;
+
+  bool Push(uint32_t item);
+  bool Pop(uint32_t* item);
+  void PushWait(uint32_t item, uint64_t* stalls);
+  uint32_t PopWait(uint64_t* stalls);
+
+  // Tests.
+  static void TestWrap();
+  static void TestTwoThreads();
+  static void RunAllTests();
+};
+
+// False when full.  Producer only.
+bool SpscQueue::Push(uint32_t item)
+{
+  long position = tail;
+
+  if ((uint32_t)(position - head) == s_Capacity)
+  {
+    return false;
+  }
+
+  items[position & (s_Capacity - 1)] = item;
+  InterlockedExchange(&tail, position + 1);
+  return true;
+}
+
+// False when empty.  Consumer only.
+bool SpscQueue::Pop(uint32_t* item)
+{
+  long position = head;
+
+  if (tail == position)
+  {
+    return false;
+  }
+
+  *item = items[position & (s_Capacity - 1)];
+  InterlockedExchange(&head, position + 1);
+  return true;
+}
+
+// The other end is a stage a frame or so away, so spin briefly and then
+// give up the time slice rather than sleep on an event.
+void SpscQueue::PushWait(uint32_t item, uint64_t* stalls)
+{
+  for (uint32_t spins = 0; !Push(item); ++spins)
+  {
+    (spins < 64) ? YieldProcessor() : (void)SwitchToThread();
+    ++*stalls;
+  }
+}
+
+uint32_t SpscQueue::PopWait(uint64_t* stalls)
+{
+  uint32_t item = 0;
+
+  for (uint32_t spins = 0; !Pop(&item); ++spins)
+  {
+    (spins < 64) ? YieldProcessor() : (void)SwitchToThread();
+    ++*stalls;
+  }
+
+  return item;
+}
+
+void SpscQueue::TestWrap()
+{
+  SpscQueue queue;
+  uint32_t item = 0;
+  FailIfNotExpected(false, queue.Pop(&item), __FUNCTION__);
+
+  // Fill and drain a few times so the positions wrap around items.
+  for (uint32_t round = 0; round < 3; ++round)
+  {
+    for (uint32_t i = 0; i < s_Capacity; ++i)
+    {
+      FailIfNotExpected(true, queue.Push((round * 100) + i), __FUNCTION__);
+    }
+
+    FailIfNotExpected(false, queue.Push(0), __FUNCTION__);
+
+    for (uint32_t i = 0; i < s_Capacity; ++i)
+    {
+      FailIfNotExpected(true, queue.Pop(&item), __FUNCTION__);
+      FailIfNotExpected((round * 100) + i, item, __FUNCTION__);
+    }
+
+    FailIfNotExpected(false, queue.Pop(&item), __FUNCTION__);
+    FailIfNotExpected(true, queue.Push(7), __FUNCTION__);
+    FailIfNotExpected(true, queue.Pop(&item), __FUNCTION__);
+  }
+}
+
+static DWORD WINAPI TestSpscProducer(void* userdata)
+{
+  SpscQueue& queue = *(SpscQueue*)userdata;
+  uint64_t stalls = 0;
+
+  for (uint32_t i = 0; i < 100000; ++i)
+  {
+    queue.PushWait(i, &stalls);
+  }
+
+  return 0;
+}
+
+void SpscQueue::TestTwoThreads()
+{
+  SpscQueue queue;
+  uint64_t stalls = 0;
+  HANDLE producer = CreateThread(nullptr, 0, TestSpscProducer, &queue, 0, nullptr);
+
+  for (uint32_t i = 0; i < 100000; ++i)
+  {
+    FailIfNotExpected(i, queue.PopWait(&stalls), __FUNCTION__);
+  }
+
+  WaitForSingleObject(producer, INFINITE);
+  CloseHandle(producer);
+}
+
+void SpscQueue::RunAllTests()
+{
+  TestWrap();
+  TestTwoThreads();
+}
+
+// Runs frames through three stages: simulate on the calling thread, record
+// on a render thread and submit on a submission thread, each working on the
+// frame after the one the next stage has.  Simulate writes a snapshot of
+// everything record needs into one of s_SnapshotCount slots; record returns
+// the slot once it's done reading, so simulate never writes over a frame
+// still being recorded.  Record returns an index, like a command buffer
+// slot, that's handed to submit.
+//
+// Each stage function takes the index from the stage before and returns the
+// one for the stage after.  Simulate returning s_Stop ends the run early, so
+// a frame_count of UINT32_MAX runs until it does.  With threaded false the
+// stages run one after another on the calling thread, the same work without
+// the overlap.
+struct FramePipeline
+{
+  enum Stage
+  {
+    STAGE_SIMULATE,
+    STAGE_RECORD,
+    STAGE_SUBMIT,
+    STAGE_COUNT,
+  };
+
+  typedef uint32_t (*StageFn)(void* userdata, uint32_t index);
+
+  static const uint32_t s_SnapshotCount = 2;
+  static const uint32_t s_Stop = ~0u;
+
+  struct Stats
+  {
+    uint32_t frames;
+    double wall_ms;
+    double busy_ms[STAGE_COUNT];
+    uint64_t stalls[STAGE_COUNT]; // Spins waiting on a queue.
+  };
+
+  StageFn stages[STAGE_COUNT] = {};
+  void* userdata = nullptr;
+  SpscQueue free_snapshots; // Record to simulate.
+  SpscQueue snapshots;      // Simulate to record.
+  SpscQueue recorded;       // Record to submit.
+  Stats stats = {};
+
+  void Run(uint32_t frame_count, bool threaded);
+  uint32_t RunStage(Stage stage, uint32_t index);
+  void PrintStats(const char* name) const;
+  static DWORD WINAPI RecordThread(void* userdata);
+  static DWORD WINAPI SubmitThread(void* userdata);
+
+  // Tests.
+  static void TestFrameOrder();
+  static void TestStop();
+  static void RunAllTests();
+};
+
+uint32_t FramePipeline::RunStage(Stage stage, uint32_t index)
+{
+  double start_ms = GetTimeMs();
+  uint32_t result = stages[stage](userdata, index);
+  stats.busy_ms[stage] += GetTimeMs() - start_ms;
+  return result;
+}
+
+DWORD WINAPI FramePipeline::RecordThread(void* userdata)
+{
+  FramePipeline& pipeline = *(FramePipeline*)userdata;
+
+  for (;;)
+  {
+    uint32_t snapshot = pipeline.snapshots.PopWait(pipeline.stats.stalls + STAGE_RECORD);
+
+    if (snapshot == s_Stop)
+    {
+      pipeline.recorded.PushWait(s_Stop, pipeline.stats.stalls + STAGE_RECORD);
+      return 0;
+    }
+
+    uint32_t index = pipeline.RunStage(STAGE_RECORD, snapshot);
+    pipeline.free_snapshots.PushWait(snapshot, pipeline.stats.stalls + STAGE_RECORD);
+    pipeline.recorded.PushWait(index, pipeline.stats.stalls + STAGE_RECORD);
+  }
+}
+
+DWORD WINAPI FramePipeline::SubmitThread(void* userdata)
+{
+  FramePipeline& pipeline = *(FramePipeline*)userdata;
+
+  for (;;)
+  {
+    uint32_t index = pipeline.recorded.PopWait(pipeline.stats.stalls + STAGE_SUBMIT);
+
+    if (index == s_Stop)
+    {
+      return 0;
+    }
+
+    pipeline.RunStage(STAGE_SUBMIT, index);
+  }
+}
+
+void FramePipeline::Run(uint32_t frame_count, bool threaded)
+{
+  stats = {};
+  stats.frames = frame_count;
+  double start_ms = GetTimeMs();
+
+  if (!threaded)
+  {
+    for (uint32_t frame = 0; frame < frame_count; ++frame)
+    {
+      uint32_t snapshot = RunStage(STAGE_SIMULATE, frame % s_SnapshotCount);
+
+      if (snapshot == s_Stop)
+      {
+        stats.frames = frame;
+        break;
+      }
+
+      RunStage(STAGE_SUBMIT, RunStage(STAGE_RECORD, snapshot));
+    }
+
+    stats.wall_ms = GetTimeMs() - start_ms;
+    return;
+  }
+
+  for (uint32_t i = 0; i < s_SnapshotCount; ++i)
+  {
+    free_snapshots.Push(i);
+  }
+
+  HANDLE threads[2];
+  threads[0] = CreateThread(nullptr, 0, RecordThread, this, 0, nullptr);
+  threads[1] = CreateThread(nullptr, 0, SubmitThread, this, 0, nullptr);
+
+  for (uint32_t frame = 0; frame < frame_count; ++frame)
+  {
+    uint32_t snapshot = RunStage(STAGE_SIMULATE, free_snapshots.PopWait(stats.stalls + STAGE_SIMULATE));
+
+    if (snapshot == s_Stop)
+    {
+      stats.frames = frame;
+      break;
+    }
+
+    snapshots.PushWait(snapshot, stats.stalls + STAGE_SIMULATE);
+  }
+
+  snapshots.PushWait(s_Stop, stats.stalls + STAGE_SIMULATE);
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(threads); ++i)
+  {
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+  }
+
+  // Leave the snapshots free for the next run.
+  uint32_t snapshot = 0;
+
+  while (free_snapshots.Pop(&snapshot))
+  {
+  }
+
+  stats.wall_ms = GetTimeMs() - start_ms;
+}
+
+// Occupancy is the share of the run each stage spent working rather than
+// waiting on its neighbours.
+void FramePipeline::PrintStats(const char* name) const
+{
+  const char* const stage_names[STAGE_COUNT] = { "simulate", "record", "submit" };
+
+  if (!stats.frames || (stats.wall_ms <= 0.0))
+  {
+    printf("  %-10s no frames\n", name);
+    return;
+  }
+
+  printf("  %-10s %8.3f ms per frame, occupancy", name, stats.wall_ms / stats.frames);
+
+  for (uint32_t s = 0; s < STAGE_COUNT; ++s)
+  {
+    printf(" %s %5.1f%%", stage_names[s], stats.busy_ms[s] * 100.0 / stats.wall_ms);
+  }
+
   printf("\n");
+}
+
+struct TestFramePipelineData
+{
+  uint32_t written[FramePipeline::s_SnapshotCount]; // Frame in each snapshot.
+  volatile long reading[FramePipeline::s_SnapshotCount];
+  uint32_t next_frame;
+  uint32_t stop_frame; // Simulate returns s_Stop instead of this frame.
+  uint32_t recorded;
+  uint32_t submitted;
+  bool overwritten;           // Simulate thread only.
+  bool recorded_out_of_order; // Render thread only.
+  bool submitted_out_of_order; // Submission thread only.
+};
+
+static uint32_t TestSimulateStage(void* userdata, uint32_t snapshot)
+{
+  TestFramePipelineData& data = *(TestFramePipelineData*)userdata;
+
+  if (data.next_frame == data.stop_frame)
+  {
+    return FramePipeline::s_Stop;
+  }
+
+  data.overwritten |= (data.reading[snapshot] != 0);
+  data.written[snapshot] = data.next_frame++;
+  return snapshot;
+}
+
+static uint32_t TestRecordStage(void* userdata, uint32_t snapshot)
+{
+  TestFramePipelineData& data = *(TestFramePipelineData*)userdata;
+  InterlockedExchange(data.reading + snapshot, 1);
+  data.recorded_out_of_order |= (data.written[snapshot] != data.recorded);
+  YieldProcessor();
+  InterlockedExchange(data.reading + snapshot, 0);
+  return data.recorded++;
+}
+
+static uint32_t TestSubmitStage(void* userdata, uint32_t frame)
+{
+  TestFramePipelineData& data = *(TestFramePipelineData*)userdata;
+  data.submitted_out_of_order |= (frame != data.submitted++);
+  return 0;
+}
+
+void FramePipeline::TestFrameOrder()
+{
+  // Every stage sees every frame once, in order, and simulate never writes
+  // a snapshot that record is reading.
+  for (uint32_t threaded = 0; threaded < 2; ++threaded)
+  {
+    TestFramePipelineData data = {};
+    data.stop_frame = UINT32_MAX;
+    FramePipeline pipeline;
+    pipeline.stages[STAGE_SIMULATE] = TestSimulateStage;
+    pipeline.stages[STAGE_RECORD] = TestRecordStage;
+    pipeline.stages[STAGE_SUBMIT] = TestSubmitStage;
+    pipeline.userdata = &data;
+    pipeline.Run(10000, threaded != 0);
+    FailIfNotExpected(10000u, data.next_frame, __FUNCTION__);
+    FailIfNotExpected(10000u, data.recorded, __FUNCTION__);
+    FailIfNotExpected(10000u, data.submitted, __FUNCTION__);
+    FailIfNotExpected(false, data.overwritten, __FUNCTION__);
+    FailIfNotExpected(false, data.recorded_out_of_order, __FUNCTION__);
+    FailIfNotExpected(false, data.submitted_out_of_order, __FUNCTION__);
+  }
+}
+
+void FramePipeline::TestStop()
+{
+  // Frames simulated before the stop still make it through record and
+  // submit, and the run counts only those.
+  for (uint32_t threaded = 0; threaded < 2; ++threaded)
+  {
+    TestFramePipelineData data = {};
+    data.stop_frame = 500;
+    FramePipeline pipeline;
+    pipeline.stages[STAGE_SIMULATE] = TestSimulateStage;
+    pipeline.stages[STAGE_RECORD] = TestRecordStage;
+    pipeline.stages[STAGE_SUBMIT] = TestSubmitStage;
+    pipeline.userdata = &data;
+    pipeline.Run(UINT32_MAX, threaded != 0);
+    FailIfNotExpected(500u, pipeline.stats.frames, __FUNCTION__);
+    FailIfNotExpected(500u, data.recorded, __FUNCTION__);
+    FailIfNotExpected(500u, data.submitted, __FUNCTION__);
+    FailIfNotExpected(false, data.submitted_out_of_order, __FUNCTION__);
+  }
+}
+
+void FramePipeline::RunAllTests()
+{
+  TestFrameOrder();
+  TestStop();
+}
+
+// Stands in for a game frame: simulate moves a few thousand objects, record
+// draws each with its own clip_from_obj push constant, and submit hands the
+// command buffer to the queue.
+struct FrameStagesBench
+{
+  struct Snapshot
+  {
+    Affine3x4* world_from_obj;
+    float time;
+  };
+
+  struct CmdSlot
+  {
+    VkCommandBuffer cmd;
+    VkFence fence;
+  };
+
+  VulkanState* state;
+  uint32_t object_count;
+  uint32_t frame;
+  Snapshot snapshots[FramePipeline::s_SnapshotCount];
+  CmdSlot cmd_slots[3];
+  uint32_t next_cmd_slot;
+  uint32_t recording_snapshot; // Render thread only.
+  RenderGraph* graph;
+  VkPipeline pipeline;
+  VkPipelineLayout pipeline_layout;
+  VkBuffer vertex_buffer;
+  Mat4 clip_from_world;
+  VkExtent2D extent;
+};
+
+static uint32_t SimulateFrameStagesBench(void* userdata, uint32_t index)
+{
+  FrameStagesBench& bench = *(FrameStagesBench*)userdata;
+  FrameStagesBench::Snapshot& snapshot = bench.snapshots[index];
+  snapshot.time = bench.frame++ / 60.0f;
+
+  // Objects orbit the middle of a grid at their own speeds, spinning as
+  // they go.
+  uint32_t grid = (uint32_t)std::sqrt((float)bench.object_count);
+
+  for (uint32_t i = 0; i < bench.object_count; ++i)
+  {
+    float angle = snapshot.time * (0.5f + ((i % 17) * 0.1f));
+    float s = std::sin(angle);
+    float c = std::cos(angle);
+    float x = ((((i % grid) + 0.5f) * 2.0f) / grid) - 1.0f;
+    float y = ((((i / grid) + 0.5f) * 2.0f) / grid) - 1.0f;
+    Affine3x4& m = snapshot.world_from_obj[i];
+    m.SetIdentity();
+    m.m[0] = c * 0.02f;
+    m.m[1] = -s * 0.02f;
+    m.m[4] = s * 0.02f;
+    m.m[5] = c * 0.02f;
+    m.SetPosition(Vec3(x + (0.01f * c), y + (0.01f * s), 0.5f));
+  }
+
+  return index;
+}
+
+static void RecordFrameStagesBenchPass(VkCommandBuffer cmd, void* userdata)
+{
+  const FrameStagesBench& bench = *(const FrameStagesBench*)userdata;
+  const FrameStagesBench::Snapshot& snapshot = bench.snapshots[bench.recording_snapshot];
+  const VkDeviceSize offsets = 0;
+  VkViewport viewport = {};
+  viewport.width = (float)bench.extent.width;
+  viewport.height = (float)bench.extent.height;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = {};
+  scissor.extent = bench.extent;
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, bench.pipeline);
+  vkCmdBindVertexBuffers(cmd, 1, 1, &bench.vertex_buffer, &offsets);
+
+  for (uint32_t i = 0; i < bench.object_count; ++i)
+  {
+    Mat4 clip_from_obj = bench.clip_from_world * snapshot.world_from_obj[i].ToMat4();
+    vkCmdPushConstants(cmd, bench.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(Mat4), &clip_from_obj);
+    vkCmdDraw(cmd, ARRAY_COUNT(s_ClipSpaceTriangleVertices), 1, 0, 0);
+  }
+}
+
+static uint32_t RecordFrameStagesBench(void* userdata, uint32_t index)
+{
+  FrameStagesBench& bench = *(FrameStagesBench*)userdata;
+  uint32_t slot_index = bench.next_cmd_slot;
+  FrameStagesBench::CmdSlot& slot = bench.cmd_slots[slot_index];
+  bench.next_cmd_slot = (bench.next_cmd_slot + 1) % ARRAY_COUNT(bench.cmd_slots);
+
+  // The fence is signaled once the GPU is done with the slot's last frame,
+  // which the submit stage may not have even submitted yet.
+  VK_CHECK(vkWaitForFences(bench.state->device, 1, &slot.fence, VK_TRUE, UINT64_MAX));
+  VK_CHECK(vkResetFences(bench.state->device, 1, &slot.fence));
+
+  VkCommandBufferBeginInfo cmd_buf_info = {};
+  cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK(vkBeginCommandBuffer(slot.cmd, &cmd_buf_info));
+  bench.recording_snapshot = index;
+  bench.graph->Execute(slot.cmd, 0);
+  VK_CHECK(vkEndCommandBuffer(slot.cmd));
+  return slot_index;
+}
+
+static uint32_t SubmitFrameStagesBench(void* userdata, uint32_t index)
+{
+  FrameStagesBench& bench = *(FrameStagesBench*)userdata;
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &bench.cmd_slots[index].cmd;
+  VK_CHECK(vkQueueSubmit(bench.state->queue, 1, &submit_info, bench.cmd_slots[index].fence));
+  return 0;
+}
+
+// The same frames through FramePipeline on one thread and on three,
+// reporting the throughput gain and how busy each stage was.
+void RunFrameStagesBench(VulkanState& state)
+{
+  const uint32_t object_counts[] = { 1024, 8192, 32768 };
+  const uint32_t max_objects = 32768;
+  const uint32_t frame_count = 200;
+  const VkExtent2D extent = { 512, 512 };
+
+  printf("Frame stages: simulate, record and submit threads\n");
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule frag_module = VK_NULL_HANDLE;
+
+  if (!state.LoadShaderModule("meshlet.vert.spv", &vertex_module) || !state.LoadShaderModule("basic.frag.spv", &frag_module))
+  {
+    vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+    printf("  skipped, no shaders\n");
+    return;
+  }
+
+  FrameStagesBench bench = {};
+  bench.state = &state;
+  bench.extent = extent;
+  bench.clip_from_world.SetIdentity();
+
+  for (uint32_t i = 0; i < FramePipeline::s_SnapshotCount; ++i)
+  {
+    bench.snapshots[i].world_from_obj = (Affine3x4*)Alloc(sizeof(Affine3x4) * max_objects, 16);
+  }
+
+  VkDeviceMemory vertex_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(sizeof(s_ClipSpaceTriangleVertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &bench.vertex_buffer, &vertex_memory);
+  state.UploadBuffer(bench.vertex_buffer, s_ClipSpaceTriangleVertices, sizeof(s_ClipSpaceTriangleVertices));
+
+  VkPushConstantRange push_constant_range = {};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.size = sizeof(Mat4);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.pushConstantRangeCount = 1;
+  pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+  VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_create_info, &state.callbacks, &bench.pipeline_layout));
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage color_image = VK_NULL_HANDLE;
+  VkDeviceMemory color_memory = VK_NULL_HANDLE;
+  state.CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &color_image, &color_memory);
+
+  RenderGraph graph;
+  uint32_t output = graph.ImportImage("output", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &color_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  uint32_t pass = graph.AddPass("objects", RecordFrameStagesBenchPass, &bench);
+  graph.AddUse(pass, output, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.Compile(state);
+  bench.graph = &graph;
+  bench.pipeline = CreateVertexColorPipeline(state, graph.RenderPass(pass), bench.pipeline_layout, vertex_module, frag_module);
+
+  // Only the render thread records, so one pool is enough.
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  fence_create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(bench.cmd_slots); ++i)
+  {
+    VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &bench.cmd_slots[i].cmd));
+    VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &bench.cmd_slots[i].fence));
+  }
+
+  FramePipeline frame_pipeline;
+  frame_pipeline.stages[FramePipeline::STAGE_SIMULATE] = SimulateFrameStagesBench;
+  frame_pipeline.stages[FramePipeline::STAGE_RECORD] = RecordFrameStagesBench;
+  frame_pipeline.stages[FramePipeline::STAGE_SUBMIT] = SubmitFrameStagesBench;
+  frame_pipeline.userdata = &bench;
+
+  for (uint32_t c = 0; c < ARRAY_COUNT(object_counts); ++c)
+  {
+    bench.object_count = object_counts[c];
+    printf("  %u objects:\n", bench.object_count);
+    double serial_ms = 0.0;
+
+    for (uint32_t threaded = 0; threaded < 2; ++threaded)
+    {
+      // A few frames to warm up first.
+      frame_pipeline.Run(8, threaded != 0);
+      frame_pipeline.Run(frame_count, threaded != 0);
+      VK_CHECK(vkQueueWaitIdle(state.queue));
+      frame_pipeline.PrintStats(threaded ? "threaded" : "serial");
+
+      if (!threaded)
+      {
+        serial_ms = frame_pipeline.stats.wall_ms;
+      }
+      else
+      {
+        printf("  %-10s %8.2fx throughput\n", "", serial_ms / frame_pipeline.stats.wall_ms);
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(bench.cmd_slots); ++i)
+  {
+    vkDestroyFence(state.device, bench.cmd_slots[i].fence, &state.callbacks);
+  }
+
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+  vkDestroyPipeline(state.device, bench.pipeline, &state.callbacks);
+  graph.Destroy();
+  vkDestroyImage(state.device, color_image, &state.callbacks);
+  vkFreeMemory(state.device, color_memory, &state.callbacks);
+  vkDestroyPipelineLayout(state.device, bench.pipeline_layout, &state.callbacks);
+  vkDestroyBuffer(state.device, bench.vertex_buffer, &state.callbacks);
+  vkFreeMemory(state.device, vertex_memory, &state.callbacks);
+  vkDestroyShaderModule(state.device, vertex_module, &state.callbacks);
+  vkDestroyShaderModule(state.device, frag_module, &state.callbacks);
+
+  for (uint32_t i = 0; i < FramePipeline::s_SnapshotCount; ++i)
+  {
+    Free(bench.snapshots[i].world_from_obj);
+  }
+}
+
+// Recycles fences and binary semaphores rather than creating them whenever
+// a submission needs one.  Get*() returns one unsignaled; Recycle*() takes
+// it back once nothing pending uses it, which for a semaphore means the
+// submission that waited on it has completed.  DeferredDeleter does that
+// for anything retired through it.
+struct SyncPool
+{
+  struct Stats
+  {
+    uint32_t fences_created;
+    uint32_t semaphores_created;
+    uint64_t reused;
+  };
+
+  VulkanState* state = nullptr;
+  VkFence fences[64];
+  uint32_t fence_count = 0;
+  VkSemaphore semaphores[64];
+  uint32_t semaphore_count = 0;
+  Stats stats = {};
+
+  void Create(VulkanState& vulkan_state);
+  void Destroy();
+  VkFence GetFence();
+  void RecycleFence(VkFence fence);
+  VkSemaphore GetSemaphore();
+  void RecycleSemaphore(VkSemaphore semaphore);
+};
+
+void SyncPool::Create(VulkanState& vulkan_state)
+{
+  state = &vulkan_state;
+  fence_count = 0;
+  semaphore_count = 0;
+  stats = {};
+}
+
+void SyncPool::Destroy()
+{
+  for (uint32_t i = 0; i < fence_count; ++i)
+  {
+    vkDestroyFence(state->device, fences[i], &state->callbacks);
+  }
+
+  for (uint32_t i = 0; i < semaphore_count; ++i)
+  {
+    vkDestroySemaphore(state->device, semaphores[i], &state->callbacks);
+  }
+
+  fence_count = 0;
+  semaphore_count = 0;
+}
+
+VkFence SyncPool::GetFence()
+{
+  if (fence_count)
+  {
+    ++stats.reused;
+    return fences[--fence_count];
+  }
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state->device, &fence_create_info, &state->callbacks, &fence));
+  ++stats.fences_created;
+  return fence;
+}
+
+// The fence must have signaled, or never been submitted.
+void SyncPool::RecycleFence(VkFence fence)
+{
+  if (fence_count == ARRAY_COUNT(fences))
+  {
+    vkDestroyFence(state->device, fence, &state->callbacks);
+    return;
+  }
+
+  VK_CHECK(vkResetFences(state->device, 1, &fence));
+  fences[fence_count++] = fence;
+}
+
+VkSemaphore SyncPool::GetSemaphore()
+{
+  if (semaphore_count)
+  {
+    ++stats.reused;
+    return semaphores[--semaphore_count];
+  }
+
+  VkSemaphoreCreateInfo semaphore_create_info = {};
+  semaphore_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  VkSemaphore semaphore = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateSemaphore(state->device, &semaphore_create_info, &state->callbacks, &semaphore));
+  ++stats.semaphores_created;
+  return semaphore;
+}
+
+// The semaphore must be unsignaled with no pending wait.
+void SyncPool::RecycleSemaphore(VkSemaphore semaphore)
+{
+  if (semaphore_count == ARRAY_COUNT(semaphores))
+  {
+    vkDestroySemaphore(state->device, semaphore, &state->callbacks);
+    return;
+  }
+
+  semaphores[semaphore_count++] = semaphore;
+}
+
+// Batches are destroyed in this order, so views go before their images and
+// buffers and images before the memory bound to them.
+enum DeferredKind
+{
+  DEFERRED_IMAGE_VIEW,
+  DEFERRED_PIPELINE,
+  DEFERRED_BUFFER,
+  DEFERRED_IMAGE,
+  DEFERRED_MEMORY,
+  DEFERRED_FENCE,     // Back to the SyncPool.
+  DEFERRED_SEMAPHORE, // Back to the SyncPool.
+  DEFERRED_KIND_COUNT,
+};
+
+// Destroys objects once the GPU is done with them, without stalling for
+// it.  Submissions go through Submit(), which numbers them and signals a
+// timeline semaphore with the number; objects are retired with the number
+// of the last submission that used them and destroyed in a batch by the
+// first Collect() after the semaphore passes it.
+//
+// Without VK_KHR_timeline_semaphore each Submit() is followed by an empty
+// submission with a pooled fence, and the oldest fences are polled in
+// order instead.
+//
+// Only RunDeferredDeleteBench() uses it so far.  The interactive loop
+// creates its fences and semaphores once, and the residency manager defers
+// its own frees by frame.
+struct DeferredDeleter
+{
+  struct Entry
+  {
+    uint64_t value; // Submission that must complete first.
+    DeferredKind kind;
+    uint64_t handle;
+  };
+
+  struct PendingFence
+  {
+    uint64_t value;
+    VkFence fence;
+  };
+
+  struct Stats
+  {
+    uint64_t retired;
+    uint64_t destroyed;
+    uint64_t batches;
+    uint64_t stalls; // Full waits because the entry array filled.
+    uint32_t max_pending;
+  };
+
+  VulkanState* state = nullptr;
+  SyncPool* pool = nullptr;
+  VkSemaphore timeline = VK_NULL_HANDLE;
+#ifdef VK_KHR_timeline_semaphore
+  PFN_vkGetSemaphoreCounterValueKHR get_counter_value = nullptr;
+  PFN_vkWaitSemaphoresKHR wait_semaphores = nullptr;
+#endif
+  PendingFence pending_fences[16];
+  uint32_t pending_fence_head = 0;
+  uint32_t pending_fence_count = 0;
+  uint64_t submitted = 0; // Number of the last submission.
+  uint64_t completed = 0; // Highest number the GPU is known to be past.
+  Entry* entries = nullptr;
+  Entry* batch = nullptr;
+  uint32_t entry_count = 0;
+  uint32_t capacity = 0;
+  Stats stats = {};
+
+  void Create(VulkanState& vulkan_state, SyncPool& sync_pool, uint32_t entry_capacity);
+  void Destroy();
+  uint64_t Submit(VkQueue queue, const VkSubmitInfo& submit_info, VkFence fence);
+  uint64_t Poll();
+  void Wait(uint64_t value);
+  void Collect();
+  void Retire(DeferredKind kind, uint64_t handle, uint64_t value);
+  void RetireBuffer(VkBuffer buffer, uint64_t value);
+  void RetireImage(VkImage image, uint64_t value);
+  void RetireImageView(VkImageView view, uint64_t value);
+  void RetireMemory(VkDeviceMemory memory, uint64_t value);
+  void RetirePipeline(VkPipeline pipeline, uint64_t value);
+  void RetireFence(VkFence fence, uint64_t value);
+  void RetireSemaphore(VkSemaphore semaphore, uint64_t value);
+  static uint32_t TakeCompleted(Entry* entries, uint32_t* count, uint64_t completed, Entry* out);
+
+  // Tests.
+  static void TestTakeCompleted();
+  static void RunAllTests();
+};
+
+void DeferredDeleter::Create(VulkanState& vulkan_state, SyncPool& sync_pool, uint32_t entry_capacity)
+{
+  state = &vulkan_state;
+  pool = &sync_pool;
+  capacity = entry_capacity;
+  entries = (Entry*)Alloc(sizeof(Entry) * capacity, 16);
+  batch = (Entry*)Alloc(sizeof(Entry) * capacity, 16);
+  entry_count = 0;
+  submitted = 0;
+  completed = 0;
+  pending_fence_head = 0;
+  pending_fence_count = 0;
+  stats = {};
+  timeline = VK_NULL_HANDLE;
+
+#ifdef VK_KHR_timeline_semaphore
+  get_counter_value = (PFN_vkGetSemaphoreCounterValueKHR)vkGetDeviceProcAddr(state->device, "vkGetSemaphoreCounterValueKHR");
+  wait_semaphores = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(state->device, "vkWaitSemaphoresKHR");
+
+  if (state->timeline_semaphores && get_counter_value && wait_semaphores)
+  {
+    VkSemaphoreTypeCreateInfoKHR type_create_info = {};
+    type_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+    type_create_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+    type_create_info.initialValue = 0;
+    VkSemaphoreCreateInfo semaphore_create_info = {};
+    semaphore_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_create_info.pNext = &type_create_info;
+    VK_CHECK(vkCreateSemaphore(state->device, &semaphore_create_info, &state->callbacks, &timeline));
+  }
+#endif
+}
+
+// Waits for every submission, then destroys everything still retired.
+void DeferredDeleter::Destroy()
+{
+  if (!state)
+  {
+    return;
+  }
+
+  Wait(submitted);
+  Collect();
+
+  if (timeline)
+  {
+    vkDestroySemaphore(state->device, timeline, &state->callbacks);
+    timeline = VK_NULL_HANDLE;
+  }
+
+  Free(entries);
+  Free(batch);
+  entries = nullptr;
+  batch = nullptr;
+  state = nullptr;
+}
+
+// Submits and returns the submission's number.  fence may be
+// VK_NULL_HANDLE.
+uint64_t DeferredDeleter::Submit(VkQueue queue, const VkSubmitInfo& submit_info, VkFence fence)
+{
+  uint64_t value = ++submitted;
+
+#ifdef VK_KHR_timeline_semaphore
+  if (timeline)
+  {
+    // The timeline joins the submission's own signals.  Values for binary
+    // semaphores are ignored.
+    VkSemaphore signals[8];
+    uint64_t values[ARRAY_COUNT(signals)] = {};
+
+    if (submit_info.signalSemaphoreCount >= ARRAY_COUNT(signals))
+    {
+      Fail(__FUNCTION__);
+    }
+
+    for (uint32_t i = 0; i < submit_info.signalSemaphoreCount; ++i)
+    {
+      signals[i] = submit_info.pSignalSemaphores[i];
+    }
+
+    signals[submit_info.signalSemaphoreCount] = timeline;
+    values[submit_info.signalSemaphoreCount] = value;
+
+    VkTimelineSemaphoreSubmitInfoKHR timeline_submit_info = {};
+    timeline_submit_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+    timeline_submit_info.pNext = submit_info.pNext;
+    timeline_submit_info.signalSemaphoreValueCount = submit_info.signalSemaphoreCount + 1;
+    timeline_submit_info.pSignalSemaphoreValues = values;
+
+    VkSubmitInfo timeline_info = submit_info;
+    timeline_info.pNext = &timeline_submit_info;
+    timeline_info.signalSemaphoreCount = submit_info.signalSemaphoreCount + 1;
+    timeline_info.pSignalSemaphores = signals;
+    VK_CHECK(vkQueueSubmit(queue, 1, &timeline_info, fence));
+    return value;
+  }
+#endif
+
+  VK_CHECK(vkQueueSubmit(queue, 1, &submit_info, fence));
+
+  if (pending_fence_count == ARRAY_COUNT(pending_fences))
+  {
+    Wait(pending_fences[pending_fence_head].value);
+  }
+
+  // An empty submission's fence signals once all earlier work is done.
+  PendingFence& pending = pending_fences[(pending_fence_head + pending_fence_count++) % ARRAY_COUNT(pending_fences)];
+  pending.value = value;
+  pending.fence = pool->GetFence();
+  VK_CHECK(vkQueueSubmit(queue, 0, nullptr, pending.fence));
+  return value;
+}
+
+// Updates and returns the last completed submission number.
+uint64_t DeferredDeleter::Poll()
+{
+#ifdef VK_KHR_timeline_semaphore
+  if (timeline)
+  {
+    VK_CHECK(get_counter_value(state->device, timeline, &completed));
+    return completed;
+  }
+#endif
+
+  while (pending_fence_count)
+  {
+    PendingFence& pending = pending_fences[pending_fence_head];
+
+    if (vkGetFenceStatus(state->device, pending.fence) != VK_SUCCESS)
+    {
+      break;
+    }
+
+    completed = pending.value;
+    pool->RecycleFence(pending.fence);
+    pending_fence_head = (pending_fence_head + 1) % ARRAY_COUNT(pending_fences);
+    --pending_fence_count;
+  }
+
+  return completed;
+}
+
+// Blocks until submission value has completed.
+void DeferredDeleter::Wait(uint64_t value)
+{
+  if ((value <= completed) || (value > submitted))
+  {
+    return;
+  }
+
+#ifdef VK_KHR_timeline_semaphore
+  if (timeline)
+  {
+    VkSemaphoreWaitInfoKHR wait_info = {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &timeline;
+    wait_info.pValues = &value;
+    VK_CHECK(wait_semaphores(state->device, &wait_info, UINT64_MAX));
+    Poll();
+    return;
+  }
+#endif
+
+  // Values only ever go up, so the first fence at or past value covers it.
+  for (uint32_t i = 0; i < pending_fence_count; ++i)
+  {
+    const PendingFence& pending = pending_fences[(pending_fence_head + i) % ARRAY_COUNT(pending_fences)];
+
+    if (pending.value >= value)
+    {
+      VK_CHECK(vkWaitForFences(state->device, 1, &pending.fence, VK_TRUE, UINT64_MAX));
+      break;
+    }
+  }
+
+  Poll();
+}
+
+// Moves entries whose submission has completed to out, grouped in
+// DeferredKind order, and closes the gaps they leave in entries.  Returns
+// how many moved.
+uint32_t DeferredDeleter::TakeCompleted(Entry* entries, uint32_t* count, uint64_t completed, Entry* out)
+{
+  uint32_t kind_counts[DEFERRED_KIND_COUNT + 1] = {};
+  uint32_t kept = 0;
+
+  for (uint32_t i = 0; i < *count; ++i)
+  {
+    if (entries[i].value <= completed)
+    {
+      ++kind_counts[entries[i].kind + 1];
+    }
+  }
+
+  for (uint32_t k = 0; k < DEFERRED_KIND_COUNT; ++k)
+  {
+    kind_counts[k + 1] += kind_counts[k];
+  }
+
+  for (uint32_t i = 0; i < *count; ++i)
+  {
+    if (entries[i].value <= completed)
+    {
+      out[kind_counts[entries[i].kind]++] = entries[i];
+    }
+    else
+    {
+      entries[kept++] = entries[i];
+    }
+  }
+
+  uint32_t taken = *count - kept;
+  *count = kept;
+  return taken;
+}
+
+// Destroys everything retired whose submission has completed, in one batch.
+void DeferredDeleter::Collect()
+{
+  uint32_t taken = TakeCompleted(entries, &entry_count, Poll(), batch);
+
+  if (!taken)
+  {
+    return;
+  }
+
+  for (uint32_t i = 0; i < taken; ++i)
+  {
+    const Entry& entry = batch[i];
+
+    switch (entry.kind)
+    {
+      case DEFERRED_IMAGE_VIEW: vkDestroyImageView(state->device, (VkImageView)entry.handle, &state->callbacks); break;
+      case DEFERRED_PIPELINE: vkDestroyPipeline(state->device, (VkPipeline)entry.handle, &state->callbacks); break;
+      case DEFERRED_BUFFER: vkDestroyBuffer(state->device, (VkBuffer)entry.handle, &state->callbacks); break;
+      case DEFERRED_IMAGE: vkDestroyImage(state->device, (VkImage)entry.handle, &state->callbacks); break;
+      case DEFERRED_MEMORY: vkFreeMemory(state->device, (VkDeviceMemory)entry.handle, &state->callbacks); break;
+      case DEFERRED_FENCE: pool->RecycleFence((VkFence)entry.handle); break;
+      case DEFERRED_SEMAPHORE: pool->RecycleSemaphore((VkSemaphore)entry.handle); break;
+      default: Fail(__FUNCTION__);
+    }
+  }
+
+  stats.destroyed += taken;
+  ++stats.batches;
+}
+
+// value is the number Submit() returned for the last submission that used
+// the object.
+void DeferredDeleter::Retire(DeferredKind kind, uint64_t handle, uint64_t value)
+{
+  if (entry_count == capacity)
+  {
+    Collect();
+  }
+
+  // Everything retired is still in flight, so the only way to make room
+  // is to wait for it.
+  if (entry_count == capacity)
+  {
+    ++stats.stalls;
+    Wait(submitted);
+    Collect();
+  }
+
+  Entry& entry = entries[entry_count++];
+  entry.value = value;
+  entry.kind = kind;
+  entry.handle = handle;
+  ++stats.retired;
+  stats.max_pending = (entry_count > stats.max_pending) ? entry_count : stats.max_pending;
+}
+
+void DeferredDeleter::RetireBuffer(VkBuffer buffer, uint64_t value)
+{
+  Retire(DEFERRED_BUFFER, (uint64_t)buffer, value);
+}
+
+void DeferredDeleter::RetireImage(VkImage image, uint64_t value)
+{
+  Retire(DEFERRED_IMAGE, (uint64_t)image, value);
+}
+
+void DeferredDeleter::RetireImageView(VkImageView view, uint64_t value)
+{
+  Retire(DEFERRED_IMAGE_VIEW, (uint64_t)view, value);
+}
+
+void DeferredDeleter::RetireMemory(VkDeviceMemory memory, uint64_t value)
+{
+  Retire(DEFERRED_MEMORY, (uint64_t)memory, value);
+}
+
+void DeferredDeleter::RetirePipeline(VkPipeline pipeline, uint64_t value)
+{
+  Retire(DEFERRED_PIPELINE, (uint64_t)pipeline, value);
+}
+
+void DeferredDeleter::RetireFence(VkFence fence, uint64_t value)
+{
+  Retire(DEFERRED_FENCE, (uint64_t)fence, value);
+}
+
+void DeferredDeleter::RetireSemaphore(VkSemaphore semaphore, uint64_t value)
+{
+  Retire(DEFERRED_SEMAPHORE, (uint64_t)semaphore, value);
+}
+
+void DeferredDeleter::TestTakeCompleted()
+{
+  Entry entries[6] = {
+    { 1, DEFERRED_MEMORY, 10 },
+    { 4, DEFERRED_BUFFER, 11 },
+    { 2, DEFERRED_BUFFER, 12 },
+    { 3, DEFERRED_IMAGE_VIEW, 13 },
+    { 5, DEFERRED_MEMORY, 14 },
+    { 2, DEFERRED_SEMAPHORE, 15 } };
+  Entry out[6] = {};
+  uint32_t count = 6;
+
+  // Completed entries come out views first and memory after buffers; the
+  // rest keep their order.
+  FailIfNotExpected(4u, TakeCompleted(entries, &count, 3, out), __FUNCTION__);
+  FailIfNotExpected(2u, count, __FUNCTION__);
+  FailIfNotExpected(13ull, (unsigned long long)out[0].handle, __FUNCTION__);
+  FailIfNotExpected(12ull, (unsigned long long)out[1].handle, __FUNCTION__);
+  FailIfNotExpected(10ull, (unsigned long long)out[2].handle, __FUNCTION__);
+  FailIfNotExpected(15ull, (unsigned long long)out[3].handle, __FUNCTION__);
+  FailIfNotExpected(11ull, (unsigned long long)entries[0].handle, __FUNCTION__);
+  FailIfNotExpected(14ull, (unsigned long long)entries[1].handle, __FUNCTION__);
+
+  FailIfNotExpected(0u, TakeCompleted(entries, &count, 3, out), __FUNCTION__);
+  FailIfNotExpected(2u, TakeCompleted(entries, &count, 5, out), __FUNCTION__);
+  FailIfNotExpected(0u, count, __FUNCTION__);
+}
+
+void DeferredDeleter::RunAllTests()
+{
+  TestTakeCompleted();
+}
+
+// Every frame uploads through fresh staging buffers and hands the upload on
+// to a second submission through a semaphore, then gets rid of the staging
+// buffers, their memory and the semaphore.  Either the frame waits for the
+// queue to go idle and destroys them on the spot, creating a new semaphore
+// each time, or they're retired to a DeferredDeleter and the semaphore
+// comes from a SyncPool.
+void RunDeferredDeleteBench(VulkanState& state)
+{
+  const uint32_t buffers_per_frame = 8;
+  const VkDeviceSize buffer_size = 256 * 1024;
+  const uint32_t frame_count = 256;
+  const uint32_t cmd_slot_count = 3;
+  enum { MODE_WAIT_IDLE, MODE_DEFERRED, MODE_COUNT };
+  const char* const mode_names[MODE_COUNT] = { "wait idle", "deferred" };
+
+  printf("Deferred deletion: %u x %.0f KB staging buffers per frame, %s\n", buffers_per_frame, buffer_size / 1024.0,
+    state.timeline_semaphores ? "timeline semaphore" : "fences, no timeline semaphores");
+
+  VkBuffer target = VK_NULL_HANDLE;
+  VkDeviceMemory target_memory = VK_NULL_HANDLE;
+  VkBuffer copy_target = VK_NULL_HANDLE;
+  VkDeviceMemory copy_target_memory = VK_NULL_HANDLE;
+  state.CreateBuffer(buffer_size * buffers_per_frame, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &target, &target_memory);
+  state.CreateBuffer(buffer_size * buffers_per_frame, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &copy_target, &copy_target_memory);
+  uint8_t* data = (uint8_t*)Alloc((size_t)buffer_size, 16);
+  memset(data, 0x5a, (size_t)buffer_size);
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  // Each frame slot has an upload and a use command buffer, reused once the
+  // slot's last submission has completed.
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 2 * cmd_slot_count;
+  VkCommandBuffer cmds[2 * cmd_slot_count] = {};
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, cmds));
+
+  for (uint32_t mode = 0; mode < MODE_COUNT; ++mode)
+  {
+    SyncPool pool;
+    pool.Create(state);
+    DeferredDeleter deleter;
+    deleter.Create(state, pool, 1024);
+    uint64_t slot_values[cmd_slot_count] = {};
+    double worst_ms = 0.0;
+    double start_ms = GetTimeMs();
+
+    for (uint32_t frame = 0; frame < frame_count; ++frame)
+    {
+      double frame_start_ms = GetTimeMs();
+      uint32_t slot = frame % cmd_slot_count;
+      deleter.Wait(slot_values[slot]);
+      VkCommandBuffer upload_cmd = cmds[2 * slot];
+      VkCommandBuffer use_cmd = cmds[(2 * slot) + 1];
+      VkBuffer staging[buffers_per_frame];
+      VkDeviceMemory staging_memory[buffers_per_frame];
+
+      VkCommandBufferBeginInfo cmd_buf_info = {};
+      cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      VK_CHECK(vkBeginCommandBuffer(upload_cmd, &cmd_buf_info));
+
+      for (uint32_t b = 0; b < buffers_per_frame; ++b)
+      {
+        void* mapped = nullptr;
+        state.CreateBuffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging + b, staging_memory + b);
+        VK_CHECK(vkMapMemory(state.device, staging_memory[b], 0, VK_WHOLE_SIZE, 0, &mapped));
+        memcpy(mapped, data, (size_t)buffer_size);
+        vkUnmapMemory(state.device, staging_memory[b]);
+
+        VkBufferCopy copy_region = {};
+        copy_region.dstOffset = b * buffer_size;
+        copy_region.size = buffer_size;
+        vkCmdCopyBuffer(upload_cmd, staging[b], target, 1, &copy_region);
+      }
+
+      VK_CHECK(vkEndCommandBuffer(upload_cmd));
+
+      VK_CHECK(vkBeginCommandBuffer(use_cmd, &cmd_buf_info));
+      VkBufferCopy use_region = {};
+      use_region.size = buffer_size * buffers_per_frame;
+      vkCmdCopyBuffer(use_cmd, target, copy_target, 1, &use_region);
+      VK_CHECK(vkEndCommandBuffer(use_cmd));
+
+      VkSemaphore uploaded = VK_NULL_HANDLE;
+
+      if (mode == MODE_DEFERRED)
+      {
+        uploaded = pool.GetSemaphore();
+      }
+      else
+      {
+        VkSemaphoreCreateInfo semaphore_create_info = {};
+        semaphore_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        VK_CHECK(vkCreateSemaphore(state.device, &semaphore_create_info, &state.callbacks, &uploaded));
+      }
+
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.commandBufferCount = 1;
+      submit_info.pCommandBuffers = &upload_cmd;
+      submit_info.signalSemaphoreCount = 1;
+      submit_info.pSignalSemaphores = &uploaded;
+      uint64_t upload_value = deleter.Submit(state.queue, submit_info, VK_NULL_HANDLE);
+
+      VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+      submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.waitSemaphoreCount = 1;
+      submit_info.pWaitSemaphores = &uploaded;
+      submit_info.pWaitDstStageMask = &wait_stage;
+      submit_info.commandBufferCount = 1;
+      submit_info.pCommandBuffers = &use_cmd;
+      uint64_t use_value = deleter.Submit(state.queue, submit_info, VK_NULL_HANDLE);
+      slot_values[slot] = use_value;
+
+      if (mode == MODE_DEFERRED)
+      {
+        for (uint32_t b = 0; b < buffers_per_frame; ++b)
+        {
+          deleter.RetireBuffer(staging[b], upload_value);
+          deleter.RetireMemory(staging_memory[b], upload_value);
+        }
+
+        deleter.RetireSemaphore(uploaded, use_value);
+        deleter.Collect();
+      }
+      else
+      {
+        VK_CHECK(vkQueueWaitIdle(state.queue));
+
+        for (uint32_t b = 0; b < buffers_per_frame; ++b)
+        {
+          vkDestroyBuffer(state.device, staging[b], &state.callbacks);
+          vkFreeMemory(state.device, staging_memory[b], &state.callbacks);
+        }
+
+        vkDestroySemaphore(state.device, uploaded, &state.callbacks);
+      }
+
+      double frame_ms = GetTimeMs() - frame_start_ms;
+      worst_ms = (frame_ms > worst_ms) ? frame_ms : worst_ms;
+    }
+
+    deleter.Wait(deleter.submitted);
+    double total_ms = GetTimeMs() - start_ms;
+    printf("  %-10s %8.3f ms per frame, %8.3f ms worst", mode_names[mode], total_ms / frame_count, worst_ms);
+
+    if (mode == MODE_DEFERRED)
+    {
+      printf(", %u pending at most, %llu batches, %u semaphores and %u fences created, %llu reused",
+        deleter.stats.max_pending, (unsigned long long)deleter.stats.batches, pool.stats.semaphores_created, pool.stats.fences_created, (unsigned long long)pool.stats.reused);
+    }
+
+    printf("\n");
+    deleter.Destroy();
+    pool.Destroy();
+  }
+
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+  vkDestroyBuffer(state.device, copy_target, &state.callbacks);
+  vkFreeMemory(state.device, copy_target_memory, &state.callbacks);
+  vkDestroyBuffer(state.device, target, &state.callbacks);
+  vkFreeMemory(state.device, target_memory, &state.callbacks);
+  Free(data);
+}
+
+// Device-level commands and the resources they use, captured from main()'s
+// scene pass into a compact binary trace for TraceReplayer.
+//
+// The file is a Header followed by chunks, each an op and a payload size,
+// then the payload padded to four bytes.  Resources come first: buffers with
+// their contents, SPIR-V, pipelines and uniform descriptor sets, numbered
+// from 0 within each kind.  Frames follow as BEGIN_FRAME ... END_FRAME around
+// the render passes and the commands recorded inside them.  Barriers, render
+// pass and framebuffer objects aren't captured; the replayer's render graph
+// rebuilds them from the formats, clear values and render area.
+//
+// main() records its command buffers once per swapchain image and submits
+// them again and again, so commands go into a stream per image between
+// BeginCommands() and EndCommands(), and Frame() appends the stream of the
+// image each submitted frame used.
+struct CommandTrace
+{
+  enum Op
+  {
+    TRACE_BUFFER,              // BufferChunk, then the contents.
+    TRACE_SHADER,              // ShaderChunk, then the SPIR-V.
+    TRACE_PIPELINE,            // PipelineChunk.
+    TRACE_DESCRIPTOR_SET,      // DescriptorSetChunk.
+    TRACE_BEGIN_FRAME,         // Frame number.
+    TRACE_END_FRAME,
+    TRACE_BEGIN_RENDER_PASS,   // RenderPassChunk.
+    TRACE_END_RENDER_PASS,
+    TRACE_BIND_PIPELINE,       // Pipeline id.
+    TRACE_BIND_DESCRIPTOR_SET, // Descriptor set id, bound to set 0.
+    TRACE_BIND_VERTEX_BUFFER,  // VertexBufferChunk.
+    TRACE_SET_VIEWPORT,        // VkViewport.
+    TRACE_SET_SCISSOR,         // VkRect2D.
+    TRACE_DRAW,                // DrawChunk.
+  };
+
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t color_format;
+    uint32_t depth_format;
+    uint32_t frame_count;
+  };
+
+  struct Chunk
+  {
+    uint32_t op;
+    uint32_t size; // Payload bytes, a multiple of 4.
+  };
+
+  struct BufferChunk
+  {
+    uint32_t id;
+    uint32_t usage;
+    uint32_t bytes;
+  };
+
+  struct ShaderChunk
+  {
+    uint32_t id;
+    uint32_t bytes;
+  };
+
+  // Pipelines are CreateVertexColorPipeline() ones: Vertex input, dynamic
+  // viewport and scissor, one uniform buffer in set 0.
+  struct PipelineChunk
+  {
+    uint32_t id;
+    uint32_t vertex_shader;
+    uint32_t frag_shader;
+    uint32_t depth_test;
+    uint32_t cull_mode;
+  };
+
+  struct DescriptorSetChunk
+  {
+    uint32_t id;
+    uint32_t buffer;
+    uint32_t offset;
+    uint32_t range;
+  };
+
+  struct RenderPassChunk
+  {
+    float clear_color[4];
+    float clear_depth;
+    uint32_t width;
+    uint32_t height;
+  };
+
+  struct VertexBufferChunk
+  {
+    uint32_t binding;
+    uint32_t buffer;
+    uint32_t offset;
+  };
+
+  struct DrawChunk
+  {
+    uint32_t vertex_count;
+    uint32_t instance_count;
+    uint32_t first_vertex;
+    uint32_t first_instance;
+  };
+
+  struct Stream
+  {
+    uint8_t* data;
+    uint32_t size;
+    uint32_t capacity;
+  };
+
+  // Handles seen while capturing, indexed by id.
+  struct HandleTable
+  {
+    uint64_t handles[64];
+    uint32_t count;
+  };
+
+  static const uint32_t s_Magic = 0x54434b56; // "VKCT" at the start of the file.
+  static const uint32_t s_Version = 1;
+
+  Header header = {};
+  Stream resources = {};
+  Stream frames = {};
+  Stream* commands = nullptr; // One per swapchain image.
+  uint32_t command_count = 0;
+  Stream* recording = nullptr;
+  HandleTable buffers = {};
+  HandleTable pipelines = {};
+  HandleTable descriptor_sets = {};
+  uint32_t shader_count = 0;
+
+  void Create(VkExtent2D extent, VkFormat color_format, VkFormat depth_format, uint32_t image_count);
+  void Destroy();
+  uint32_t AddBuffer(VkBuffer buffer, VkBufferUsageFlags usage, const void* data, uint32_t bytes);
+  uint32_t AddShader(const void* code, uint32_t bytes);
+  void AddPipeline(VkPipeline pipeline, uint32_t vertex_shader, uint32_t frag_shader, bool depth_test, VkCullModeFlags cull_mode);
+  void AddDescriptorSet(VkDescriptorSet set, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range);
+  void BeginCommands(uint32_t slot);
+  void EndCommands();
+  void Frame(uint32_t slot);
+  bool Write(const char* path) const;
+
+  // Commands, between BeginCommands() and EndCommands().
+  void RecordBeginRenderPass(const VkClearValue& clear_color, float clear_depth, VkExtent2D extent);
+  void RecordEndRenderPass();
+  void RecordBindPipeline(VkPipeline pipeline);
+  void RecordBindDescriptorSet(VkDescriptorSet set);
+  void RecordBindVertexBuffer(uint32_t binding, VkBuffer buffer, VkDeviceSize offset);
+  void RecordSetViewport(const VkViewport& viewport);
+  void RecordSetScissor(const VkRect2D& scissor);
+  void RecordDraw(uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance);
+  void RecordCommand(Op op, const void* payload, uint32_t size);
+
+  // The vkCmd* calls the scene pass makes, also recorded when trace isn't null.
+  static void CmdBindPipeline(CommandTrace* trace, VkCommandBuffer cmd, VkPipeline pipeline);
+  static void CmdBindDescriptorSet(CommandTrace* trace, VkCommandBuffer cmd, VkPipelineLayout layout, VkDescriptorSet set);
+  static void CmdBindVertexBuffer(CommandTrace* trace, VkCommandBuffer cmd, uint32_t binding, VkBuffer buffer, VkDeviceSize offset);
+  static void CmdSetViewport(CommandTrace* trace, VkCommandBuffer cmd, const VkViewport& viewport);
+  static void CmdSetScissor(CommandTrace* trace, VkCommandBuffer cmd, const VkRect2D& scissor);
+  static void CmdDraw(CommandTrace* trace, VkCommandBuffer cmd, uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance);
+
+  static void Append(Stream& stream, const void* data, uint32_t bytes);
+  static void AppendChunk(Stream& stream, Op op, const void* payload, uint32_t size, const void* extra = nullptr, uint32_t extra_size = 0);
+  static void StreamDestroy(Stream& stream);
+  static uint32_t AddHandle(HandleTable& table, uint64_t handle);
+  static uint32_t FindHandle(const HandleTable& table, uint64_t handle);
+  static bool NextChunk(const uint8_t* data, uint32_t size, uint32_t* offset, Chunk* chunk, const uint8_t** payload);
+  static bool ReadPayload(const Chunk& chunk, const uint8_t* payload, void* out, uint32_t size);
+
+  // Tests.
+  static void TestRoundTrip();
+  static void TestTruncated();
+  static void RunAllTests();
+};
+
+void CommandTrace::Create(VkExtent2D extent, VkFormat color_format, VkFormat depth_format, uint32_t image_count)
+{
+  command_count = image_count;
+  commands = (Stream*)Alloc(sizeof(Stream) * image_count, 16);
+
+  for (uint32_t i = 0; i < image_count; ++i)
+  {
+    commands[i] = {};
+  }
+
+  header.magic = s_Magic;
+  header.version = s_Version;
+  header.width = extent.width;
+  header.height = extent.height;
+  header.color_format = (uint32_t)color_format;
+  header.depth_format = (uint32_t)depth_format;
+  header.frame_count = 0;
+}
+
+void CommandTrace::Destroy()
+{
+  StreamDestroy(resources);
+  StreamDestroy(frames);
+
+  for (uint32_t i = 0; i < command_count; ++i)
+  {
+    StreamDestroy(commands[i]);
+  }
+
+  Free(commands);
+  commands = nullptr;
+  command_count = 0;
+
+  recording = nullptr;
+  buffers = {};
+  pipelines = {};
+  descriptor_sets = {};
+  shader_count = 0;
+  header = {};
+}
+
+// data may be null for a buffer whose contents were never written, which
+// is captured as zeros.
+uint32_t CommandTrace::AddBuffer(VkBuffer buffer, VkBufferUsageFlags usage, const void* data, uint32_t bytes)
+{
+  BufferChunk chunk = {};
+  chunk.id = AddHandle(buffers, (uint64_t)buffer);
+  chunk.usage = usage;
+  chunk.bytes = bytes;
+  AppendChunk(resources, TRACE_BUFFER, &chunk, sizeof(chunk), data, bytes);
+  return chunk.id;
+}
+
+uint32_t CommandTrace::AddShader(const void* code, uint32_t bytes)
+{
+  ShaderChunk chunk = {};
+  chunk.id = shader_count++;
+  chunk.bytes = bytes;
+  AppendChunk(resources, TRACE_SHADER, &chunk, sizeof(chunk), code, bytes);
+  return chunk.id;
+}
+
+void CommandTrace::AddPipeline(VkPipeline pipeline, uint32_t vertex_shader, uint32_t frag_shader, bool depth_test, VkCullModeFlags cull_mode)
+{
+  PipelineChunk chunk = {};
+  chunk.id = AddHandle(pipelines, (uint64_t)pipeline);
+  chunk.vertex_shader = vertex_shader;
+  chunk.frag_shader = frag_shader;
+  chunk.depth_test = depth_test ? 1 : 0;
+  chunk.cull_mode = cull_mode;
+  AppendChunk(resources, TRACE_PIPELINE, &chunk, sizeof(chunk));
+}
+
+void CommandTrace::AddDescriptorSet(VkDescriptorSet set, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+{
+  DescriptorSetChunk chunk = {};
+  chunk.id = AddHandle(descriptor_sets, (uint64_t)set);
+  chunk.buffer = FindHandle(buffers, (uint64_t)buffer);
+  chunk.offset = (uint32_t)offset;
+  chunk.range = (uint32_t)range;
+  AppendChunk(resources, TRACE_DESCRIPTOR_SET, &chunk, sizeof(chunk));
+}
+
+// Starts over the stream for a command buffer being recorded again.
+void CommandTrace::BeginCommands(uint32_t slot)
+{
+  if (slot >= command_count)
+  {
+    Fail(__FUNCTION__);
+  }
+
+  recording = commands + slot;
+  recording->size = 0;
+}
+
+void CommandTrace::EndCommands()
+{
+  recording = nullptr;
+}
+
+void CommandTrace::Frame(uint32_t slot)
+{
+  const Stream& stream = commands[slot];
+  AppendChunk(frames, TRACE_BEGIN_FRAME, &header.frame_count, sizeof(header.frame_count));
+  Append(frames, stream.data, stream.size);
+  AppendChunk(frames, TRACE_END_FRAME, nullptr, 0);
+  ++header.frame_count;
+}
+
+bool CommandTrace::Write(const char* path) const
+{
+  FILE* file = fopen(path, "wb");
+
+  if (!file)
+  {
+    printf("Couldn't open '%s' for the capture\n", path);
+    return false;
+  }
+
+  bool written = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+    (!resources.size || (fwrite(resources.data, resources.size, 1, file) == 1)) &&
+    (!frames.size || (fwrite(frames.data, frames.size, 1, file) == 1));
+  written = !fclose(file) && written;
+
+  if (written)
+  {
+    printf("Captured %u frames to '%s', %.1f KB of resources and %.1f KB of commands\n", header.frame_count, path, resources.size / 1024.0, frames.size / 1024.0);
+  }
+  else
+  {
+    printf("Couldn't write the capture to '%s'\n", path);
+  }
+
+  return written;
+}
+
+void CommandTrace::RecordBeginRenderPass(const VkClearValue& clear_color, float clear_depth, VkExtent2D extent)
+{
+  RenderPassChunk chunk = {};
+  memcpy(chunk.clear_color, clear_color.color.float32, sizeof(chunk.clear_color));
+  chunk.clear_depth = clear_depth;
+  chunk.width = extent.width;
+  chunk.height = extent.height;
+  RecordCommand(TRACE_BEGIN_RENDER_PASS, &chunk, sizeof(chunk));
+}
+
+void CommandTrace::RecordEndRenderPass()
+{
+  RecordCommand(TRACE_END_RENDER_PASS, nullptr, 0);
+}
+
+void CommandTrace::RecordBindPipeline(VkPipeline pipeline)
+{
+  uint32_t id = FindHandle(pipelines, (uint64_t)pipeline);
+  RecordCommand(TRACE_BIND_PIPELINE, &id, sizeof(id));
+}
+
+void CommandTrace::RecordBindDescriptorSet(VkDescriptorSet set)
+{
+  uint32_t id = FindHandle(descriptor_sets, (uint64_t)set);
+  RecordCommand(TRACE_BIND_DESCRIPTOR_SET, &id, sizeof(id));
+}
+
+void CommandTrace::RecordBindVertexBuffer(uint32_t binding, VkBuffer buffer, VkDeviceSize offset)
+{
+  VertexBufferChunk chunk = {};
+  chunk.binding = binding;
+  chunk.buffer = FindHandle(buffers, (uint64_t)buffer);
+  chunk.offset = (uint32_t)offset;
+  RecordCommand(TRACE_BIND_VERTEX_BUFFER, &chunk, sizeof(chunk));
+}
+
+void CommandTrace::RecordSetViewport(const VkViewport& viewport)
+{
+  RecordCommand(TRACE_SET_VIEWPORT, &viewport, sizeof(viewport));
+}
+
+void CommandTrace::RecordSetScissor(const VkRect2D& scissor)
+{
+  RecordCommand(TRACE_SET_SCISSOR, &scissor, sizeof(scissor));
+}
+
+void CommandTrace::RecordDraw(uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance)
+{
+  DrawChunk chunk = { vertex_count, instance_count, first_vertex, first_instance };
+  RecordCommand(TRACE_DRAW, &chunk, sizeof(chunk));
+}
+
+void CommandTrace::RecordCommand(Op op, const void* payload, uint32_t size)
+{
+  if (!recording)
+  {
+    Fail(__FUNCTION__);
+  }
+
+  AppendChunk(*recording, op, payload, size);
+}
+
+void CommandTrace::CmdBindPipeline(CommandTrace* trace, VkCommandBuffer cmd, VkPipeline pipeline)
+{
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+
+  if (trace)
+  {
+    trace->RecordBindPipeline(pipeline);
+  }
+}
+
+void CommandTrace::CmdBindDescriptorSet(CommandTrace* trace, VkCommandBuffer cmd, VkPipelineLayout layout, VkDescriptorSet set)
+{
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1, &set, 0, nullptr);
+
+  if (trace)
+  {
+    trace->RecordBindDescriptorSet(set);
+  }
+}
+
+void CommandTrace::CmdBindVertexBuffer(CommandTrace* trace, VkCommandBuffer cmd, uint32_t binding, VkBuffer buffer, VkDeviceSize offset)
+{
+  vkCmdBindVertexBuffers(cmd, binding, 1, &buffer, &offset);
+
+  if (trace)
+  {
+    trace->RecordBindVertexBuffer(binding, buffer, offset);
+  }
+}
+
+void CommandTrace::CmdSetViewport(CommandTrace* trace, VkCommandBuffer cmd, const VkViewport& viewport)
+{
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+
+  if (trace)
+  {
+    trace->RecordSetViewport(viewport);
+  }
+}
+
+void CommandTrace::CmdSetScissor(CommandTrace* trace, VkCommandBuffer cmd, const VkRect2D& scissor)
+{
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+  if (trace)
+  {
+    trace->RecordSetScissor(scissor);
+  }
+}
+
+void CommandTrace::CmdDraw(CommandTrace* trace, VkCommandBuffer cmd, uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance)
+{
+  vkCmdDraw(cmd, vertex_count, instance_count, first_vertex, first_instance);
+
+  if (trace)
+  {
+    trace->RecordDraw(vertex_count, instance_count, first_vertex, first_instance);
+  }
+}
+
+// Null data appends zeros.
+void CommandTrace::Append(Stream& stream, const void* data, uint32_t bytes)
+{
+  if (stream.size + bytes > stream.capacity)
+  {
+    uint32_t capacity = stream.capacity ? stream.capacity : 4096;
+
+    while (capacity < stream.size + bytes)
+    {
+      capacity *= 2;
+    }
+
+    uint8_t* grown = (uint8_t*)Alloc(capacity, 16);
+
+    if (stream.size)
+    {
+      memcpy(grown, stream.data, stream.size);
+    }
+
+    Free(stream.data);
+    stream.data = grown;
+    stream.capacity = capacity;
+  }
+
+  if (data)
+  {
+    memcpy(stream.data + stream.size, data, bytes);
+  }
+  else
+  {
+    memset(stream.data + stream.size, 0, bytes);
+  }
+
+  stream.size += bytes;
+}
+
+// The payload is the fixed part followed by extra_size bytes of extra,
+// padded to a multiple of 4.
+void CommandTrace::AppendChunk(Stream& stream, Op op, const void* payload, uint32_t size, const void* extra, uint32_t extra_size)
+{
+  uint32_t padded_extra = (extra_size + 3) & ~3u;
+  Chunk chunk = { (uint32_t)op, size + padded_extra };
+  Append(stream, &chunk, sizeof(chunk));
+  Append(stream, payload, size);
+  Append(stream, extra, extra_size);
+  Append(stream, nullptr, padded_extra - extra_size);
+}
+
+void CommandTrace::StreamDestroy(Stream& stream)
+{
+  Free(stream.data);
+  stream = {};
+}
+
+uint32_t CommandTrace::AddHandle(HandleTable& table, uint64_t handle)
+{
+  if (table.count >= ARRAY_COUNT(table.handles))
+  {
+    Fail(__FUNCTION__);
+  }
+
+  table.handles[table.count] = handle;
+  return table.count++;
+}
+
+// Commands may only use handles that were added as resources.
+uint32_t CommandTrace::FindHandle(const HandleTable& table, uint64_t handle)
+{
+  for (uint32_t i = 0; i < table.count; ++i)
+  {
+    if (table.handles[i] == handle)
+    {
+      return i;
+    }
+  }
+
+  Fail(__FUNCTION__);
+  return ~0u;
+}
+
+// Reads the chunk at *offset and moves past it.  Returns false at the end
+// of the data or at a chunk that runs past it.
+bool CommandTrace::NextChunk(const uint8_t* data, uint32_t size, uint32_t* offset, Chunk* chunk, const uint8_t** payload)
+{
+  if ((*offset > size) || (size - *offset < sizeof(Chunk)))
+  {
+    return false;
+  }
+
+  memcpy(chunk, data + *offset, sizeof(Chunk));
+  uint32_t payload_offset = *offset + sizeof(Chunk);
+
+  if (chunk->size > size - payload_offset)
+  {
+    return false;
+  }
+
+  *payload = data + payload_offset;
+  *offset = payload_offset + chunk->size;
+  return true;
+}
+
+// Copies the fixed part of a payload, false if the chunk is too small for it.
+bool CommandTrace::ReadPayload(const Chunk& chunk, const uint8_t* payload, void* out, uint32_t size)
+{
+  if (chunk.size < size)
+  {
+    return false;
+  }
+
+  memcpy(out, payload, size);
+  return true;
+}
+
+void CommandTrace::TestRoundTrip()
+{
+  const VkBuffer vertex_buffer = (VkBuffer)(uintptr_t)0x10;
+  const VkBuffer uniform_buffer = (VkBuffer)(uintptr_t)0x20;
+  const VkPipeline pipeline = (VkPipeline)(uintptr_t)0x30;
+  const VkDescriptorSet set = (VkDescriptorSet)(uintptr_t)0x40;
+  const uint8_t vertex_data[5] = { 1, 2, 3, 4, 5 };
+  const uint32_t code[3] = { 0x07230203, 0, 0 };
+
+  CommandTrace trace;
+  VkExtent2D extent = { 64, 32 };
+  trace.Create(extent, VK_FORMAT_B8G8R8A8_UNORM, VK_FORMAT_D16_UNORM, 2);
+  FailIfNotExpected(0u, trace.AddBuffer(vertex_buffer, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertex_data, sizeof(vertex_data)), __FUNCTION__);
+  FailIfNotExpected(1u, trace.AddBuffer(uniform_buffer, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, nullptr, 8), __FUNCTION__);
+  FailIfNotExpected(0u, trace.AddShader(code, sizeof(code)), __FUNCTION__);
+  FailIfNotExpected(1u, trace.AddShader(code, sizeof(code)), __FUNCTION__);
+  trace.AddPipeline(pipeline, 0, 1, true, VK_CULL_MODE_BACK_BIT);
+  trace.AddDescriptorSet(set, uniform_buffer, 0, 8);
+
+  // Two command buffers, the second recorded twice; only the last recording
+  // counts.
+  VkClearValue clear = {};
+  clear.color.float32[3] = 1.0f;
+  VkViewport viewport = { 0.0f, 0.0f, 64.0f, 32.0f, 0.0f, 1.0f };
+  trace.BeginCommands(0);
+  trace.RecordDraw(6, 1, 0, 0);
+  trace.EndCommands();
+  trace.BeginCommands(1);
+  trace.RecordDraw(9, 1, 0, 0);
+  trace.EndCommands();
+  trace.BeginCommands(1);
+  trace.RecordBeginRenderPass(clear, 1.0f, extent);
+  trace.RecordBindPipeline(pipeline);
+  trace.RecordBindDescriptorSet(set);
+  trace.RecordBindVertexBuffer(1, vertex_buffer, 0);
+  trace.RecordSetViewport(viewport);
+  trace.RecordDraw(3, 1, 0, 0);
+  trace.RecordEndRenderPass();
+  trace.EndCommands();
+  trace.Frame(1);
+  trace.Frame(0);
+  trace.Frame(1);
+  FailIfNotExpected(3u, trace.header.frame_count, __FUNCTION__);
+
+  // Resources: the odd-sized buffer is padded, the unwritten one is zeros.
+  uint32_t offset = 0;
+  Chunk chunk = {};
+  const uint8_t* payload = nullptr;
+  BufferChunk buffer = {};
+  FailIfNotExpected(true, NextChunk(trace.resources.data, trace.resources.size, &offset, &chunk, &payload), __FUNCTION__);
+  FailIfNotExpected((uint32_t)TRACE_BUFFER, chunk.op, __FUNCTION__);
+  FailIfNotExpected((uint32_t)(sizeof(BufferChunk) + 8), chunk.size, __FUNCTION__);
+  FailIfNotExpected(true, ReadPayload(chunk, payload, &buffer, sizeof(buffer)), __FUNCTION__);
+  FailIfNotExpected(5u, buffer.bytes, __FUNCTION__);
+  FailIfNotExpected(0, memcmp(payload + sizeof(buffer), vertex_data, sizeof(vertex_data)), __FUNCTION__);
+  FailIfNotExpected(true, NextChunk(trace.resources.data, trace.resources.size, &offset, &chunk, &payload), __FUNCTION__);
+  FailIfNotExpected(true, ReadPayload(chunk, payload, &buffer, sizeof(buffer)), __FUNCTION__);
+  FailIfNotExpected(1u, buffer.id, __FUNCTION__);
+  const uint8_t zeros[8] = {};
+  FailIfNotExpected(0, memcmp(payload + sizeof(buffer), zeros, sizeof(zeros)), __FUNCTION__);
+
+  const uint32_t resource_ops[4] = { TRACE_SHADER, TRACE_SHADER, TRACE_PIPELINE, TRACE_DESCRIPTOR_SET };
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(resource_ops); ++i)
+  {
+    FailIfNotExpected(true, NextChunk(trace.resources.data, trace.resources.size, &offset, &chunk, &payload), __FUNCTION__);
+    FailIfNotExpected(resource_ops[i], chunk.op, __FUNCTION__);
+  }
+
+  DescriptorSetChunk set_chunk = {};
+  FailIfNotExpected(true, ReadPayload(chunk, payload, &set_chunk, sizeof(set_chunk)), __FUNCTION__);
+  FailIfNotExpected(1u, set_chunk.buffer, __FUNCTION__);
+  FailIfNotExpected(false, NextChunk(trace.resources.data, trace.resources.size, &offset, &chunk, &payload), __FUNCTION__);
+
+  // Frames: each is the last recording of its command buffer.
+  const uint32_t frame_ops[] = {
+    TRACE_BEGIN_FRAME, TRACE_BEGIN_RENDER_PASS, TRACE_BIND_PIPELINE, TRACE_BIND_DESCRIPTOR_SET, TRACE_BIND_VERTEX_BUFFER,
+    TRACE_SET_VIEWPORT, TRACE_DRAW, TRACE_END_RENDER_PASS, TRACE_END_FRAME,
+    TRACE_BEGIN_FRAME, TRACE_DRAW, TRACE_END_FRAME,
+    TRACE_BEGIN_FRAME, TRACE_BEGIN_RENDER_PASS, TRACE_BIND_PIPELINE, TRACE_BIND_DESCRIPTOR_SET, TRACE_BIND_VERTEX_BUFFER,
+    TRACE_SET_VIEWPORT, TRACE_DRAW, TRACE_END_RENDER_PASS, TRACE_END_FRAME };
+  offset = 0;
+
+  for (uint32_t i = 0; i < ARRAY_COUNT(frame_ops); ++i)
+  {
+    FailIfNotExpected(true, NextChunk(trace.frames.data, trace.frames.size, &offset, &chunk, &payload), __FUNCTION__);
+    FailIfNotExpected(frame_ops[i], chunk.op, __FUNCTION__);
+
+    if (chunk.op == TRACE_BEGIN_FRAME)
+    {
+      uint32_t frame = ~0u;
+      FailIfNotExpected(true, ReadPayload(chunk, payload, &frame, sizeof(frame)), __FUNCTION__);
+      FailIfNotExpected((i == 0) ? 0u : ((i == 9) ? 1u : 2u), frame, __FUNCTION__);
+    }
+    else if (chunk.op == TRACE_BEGIN_RENDER_PASS)
+    {
+      RenderPassChunk pass = {};
+      FailIfNotExpected(true, ReadPayload(chunk, payload, &pass, sizeof(pass)), __FUNCTION__);
+      FailIfNotExpected(1.0f, pass.clear_color[3], __FUNCTION__);
+      FailIfNotExpected(32u, pass.height, __FUNCTION__);
+    }
+    else if (chunk.op == TRACE_DRAW)
+    {
+      DrawChunk draw = {};
+      FailIfNotExpected(true, ReadPayload(chunk, payload, &draw, sizeof(draw)), __FUNCTION__);
+      FailIfNotExpected((i == 10) ? 6u : 3u, draw.vertex_count, __FUNCTION__);
+    }
+    else if (chunk.op == TRACE_SET_VIEWPORT)
+    {
+      VkViewport read = {};
+      FailIfNotExpected(true, ReadPayload(chunk, payload, &read, sizeof(read)), __FUNCTION__);
+      FailIfNotExpected(64.0f, read.width, __FUNCTION__);
+    }
+  }
+
+  FailIfNotExpected(false, NextChunk(trace.frames.data, trace.frames.size, &offset, &chunk, &payload), __FUNCTION__);
+  trace.Destroy();
+}
+
+void CommandTrace::TestTruncated()
+{
+  CommandTrace::Stream stream = {};
+  DrawChunk draw = { 3, 1, 0, 0 };
+  AppendChunk(stream, TRACE_DRAW, &draw, sizeof(draw));
+  AppendChunk(stream, TRACE_END_FRAME, nullptr, 0);
+
+  // A chunk cut short anywhere stops the walk before it.
+  uint32_t offset = 0;
+  Chunk chunk = {};
+  const uint8_t* payload = nullptr;
+  FailIfNotExpected(false, NextChunk(stream.data, sizeof(Chunk) + sizeof(draw) - 1, &offset, &chunk, &payload), __FUNCTION__);
+  FailIfNotExpected(0u, offset, __FUNCTION__);
+  FailIfNotExpected(true, NextChunk(stream.data, stream.size - 1, &offset, &chunk, &payload), __FUNCTION__);
+  FailIfNotExpected(false, NextChunk(stream.data, stream.size - 1, &offset, &chunk, &payload), __FUNCTION__);
+  FailIfNotExpected(true, NextChunk(stream.data, stream.size, &offset, &chunk, &payload), __FUNCTION__);
+  FailIfNotExpected((uint32_t)TRACE_END_FRAME, chunk.op, __FUNCTION__);
+  FailIfNotExpected(stream.size, offset, __FUNCTION__);
+
+  // A payload too small for what the op expects.
+  DrawChunk read = {};
+  chunk.size = sizeof(read) - 4;
+  FailIfNotExpected(false, ReadPayload(chunk, payload, &read, sizeof(read)), __FUNCTION__);
+  StreamDestroy(stream);
+}
+
+void CommandTrace::RunAllTests()
+{
+  TestRoundTrip();
+  TestTruncated();
+}
+
+// Re-issues a CommandTrace file as fast as the driver takes it.  Resources
+// are created up front.  Each frame's render passes then go through a render
+// graph over a color image and a transient depth image in the captured
+// formats, with the captured commands recorded inside.
+struct TraceReplayer
+{
+  static const uint32_t s_MaxResources = 64;
+
+  VulkanState* state = nullptr;
+  Buffer file = {};
+  CommandTrace::Header header = {};
+  const uint8_t* data = nullptr; // Chunks, after the header.
+  uint32_t size = 0;
+  VkBuffer buffers[s_MaxResources] = {};
+  VkDeviceMemory buffer_memories[s_MaxResources] = {};
+  uint32_t buffer_count = 0;
+  VkShaderModule shaders[s_MaxResources] = {};
+  uint32_t shader_count = 0;
+  VkPipeline pipelines[s_MaxResources] = {};
+  uint32_t pipeline_count = 0;
+  VkDescriptorSet descriptor_sets[s_MaxResources] = {};
+  uint32_t descriptor_set_count = 0;
+  VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  DescriptorAllocator descriptors;
+  VkImage color_image = VK_NULL_HANDLE;
+  VkDeviceMemory color_memory = VK_NULL_HANDLE;
+  RenderGraph graph;
+  uint32_t color = 0;
+  uint32_t depth = 0;
+  uint32_t pass = 0;
+  uint32_t* frame_offsets = nullptr; // Of each BEGIN_FRAME chunk.
+  uint32_t frame_count = 0;
+  uint32_t pass_begin = 0; // Commands of the render pass being recorded.
+  uint32_t pass_end = 0;
+  uint32_t skipped = 0;    // Commands outside a render pass, or unknown.
+
+  bool Create(VulkanState& vulkan_state, const char* path);
+  void Destroy();
+  bool CreateResource(const CommandTrace::Chunk& chunk, const uint8_t* payload);
+  void RecordFrame(VkCommandBuffer cmd, uint32_t frame);
+  void RecordCommands(VkCommandBuffer cmd);
+  static void RecordPass(VkCommandBuffer cmd, void* userdata);
+};
+
+bool TraceReplayer::Create(VulkanState& vulkan_state, const char* path)
+{
+  state = &vulkan_state;
+
+  if (!ReadBinaryFile(&file, path))
+  {
+    printf("Couldn't read '%s'\n", path);
+    return false;
+  }
+
+  if ((file.bytes < sizeof(header)) || (file.bytes - sizeof(header) > UINT32_MAX))
+  {
+    printf("'%s' isn't a capture\n", path);
+    return false;
+  }
+
+  memcpy(&header, file.data, sizeof(header));
+
+  if ((header.magic != CommandTrace::s_Magic) || (header.version != CommandTrace::s_Version))
+  {
+    printf("'%s' isn't a version %u capture\n", path, CommandTrace::s_Version);
+    return false;
+  }
+
+  data = (const uint8_t*)file.data + sizeof(header);
+  size = (uint32_t)(file.bytes - sizeof(header));
+
+  VkExtent2D extent = { header.width, header.height };
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.format = (VkFormat)header.color_format;
+  image_create_info.extent.width = extent.width;
+  image_create_info.extent.height = extent.height;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  state->CreateImage(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &color_image, &color_memory);
+
+  color = graph.ImportImage("color", (VkFormat)header.color_format, extent, VK_IMAGE_ASPECT_COLOR_BIT, 1, &color_image, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  depth = graph.CreateImage("depth", (VkFormat)header.depth_format, extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+  pass = graph.AddPass("replay", RecordPass, this);
+  graph.AddUse(pass, color, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.AddUse(pass, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+  graph.Compile(*state);
+
+  VkDescriptorSetLayoutBinding layout_binding = {};
+  layout_binding.binding = 0;
+  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  layout_binding.descriptorCount = 1;
+  layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout = {};
+  descriptor_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout.bindingCount = 1;
+  descriptor_layout.pBindings = &layout_binding;
+  VK_CHECK(vkCreateDescriptorSetLayout(state->device, &descriptor_layout, &state->callbacks, &set_layout));
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+  pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_create_info.setLayoutCount = 1;
+  pipeline_layout_create_info.pSetLayouts = &set_layout;
+  VK_CHECK(vkCreatePipelineLayout(state->device, &pipeline_layout_create_info, &state->callbacks, &pipeline_layout));
+  descriptors.Create(*state, 1);
+
+  // Every frame takes at least a chunk, which bounds the count in the header.
+  if (header.frame_count > size / sizeof(CommandTrace::Chunk))
+  {
+    header.frame_count = size / sizeof(CommandTrace::Chunk);
+  }
+
+  // Resources are created in file order, so every id is the count so far.
+  frame_offsets = (uint32_t*)Alloc(sizeof(uint32_t) * (header.frame_count ? header.frame_count : 1), 16);
+  uint32_t offset = 0;
+  uint32_t chunk_offset = 0;
+  CommandTrace::Chunk chunk = {};
+  const uint8_t* payload = nullptr;
+
+  while (CommandTrace::NextChunk(data, size, &offset, &chunk, &payload))
+  {
+    if (chunk.op == CommandTrace::TRACE_BEGIN_FRAME)
+    {
+      if (frame_count < header.frame_count)
+      {
+        frame_offsets[frame_count++] = chunk_offset;
+      }
+    }
+    else if ((chunk.op <= CommandTrace::TRACE_DESCRIPTOR_SET) && !CreateResource(chunk, payload))
+    {
+      printf("'%s' has a bad resource at offset %u\n", path, chunk_offset);
+      return false;
+    }
+
+    chunk_offset = offset;
+  }
+
+  if (offset != size)
+  {
+    printf("'%s' is truncated at offset %u\n", path, offset);
+  }
+
+  return frame_count > 0;
+}
+
+void TraceReplayer::Destroy()
+{
+  for (uint32_t i = 0; i < pipeline_count; ++i)
+  {
+    vkDestroyPipeline(state->device, pipelines[i], &state->callbacks);
+  }
+
+  for (uint32_t i = 0; i < shader_count; ++i)
+  {
+    vkDestroyShaderModule(state->device, shaders[i], &state->callbacks);
+  }
+
+  if (set_layout)
+  {
+    descriptors.Destroy();
+    vkDestroyPipelineLayout(state->device, pipeline_layout, &state->callbacks);
+    vkDestroyDescriptorSetLayout(state->device, set_layout, &state->callbacks);
+  }
+
+  for (uint32_t i = 0; i < buffer_count; ++i)
+  {
+    vkDestroyBuffer(state->device, buffers[i], &state->callbacks);
+    vkFreeMemory(state->device, buffer_memories[i], &state->callbacks);
+  }
+
+  if (color_image)
+  {
+    graph.Destroy();
+    vkDestroyImage(state->device, color_image, &state->callbacks);
+    vkFreeMemory(state->device, color_memory, &state->callbacks);
+  }
+
+  Free(frame_offsets);
+  BufferDestroy(&file);
+}
+
+bool TraceReplayer::CreateResource(const CommandTrace::Chunk& chunk, const uint8_t* payload)
+{
+  if (chunk.op == CommandTrace::TRACE_BUFFER)
+  {
+    CommandTrace::BufferChunk buffer = {};
+
+    if (!CommandTrace::ReadPayload(chunk, payload, &buffer, sizeof(buffer)) || (buffer.id != buffer_count) ||
+      (buffer_count == s_MaxResources) || (buffer.bytes > chunk.size - sizeof(buffer)) || !buffer.bytes)
+    {
+      return false;
+    }
+
+    state->CreateBuffer(buffer.bytes, buffer.usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffers + buffer_count, buffer_memories + buffer_count);
+    state->UploadBuffer(buffers[buffer_count], payload + sizeof(buffer), buffer.bytes);
+    ++buffer_count;
+  }
+  else if (chunk.op == CommandTrace::TRACE_SHADER)
+  {
+    CommandTrace::ShaderChunk shader = {};
+
+    if (!CommandTrace::ReadPayload(chunk, payload, &shader, sizeof(shader)) || (shader.id != shader_count) ||
+      (shader_count == s_MaxResources) || (shader.bytes > chunk.size - sizeof(shader)) || !shader.bytes || (shader.bytes & 3))
+    {
+      return false;
+    }
+
+    // The payload isn't guaranteed to be 4 byte aligned in the file buffer.
+    uint32_t* code = (uint32_t*)Alloc(shader.bytes, 16);
+    memcpy(code, payload + sizeof(shader), shader.bytes);
+    VkShaderModuleCreateInfo shader_module_create_info = {};
+    shader_module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shader_module_create_info.codeSize = shader.bytes;
+    shader_module_create_info.pCode = code;
+    VkResult result = vkCreateShaderModule(state->device, &shader_module_create_info, &state->callbacks, shaders + shader_count);
+    Free(code);
+
+    if (result != VK_SUCCESS)
+    {
+      return false;
+    }
+
+    ++shader_count;
+  }
+  else if (chunk.op == CommandTrace::TRACE_PIPELINE)
+  {
+    CommandTrace::PipelineChunk pipeline = {};
+
+    if (!CommandTrace::ReadPayload(chunk, payload, &pipeline, sizeof(pipeline)) || (pipeline.id != pipeline_count) ||
+      (pipeline_count == s_MaxResources) || (pipeline.vertex_shader >= shader_count) || (pipeline.frag_shader >= shader_count))
+    {
+      return false;
+    }
+
+    pipelines[pipeline_count++] = CreateVertexColorPipeline(*state, graph.RenderPass(pass), pipeline_layout, shaders[pipeline.vertex_shader], shaders[pipeline.frag_shader],
+      pipeline.depth_test != 0, false, (VkCullModeFlags)pipeline.cull_mode);
+  }
+  else if (chunk.op == CommandTrace::TRACE_DESCRIPTOR_SET)
+  {
+    CommandTrace::DescriptorSetChunk set = {};
+
+    if (!CommandTrace::ReadPayload(chunk, payload, &set, sizeof(set)) || (set.id != descriptor_set_count) ||
+      (descriptor_set_count == s_MaxResources) || (set.buffer >= buffer_count))
+    {
+      return false;
+    }
+
+    DescriptorBinding binding = {};
+    binding.binding = 0;
+    binding.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    binding.buffer.buffer = buffers[set.buffer];
+    binding.buffer.offset = set.offset;
+    binding.buffer.range = set.range;
+    descriptor_sets[descriptor_set_count++] = descriptors.Get(set_layout, &binding, 1);
+  }
+
+  return true;
+}
+
+// Each captured render pass becomes one run of the graph, with its clear
+// values and render area.
+void TraceReplayer::RecordFrame(VkCommandBuffer cmd, uint32_t frame)
+{
+  uint32_t offset = frame_offsets[frame];
+  CommandTrace::Chunk chunk = {};
+  const uint8_t* payload = nullptr;
+
+  while (CommandTrace::NextChunk(data, size, &offset, &chunk, &payload) && (chunk.op != CommandTrace::TRACE_END_FRAME))
+  {
+    CommandTrace::RenderPassChunk render_pass = {};
+
+    if (chunk.op == CommandTrace::TRACE_BEGIN_FRAME)
+    {
+      continue;
+    }
+    else if ((chunk.op != CommandTrace::TRACE_BEGIN_RENDER_PASS) || !CommandTrace::ReadPayload(chunk, payload, &render_pass, sizeof(render_pass)))
+    {
+      ++skipped;
+      continue;
+    }
+
+    pass_begin = offset;
+
+    do
+    {
+      pass_end = offset;
+    } while (CommandTrace::NextChunk(data, size, &offset, &chunk, &payload) && (chunk.op != CommandTrace::TRACE_END_RENDER_PASS));
+
+    memcpy(graph.resources[color].clear_value.color.float32, render_pass.clear_color, sizeof(render_pass.clear_color));
+    graph.resources[depth].clear_value.depthStencil.depth = render_pass.clear_depth;
+    graph.passes[pass].render_area.width = (render_pass.width < header.width) ? render_pass.width : header.width;
+    graph.passes[pass].render_area.height = (render_pass.height < header.height) ? render_pass.height : header.height;
+    graph.Execute(cmd, 0);
+  }
+}
+
+void TraceReplayer::RecordCommands(VkCommandBuffer cmd)
+{
+  uint32_t offset = pass_begin;
+  CommandTrace::Chunk chunk = {};
+  const uint8_t* payload = nullptr;
+
+  while ((offset < pass_end) && CommandTrace::NextChunk(data, size, &offset, &chunk, &payload))
+  {
+    uint32_t id = ~0u;
+    CommandTrace::VertexBufferChunk vertex_buffer = {};
+    VkViewport viewport = {};
+    VkRect2D scissor = {};
+    CommandTrace::DrawChunk draw = {};
+
+    if ((chunk.op == CommandTrace::TRACE_BIND_PIPELINE) && CommandTrace::ReadPayload(chunk, payload, &id, sizeof(id)) && (id < pipeline_count))
+    {
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines[id]);
+    }
+    else if ((chunk.op == CommandTrace::TRACE_BIND_DESCRIPTOR_SET) && CommandTrace::ReadPayload(chunk, payload, &id, sizeof(id)) && (id < descriptor_set_count))
+    {
+      vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, descriptor_sets + id, 0, nullptr);
+    }
+    else if ((chunk.op == CommandTrace::TRACE_BIND_VERTEX_BUFFER) && CommandTrace::ReadPayload(chunk, payload, &vertex_buffer, sizeof(vertex_buffer)) && (vertex_buffer.buffer < buffer_count))
+    {
+      const VkDeviceSize vertex_offset = vertex_buffer.offset;
+      vkCmdBindVertexBuffers(cmd, vertex_buffer.binding, 1, buffers + vertex_buffer.buffer, &vertex_offset);
+    }
+    else if ((chunk.op == CommandTrace::TRACE_SET_VIEWPORT) && CommandTrace::ReadPayload(chunk, payload, &viewport, sizeof(viewport)))
+    {
+      vkCmdSetViewport(cmd, 0, 1, &viewport);
+    }
+    else if ((chunk.op == CommandTrace::TRACE_SET_SCISSOR) && CommandTrace::ReadPayload(chunk, payload, &scissor, sizeof(scissor)))
+    {
+      vkCmdSetScissor(cmd, 0, 1, &scissor);
+    }
+    else if ((chunk.op == CommandTrace::TRACE_DRAW) && CommandTrace::ReadPayload(chunk, payload, &draw, sizeof(draw)))
+    {
+      vkCmdDraw(cmd, draw.vertex_count, draw.instance_count, draw.first_vertex, draw.first_instance);
+    }
+    else
+    {
+      ++skipped;
+    }
+  }
+}
+
+void TraceReplayer::RecordPass(VkCommandBuffer cmd, void* userdata)
+{
+  ((TraceReplayer*)userdata)->RecordCommands(cmd);
+}
+
+// Replays the frames of options.replay back to back, --frames of them
+// cycling through the capture or each captured frame once, and reports the
+// CPU time to record each one, the time spent in vkQueueSubmit(), the time
+// from submit until its fence signals and the GPU time between timestamps.
+// Nothing else runs in the loop, so only the driver and the GPU differ
+// between two runs over the same file.
+void RunTraceReplay(VulkanState& state, const Options& options)
+{
+  enum { TIME_RECORD, TIME_SUBMIT, TIME_COMPLETE, TIME_GPU, TIME_COUNT };
+  const char* const time_names[TIME_COUNT] = { "record", "submit", "submit to fence", "gpu" };
+
+  TraceReplayer replayer;
+  printf("Replay: '%s'\n", options.replay);
+
+  if (!replayer.Create(state, options.replay))
+  {
+    printf("  nothing to replay\n");
+    replayer.Destroy();
+    return;
+  }
+
+  uint32_t replay_count = (options.max_frames > 0) ? (uint32_t)options.max_frames : replayer.frame_count;
+  printf("  %u captured frames at %ux%u, %u buffers, %u pipelines, replaying %u frames\n", replayer.frame_count, replayer.header.width, replayer.header.height,
+    replayer.buffer_count, replayer.pipeline_count, replay_count);
+
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = 1;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, &cmd));
+
+  VkFenceCreateInfo fence_create_info = {};
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &fence));
+
+  uint32_t timestamp_bits = state.queue_properties[state.queue_family_index].timestampValidBits;
+  uint64_t timestamp_mask = (timestamp_bits >= 64) ? ~0ull : ((1ull << timestamp_bits) - 1);
+  VkQueryPool timestamp_pool = VK_NULL_HANDLE;
+
+  if (timestamp_bits)
+  {
+    VkQueryPoolCreateInfo query_pool_info = {};
+    query_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    query_pool_info.queryCount = 2;
+    VK_CHECK(vkCreateQueryPool(state.device, &query_pool_info, &state.callbacks, &timestamp_pool));
+  }
+  else
+  {
+    printf("  queue family %u has no timestamps, GPU times are 0\n", state.queue_family_index);
+  }
+
+  double totals[TIME_COUNT] = {};
+  double mins[TIME_COUNT] = {};
+  double maxes[TIME_COUNT] = {};
+
+  // The first frame warms up and isn't counted.
+  for (uint32_t i = 0; i <= replay_count; ++i)
+  {
+    uint32_t frame = i ? ((i - 1) % replayer.frame_count) : 0;
+    double times[TIME_COUNT] = {};
+    double start_ms = GetTimeMs();
+
+    VkCommandBufferBeginInfo cmd_buf_info = {};
+    cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cmd_buf_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+
+    if (timestamp_pool)
+    {
+      vkCmdResetQueryPool(cmd, timestamp_pool, 0, 2);
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_pool, 0);
+    }
+
+    replayer.RecordFrame(cmd, frame);
+
+    if (timestamp_pool)
+    {
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_pool, 1);
+    }
+
+    VK_CHECK(vkEndCommandBuffer(cmd));
+    double submit_ms = GetTimeMs();
+    times[TIME_RECORD] = submit_ms - start_ms;
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &cmd;
+    VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, fence));
+    times[TIME_SUBMIT] = GetTimeMs() - submit_ms;
+    VK_CHECK(vkWaitForFences(state.device, 1, &fence, VK_TRUE, UINT64_MAX));
+    times[TIME_COMPLETE] = GetTimeMs() - submit_ms;
+    VK_CHECK(vkResetFences(state.device, 1, &fence));
+
+    uint64_t timestamps[2] = {};
+
+    if (timestamp_pool && (vkGetQueryPoolResults(state.device, timestamp_pool, 0, 2, sizeof(timestamps), timestamps, sizeof(timestamps[0]), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) == VK_SUCCESS))
+    {
+      uint64_t ticks = (timestamps[1] - timestamps[0]) & timestamp_mask;
+      times[TIME_GPU] = (double)ticks * state.physical_device_properties.limits.timestampPeriod / 1000000.0;
+    }
+
+    if (!i)
+    {
+      continue;
+    }
+
+    printf("  frame %4u (captured %3u): record %7.3f ms, submit %7.3f ms, submit to fence %7.3f ms, gpu %7.3f ms\n", i - 1, frame,
+      times[TIME_RECORD], times[TIME_SUBMIT], times[TIME_COMPLETE], times[TIME_GPU]);
+
+    for (uint32_t t = 0; t < TIME_COUNT; ++t)
+    {
+      totals[t] += times[t];
+      mins[t] = ((i == 1) || (times[t] < mins[t])) ? times[t] : mins[t];
+      maxes[t] = (times[t] > maxes[t]) ? times[t] : maxes[t];
+    }
+  }
+
+  for (uint32_t t = 0; t < TIME_COUNT; ++t)
+  {
+    printf("  %-15s %8.3f ms average, %8.3f min, %8.3f max\n", time_names[t], totals[t] / replay_count, mins[t], maxes[t]);
+  }
+
+  if (replayer.skipped)
+  {
+    printf("  %u commands skipped, outside a render pass or unknown\n", replayer.skipped);
+  }
 
-  VK_CHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface, &surface_formats_count, nullptr)); // WTF, Intel needs this function call to get the count first... is this a bug?
-  if (surface_formats_count > ARRAY_COUNT(surface_formats))
+  if (timestamp_pool)
   {
-    surface_formats_count = ARRAY_COUNT(surface_formats);
+    vkDestroyQueryPool(state.device, timestamp_pool, &state.callbacks);
   }
 
-  VK_CHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface, &surface_formats_count, surface_formats));
+  vkDestroyFence(state.device, fence, &state.callbacks);
+  vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
+  replayer.Destroy();
+}
 
-  for (uint32_t i = 0; i < surface_formats_count; ++i)
+// When each startup phase ran, for the report printed before the first
+// frame.  Phases claim their slot with an interlocked increment, so jobs can
+// record themselves from any worker.
+struct StartupProfile
+{
+  struct Phase
   {
-    printf("surface_formats[%u]:\n", i);
-    printf("  format = %d\n", surface_formats[i].format);
-    printf("  colorspace = %d\n", surface_formats[i].colorSpace);
+    const char* name;
+    double start_ms;
+    double end_ms;
+    uint32_t worker;
+  };
+
+  double start_ms = 0.0;
+  double mark_ms = 0.0; // End of the last main thread phase.
+  volatile long phase_count = 0;
+  Phase phases[32] = {};
+
+  void Begin();
+  double Add(const char* name, double phase_start_ms);
+  void Mark(const char* name);
+  void Totals(double* wall_ms, double* work_ms, uint32_t* thread_count) const;
+  void Print() const;
+
+  // Tests.
+  static void TestTotals();
+  static void RunAllTests();
+};
+
+void StartupProfile::Begin()
+{
+  start_ms = GetTimeMs();
+  mark_ms = start_ms;
+  phase_count = 0;
+}
+
+// Records a phase that started at phase_start_ms and ends now, on the calling
+// job worker.  Returns the end time.
+double StartupProfile::Add(const char* name, double phase_start_ms)
+{
+  long index = InterlockedIncrement(&phase_count) - 1;
+
+  if (index >= (long)ARRAY_COUNT(phases))
+  {
+    Fail(__FUNCTION__);
   }
 
-  surface_format = surface_formats[0];
-  VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &present_modes_count, nullptr)); // WTF, Intel needs this function call to get the count first... is this a bug?
-  if (present_modes_count > ARRAY_COUNT(present_modes))
+  Phase& phase = phases[index];
+  phase.name = name;
+  phase.start_ms = phase_start_ms;
+  phase.end_ms = GetTimeMs();
+  phase.worker = s_JobWorkerIndex;
+  return phase.end_ms;
+}
+
+// Records the main thread's time since its last phase.
+void StartupProfile::Mark(const char* name)
+{
+  mark_ms = Add(name, mark_ms);
+}
+
+// Wall time from Begin() to the last phase ending, the sum of every phase,
+// and how many workers ran them.
+void StartupProfile::Totals(double* wall_ms, double* work_ms, uint32_t* thread_count) const
+{
+  double end_ms = start_ms;
+  uint32_t workers = 0;
+  *work_ms = 0.0;
+
+  for (long i = 0; i < phase_count; ++i)
   {
-    present_modes_count = ARRAY_COUNT(present_modes);
+    end_ms = (phases[i].end_ms > end_ms) ? phases[i].end_ms : end_ms;
+    *work_ms += phases[i].end_ms - phases[i].start_ms;
+    workers |= 1u << (phases[i].worker & 31);
   }
 
-  VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &present_modes_count, present_modes));
+  *wall_ms = end_ms - start_ms;
+  *thread_count = 0;
 
-  printf("\n");
-  for (uint32_t i = 0; i < present_modes_count; ++i)
+  for (; workers; workers &= workers - 1)
   {
-    printf("present_modes[%u] = %d\n", i, present_modes[i]);
+    ++*thread_count;
   }
+}
 
-  VkSwapchainCreateInfoKHR swapchain_create_info = {};
-  swapchain_create_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-  swapchain_create_info.surface = surface;
-  swapchain_create_info.minImageCount = 2;
-  swapchain_create_info.imageFormat = surface_format.format;
-  swapchain_create_info.imageColorSpace = surface_format.colorSpace;
-  swapchain_create_info.imageExtent = surface_capabilities.currentExtent;
-  swapchain_create_info.imageArrayLayers = 1;
-  swapchain_create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-  swapchain_create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  swapchain_create_info.queueFamilyIndexCount = 1;
-  swapchain_create_info.pQueueFamilyIndices = &queue_family_index;
-  swapchain_create_info.preTransform = surface_capabilities.currentTransform;
-  swapchain_create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-  swapchain_create_info.presentMode = present_modes[0];
+void StartupProfile::Print() const
+{
+  double wall_ms = 0.0;
+  double work_ms = 0.0;
+  uint32_t thread_count = 0;
+  Totals(&wall_ms, &work_ms, &thread_count);
+  printf("Startup: %.1f ms, %.1f ms of work on %u threads\n", wall_ms, work_ms, thread_count);
 
-  VK_CHECK(vkCreateSwapchainKHR(device, &swapchain_create_info, &callbacks, &swapchain));
-  swapchain_image_count = 0;
-  VK_CHECK(vkGetSwapchainImagesKHR(device, swapchain, &swapchain_image_count, nullptr));
+  // In the order they started.
+  uint32_t order[ARRAY_COUNT(phases)];
 
-  if (swapchain_image_count > ARRAY_COUNT(swapchain_images))
+  for (long i = 0; i < phase_count; ++i)
   {
-    swapchain_image_count = ARRAY_COUNT(swapchain_images);
-  }
+    long j = i;
 
-  VK_CHECK(vkGetSwapchainImagesKHR(device, swapchain, &swapchain_image_count, swapchain_images));
+    for (; (j > 0) && (phases[order[j - 1]].start_ms > phases[i].start_ms); --j)
+    {
+      order[j] = order[j - 1];
+    }
 
-  for (uint32_t i = 0; i < swapchain_image_count; ++i)
+    order[j] = (uint32_t)i;
+  }
+
+  for (long i = 0; i < phase_count; ++i)
   {
-    VkImageViewCreateInfo color_image_view = {};
-    color_image_view.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    color_image_view.pNext = nullptr;
-    color_image_view.flags = 0;
-    color_image_view.image = swapchain_images[i];
-    color_image_view.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    color_image_view.format = surface_format.format;
-    color_image_view.components.r = VK_COMPONENT_SWIZZLE_R;
-    color_image_view.components.g = VK_COMPONENT_SWIZZLE_G;
-    color_image_view.components.b = VK_COMPONENT_SWIZZLE_B;
-    color_image_view.components.a = VK_COMPONENT_SWIZZLE_A;
-    color_image_view.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    color_image_view.subresourceRange.baseMipLevel = 0;
-    color_image_view.subresourceRange.levelCount = 1;
-    color_image_view.subresourceRange.baseArrayLayer = 0;
-    color_image_view.subresourceRange.layerCount = 1;
-    VK_CHECK(vkCreateImageView(device, &color_image_view, &callbacks, swapchain_image_views + i));
+    const Phase& phase = phases[order[i]];
+    char thread[16] = "main";
+
+    if (phase.worker)
+    {
+      snprintf(thread, sizeof(thread), "worker %u", phase.worker);
+    }
+
+    printf("  %-20s %8.2f ms at %8.2f ms on %s\n", phase.name, phase.end_ms - phase.start_ms, phase.start_ms - start_ms, thread);
   }
 }
 
-int main(int argc, char* argv[])
+void StartupProfile::TestTotals()
+{
+  StartupProfile profile;
+  profile.start_ms = 100.0;
+  profile.phases[0] = { "window", 100.0, 110.0, 0 };
+  profile.phases[1] = { "device", 100.0, 140.0, 1 };
+  profile.phases[2] = { "tests", 101.0, 105.0, 2 };
+  profile.phases[3] = { "swapchain", 140.0, 150.0, 0 };
+  profile.phase_count = 4;
+
+  double wall_ms = 0.0;
+  double work_ms = 0.0;
+  uint32_t thread_count = 0;
+  profile.Totals(&wall_ms, &work_ms, &thread_count);
+  FailIfNotExpected(50.0, wall_ms, __FUNCTION__);
+  FailIfNotExpected(64.0, work_ms, __FUNCTION__);
+  FailIfNotExpected(3u, thread_count, __FUNCTION__);
+}
+
+void StartupProfile::RunAllTests()
+{
+  TestTotals();
+}
+
+// Startup work handed to a JobSystem.  Reading the shaders, creating the
+// device and the self-tests overlap creating the window; the shader modules
+// follow the device and the files, and the pipeline compiles while the main
+// thread allocates everything else.
+struct StartupJobs
+{
+  StartupProfile* profile = nullptr;
+  const Options* options = nullptr;
+  VulkanState* state = nullptr;
+  Buffer shader_code[2] = {};
+  VkShaderModule shader_modules[2] = {};
+  const VkGraphicsPipelineCreateInfo* pipeline_create_info = nullptr; // Stage modules are filled in by the pipeline job.
+  VkPipeline pipeline = VK_NULL_HANDLE;
+
+  JobCounter tests_done;
+  JobCounter files_read;
+  JobCounter device_ready;
+  JobCounter modules_ready;
+  JobCounter pipeline_ready;
+};
+
+// JobSystem's own tests make JobSystems, so they run on the main thread
+// before the startup one exists.
+static void StartupTestsJob(void* data, uint32_t, uint32_t)
 {
+  StartupJobs& startup = *(StartupJobs*)data;
+  double start_ms = GetTimeMs();
   Vec3::RunAllTests();
   Mat4::RunAllTests();
+  Affine3x4::RunAllTests();
+  PresentPolicy::RunAllTests();
+  ResolutionScaler::RunAllTests();
+  RenderGraph::RunAllTests();
+  DeviceScoring::RunAllTests();
+  LoadBalancer::RunAllTests();
+  DescriptorCache::RunAllTests();
+  PerDrawPath::RunAllTests();
+  TextureStreamer::RunAllTests();
+  SceneGraph::RunAllTests();
+  ParticleSystem::RunAllTests();
+  FrameReadback::RunAllTests();
+  MeshletMesh::RunAllTests();
+  OcclusionCuller::RunAllTests();
+  RenderService::RunAllTests();
+  StartupProfile::RunAllTests();
+  ResidencyManager::RunAllTests();
+  DepthPrepass::RunAllTests();
+  DrawList::RunAllTests();
+  CpuRasterizer::RunAllTests();
+  SpscQueue::RunAllTests();
+  FramePipeline::RunAllTests();
+  DeferredDeleter::RunAllTests();
+  CommandTrace::RunAllTests();
+  startup.profile->Add("self-tests", start_ms);
+}
 
-  printf("Vulkan header version: %u\n", VK_HEADER_VERSION);
-  int width = 1280;
-  int height = 720;
-  static TCHAR szWindowClass[] = _T("vulkan");
-  static TCHAR szTitle[] = _T("Vulkan");
-  HINSTANCE hInstance = GetModuleHandle(NULL);
-  WNDCLASSEX wcex = {};
+static void StartupFilesJob(void* data, uint32_t, uint32_t)
+{
+  StartupJobs& startup = *(StartupJobs*)data;
+  double start_ms = GetTimeMs();
+
+  if (!ReadBinaryFile(startup.shader_code, "basic.vert.spv"))
+  {
+    printf("Could not read vertex shader SPIR-V code!\n");
+  }
+
+  if (!ReadBinaryFile(startup.shader_code + 1, "basic.frag.spv"))
+  {
+    printf("Could not read frag shader SPIR-V code!\n");
+  }
+
+  startup.profile->Add("shader files", start_ms);
+}
+
+static void StartupDeviceJob(void* data, uint32_t, uint32_t)
+{
+  StartupJobs& startup = *(StartupJobs*)data;
+  double start_ms = GetTimeMs();
+  startup.state->Init(*startup.options);
+  startup.profile->Add("instance and device", start_ms);
+}
+
+static void StartupModulesJob(void* data, uint32_t, uint32_t)
+{
+  StartupJobs& startup = *(StartupJobs*)data;
+  VulkanState& state = *startup.state;
+  double start_ms = GetTimeMs();
+
+// typedef struct VkShaderModuleCreateInfo {
+//     VkStructureType              sType;
+//     const void*                  pNext;
+//     VkShaderModuleCreateFlags    flags;
+//     size_t                       codeSize;
+//     const uint32_t*              pCode;
+// } VkShaderModuleCreateInfo;
+
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    VkShaderModuleCreateInfo shader_module_create_info = {};
+    shader_module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shader_module_create_info.codeSize = startup.shader_code[i].bytes;
+    shader_module_create_info.pCode = (uint32_t*)startup.shader_code[i].data;
+    VK_CHECK(vkCreateShaderModule(state.device, &shader_module_create_info, &state.callbacks, startup.shader_modules + i));
+    BufferDestroy(startup.shader_code + i);
+  }
+
+  startup.profile->Add("shader modules", start_ms);
+}
+
+static void StartupPipelineJob(void* data, uint32_t, uint32_t)
+{
+  StartupJobs& startup = *(StartupJobs*)data;
+  VulkanState& state = *startup.state;
+  double start_ms = GetTimeMs();
+
+  VkGraphicsPipelineCreateInfo pipeline_create_info = *startup.pipeline_create_info;
+  VkPipelineShaderStageCreateInfo stages[2] = {};
+
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    stages[i] = pipeline_create_info.pStages[i];
+    stages[i].module = startup.shader_modules[i];
+  }
+
+  pipeline_create_info.pStages = stages;
+  VK_CHECK(vkCreateGraphicsPipelines(state.device, VK_NULL_HANDLE, 1, &pipeline_create_info, &state.callbacks, &startup.pipeline));
+  vkDestroyShaderModule(state.device, startup.shader_modules[0], &state.callbacks); // "A shader module can be destroyed while pipelines created using its shaders are still in use."
+  vkDestroyShaderModule(state.device, startup.shader_modules[1], &state.callbacks);
+  startup.profile->Add("pipeline", start_ms);
+}
+
+// Everything the scene pass needs to draw the triangle.
+struct ScenePass
+{
+  VkPipeline pipeline;
+  VkPipelineLayout pipeline_layout;
+  VkDescriptorSet desc_set;
+  VkBuffer vertex_buffer;
+  VkViewport viewport;
+  VkRect2D scissor;
+  ParticleSystem* particles; // Optional.
+  CommandTrace* trace;       // Optional, set while capturing.
+};
+
+static void RecordScenePass(VkCommandBuffer cmd, void* userdata)
+{
+  const ScenePass& pass = *(const ScenePass*)userdata;
+  CommandTrace::CmdBindPipeline(pass.trace, cmd, pass.pipeline);
+  CommandTrace::CmdBindDescriptorSet(pass.trace, cmd, pass.pipeline_layout, pass.desc_set);
+  CommandTrace::CmdBindVertexBuffer(pass.trace, cmd, 1, pass.vertex_buffer, 0);
+  CommandTrace::CmdSetViewport(pass.trace, cmd, pass.viewport);
+  CommandTrace::CmdSetScissor(pass.trace, cmd, pass.scissor);
+  CommandTrace::CmdDraw(pass.trace, cmd, 3, 1, 0, 0);
+
+  if (pass.particles)
+  {
+    pass.particles->Draw(cmd, pass.vertex_buffer);
+  }
+}
+
+struct UpscalePass
+{
+  RenderGraph* graph;
+  DynamicResolution* dynamic_resolution;
+  uint32_t src;
+  uint32_t dst;
+};
+
+static void RecordUpscalePass(VkCommandBuffer cmd, void* userdata)
+{
+  const UpscalePass& pass = *(const UpscalePass*)userdata;
+  pass.dynamic_resolution->Upscale(cmd, pass.graph->Image(pass.src), pass.graph->Image(pass.dst));
+}
+
+// The interactive loop's frames, through FramePipeline.  Simulate pumps window
+// messages and paces frames on the main thread, record acquires a swapchain
+// image on the render thread, re-recording its command buffer with dynamic
+// resolution, and submit submits and presents on the submission thread.  The
+// triangle doesn't move, so simulate has nothing to put in a snapshot.
+//
+// Each frame slot has its own acquire semaphore and fence, so a slot is only
+// reused once the GPU is done with its last frame.  Present waits on a
+// semaphore per swapchain image instead: presentation has no fence, but
+// acquiring the image again means its last present is done with it.
+//
+// Record also updates the residency manager once a frame, into the slot's
+// own command buffer, which is submitted ahead of the draw.  When that moves
+// the scene's buffers, the scene pass binds the new ones from then on.
+struct InteractiveFrames
+{
+  static const uint32_t s_FramesInFlight = 2;
+  static const uint32_t s_NoFrame = FramePipeline::s_Stop - 1; // Nothing acquired, nothing to submit.
+
+  struct Slot
+  {
+    VkSemaphore acquired;
+    VkFence fence;
+    VkCommandBuffer residency_cmd; // Copies for buffers the residency manager moves.
+    uint64_t residency_frame;      // Residency frame of the slot's last frame.
+    uint32_t image; // Written by record, read by submit before the fence can signal.
+  };
+
+  VulkanState* state;
+  RenderGraph* graph;
+  uint32_t scene;
+  ScenePass* scene_pass;
+  DynamicResolution* dynamic_resolution;
+  FrameReadback* readback;
+  CommandTrace* capture;
+  uint32_t capture_frames;
+  const char* capture_path;
+  FrameLatency* latency;
+  FramePacer* pacer;
+  ResidencyManager* residency;
+  uint32_t uniform_id;
+  uint32_t vertex_id;
+  VkBuffer uniform_buffer;   // What the scene pass's descriptor set points at.
+  bool pin_buffers;          // Capture refers to the buffers by handle.
+  DescriptorAllocator* descriptors;
+  VkDescriptorSetLayout desc_layout;
+  VkCommandBuffer* draw_cmd; // One per swapchain image.
+  VkPipelineStageFlags wait_dst_stage_mask;
+  int max_frames;
+  Slot slots[s_FramesInFlight];
+  VkSemaphore presentable[ARRAY_COUNT(VulkanState::swapchain_images)];
+  VkFence image_fences[ARRAY_COUNT(VulkanState::swapchain_images)]; // Fence of the last frame to draw each image, render thread only.
+  CRITICAL_SECTION swapchain_lock; // Acquire and present both use the swapchain.
+  uint32_t next_slot;              // Render thread only.
+  int acquired_frames;             // Render thread only.
+  uint64_t present_id;             // Of the last present, 0 without present waits.  Submit thread only.
+  volatile long presented_frames;
+  bool running;                    // Main thread only.
+};
+
+static uint32_t SimulateInteractiveFrame(void* userdata, uint32_t snapshot)
+{
+  InteractiveFrames& frames = *(InteractiveFrames*)userdata;
+  frames.pacer->Wait();
+  MSG msg;
+
+  while (BOOL message_result = PeekMessage(&msg, NULL, 0, 0, PM_REMOVE) != 0)
+  {
+    if (message_result == -1)
+    {
+      // handle the error and possibly exit
+      frames.running = false;
+      break;
+    }
+    else if (msg.message == WM_QUIT)
+    {
+      frames.running = false;
+      break;
+    }
+    else
+    {
+      TranslateMessage(&msg);
+      DispatchMessage(&msg);
+    }
+  }
+
+  if (frames.max_frames && (frames.presented_frames >= frames.max_frames))
+  {
+    frames.running = false;
+  }
+
+  return frames.running ? snapshot : FramePipeline::s_Stop;
+}
+
+static uint32_t RecordInteractiveFrame(void* userdata, uint32_t)
+{
+  InteractiveFrames& frames = *(InteractiveFrames*)userdata;
+  VkDevice device = frames.state->device;
+
+  if (frames.max_frames && (frames.acquired_frames >= frames.max_frames))
+  {
+    return InteractiveFrames::s_NoFrame;
+  }
+
+  // The fence is signaled once the GPU is done with the slot's last frame,
+  // which the submit stage may not have even submitted yet.
+  uint32_t slot_index = frames.next_slot;
+  InteractiveFrames::Slot& slot = frames.slots[slot_index];
+  VK_CHECK(vkWaitForFences(device, 1, &slot.fence, VK_TRUE, UINT64_MAX));
+
+  // Don't block on the swapchain, so a minimized window still lets the
+  // main thread see WM_QUIT and stop.
+  uint32_t image = 0;
+  EnterCriticalSection(&frames.swapchain_lock);
+  VkResult result = vkAcquireNextImageKHR(device, frames.state->swapchain, 0, slot.acquired, VK_NULL_HANDLE, &image);
+  LeaveCriticalSection(&frames.swapchain_lock);
+
+  if ((result != VK_SUCCESS) && (result != VK_SUBOPTIMAL_KHR))
+  {
+    return InteractiveFrames::s_NoFrame;
+  }
+
+  // The image's command buffer may still be in use by a frame from another
+  // slot.
+  if (frames.image_fences[image] && (frames.image_fences[image] != slot.fence))
+  {
+    VK_CHECK(vkWaitForFences(device, 1, frames.image_fences + image, VK_TRUE, UINT64_MAX));
+  }
+
+  frames.image_fences[image] = slot.fence;
+  frames.latency->Sync(slot.fence);
+  VK_CHECK(vkResetFences(device, 1, &slot.fence));
+  frames.next_slot = (slot_index + 1) % InteractiveFrames::s_FramesInFlight;
+  ++frames.acquired_frames;
+  slot.image = image;
+
+  // Frames finish in order, so with the slot's last frame done, every frame
+  // up to it is.
+  ResidencyManager& residency = *frames.residency;
+  residency.Touch(frames.uniform_id);
+  residency.Touch(frames.vertex_id);
+  VkCommandBufferBeginInfo residency_begin_info = {};
+  residency_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  residency_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK(vkBeginCommandBuffer(slot.residency_cmd, &residency_begin_info));
+  residency.Update(frames.pin_buffers ? VK_NULL_HANDLE : slot.residency_cmd, slot.residency_frame);
+  VK_CHECK(vkEndCommandBuffer(slot.residency_cmd));
+  slot.residency_frame = residency.frame;
+
+  VkBuffer uniform_buffer = residency.Buffer(frames.uniform_id);
+  VkBuffer vertex_buffer = residency.Buffer(frames.vertex_id);
+
+  if ((uniform_buffer != frames.uniform_buffer) || (vertex_buffer != frames.scene_pass->vertex_buffer))
+  {
+    // The old buffers are freed once this frame is done, so frames already
+    // in flight can keep using them.  The old set stays allocated.
+    DescriptorBinding uniform_binding = {};
+    uniform_binding.binding = 0;
+    uniform_binding.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    uniform_binding.buffer.buffer = uniform_buffer;
+    uniform_binding.buffer.range = sizeof(CubeUniforms);
+    frames.scene_pass->desc_set = frames.descriptors->Get(frames.desc_layout, &uniform_binding, 1);
+    frames.scene_pass->vertex_buffer = vertex_buffer;
+    frames.uniform_buffer = uniform_buffer;
+
+    // Dynamic resolution records each image's commands as it's drawn.
+    // Otherwise they were recorded once, so wait until no frame is running
+    // them and record them all again.
+    if (!frames.dynamic_resolution->enabled)
+    {
+      for (uint32_t i = 0; i < InteractiveFrames::s_FramesInFlight; ++i)
+      {
+        if (i != slot_index)
+        {
+          VK_CHECK(vkWaitForFences(device, 1, &frames.slots[i].fence, VK_TRUE, UINT64_MAX));
+        }
+      }
+
+      for (uint32_t i = 0; i < frames.state->swapchain_image_count; ++i)
+      {
+        VkCommandBufferBeginInfo cmd_buf_info = {};
+        cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        VK_CHECK(vkBeginCommandBuffer(frames.draw_cmd[i], &cmd_buf_info));
+
+        if (frames.scene_pass->particles)
+        {
+          frames.scene_pass->particles->Simulate(frames.draw_cmd[i]);
+        }
+
+        frames.graph->Execute(frames.draw_cmd[i], i);
+        VK_CHECK(vkEndCommandBuffer(frames.draw_cmd[i]));
+      }
+    }
+  }
+
+  if (frames.dynamic_resolution->enabled)
+  {
+    // The render extent can change every frame, so re-record.  The fence
+    // waits above mean the previous use of this command buffer is done.
+    // Capture is off with dynamic resolution, so scene_pass->trace, which
+    // the submit stage clears, is never read here.
+    DynamicResolution& dynamic_resolution = *frames.dynamic_resolution;
+    dynamic_resolution.ReadGpuTime(*frames.state, slot_index);
+    VkExtent2D render_extent = dynamic_resolution.RenderExtent();
+    VkCommandBuffer cmd = frames.draw_cmd[image];
+    frames.scene_pass->viewport.width = (float)render_extent.width;
+    frames.scene_pass->viewport.height = (float)render_extent.height;
+    frames.scene_pass->scissor.extent = render_extent;
+    frames.graph->passes[frames.scene].render_area = render_extent;
+
+    VkCommandBufferBeginInfo cmd_buf_info = {};
+    cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    VK_CHECK(vkBeginCommandBuffer(cmd, &cmd_buf_info));
+    dynamic_resolution.BeginFrame(cmd, slot_index);
+
+    if (frames.scene_pass->particles)
+    {
+      frames.scene_pass->particles->Simulate(cmd);
+    }
+
+    frames.graph->Execute(cmd, image);
+    dynamic_resolution.EndFrame(cmd, slot_index);
+    VK_CHECK(vkEndCommandBuffer(cmd));
+  }
+
+  return slot_index;
+}
+
+static uint32_t SubmitInteractiveFrame(void* userdata, uint32_t index)
+{
+  InteractiveFrames& frames = *(InteractiveFrames*)userdata;
+
+  if (index == InteractiveFrames::s_NoFrame)
+  {
+    return 0;
+  }
+
+  // Once submitted the slot's fence can signal and record can reuse the
+  // slot, so take what's needed from it first.
+  InteractiveFrames::Slot& slot = frames.slots[index];
+  VkFence fence = slot.fence;
+  uint32_t image = slot.image;
+  VkCommandBuffer cmds[2] = { slot.residency_cmd, frames.draw_cmd[image] };
+
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.waitSemaphoreCount = 1;
+  submit_info.pWaitSemaphores = &slot.acquired;
+  submit_info.pWaitDstStageMask = &frames.wait_dst_stage_mask;
+  submit_info.commandBufferCount = ARRAY_COUNT(cmds);
+  submit_info.pCommandBuffers = cmds;
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = frames.presentable + image;
+
+  // Copies get their own submission so the draw's fence, and with it the
+  // slot, never waits on them.  The copy submission signals the present
+  // semaphore instead of the draw.
+  VkCommandBuffer copy_cmd = VK_NULL_HANDLE;
+  VkFence copy_fence = VK_NULL_HANDLE;
+
+  if (frames.readback->state)
+  {
+    frames.readback->Poll();
+    frames.readback->Capture(frames.state->swapchain_images[image], VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, &copy_cmd, &copy_fence);
+  }
+
+  submit_info.signalSemaphoreCount = copy_cmd ? 0 : 1;
+  bool measure = frames.latency->Idle();
+  uint64_t present_id = frames.state->present_wait ? (frames.present_id + 1) : 0;
+
+  if (measure)
+  {
+    frames.latency->Submitted();
+  }
+
+  VK_CHECK(vkQueueSubmit(frames.state->queue, 1, &submit_info, fence));
+
+  if (measure)
+  {
+    frames.latency->Watch(fence, present_id);
+  }
+
+  if (copy_cmd)
+  {
+    VkSubmitInfo copy_submit_info = {};
+    copy_submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    copy_submit_info.commandBufferCount = 1;
+    copy_submit_info.pCommandBuffers = &copy_cmd;
+    copy_submit_info.signalSemaphoreCount = 1;
+    copy_submit_info.pSignalSemaphores = frames.presentable + image;
+    VK_CHECK(vkQueueSubmit(frames.state->queue, 1, &copy_submit_info, copy_fence));
+  }
+
+  VkPresentInfoKHR present_info = {};
+  present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+  present_info.waitSemaphoreCount = 1;
+  present_info.pWaitSemaphores = frames.presentable + image;
+  present_info.swapchainCount = 1;
+  present_info.pSwapchains = &frames.state->swapchain;
+  present_info.pImageIndices = &image;
 
-  wcex.cbSize = sizeof(WNDCLASSEX);
-  wcex.style = CS_HREDRAW | CS_VREDRAW;
-  wcex.lpfnWndProc = WndProc;
-  wcex.cbClsExtra = 0;
-  wcex.cbWndExtra = 0;
-  wcex.hInstance = hInstance;
-  wcex.hIcon = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_APPLICATION));
-  wcex.hCursor = LoadCursor(NULL, IDC_ARROW);
-  wcex.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
-  wcex.lpszMenuName = NULL;
-  wcex.lpszClassName = szWindowClass;
-  wcex.hIconSm = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_APPLICATION));
+#ifdef VK_KHR_present_id
+  // Every present gets the next id, so FrameLatency can wait for any of them.
+  VkPresentIdKHR present_id_info = {};
+  present_id_info.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+  present_id_info.swapchainCount = 1;
+  present_id_info.pPresentIds = &present_id;
 
-  if (!RegisterClassEx(&wcex))
+  if (present_id)
   {
-    MessageBox(NULL,
-      _T("Call to RegisterClassEx failed!"),
-      _T("Win32 Guided Tour"),
-      NULL);
-
-    return 1;
+    present_info.pNext = &present_id_info;
+    frames.present_id = present_id;
   }
+#endif
 
-  HWND hwnd = CreateWindow(szWindowClass, szTitle, WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, width, height, NULL, NULL, hInstance, NULL);
+  EnterCriticalSection(&frames.swapchain_lock);
+  VK_CHECK(vkQueuePresentKHR(frames.state->queue, &present_info));
+  LeaveCriticalSection(&frames.swapchain_lock);
+  long presented_frames = InterlockedIncrement(&frames.presented_frames);
 
-  if (hwnd == NULL)
+  if (frames.scene_pass->trace)
   {
-    char buffer[512] = {};
-    DWORD result = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), 0, buffer, sizeof(buffer), NULL);
-    printf("%s\n", buffer);
-    getchar();
-    return 1;
+    frames.capture->Frame(image);
+
+    if (frames.capture->header.frame_count >= frames.capture_frames)
+    {
+      frames.capture->Write(frames.capture_path);
+      frames.capture->Destroy();
+      frames.scene_pass->trace = nullptr;
+    }
   }
 
-  ShowWindow(hwnd, SW_SHOW);
+  if (!(presented_frames % 1000))
+  {
+    frames.latency->PrintAndReset();
+  }
 
-  VulkanState state;
-  state.Init();
-  state.CreateSwapchain(hInstance);
+  return 0;
+}
 
-  VkCommandPoolCreateInfo cmd_pool_info = {};
-  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
-  VkCommandPool cmd_pool = {};
-  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
+int main(int argc, char* argv[])
+{
+  StartupProfile profile;
+  profile.Begin();
+  JobSystem::RunAllTests();
 
-  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
-  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  cmd_buffer_alloc_info.commandPool = cmd_pool;
-  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  cmd_buffer_alloc_info.commandBufferCount = 2;
-  VkCommandBuffer draw_cmd[2] = {};
-  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, draw_cmd));
+  Options options;
+  options.Parse(argc, argv);
 
-  VkImageCreateInfo image_create_info = {};
-  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-  image_create_info.imageType = VK_IMAGE_TYPE_2D;
-  image_create_info.format = VK_FORMAT_D16_UNORM;
-  image_create_info.extent.width = width;
-  image_create_info.extent.height = height;
-  image_create_info.extent.depth = 1;
-  image_create_info.mipLevels = 1;
-  image_create_info.arrayLayers = 1;
-  image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
-  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  image_create_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  VkImage depth_buffer = {};
-  VK_CHECK(vkCreateImage(state.device, &image_create_info, &state.callbacks, &depth_buffer));
+  if (options.cpu)
+  {
+    return RunCpuRenderer(options);
+  }
+
+  printf("Vulkan header version: %u\n", VK_HEADER_VERSION);
+  VulkanState state;
+  StartupJobs startup;
+  startup.profile = &profile;
+  startup.options = &options;
+  startup.state = &state;
+  JobSystem jobs;
+  jobs.Create(4);
+  jobs.Run(StartupDeviceJob, &startup, &startup.device_ready);
+  jobs.Run(StartupFilesJob, &startup, &startup.files_read);
+  jobs.Run(StartupTestsJob, &startup, &startup.tests_done);
+  profile.Mark("options");
 
-  VkMemoryRequirements mem_reqs = {};
-  vkGetImageMemoryRequirements(state.device, depth_buffer, &mem_reqs);
-  VkMemoryAllocateInfo mem_alloc_info = {};
-  mem_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  mem_alloc_info.allocationSize = mem_reqs.size;
+  int width = options.width;
+  int height = options.height;
+  static TCHAR szWindowClass[] = _T("vulkan");
+  static TCHAR szTitle[] = _T("Vulkan");
+  HINSTANCE hInstance = GetModuleHandle(NULL);
+  HWND hwnd = NULL;
 
-  for (uint32_t i = 0; i < state.memory_properties[0].memoryTypeCount; ++i)
+  if (!options.headless && !options.serve && !options.replay)
   {
-    // wtf is this check doing?  Why does this work?
-    bool is_supported_memory_type = (mem_reqs.memoryTypeBits & (1 << i)) > 0;
-    if (is_supported_memory_type)
+    WNDCLASSEX wcex = {};
+
+    wcex.cbSize = sizeof(WNDCLASSEX);
+    wcex.style = CS_HREDRAW | CS_VREDRAW;
+    wcex.lpfnWndProc = WndProc;
+    wcex.cbClsExtra = 0;
+    wcex.cbWndExtra = 0;
+    wcex.hInstance = hInstance;
+    wcex.hIcon = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_APPLICATION));
+    wcex.hCursor = LoadCursor(NULL, IDC_ARROW);
+    wcex.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
+    wcex.lpszMenuName = NULL;
+    wcex.lpszClassName = szWindowClass;
+    wcex.hIconSm = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_APPLICATION));
+
+    if (!RegisterClassEx(&wcex))
     {
-      if ((state.memory_properties[0].memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) == VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
-      {
-        mem_alloc_info.memoryTypeIndex = i;
-      }
-    }
-  }
+      MessageBox(NULL,
+        _T("Call to RegisterClassEx failed!"),
+        _T("Win32 Guided Tour"),
+        NULL);
 
-  VkDeviceMemory depth_buffer_memory = {};
-  VK_CHECK(vkAllocateMemory(state.device, &mem_alloc_info, &state.callbacks, &depth_buffer_memory));
-  VK_CHECK(vkBindImageMemory(state.device, depth_buffer, depth_buffer_memory, 0));
-  VkImageViewCreateInfo depth_view_info = {};
-  depth_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-  depth_view_info.image = depth_buffer;
-  depth_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-  depth_view_info.format = VK_FORMAT_D16_UNORM;
-  depth_view_info.components.r = VK_COMPONENT_SWIZZLE_R;
-  depth_view_info.components.g = VK_COMPONENT_SWIZZLE_G;
-  depth_view_info.components.b = VK_COMPONENT_SWIZZLE_B;
-  depth_view_info.components.a = VK_COMPONENT_SWIZZLE_A;
-  depth_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-  depth_view_info.subresourceRange.baseMipLevel = 0;
-  depth_view_info.subresourceRange.levelCount = 1;
-  depth_view_info.subresourceRange.baseArrayLayer = 0;
-  depth_view_info.subresourceRange.layerCount = 1;
-  VkImageView depth_image_view = {};
-  VK_CHECK(vkCreateImageView(state.device, &depth_view_info, &state.callbacks, &depth_image_view));
+      return 1;
+    }
 
-  VkBufferCreateInfo buffer_create_info = {};
-  buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  buffer_create_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-  buffer_create_info.size = sizeof(CubeUniforms);
-  buffer_create_info.queueFamilyIndexCount = 0;
-  buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  VkBuffer uniform_buffer = {};
-  VK_CHECK(vkCreateBuffer(state.device, &buffer_create_info, &state.callbacks, &uniform_buffer));
+    hwnd = CreateWindow(szWindowClass, szTitle, WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, width, height, NULL, NULL, hInstance, NULL);
 
-  VkMemoryRequirements memory_requirements = {};
-  vkGetBufferMemoryRequirements(state.device, uniform_buffer, &memory_requirements);
+    if (hwnd == NULL)
+    {
+      char buffer[512] = {};
+      DWORD result = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), 0, buffer, sizeof(buffer), NULL);
+      printf("%s\n", buffer);
+      getchar();
+      return 1;
+    }
 
-  VkMemoryAllocateInfo alloc_info = {};
-  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  alloc_info.allocationSize = memory_requirements.size;
+    ShowWindow(hwnd, SW_SHOW);
+  }
 
-  VkFlags required_mask = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  profile.Mark("window");
+  jobs.Wait(&startup.device_ready);
+  profile.Mark("wait for device");
 
-  // Look for a memory type that matches what we're looking for.
-  for (uint32_t i = 0; i < state.memory_properties[0].memoryTypeCount; ++i)
+  if (options.serve || options.bench || options.replay)
   {
-    if ((memory_requirements.memoryTypeBits & (1 << i)) && ((state.memory_properties[0].memoryTypes[i].propertyFlags & required_mask) == required_mask))
-    {
-      alloc_info.memoryTypeIndex = i;
-      break;
-    }
+    jobs.Wait(&startup.tests_done);
+    jobs.Wait(&startup.files_read);
+    jobs.Destroy();
+    BufferDestroy(startup.shader_code);
+    BufferDestroy(startup.shader_code + 1);
+    profile.Print();
   }
 
-  VkDeviceMemory uniform_device_memory = {};
-  VK_CHECK(vkAllocateMemory(state.device, &alloc_info, &state.callbacks, &uniform_device_memory));
+  if (options.serve)
+  {
+    RenderService service;
 
-  CubeUniforms* mapped_uniform_data = NULL;
-  VK_CHECK(vkMapMemory(state.device, uniform_device_memory, 0, memory_requirements.size, 0, (void**)&mapped_uniform_data));
-  // Need to copy stuff here.
-  vkUnmapMemory(state.device, uniform_device_memory);
+    if (service.Create(state, options.serve))
+    {
+      service.Run((uint32_t)options.max_frames);
+      service.Destroy();
+    }
+    else
+    {
+      printf("Render service: no shaders\n");
+    }
 
-  VK_CHECK(vkBindBufferMemory(state.device, uniform_buffer, uniform_device_memory, 0));
+    vkDestroyDevice(state.device, &state.callbacks);
+    vkDestroyInstance(state.instance, &state.callbacks);
+    return 0;
+  }
 
-  buffer_create_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-  buffer_create_info.size = sizeof(s_ClipSpaceTriangleVertices);
-  VkBuffer vertex_buffer = {};
-  VK_CHECK(vkCreateBuffer(state.device, &buffer_create_info, &state.callbacks, &vertex_buffer));
-  vkGetBufferMemoryRequirements(state.device, vertex_buffer, &memory_requirements);
-  alloc_info.allocationSize = memory_requirements.size;
+  if (options.replay)
+  {
+    RunTraceReplay(state, options);
+    vkDestroyDevice(state.device, &state.callbacks);
+    vkDestroyInstance(state.instance, &state.callbacks);
+    return 0;
+  }
 
-  // This really needs to be function.
-  // Look for a memory type that matches what we're looking for.
-  for (uint32_t i = 0; i < state.memory_properties[0].memoryTypeCount; ++i)
+  if (options.bench)
   {
-    if ((memory_requirements.memoryTypeBits & (1 << i)) && ((state.memory_properties[0].memoryTypes[i].propertyFlags & required_mask) == required_mask))
+    if (!strcmp(options.bench, "queue-overlap"))
     {
-      alloc_info.memoryTypeIndex = i;
-      break;
+      RunQueueOverlapBench(state);
+    }
+    else if (!strcmp(options.bench, "render-graph"))
+    {
+      RunRenderGraphBench(state, options);
+    }
+    else if (!strcmp(options.bench, "multi-device"))
+    {
+      RunMultiDeviceBench(state, options);
+    }
+    else if (!strcmp(options.bench, "descriptors"))
+    {
+      RunDescriptorBench(state);
+    }
+    else if (!strcmp(options.bench, "per-draw"))
+    {
+      RunPerDrawBench(state, options);
+    }
+    else if (!strcmp(options.bench, "texture-streaming"))
+    {
+      RunTextureStreamingBench(state, options);
+    }
+    else if (!strcmp(options.bench, "jobs"))
+    {
+      RunJobSystemBench(state);
+    }
+    else if (!strcmp(options.bench, "scene-graph"))
+    {
+      RunSceneGraphBench(state);
+    }
+    else if (!strcmp(options.bench, "particles"))
+    {
+      RunParticleBench(state);
+    }
+    else if (!strcmp(options.bench, "readback"))
+    {
+      RunReadbackBench(state, options);
+    }
+    else if (!strcmp(options.bench, "meshlets"))
+    {
+      RunMeshletBench(state, options);
+    }
+    else if (!strcmp(options.bench, "occlusion"))
+    {
+      RunOcclusionBench(state, options);
+    }
+    else if (!strcmp(options.bench, "affine"))
+    {
+      RunAffineBench(state);
     }
+    else if (!strcmp(options.bench, "multiview"))
+    {
+      RunMultiviewBench(state);
+    }
+    else if (!strcmp(options.bench, "residency"))
+    {
+      RunResidencyBench(state);
+    }
+    else if (!strcmp(options.bench, "prepass"))
+    {
+      RunPrepassBench(state);
+    }
+    else if (!strcmp(options.bench, "drawlist"))
+    {
+      RunDrawListBench(state);
+    }
+    else if (!strcmp(options.bench, "cpuraster"))
+    {
+      RunCpuRasterBench(&state);
+    }
+    else if (!strcmp(options.bench, "stages"))
+    {
+      RunFrameStagesBench(state);
+    }
+    else if (!strcmp(options.bench, "deferred"))
+    {
+      RunDeferredDeleteBench(state);
+    }
+    else
+    {
+      printf("Unknown benchmark '%s'\n", options.bench);
+    }
+
+    vkDestroyDevice(state.device, &state.callbacks);
+    vkDestroyInstance(state.instance, &state.callbacks);
+    return 0;
   }
 
-  VkDeviceMemory vertex_buffer_device_memory = {};
-  VK_CHECK(vkAllocateMemory(state.device, &alloc_info, &state.callbacks, &vertex_buffer_device_memory));
+  // The modules only need the device and the files, so they build
+  // alongside the swapchain.
+  jobs.RunAfter(&startup.files_read, StartupModulesJob, &startup, &startup.modules_ready);
+  state.CreateSwapchain(hInstance, options);
+  profile.Mark("swapchain");
 
-  Vertex* vertex_data = nullptr;
-  VK_CHECK(vkMapMemory(state.device, vertex_buffer_device_memory, 0, memory_requirements.size, 0, (void**)&vertex_data));
-  memmove(vertex_data, s_ClipSpaceTriangleVertices, sizeof(s_ClipSpaceTriangleVertices));
-  vkUnmapMemory(state.device, vertex_buffer_device_memory);
-  VK_CHECK(vkBindBufferMemory(state.device, vertex_buffer, vertex_buffer_device_memory, 0));
+  VkCommandPoolCreateInfo cmd_pool_info = {};
+  cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmd_pool_info.queueFamilyIndex = state.queue_family_index;
+  cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VkCommandPool cmd_pool = {};
+  VK_CHECK(vkCreateCommandPool(state.device, &cmd_pool_info, &state.callbacks, &cmd_pool));
 
-  VkDescriptorBufferInfo buffer_info = {};
-  buffer_info.buffer = uniform_buffer;
-  buffer_info.offset = 0;
-  buffer_info.range = sizeof(CubeUniforms);
+  VkCommandBufferAllocateInfo cmd_buffer_alloc_info = {};
+  cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_buffer_alloc_info.commandPool = cmd_pool;
+  cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_buffer_alloc_info.commandBufferCount = state.swapchain_image_count;
+  VkCommandBuffer draw_cmd[ARRAY_COUNT(state.swapchain_images)] = {};
+  VK_CHECK(vkAllocateCommandBuffers(state.device, &cmd_buffer_alloc_info, draw_cmd));
 
   VkDescriptorSetLayoutBinding layout_binding = {};
   layout_binding.binding = 0;
@@ -970,142 +18857,38 @@ int main(int argc, char* argv[])
   VkPipelineLayout pipeline_layout = {};
   VK_CHECK(vkCreatePipelineLayout(state.device, &pipeline_layout_create_info, &state.callbacks, &pipeline_layout));
 
-// typedef struct VkAttachmentDescription {
-//     VkAttachmentDescriptionFlags    flags;
-//     VkFormat                        format;
-//     VkSampleCountFlagBits           samples;
-//     VkAttachmentLoadOp              loadOp;
-//     VkAttachmentStoreOp             storeOp;
-//     VkAttachmentLoadOp              stencilLoadOp;
-//     VkAttachmentStoreOp             stencilStoreOp;
-//     VkImageLayout                   initialLayout;
-//     VkImageLayout                   finalLayout;
-// } VkAttachmentDescription;
-
-  VkAttachmentDescription attachments[2] = {};
-  attachments[0].format = state.surface_format.format;
-  attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
-  attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-  attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-  attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  attachments[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-  attachments[1].format = VK_FORMAT_D16_UNORM;
-  attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
-  attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-  attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-// typedef struct VkAttachmentReference {
-//     uint32_t         attachment;
-//     VkImageLayout    layout;
-// } VkAttachmentReference;
-
-  VkAttachmentReference color_reference = {};
-  color_reference.attachment = 0;
-  color_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-  VkAttachmentReference depth_reference = {};
-  depth_reference.attachment = 1;
-  depth_reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-// typedef struct VkSubpassDescription {
-//     VkSubpassDescriptionFlags       flags;
-//     VkPipelineBindPoint             pipelineBindPoint;
-//     uint32_t                        inputAttachmentCount;
-//     const VkAttachmentReference*    pInputAttachments;
-//     uint32_t                        colorAttachmentCount;
-//     const VkAttachmentReference*    pColorAttachments;
-//     const VkAttachmentReference*    pResolveAttachments;
-//     const VkAttachmentReference*    pDepthStencilAttachment;
-//     uint32_t                        preserveAttachmentCount;
-//     const uint32_t*                 pPreserveAttachments;
-// } VkSubpassDescription;
-
-  VkSubpassDescription subpass = {};
-  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-  subpass.flags = 0;
-  subpass.inputAttachmentCount = 0;
-  subpass.pInputAttachments = nullptr;
-  subpass.colorAttachmentCount = 1;
-  subpass.pColorAttachments = &color_reference;
-  subpass.pResolveAttachments = nullptr;
-  subpass.pDepthStencilAttachment = &depth_reference;
-  subpass.preserveAttachmentCount = 0;
-  subpass.pPreserveAttachments = nullptr;
-
-// typedef struct VkRenderPassCreateInfo {
-//     VkStructureType                   sType;
-//     const void*                       pNext;
-//     VkRenderPassCreateFlags           flags;
-//     uint32_t                          attachmentCount;
-//     const VkAttachmentDescription*    pAttachments;
-//     uint32_t                          subpassCount;
-//     const VkSubpassDescription*       pSubpasses;
-//     uint32_t                          dependencyCount;
-//     const VkSubpassDependency*        pDependencies;
-// } VkRenderPassCreateInfo;
-
-// typedef struct VkSubpassDependency {
-//     uint32_t                srcSubpass;
-//     uint32_t                dstSubpass;
-//     VkPipelineStageFlags    srcStageMask;
-//     VkPipelineStageFlags    dstStageMask;
-//     VkAccessFlags           srcAccessMask;
-//     VkAccessFlags           dstAccessMask;
-//     VkDependencyFlags       dependencyFlags;
-// } VkSubpassDependency;
-
-  VkRenderPassCreateInfo rp_info = {};
-  rp_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-  rp_info.attachmentCount = 2;
-  rp_info.pAttachments = attachments;
-  rp_info.subpassCount = 1;
-  rp_info.pSubpasses = &subpass;
-  rp_info.dependencyCount = 0;
-  rp_info.pDependencies = nullptr;
-
-  VkRenderPass render_pass = {};
-  VK_CHECK(vkCreateRenderPass(state.device, &rp_info, &state.callbacks, &render_pass));
-
-  VkImageView framebuffer_attachments[2] = {};
-  framebuffer_attachments[1] = depth_image_view;
-
-// typedef struct VkFramebufferCreateInfo {
-//     VkStructureType             sType;
-//     const void*                 pNext;
-//     VkFramebufferCreateFlags    flags;
-//     VkRenderPass                renderPass;
-//     uint32_t                    attachmentCount;
-//     const VkImageView*          pAttachments;
-//     uint32_t                    width;
-//     uint32_t                    height;
-//     uint32_t                    layers;
-// } VkFramebufferCreateInfo;
-
-  VkFramebufferCreateInfo fb_info = {};
-  fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-  fb_info.pNext = nullptr;
-  fb_info.renderPass = render_pass;
-  fb_info.attachmentCount = 2;
-  fb_info.pAttachments = framebuffer_attachments;
-  fb_info.width = 1264; // This is so fail, is the windows title bar eating up space?
-  fb_info.height = 681;
-  fb_info.layers = 1;
-
-  VkFramebuffer framebuffers[2] = {};
+  // The scene renders straight into the swapchain image, or with dynamic
+  // resolution into an offscreen target that's then blitted up to it.
+  DynamicResolution dynamic_resolution;
 
-  for (uint32_t i = 0; i < state.swapchain_image_count; ++i)
+  if (options.frame_budget_ms > 0.0f)
+  {
+    dynamic_resolution.Create(state, options.frame_budget_ms, InteractiveFrames::s_FramesInFlight);
+  }
+
+  RenderGraph graph;
+  uint32_t backbuffer = graph.ImportImage("backbuffer", state.surface_format.format, state.swapchain_extent, VK_IMAGE_ASPECT_COLOR_BIT, state.swapchain_image_count, state.swapchain_images, state.swapchain_image_views, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+  uint32_t depth = graph.CreateImage("depth", VK_FORMAT_D16_UNORM, state.swapchain_extent, VK_IMAGE_ASPECT_DEPTH_BIT);
+  uint32_t scene_color = dynamic_resolution.enabled ? graph.CreateImage("scene", state.surface_format.format, state.swapchain_extent, VK_IMAGE_ASPECT_COLOR_BIT) : backbuffer;
+  graph.resources[scene_color].clear_value.color.float32[3] = 1.0f;
+
+  ScenePass scene_pass = {};
+  uint32_t scene = graph.AddPass("scene", RecordScenePass, &scene_pass);
+  graph.AddUse(scene, scene_color, RENDER_GRAPH_ACCESS_COLOR_WRITE);
+  graph.AddUse(scene, depth, RENDER_GRAPH_ACCESS_DEPTH_WRITE);
+
+  UpscalePass upscale_pass = { &graph, &dynamic_resolution, scene_color, backbuffer };
+
+  if (dynamic_resolution.enabled)
   {
-    framebuffer_attachments[0] = state.swapchain_image_views[i];
-    VK_CHECK(vkCreateFramebuffer(state.device, &fb_info, &state.callbacks, framebuffers + i));
+    uint32_t upscale = graph.AddPass("upscale", RecordUpscalePass, &upscale_pass);
+    graph.AddUse(upscale, scene_color, RENDER_GRAPH_ACCESS_TRANSFER_SRC);
+    graph.AddUse(upscale, backbuffer, RENDER_GRAPH_ACCESS_TRANSFER_DST);
   }
 
+  graph.Compile(state);
+  VkRenderPass render_pass = graph.RenderPass(scene);
+
 // typedef struct VkPipelineDynamicStateCreateInfo {
 //     VkStructureType                      sType;
 //     const void*                          pNext;
@@ -1325,45 +19108,6 @@ int main(int argc, char* argv[])
   ms.alphaToOneEnable = VK_FALSE;
   ms.minSampleShading = 0.0;
 
-  Buffer vertex_shader_code = {};
-  Buffer frag_shader_code = {};
-  if (!ReadBinaryFile(&vertex_shader_code, "basic.vert.spv"))
-  {
-    printf("Could not read vertex shader SPIR-V code!\n");
-  }
-
-  if (!ReadBinaryFile(&frag_shader_code, "basic.frag.spv"))
-  {
-    printf("Could not read frag shader SPIR-V code!\n");
-  }
-
-// typedef struct VkShaderModuleCreateInfo {
-//     VkStructureType              sType;
-//     const void*                  pNext;
-//     VkShaderModuleCreateFlags    flags;
-//     size_t                       codeSize;
-//     const uint32_t*              pCode;
-// } VkShaderModuleCreateInfo;
-
-  VkShaderModuleCreateInfo shader_module_create_info[2] = {};
-  shader_module_create_info[0].sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-  shader_module_create_info[0].codeSize = vertex_shader_code.bytes;
-  shader_module_create_info[0].pCode = (uint32_t*)vertex_shader_code.data;
-  shader_module_create_info[1].sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-  shader_module_create_info[1].codeSize = frag_shader_code.bytes;
-  shader_module_create_info[1].pCode = (uint32_t*)frag_shader_code.data;
-
-  // Need to create a shader module first before trying to set up the
-  // shader stage for the pipeline...
-  VkShaderModule vertex_module = {};
-  VkShaderModule frag_module = {};
-
-  VK_CHECK(vkCreateShaderModule(state.device, shader_module_create_info, &state.callbacks, &vertex_module));
-  BufferDestroy(&vertex_shader_code);
-
-  VK_CHECK(vkCreateShaderModule(state.device, shader_module_create_info + 1, &state.callbacks, &frag_module));
-  BufferDestroy(&frag_shader_code);
-
 // We need this shader stage create info to create a graphics pipeline.
 // typedef struct VkPipelineShaderStageCreateInfo {
 //     VkStructureType                     sType;
@@ -1378,11 +19122,11 @@ int main(int argc, char* argv[])
   VkPipelineShaderStageCreateInfo shader_stage_create_info[2] = {};
   shader_stage_create_info[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
   shader_stage_create_info[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-  shader_stage_create_info[0].module = vertex_module;
+  shader_stage_create_info[0].module = VK_NULL_HANDLE; // Filled in by StartupPipelineJob().
   shader_stage_create_info[0].pName = "main";
   shader_stage_create_info[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
   shader_stage_create_info[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  shader_stage_create_info[1].module = frag_module;
+  shader_stage_create_info[1].module = VK_NULL_HANDLE;
   shader_stage_create_info[1].pName = "main";
 
 // typedef struct VkGraphicsPipelineCreateInfo {
@@ -1407,7 +19151,6 @@ int main(int argc, char* argv[])
 //     int32_t                                          basePipelineIndex;
 // } VkGraphicsPipelineCreateInfo;
 
-  VkPipeline pipeline = {};
   VkGraphicsPipelineCreateInfo pipeline_create_info = {};
   pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
   pipeline_create_info.pNext = nullptr;
@@ -1428,22 +19171,34 @@ int main(int argc, char* argv[])
   pipeline_create_info.stageCount = 2;
   pipeline_create_info.renderPass = render_pass;
   pipeline_create_info.subpass = 0;
-  VK_CHECK(vkCreateGraphicsPipelines(state.device, VK_NULL_HANDLE, 1, &pipeline_create_info, &state.callbacks, &pipeline));
-  vkDestroyShaderModule(state.device, vertex_module, &state.callbacks); // "A shader module can be destroyed while pipelines created using its shaders are still in use."
-  vkDestroyShaderModule(state.device, frag_module, &state.callbacks);
 
-  VkClearValue clear_values_black[2] = {};
-  clear_values_black[0].color.float32[0] = 0.0f;
-  clear_values_black[0].color.float32[1] = 0.0f;
-  clear_values_black[0].color.float32[2] = 0.0f;
-  clear_values_black[0].color.float32[3] = 1.0f;
-  clear_values_black[1].depthStencil.depth = 1.0f;
-  clear_values_black[1].depthStencil.stencil = 0;
-  
-  VkSemaphore img_acq_sem = {};
+  // The pipeline compiles on a worker while the rest gets allocated here.
+  startup.pipeline_create_info = &pipeline_create_info;
+  jobs.RunAfter(&startup.modules_ready, StartupPipelineJob, &startup, &startup.pipeline_ready);
+  profile.Mark("render graph");
+
+  // The scene's buffers go through the residency manager so they count
+  // against the device heap's budget, fall back to host memory when it's
+  // full, and move between the two as the budget changes.  Images don't.
+  ResidencyManager residency;
+  residency.Create(state, 2);
+  uint32_t uniform_id = residency.CreateBuffer(sizeof(CubeUniforms), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, RESIDENCY_PRIORITY_HIGH);
+  uint32_t vertex_id = residency.CreateBuffer(sizeof(s_ClipSpaceTriangleVertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, RESIDENCY_PRIORITY_HIGH);
+  VkBuffer uniform_buffer = residency.Buffer(uniform_id);
+  VkBuffer vertex_buffer = residency.Buffer(vertex_id);
+  CubeUniforms zero_uniforms = {};
+  state.UploadBuffer(uniform_buffer, &zero_uniforms, sizeof(CubeUniforms));
+  state.UploadBuffer(vertex_buffer, s_ClipSpaceTriangleVertices, sizeof(s_ClipSpaceTriangleVertices));
+
+  if (residency.stats.fallbacks)
+  {
+    printf("Residency: %u scene buffers in host memory\n", residency.stats.fallbacks);
+    residency.PrintHeaps();
+  }
+
+  InteractiveFrames frames = {};
   VkSemaphoreCreateInfo sem_create_info = {};
   sem_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-  VK_CHECK(vkCreateSemaphore(state.device, &sem_create_info, &state.callbacks, &img_acq_sem));
 
 // typedef struct VkFenceCreateInfo {
 //     VkStructureType       sType;
@@ -1451,25 +19206,27 @@ int main(int argc, char* argv[])
 //     VkFenceCreateFlags    flags;
 // } VkFenceCreateInfo;
 
-  VkFence submit_fence = {};
   VkFenceCreateInfo fence_create_info = {};
   fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
   fence_create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-  VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &submit_fence));
-
-  uint32_t current_buffer = {};
-
-  VkRenderPassBeginInfo rp_begin = {};
-  rp_begin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-  rp_begin.pNext = nullptr;
-  rp_begin.renderPass = render_pass;
-  rp_begin.framebuffer = framebuffers[0];
-  rp_begin.renderArea.offset.x = 0;
-  rp_begin.renderArea.offset.y = 0;
-  rp_begin.renderArea.extent.width = 1264;
-  rp_begin.renderArea.extent.height = 681;
-  rp_begin.clearValueCount = 2;
-  rp_begin.pClearValues = clear_values_black;
+
+  VkCommandBufferAllocateInfo residency_cmd_alloc_info = {};
+  residency_cmd_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  residency_cmd_alloc_info.commandPool = cmd_pool;
+  residency_cmd_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  residency_cmd_alloc_info.commandBufferCount = 1;
+
+  for (uint32_t i = 0; i < InteractiveFrames::s_FramesInFlight; ++i)
+  {
+    VK_CHECK(vkCreateSemaphore(state.device, &sem_create_info, &state.callbacks, &frames.slots[i].acquired));
+    VK_CHECK(vkCreateFence(state.device, &fence_create_info, &state.callbacks, &frames.slots[i].fence));
+    VK_CHECK(vkAllocateCommandBuffers(state.device, &residency_cmd_alloc_info, &frames.slots[i].residency_cmd));
+  }
+
+  for (uint32_t i = 0; i < state.swapchain_image_count; ++i)
+  {
+    VK_CHECK(vkCreateSemaphore(state.device, &sem_create_info, &state.callbacks, &frames.presentable[i]));
+  }
 
   VkCommandBufferBeginInfo cmd_buf_info = {};
   cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -1477,213 +19234,214 @@ int main(int argc, char* argv[])
   cmd_buf_info.flags = 0;
   cmd_buf_info.pInheritanceInfo = nullptr;
 
-  VkDescriptorPoolSize type_count = {};
-  type_count.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  type_count.descriptorCount = 1;
+  // The uniforms never change, so the set is only written again when the
+  // residency manager moves the buffer, and the allocator is never reset.
+  DescriptorAllocator descriptors;
+  descriptors.Create(state, 1);
 
-  VkDescriptorPoolCreateInfo descriptor_pool = {};
-  descriptor_pool.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  descriptor_pool.pNext = nullptr;
-  descriptor_pool.maxSets = 1;
-  descriptor_pool.poolSizeCount = 1;
-  descriptor_pool.pPoolSizes = &type_count;
-  VkDescriptorPool desc_pool = {};
-  VK_CHECK(vkCreateDescriptorPool(state.device, &descriptor_pool, &state.callbacks, &desc_pool));
+  DescriptorBinding uniform_binding = {};
+  uniform_binding.binding = 0;
+  uniform_binding.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  uniform_binding.buffer.buffer = uniform_buffer;
+  uniform_binding.buffer.offset = 0;
+  uniform_binding.buffer.range = sizeof(CubeUniforms);
+  VkDescriptorSet desc_set = descriptors.Get(desc_layout, &uniform_binding, 1);
 
-  VkDescriptorSetAllocateInfo desc_alloc_info = {};
-  desc_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-  desc_alloc_info.pNext = nullptr;
-  desc_alloc_info.descriptorPool = desc_pool;
-  desc_alloc_info.descriptorSetCount = 1;
-  desc_alloc_info.pSetLayouts = &desc_layout;
-  VkDescriptorSet desc_set = {};
-  VK_CHECK(vkAllocateDescriptorSets(state.device, &desc_alloc_info, &desc_set));
+  // Particles live for one to three seconds at 60Hz, so emitting capacity /
+  // 180 per frame keeps most of the pool in use.
+  ParticleSystem particles;
 
-  VkWriteDescriptorSet writes = {};
-  writes.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-  writes.pNext = nullptr;
-  writes.dstSet = desc_set;
-  writes.descriptorCount = 1;
-  writes.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  writes.pBufferInfo = &buffer_info;
-  writes.dstArrayElement = 0;
-  writes.dstBinding = 0;
-  vkUpdateDescriptorSets(state.device, 1, &writes, 0, nullptr);
-
-  VkImageSubresourceRange swapchain_image_subresource_range = {};
-  swapchain_image_subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  swapchain_image_subresource_range.baseMipLevel = 0;
-  swapchain_image_subresource_range.levelCount = 1;
-  swapchain_image_subresource_range.baseArrayLayer = 0;
-  swapchain_image_subresource_range.layerCount = 1;
-
-// typedef struct VkImageMemoryBarrier {
-//     VkStructureType            sType;
-//     const void*                pNext;
-//     VkAccessFlags              srcAccessMask;
-//     VkAccessFlags              dstAccessMask;
-//     VkImageLayout              oldLayout;
-//     VkImageLayout              newLayout;
-//     uint32_t                   srcQueueFamilyIndex;
-//     uint32_t                   dstQueueFamilyIndex;
-//     VkImage                    image;
-//     VkImageSubresourceRange    subresourceRange;
-// } VkImageMemoryBarrier;
-
-  // Set up the image layout transition.
-  VkImageMemoryBarrier img_mem_barrier = {};
-  img_mem_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  img_mem_barrier.pNext = nullptr;
-  img_mem_barrier.srcQueueFamilyIndex = state.queue_family_index;
-  img_mem_barrier.dstQueueFamilyIndex = state.queue_family_index;
-  img_mem_barrier.subresourceRange = swapchain_image_subresource_range;
+  if (options.particles > 0)
+  {
+    uint32_t max_particles = (uint32_t)options.particles;
 
-  const VkDeviceSize offsets = 0;
-  VkViewport viewport = {};
-  viewport.height = 681;
-  viewport.width = 1264;
-  viewport.minDepth = (float)0.0f;
-  viewport.maxDepth = (float)1.0f;
+    if (particles.Create(state, descriptors, render_pass, max_particles, (max_particles + 179) / 180, 64))
+    {
+      scene_pass.particles = &particles;
+    }
+    else
+    {
+      printf("Particles disabled, shaders not found\n");
+    }
+  }
 
-  VkRect2D scissor = {};
-  scissor.extent.width = 1264;
-  scissor.extent.height = 681;
-  scissor.offset.x = 0;
-  scissor.offset.y = 0;
-
-  // Set up the command buffer for drawing.
-  VK_CHECK(vkBeginCommandBuffer(draw_cmd[0], &cmd_buf_info));
-  vkCmdBeginRenderPass(draw_cmd[0], &rp_begin, VK_SUBPASS_CONTENTS_INLINE);
-  vkCmdBindPipeline(draw_cmd[0], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-  vkCmdBindDescriptorSets(draw_cmd[0], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &desc_set, 0, nullptr);
-  vkCmdBindVertexBuffers(draw_cmd[0], 1, 1, &vertex_buffer, &offsets);
-  vkCmdSetViewport(draw_cmd[0], 0, 1, &viewport);
-  vkCmdSetScissor(draw_cmd[0], 0, 1, &scissor);
-  vkCmdDraw(draw_cmd[0], 3, 1, 0, 0);
-  vkCmdEndRenderPass(draw_cmd[0]);
-  VK_CHECK(vkEndCommandBuffer(draw_cmd[0]));
-
-  rp_begin.framebuffer = framebuffers[1];
-  VK_CHECK(vkBeginCommandBuffer(draw_cmd[1], &cmd_buf_info));
-  vkCmdBeginRenderPass(draw_cmd[1], &rp_begin, VK_SUBPASS_CONTENTS_INLINE);
-  vkCmdBindPipeline(draw_cmd[1], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-  vkCmdBindDescriptorSets(draw_cmd[1], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &desc_set, 0, nullptr);
-  vkCmdBindVertexBuffers(draw_cmd[1], 1, 1, &vertex_buffer, &offsets);
-  vkCmdSetViewport(draw_cmd[1], 0, 1, &viewport);
-  vkCmdSetScissor(draw_cmd[1], 0, 1, &scissor);
-  vkCmdDraw(draw_cmd[1], 3, 1, 0, 0);
-  vkCmdEndRenderPass(draw_cmd[1]);
-  VK_CHECK(vkEndCommandBuffer(draw_cmd[1]));
-
-// typedef struct VkSubmitInfo {
-//     VkStructureType                sType;
-//     const void*                    pNext;
-//     uint32_t                       waitSemaphoreCount;
-//     const VkSemaphore*             pWaitSemaphores;
-//     const VkPipelineStageFlags*    pWaitDstStageMask;
-//     uint32_t                       commandBufferCount;
-//     const VkCommandBuffer*         pCommandBuffers;
-//     uint32_t                       signalSemaphoreCount;
-//     const VkSemaphore*             pSignalSemaphores;
-// } VkSubmitInfo;
-
-  VkPipelineStageFlags wait_dst_stage_mask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-  VkSubmitInfo submit_info = {};
-  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submit_info.waitSemaphoreCount = 1;
-  submit_info.pWaitSemaphores = &img_acq_sem;
-  submit_info.pWaitDstStageMask = &wait_dst_stage_mask;
-  submit_info.commandBufferCount = 1;
-  submit_info.pCommandBuffers = draw_cmd;
-  submit_info.signalSemaphoreCount = 1;
-  submit_info.pSignalSemaphores = &img_acq_sem;
-
-// typedef struct VkPresentInfoKHR {
-//     VkStructureType          sType;
-//     const void*              pNext;
-//     uint32_t                 waitSemaphoreCount;
-//     const VkSemaphore*       pWaitSemaphores;
-//     uint32_t                 swapchainCount;
-//     const VkSwapchainKHR*    pSwapchains;
-//     const uint32_t*          pImageIndices;
-//     VkResult*                pResults;
-// } VkPresentInfoKHR;
+  profile.Mark("resources");
+  jobs.Wait(&startup.pipeline_ready);
+  jobs.Wait(&startup.tests_done);
+  jobs.Destroy();
+  profile.Mark("wait for pipeline");
+  VkPipeline pipeline = startup.pipeline;
 
-  VkPresentInfoKHR present_info = {};
-  present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-  present_info.pNext = nullptr;
-  present_info.waitSemaphoreCount = 1;
-  present_info.pWaitSemaphores = &img_acq_sem;
-  present_info.swapchainCount = 1;
-  present_info.pSwapchains = &state.swapchain;
-  present_info.pImageIndices = &current_buffer;
-  present_info.pResults = nullptr;
+  scene_pass.pipeline = pipeline;
+  scene_pass.pipeline_layout = pipeline_layout;
+  scene_pass.desc_set = desc_set;
+  scene_pass.vertex_buffer = vertex_buffer;
+  scene_pass.viewport.height = (float)state.swapchain_extent.height;
+  scene_pass.viewport.width = (float)state.swapchain_extent.width;
+  scene_pass.viewport.minDepth = (float)0.0f;
+  scene_pass.viewport.maxDepth = (float)1.0f;
+  scene_pass.scissor.extent = state.swapchain_extent;
+  scene_pass.scissor.offset.x = 0;
+  scene_pass.scissor.offset.y = 0;
 
-  MSG msg;
-  bool running = true;
-  int frame = 0;
+  // The capture holds the buffers and shaders the scene pass uses, then
+  // what's recorded below.  The uniform buffer is only ever zeroed, so it's
+  // captured as zeros.
+  CommandTrace capture;
+  uint32_t capture_frames = (options.max_frames > 0) ? (uint32_t)options.max_frames : 60;
+
+  if (options.capture)
+  {
+    Buffer code[2] = {};
+
+    if (scene_pass.particles || dynamic_resolution.enabled)
+    {
+      printf("Capture disabled, particles and dynamic resolution aren't traced\n");
+    }
+    else if (!ReadBinaryFile(code, "basic.vert.spv") || !ReadBinaryFile(code + 1, "basic.frag.spv"))
+    {
+      printf("Capture disabled, shaders not found\n");
+    }
+    else
+    {
+      capture.Create(state.swapchain_extent, graph.resources[scene_color].format, graph.resources[depth].format, state.swapchain_image_count);
+      capture.AddBuffer(uniform_buffer, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, nullptr, sizeof(CubeUniforms));
+      capture.AddBuffer(vertex_buffer, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, s_ClipSpaceTriangleVertices, sizeof(s_ClipSpaceTriangleVertices));
+      uint32_t vertex_shader = capture.AddShader(code[0].data, (uint32_t)code[0].bytes);
+      uint32_t frag_shader = capture.AddShader(code[1].data, (uint32_t)code[1].bytes);
+      capture.AddPipeline(pipeline, vertex_shader, frag_shader, ds.depthTestEnable == VK_TRUE, rs.cullMode);
+      capture.AddDescriptorSet(desc_set, uniform_buffer, 0, sizeof(CubeUniforms));
+      scene_pass.trace = &capture;
+    }
 
-  while (running)
+    BufferDestroy(code);
+    BufferDestroy(code + 1);
+  }
+
+  // Set up a command buffer for drawing into each swapchain image.
+  for (uint32_t i = 0; i < state.swapchain_image_count; ++i)
   {
-    // if (!(frame % (1000)))
-    // {
-    //   printf("Frame %d\n", frame);
-    // }
+    VK_CHECK(vkBeginCommandBuffer(draw_cmd[i], &cmd_buf_info));
 
-    ++frame;
-    if (VK_SUCCESS == vkAcquireNextImageKHR(state.device, state.swapchain, 0, img_acq_sem, VK_NULL_HANDLE, &current_buffer))
+    if (scene_pass.particles)
     {
-      submit_info.pCommandBuffers = draw_cmd + current_buffer;
-      VK_CHECK(vkWaitForFences(state.device, 1, &submit_fence, VK_TRUE, UINT64_MAX));
-      VK_CHECK(vkResetFences(state.device, 1, &submit_fence));
-      VK_CHECK(vkQueueSubmit(state.queue, 1, &submit_info, submit_fence));
-      VK_CHECK(vkQueuePresentKHR(state.queue, &present_info));
+      particles.Simulate(draw_cmd[i]);
     }
 
-    while (BOOL message_result = PeekMessage(&msg, NULL, 0, 0, PM_REMOVE) != 0)
+    if (scene_pass.trace)
     {
-      if (message_result == -1)
-      {
-        // handle the error and possibly exit
-        running = false;
-        break;
-      }
-      else if (msg.message == WM_QUIT)
-      {
-        running = false;
-        break;
-      }
-      else
-      {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
-      }
+      capture.BeginCommands(i);
+      capture.RecordBeginRenderPass(graph.resources[scene_color].clear_value, graph.resources[depth].clear_value.depthStencil.depth, graph.passes[scene].render_area);
     }
+
+    graph.Execute(draw_cmd[i], i);
+
+    if (scene_pass.trace)
+    {
+      capture.RecordEndRenderPass();
+      capture.EndCommands();
+    }
+
+    VK_CHECK(vkEndCommandBuffer(draw_cmd[i]));
+  }
+
+  FrameReadback readback;
+
+  if (options.dump)
+  {
+    if (!state.swapchain_readable)
+    {
+      printf("Frame dump disabled, swapchain images can't be copied from\n");
+    }
+    else if (!readback.Create(state, state.swapchain_extent, state.surface_format.format, 3, options.dump))
+    {
+      printf("Frame dump disabled\n");
+    }
+  }
+
+  profile.Mark("frame setup");
+  profile.Print();
+
+  FramePacer pacer;
+  pacer.Init(options.frame_limit_hz);
+  FrameLatency latency;
+  latency.Create(state.device, state.present_wait ? state.swapchain : VK_NULL_HANDLE, &frames.swapchain_lock);
+
+  frames.state = &state;
+  frames.graph = &graph;
+  frames.scene = scene;
+  frames.scene_pass = &scene_pass;
+  frames.dynamic_resolution = &dynamic_resolution;
+  frames.readback = &readback;
+  frames.capture = &capture;
+  frames.capture_frames = capture_frames;
+  frames.capture_path = options.capture;
+  frames.latency = &latency;
+  frames.pacer = &pacer;
+  frames.residency = &residency;
+  frames.uniform_id = uniform_id;
+  frames.vertex_id = vertex_id;
+  frames.uniform_buffer = uniform_buffer;
+  frames.pin_buffers = (scene_pass.trace != nullptr);
+  frames.descriptors = &descriptors;
+  frames.desc_layout = desc_layout;
+  frames.draw_cmd = draw_cmd;
+  frames.wait_dst_stage_mask = graph.FirstStages(backbuffer);
+  frames.max_frames = options.max_frames;
+  frames.running = true;
+  InitializeCriticalSection(&frames.swapchain_lock);
+
+  FramePipeline frame_pipeline;
+  frame_pipeline.stages[FramePipeline::STAGE_SIMULATE] = SimulateInteractiveFrame;
+  frame_pipeline.stages[FramePipeline::STAGE_RECORD] = RecordInteractiveFrame;
+  frame_pipeline.stages[FramePipeline::STAGE_SUBMIT] = SubmitInteractiveFrame;
+  frame_pipeline.userdata = &frames;
+  frame_pipeline.Run(UINT32_MAX, true);
+  printf("Frame stages:\n");
+  frame_pipeline.PrintStats("threaded");
+
+  // A window closed before the capture filled keeps what it has.
+  if (scene_pass.trace)
+  {
+    capture.Write(options.capture);
+    capture.Destroy();
+    scene_pass.trace = nullptr;
   }
 
-  // Wait for the last submission to flush before destroying everything.
-  VK_CHECK(vkWaitForFences(state.device, 1, &submit_fence, VK_TRUE, UINT64_MAX));
-  VK_CHECK(vkResetFences(state.device, 1, &submit_fence));
+  // Every recorded frame has been submitted.  Wait for them, and the presents
+  // waiting on their semaphores, to flush before destroying everything.
+  latency.PrintAndReset();
+  latency.Destroy();
+  VK_CHECK(vkQueueWaitIdle(state.queue));
 
-  vkDestroyDescriptorPool(state.device, desc_pool, &state.callbacks);
+  if (readback.state)
+  {
+    readback.Destroy();
+    printf("Frame dump: wrote %ld of %llu frames, %llu dropped\n", readback.stats.written, (unsigned long long)(readback.stats.captured + readback.stats.dropped), (unsigned long long)readback.stats.dropped);
+  }
+
+  particles.Destroy();
+  descriptors.Destroy();
   vkDestroyPipeline(state.device, pipeline, &state.callbacks);
 
+  dynamic_resolution.Destroy(state);
+  graph.Destroy();
+
+  for (uint32_t i = 0; i < InteractiveFrames::s_FramesInFlight; ++i)
+  {
+    vkDestroyFence(state.device, frames.slots[i].fence, &state.callbacks);
+    vkDestroySemaphore(state.device, frames.slots[i].acquired, &state.callbacks);
+  }
+
   for (uint32_t i = 0; i < state.swapchain_image_count; ++i)
   {
-    vkDestroyFramebuffer(state.device, framebuffers[i], &state.callbacks);
+    vkDestroySemaphore(state.device, frames.presentable[i], &state.callbacks);
   }
-  vkDestroyRenderPass(state.device, render_pass, &state.callbacks);
-  vkDestroyFence(state.device, submit_fence, &state.callbacks);
-  vkDestroySemaphore(state.device, img_acq_sem, &state.callbacks);
-  vkFreeMemory(state.device, vertex_buffer_device_memory, &state.callbacks);
-  vkFreeMemory(state.device, uniform_device_memory, &state.callbacks);
+
+  DeleteCriticalSection(&frames.swapchain_lock);
   vkDestroyPipelineLayout(state.device, pipeline_layout, &state.callbacks);
   vkDestroyDescriptorSetLayout(state.device, desc_layout, &state.callbacks);
-  vkDestroyBuffer(state.device, vertex_buffer, &state.callbacks);
-  vkDestroyBuffer(state.device, uniform_buffer, &state.callbacks);
-  vkDestroyImageView(state.device, depth_image_view, &state.callbacks);
-  vkFreeMemory(state.device, depth_buffer_memory, &state.callbacks);
-  vkDestroyImage(state.device, depth_buffer, &state.callbacks);
+  residency.Destroy();
   vkDestroyCommandPool(state.device, cmd_pool, &state.callbacks);
   for (uint32_t i = 0; i < state.swapchain_image_count; ++i)
   {
@@ -1694,7 +19452,11 @@ int main(int argc, char* argv[])
   vkDestroyDevice(state.device, &state.callbacks);
   vkDestroyInstance(state.instance, &state.callbacks);
 
-  DestroyWindow(hwnd);
+  if (hwnd)
+  {
+    DestroyWindow(hwnd);
+  }
+
   getchar();
 
   return 0;
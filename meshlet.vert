@@ -0,0 +1,21 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+layout(push_constant, row_major) uniform Camera
+{
+  mat4 clip_from_world;
+} camera;
+
+layout(location = 0) in vec3 in_position;
+layout(location = 1) in vec4 in_color;
+layout(location = 0) out vec4 out_color;
+
+// Matches depth_prepass.vert, so a main pass can test EQUAL against its depth.
+invariant gl_Position;
+
+// Meshlet vertices are already in world space.
+void main()
+{
+  out_color = in_color;
+  gl_Position = camera.clip_from_world * vec4(in_position, 1.0f);
+}
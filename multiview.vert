@@ -0,0 +1,37 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+#extension GL_EXT_multiview : enable
+
+// Matches MultiviewCamera.
+struct Camera
+{
+  vec4 view_from_world[3]; // Affine3x4 rows.
+  layout(row_major) mat4 clip_from_view;
+};
+
+layout(std430, binding = 0) readonly buffer Cameras
+{
+  Camera cameras[];
+} views;
+
+// The camera of the pass's first view.  A multiview pass adds gl_ViewIndex
+// to it, a plain pass draws just that one with gl_ViewIndex 0.
+layout(push_constant) uniform Params
+{
+  uint first_view;
+} params;
+
+layout(location = 0) in vec3 in_position;
+layout(location = 1) in vec4 in_color;
+layout(location = 0) out vec4 out_color;
+
+// Vertices are already in world space.
+void main()
+{
+  Camera camera = views.cameras[params.first_view + gl_ViewIndex];
+  vec4 position = vec4(in_position, 1.0f);
+  vec4 view_position = vec4(dot(camera.view_from_world[0], position), dot(camera.view_from_world[1], position), dot(camera.view_from_world[2], position), 1.0f);
+  out_color = in_color;
+  gl_Position = camera.clip_from_view * view_position;
+}
@@ -0,0 +1,20 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+layout(location = 0) in vec4 in_color;
+layout(location = 0) out vec4 out_color;
+
+// Stands in for a material expensive enough that shading hidden fragments
+// shows up in the frame time.
+void main()
+{
+  vec3 c = in_color.rgb;
+
+  for (int i = 0; i < 64; ++i)
+  {
+    c = fract((c * 1.7f) + sin((c.zxy * 3.1f) + (gl_FragCoord.xyx * 0.01f)));
+  }
+
+  out_color = vec4(mix(in_color.rgb, c, 0.1f), in_color.a);
+}
@@ -0,0 +1,50 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+struct Particle
+{
+  vec4 position; // w is age.
+  vec4 velocity; // w is lifetime.
+};
+
+layout(std430, binding = 0) readonly buffer Particles
+{
+  Particle particles[];
+} data;
+
+layout(std430, binding = 1) readonly buffer Alive
+{
+  uint indices[];
+} alive;
+
+// Matches ParticleCounters.
+layout(std430, binding = 3) readonly buffer Counters
+{
+  uint current;
+  uint dead_count;
+  uint emit_count;
+  uint simulate_count;
+  uint frame;
+  uint capacity;
+  uint simulated;
+  uint pad;
+  uint emit_dispatch[3];
+  uint simulate_dispatch[3];
+  uint draw[4];
+} counters;
+
+layout(location = 0) in vec3 in_position;
+layout(location = 1) in vec4 in_color;
+layout(location = 0) out vec4 out_color;
+
+// One instance of the triangle per surviving particle, shrunk and moved to
+// its position and faded out over its lifetime.
+void main()
+{
+  uint index = alive.indices[((counters.current ^ 1) * counters.capacity) + gl_InstanceIndex];
+  Particle p = data.particles[index];
+  float life = 1.0f - (p.position.w / p.velocity.w);
+  out_color = vec4(in_color.rgb * life, 1.0f);
+  gl_Position = vec4(p.position.xy + (in_position.xy * 0.01f), p.position.z, 1.0f);
+}
@@ -0,0 +1,21 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+// Rows of an Affine3x4, the bottom row is 0 0 0 1.
+layout(std140, binding = 0) uniform PerDraw
+{
+  vec4 obj_to_world[3];
+} per_draw;
+
+layout(location = 0) in vec3 in_position;
+layout(location = 1) in vec4 in_color;
+layout(location = 0) out vec4 out_color;
+
+// Per-draw data from a dynamic uniform buffer, rebound at a new offset for
+// every draw.
+void main()
+{
+  out_color = in_color;
+  vec4 position = vec4(in_position, 1.0f);
+  gl_Position = vec4(dot(per_draw.obj_to_world[0], position), dot(per_draw.obj_to_world[1], position), dot(per_draw.obj_to_world[2], position), 1.0f);
+}
@@ -0,0 +1,27 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+// Rows of an Affine3x4, the bottom row is 0 0 0 1.
+struct Affine3x4
+{
+  vec4 rows[3];
+};
+
+layout(std430, binding = 0) readonly buffer PerDraw
+{
+  Affine3x4 obj_to_world[];
+} per_draw;
+
+layout(location = 0) in vec3 in_position;
+layout(location = 1) in vec4 in_color;
+layout(location = 0) out vec4 out_color;
+
+// Per-draw data from one storage buffer bound for the whole frame.  Each draw
+// is a single instance whose firstInstance is its index into the array.
+void main()
+{
+  out_color = in_color;
+  Affine3x4 obj_to_world = per_draw.obj_to_world[gl_InstanceIndex];
+  vec4 position = vec4(in_position, 1.0f);
+  gl_Position = vec4(dot(obj_to_world.rows[0], position), dot(obj_to_world.rows[1], position), dot(obj_to_world.rows[2], position), 1.0f);
+}